@@ -0,0 +1,22 @@
+#version 330 core
+#extension GL_ARB_separate_shader_objects: enable
+
+in vec2 fragUv;
+
+// One palette index per pixel, row 0 at the top, column 256 holds the row's emphasis bits
+uniform usampler2D uScreen;
+// 64 colours for each of the 8 combinations of emphasis bits
+uniform sampler2D uPalette;
+
+out vec4 outColor;
+
+void main(void)
+{
+	int x = min(int(fragUv.x * 256.0), 255);
+	int y = 239 - min(int(fragUv.y * 240.0), 239);
+
+	uint index = texelFetch(uScreen, ivec2(x, y), 0).r;
+	uint emphasis = texelFetch(uScreen, ivec2(256, y), 0).r;
+
+	outColor = vec4(texelFetch(uPalette, ivec2(int(emphasis * 64u + (index & 63u)), 0), 0).rgb, 1.0);
+}
\ No newline at end of file
@@ -480,7 +480,7 @@ bool debugger_step(uint16_t *lineIndex)
 {
 	interpret_step();
 
-	uint16_t addr = nes_cpu_registers.PC;
+	uint16_t addr = nes_current->cpu_registers.PC;
 
 	for (uint16_t i = 0; i < debugger.lineCount; ++i)
 	{
@@ -6,12 +6,16 @@
 #include <stdio.h>
 #include <stdbool.h>
 #include <stdint.h>
+#include <string.h>
 
 #include <glm/glm.h>
 
 #define WIDTH 960
 #define HEIGHT 544
 
+// Frames run per host frame while Tab is held
+#define FAST_FORWARD_FRAMES 4
+
 #define WS_ENGLISH_CHARS U"\x20!\x22#$%&'()*+,-./0123456789:;<=>?@ABCDEFGHIJKLMNOPQRSTUVWXYZ[\x5C]^_`abcdefghijklmnopqrstuvwxyz{|}~"
 #define ARRAY_SIZE(x) (sizeof(x)/sizeof((x)[0]))
 
@@ -40,6 +44,15 @@ size_t read_entire_file(const char *path, uint8_t **data)
 #define STBTT_STATIC
 #include "stb_truetype.h"
 #include "nes_cpu.h"
+#include "nes_runahead.h"
+#include "nes_framehash.h"
+#include "nes_movie.h"
+#include "nes_audio_sink.h"
+#include "nes_jit.h"
+#include "nes_profile.h"
+#include "nes_trace.h"
+#include "nes_coverage.h"
+#include "nes_render.h"
 #include "debugger.h"
 
 /*
@@ -535,6 +548,8 @@ void render_code_line()
 
 void RenderText_FontAtlas_ASCII(const FontAtlas *atlas, const OpenGLShader *shader, const char *text, glm_vec2 start, glm_vec3 color)
 {
+	NES_TRACE_SCOPE(NES_TRACE_TEXT);
+
 	unsigned long long slen = strlen(text);
 
 	glActiveTexture(GL_TEXTURE0);
@@ -663,6 +678,57 @@ void render_mesh(OpenGLMesh *mesh)
 	glDrawElements(GL_TRIANGLES, mesh->drawCount, GL_UNSIGNED_INT, NULL);
 }
 
+/*
+	The PPU's picture goes up as it comes out of screen_buffer, a palette index per pixel plus
+	each row's emphasis bits, a quarter of what RGBA would take. The fragment shader looks the
+	colours up in a 512 entry palette texture built once from PPU_colour().
+*/
+typedef struct NESScreen
+{
+	GLuint indexTexture;
+	GLuint paletteTexture;
+} NESScreen;
+
+/* Upload the bound machine's last frame, PPU_SCREEN_EMPHASIS + 1 bytes of each of the 240 rows */
+void upload_nes_screen(const NESScreen *screen)
+{
+	glBindTexture(GL_TEXTURE_2D, screen->indexTexture);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+	glPixelStorei(GL_UNPACK_ROW_LENGTH, PPU_SCREEN_STRIDE);
+	glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, PPU_SCREEN_EMPHASIS + 1, 240, GL_RED_INTEGER, GL_UNSIGNED_BYTE, nes_current->ppu.screen_buffer);
+	glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+	glBindTexture(GL_TEXTURE_2D, 0);
+}
+
+NESScreen create_nes_screen(void)
+{
+	NESScreen screen;
+	uint32_t palette[512];
+
+	for (uint16_t i = 0; i < 512; i++)
+		palette[i] = PPU_colour(i) | 0xFF000000;
+
+	glGenTextures(1, &screen.paletteTexture);
+	glBindTexture(GL_TEXTURE_2D, screen.paletteTexture);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, 512, 1, 0, GL_BGRA, GL_UNSIGNED_BYTE, palette);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+
+	// Integer textures can't be filtered anyway
+	glGenTextures(1, &screen.indexTexture);
+	glBindTexture(GL_TEXTURE_2D, screen.indexTexture);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_R8UI, PPU_SCREEN_EMPHASIS + 1, 240, 0, GL_RED_INTEGER, GL_UNSIGNED_BYTE, NULL);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	glBindTexture(GL_TEXTURE_2D, 0);
+
+	upload_nes_screen(&screen);
+
+	return screen;
+}
+
 glm_mat4 GetOrthographicMatrix(float left, float right, float bottom, float top, float far, float near)
 {
 	glm_mat4 m;
@@ -708,6 +774,7 @@ void scroll_callback(GLFWwindow* window, double xoffset, double yoffset)
 #define SPACING_COEFF_X 1.25f
 #define DEBUGGER_ADDR_PANEL_WIDTH 80.0f
 #define DEBUGGER_CODE_MARGIN_X 16.0f
+#define DEBUGGER_HEAT_WIDTH 6.0f
 
 const glm_vec3 DEBUGGER_SELECTION_COLOR = (glm_vec3){0.7f, 0.7f, 0.7f};
 const glm_vec3 DEBUGGER_STEP_COLOR = (glm_vec3){0.75f, 0.3f, 0.3f};
@@ -735,26 +802,229 @@ AxisAlignedBoundingBox2D calculate_mos6502_assembly_line_bounds(
 	return box;
 }
 
+#ifdef NES_TRACE
+#define TRACE_OVERLAY_WIDTH 220.0f
+#define TRACE_OVERLAY_BAR_MS 16.67f
+
+/* Host frame time by zone (see nes_trace.h), in the top right corner of 'extents' */
+static void render_trace_overlay(const FontAtlas *atlas, const OpenGLShader *fontShader, const OpenGLShader *colorShader,
+	OpenGLMesh *quadMesh, const glm_mat4 *proj, const AxisAlignedBoundingBox2D *extents)
+{
+	const double *ms = nes_trace_frame_ms();
+	float lineHeight = (float)atlas->pixelHeight + 4.0f;
+	float x0 = extents->x1 - TRACE_OVERLAY_WIDTH - 8.0f;
+	float y1 = extents->y1 - 8.0f;
+
+	double total = 0.0;
+	for (int zone = 0; zone < NES_TRACE_ZONE_COUNT; zone++)
+		total += ms[zone];
+
+	AxisAlignedBoundingBox2D box = { x0, y1 - lineHeight * (NES_TRACE_ZONE_COUNT + 1) - 8.0f, x0 + TRACE_OVERLAY_WIDTH, y1 };
+	glm_mat4 model = Matrix_From_AxisAlignedBoundingBox2D(&box);
+	glm_vec4 color;
+
+	glUseProgram(colorShader->id);
+	glUniformMatrix4fv(glGetUniformLocation(colorShader->id, "uProjection"), 1, GL_FALSE, &proj->elem[0][0]);
+	glUniformMatrix4fv(glGetUniformLocation(colorShader->id, "uModel"), 1, GL_FALSE, &model.elem[0][0]);
+
+	color.rgb = glm_vec3(0.1f);
+	color.a = 0.85f;
+	glUniform4fv(glGetUniformLocation(colorShader->id, "uColor"), 1, &color.elem[0]);
+	render_mesh(quadMesh);
+
+	// One bar per zone, full width is a 60 Hz frame
+	for (int zone = 0; zone < NES_TRACE_ZONE_COUNT; zone++)
+	{
+		float width = (float)ms[zone] / TRACE_OVERLAY_BAR_MS * (TRACE_OVERLAY_WIDTH - 16.0f);
+		float y = y1 - lineHeight * (zone + 2);
+
+		if (width < 1.0f)
+			continue;
+
+		AxisAlignedBoundingBox2D bar = { x0 + 8.0f, y, x0 + 8.0f + fminf(width, TRACE_OVERLAY_WIDTH - 16.0f), y + lineHeight - 2.0f };
+		model = Matrix_From_AxisAlignedBoundingBox2D(&bar);
+
+		color.rgb = DEBUGGER_STEP_COLOR;
+		color.a = 0.5f;
+		glUniformMatrix4fv(glGetUniformLocation(colorShader->id, "uModel"), 1, GL_FALSE, &model.elem[0][0]);
+		glUniform4fv(glGetUniformLocation(colorShader->id, "uColor"), 1, &color.elem[0]);
+		render_mesh(quadMesh);
+	}
+
+	glUseProgram(fontShader->id);
+	glUniformMatrix4fv(glGetUniformLocation(fontShader->id, "inProjection"), 1, GL_FALSE, &proj->elem[0][0]);
+
+	char line[64];
+
+	sprintf(line, "frame %6.2f ms", total);
+	RenderText_FontAtlas_ASCII(atlas, fontShader, line, (glm_vec2) {x0 + 8.0f, y1 - lineHeight}, glm_vec3(1.0f));
+
+	for (int zone = 0; zone < NES_TRACE_ZONE_COUNT; zone++)
+	{
+		sprintf(line, "%-8s %6.2f ms", nes_trace_zones[zone].name, ms[zone]);
+		RenderText_FontAtlas_ASCII(atlas, fontShader, line, (glm_vec2) {x0 + 8.0f, y1 - lineHeight * (zone + 2)}, (glm_vec3){0.8f, 0.8f, 0.8f});
+	}
+}
+#endif
+
+/* Keyboard to controller 1: X = A, Z = B, Right Shift = Select, Enter = Start, arrows = D-pad */
+static void read_pads(GLFWwindow *window)
+{
+	static const int keys[8] =
+	{
+		GLFW_KEY_X, GLFW_KEY_Z, GLFW_KEY_RIGHT_SHIFT, GLFW_KEY_ENTER,
+		GLFW_KEY_UP, GLFW_KEY_DOWN, GLFW_KEY_LEFT, GLFW_KEY_RIGHT
+	};
+
+	uint8_t pad = 0;
+
+	for (int i = 0; i < 8; i++)
+		if (glfwGetKey(window, keys[i]) == GLFW_PRESS)
+			pad |= 1 << i;
+
+	nes_current->pad[0] = pad;
+	nes_current->pad[1] = 0;
+}
+
 int main(int argc, char *argv[])
 {
-	/* Zero out registers, init CPU */
-	nes_init_cpu();
+	/* Create the console, zero out registers, init CPU and PPU */
+	nes_machine *machine = nes_machine_create();
+	if (machine == NULL)
+	{
+		fprintf(stderr, "error: Failed to allocate the NES\n");
+		return -1;
+	}
+
+	nes_machine_bind(machine);
 
-	/* Check if only one argument after file name */
-	if (argc != 2)
+	/* Frames to run ahead of the displayed one while running (R key) */
+	uint8_t runahead_frames = 0;
+	nes_runahead *runahead = nes_runahead_create();
+	if (runahead == NULL)
 	{
-		fprintf(stderr, "error: Invalid usage. USAGE:\n./nes_cpu [FILE]\n");
+		fprintf(stderr, "error: Failed to allocate run-ahead\n");
+		return -1;
+	}
+
+	/* Per-frame screen/RAM hashes for golden-output testing, see nes_framehash.h */
+	nes_framehash_log *hash_log = NULL;
+
+	/* Input movie being recorded or played back, see nes_movie.h */
+	nes_movie *movie = NULL;
+	const char *record_path = NULL, *play_path = NULL;
+
+	/* Audio goes to the sound card, or a WAV file with -wav */
+	const char *wav_path = NULL;
+
+	/* Translate hot code to x86-64 with -jit, see nes_jit.h */
+	bool use_jit = false;
+
+	/* Draw the picture on a second thread with -render-thread, see nes_render.h */
+	bool render_thread = false;
+
+	/* Dump host time as Chrome trace JSON with -trace, only in builds with NES_TRACE, see nes_trace.h */
+	const char *trace_path = NULL;
+
+	/* Profile the game with -profile, sampling every -profile-period cycles (0 counts them all), see nes_profile.h */
+	const char *profile_path = NULL;
+	uint32_t profile_period = NES_PROFILE_PERIOD;
+
+	/* Save a code/data log with -cdl, only in builds with NES_COVERAGE, see nes_coverage.h */
+	const char *cdl_path = NULL;
+
+	/* Positional arguments: file name, optional run-ahead frame count and hash log */
+	const char *positional[3] = { NULL, NULL, NULL };
+	int positional_count = 0;
+
+	for (int i = 1; i < argc; i++)
+	{
+		if (strcmp(argv[i], "-record") == 0 && i + 1 < argc)
+			record_path = argv[++i];
+		else if (strcmp(argv[i], "-play") == 0 && i + 1 < argc)
+			play_path = argv[++i];
+		else if (strcmp(argv[i], "-wav") == 0 && i + 1 < argc)
+			wav_path = argv[++i];
+		else if (strcmp(argv[i], "-jit") == 0)
+			use_jit = true;
+		else if (strcmp(argv[i], "-render-thread") == 0)
+			render_thread = true;
+		else if (strcmp(argv[i], "-trace") == 0 && i + 1 < argc)
+			trace_path = argv[++i];
+		else if (strcmp(argv[i], "-profile") == 0 && i + 1 < argc)
+			profile_path = argv[++i];
+		else if (strcmp(argv[i], "-profile-period") == 0 && i + 1 < argc)
+			profile_period = (uint32_t)strtoul(argv[++i], NULL, 10);
+		else if (strcmp(argv[i], "-cdl") == 0 && i + 1 < argc)
+			cdl_path = argv[++i];
+		else if (positional_count < 3)
+			positional[positional_count++] = argv[i];
+		else
+			positional_count = 4;
+	}
+
+	if (positional_count < 1 || positional_count > 3 || (record_path != NULL && play_path != NULL))
+	{
+		fprintf(stderr, "error: Invalid usage. USAGE:\n./nes_cpu [FILE] [RUN-AHEAD FRAMES] [HASH LOG] [-record MOVIE | -play MOVIE] [-wav FILE] [-jit] [-render-thread] [-profile FILE [-profile-period CYCLES]] [-trace FILE] [-cdl FILE]\n");
 		return -1;
 	}
 	else
 	{
+		if (positional[1] != NULL)
+			runahead_frames = (uint8_t)atoi(positional[1]);
+
+		if (positional[2] != NULL && (hash_log = nes_framehash_open(positional[2], positional[0])) == NULL)
+			return -1;
+
 		/* Load the rom into NES memory */
-		if (nes_load_rom(argv[1], &nes_cartridge) != 0)
+		if (nes_load_rom(positional[0], &nes_current->cartridge) != 0)
 		{
 			return -1;
 		}
+
+		if (use_jit && !nes_jit_enable())
+			return -1;
+
+		if (profile_path != NULL && !nes_profile_enable(profile_period))
+			return -1;
+
+		if (cdl_path != NULL && !nes_coverage_enable())
+			return -1;
+
+		if (render_thread && !nes_render_start())
+			return -1;
+
+#ifndef NES_TRACE
+		if (trace_path != NULL)
+			fprintf(stderr, "warning: Built without NES_TRACE, -trace has nothing to write\n");
+#endif
+
+		/* Movies start from the freshly loaded machine */
+		if (record_path != NULL && (movie = nes_movie_create(positional[0])) == NULL)
+			return -1;
+
+		if (play_path != NULL && ((movie = nes_movie_load(play_path)) == NULL || nes_movie_check(movie, positional[0]) != 0))
+			return -1;
 	}
 
+	/* About 85 ms of audio, rate control keeps it half full */
+	nes_audio_ring *audio_ring = nes_audio_ring_create(4096);
+	nes_audio_sink *audio_sink = NULL;
+
+	if (audio_ring == NULL)
+		return -1;
+
+	if (wav_path != NULL)
+		audio_sink = nes_audio_sink_wav(audio_ring, wav_path);
+	else
+		audio_sink = nes_audio_sink_device(audio_ring);
+
+	/* No sound card (or no backend for this platform), keep emulating in silence */
+	if (audio_sink == NULL)
+		audio_sink = nes_audio_sink_null(audio_ring);
+
+	machine->audio.ring = audio_ring;
+
 	init_debugger(0x8000U, 0xFFFFU);
 	debugger_disassemble();
 
@@ -831,6 +1101,10 @@ int main(int argc, char *argv[])
 
 	OpenGLShader colorShader = create_shader_program("../data/shaders/color.vert", "../data/shaders/color.frag");
 
+	OpenGLShader screenShader = create_shader_program("../data/shaders/nes_screen.vert", "../data/shaders/nes_screen.frag");
+
+	NESScreen nesScreen = create_nes_screen();
+
 	printf("Created shader truetype_render.\n");
 
 /*
@@ -853,9 +1127,15 @@ int main(int argc, char *argv[])
 
 	static uint16_t lineIndex = 0;
 	static int curr_state = GLFW_RELEASE, prev_state;
+	static int curr_run_state = GLFW_RELEASE, prev_run_state;
+	static int curr_reset_state = GLFW_RELEASE, prev_reset_state;
+	static bool running = false;
 
 	while (!glfwWindowShouldClose(window))
 	{
+#ifdef NES_TRACE
+		nes_trace_frame();
+#endif
 		glfwPollEvents();
 
 		glfwGetFramebufferSize(window, &width, &height);
@@ -871,6 +1151,69 @@ int main(int argc, char *argv[])
 			debugger_step(&lineIndex);
 		}
 
+		prev_run_state = curr_run_state;
+		curr_run_state = glfwGetKey(window, GLFW_KEY_R);
+
+		if (curr_run_state == GLFW_RELEASE && prev_run_state == GLFW_PRESS)
+		{
+			running = !running;
+			nes_runahead_reset_stats(runahead);
+		}
+
+		prev_reset_state = curr_reset_state;
+		curr_reset_state = glfwGetKey(window, GLFW_KEY_BACKSPACE);
+
+		/* The console's reset button */
+		if (curr_reset_state == GLFW_RELEASE && prev_reset_state == GLFW_PRESS)
+			nes_cpu_reset();
+
+		/* Tab fast-forwards, only the last of the frames run per host frame is drawn and heard */
+		uint8_t frames = glfwGetKey(window, GLFW_KEY_TAB) == GLFW_PRESS ? FAST_FORWARD_FRAMES : 1;
+
+		for (uint8_t frame = 1; running && frame < frames; frame++)
+		{
+			if (play_path == NULL || !nes_movie_play_frame(movie))
+				read_pads(window);
+
+			if (record_path != NULL)
+				nes_movie_record_frame(movie);
+
+			nes_runahead_skip_frame();
+
+			/* No picture to hash, the RAM still has to match */
+			if (hash_log != NULL)
+				nes_framehash_write(hash_log, 0, nes_framehash_ram());
+		}
+
+		if (running)
+		{
+			/* Pads for this frame, from the movie or the keyboard */
+			if (play_path == NULL || !nes_movie_play_frame(movie))
+				read_pads(window);
+
+			if (record_path != NULL)
+				nes_movie_record_frame(movie);
+
+			nes_runahead_frame(runahead, runahead_frames);
+
+			/* The render thread's frames show up a frame late, unless they get hashed */
+			if (hash_log != NULL)
+				nes_render_sync();
+			else
+				nes_render_present();
+
+			upload_nes_screen(&nesScreen);
+
+			NES_TRACE_BEGIN(NES_TRACE_AUDIO);
+			nes_audio_sink_frame(audio_sink);
+			NES_TRACE_END();
+
+			if (hash_log != NULL)
+				nes_framehash_write(hash_log, nes_framehash_screen(), nes_framehash_ram());
+		}
+
+		NES_TRACE_BEGIN(NES_TRACE_UI);
+
 		glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
 		glEnable(GL_BLEND);
@@ -935,28 +1278,41 @@ int main(int argc, char *argv[])
 
 			char tmp[32];
 
-			sprintf(tmp, "A: 0x%02X", nes_cpu_registers.A);
+			sprintf(tmp, "A: 0x%02X", nes_current->cpu_registers.A);
 			RenderText_FontAtlas_ASCII(&fontAtlas, &fontShader, tmp, (glm_vec2) {10, height - fontAtlas.pixelHeight}, (glm_vec3){1.0f, 1.0f, 1.0f});
 
-			sprintf(tmp, "X: 0x%02X", nes_cpu_registers.X);
+			sprintf(tmp, "X: 0x%02X", nes_current->cpu_registers.X);
 
 			RenderText_FontAtlas_ASCII(&fontAtlas, &fontShader, tmp, (glm_vec2) {110, height - fontAtlas.pixelHeight}, (glm_vec3){1.0f, 1.0f, 1.0f});
 			
-			sprintf(tmp, "Y: 0x%02X", nes_cpu_registers.Y);
+			sprintf(tmp, "Y: 0x%02X", nes_current->cpu_registers.Y);
 
 			RenderText_FontAtlas_ASCII(&fontAtlas, &fontShader, tmp, (glm_vec2) {210, height - fontAtlas.pixelHeight}, (glm_vec3){1.0f, 1.0f, 1.0f});
 
-			sprintf(tmp, "S: 0x%02X", nes_cpu_registers.S);
+			sprintf(tmp, "S: 0x%02X", nes_cpu_status(&nes_current->cpu_registers));
 
 			RenderText_FontAtlas_ASCII(&fontAtlas, &fontShader, tmp, (glm_vec2) {310, height - fontAtlas.pixelHeight}, (glm_vec3){1.0f, 1.0f, 1.0f});
 
-			sprintf(tmp, "SP: 0x%02X", nes_cpu_registers.SP);
+			sprintf(tmp, "SP: 0x%02X", nes_current->cpu_registers.SP);
 
 			RenderText_FontAtlas_ASCII(&fontAtlas, &fontShader, tmp, (glm_vec2) {410, height - fontAtlas.pixelHeight}, (glm_vec3){1.0f, 1.0f, 1.0f});
 
-			sprintf(tmp, "PC: 0x%04X", nes_cpu_registers.PC);
+			sprintf(tmp, "PC: 0x%04X", nes_current->cpu_registers.PC);
 
 			RenderText_FontAtlas_ASCII(&fontAtlas, &fontShader, tmp, (glm_vec2) {510, height - fontAtlas.pixelHeight}, (glm_vec3){1.0f, 1.0f, 1.0f});
+
+			if (running)
+			{
+				// Emulation cost per host frame, the run-ahead frames have to fit in here too
+				const nes_runahead_stats *stats = nes_runahead_get_stats(runahead);
+				char frame_str[128];
+
+				sprintf(frame_str, "Frame: %.2f ms (avg %.2f, max %.2f) real %.2f, ahead x%d %.2f, save %.3f, load %.3f",
+					stats->total_ms, stats->average_total_ms, stats->max_total_ms, stats->real_ms,
+					stats->frames_ahead, stats->ahead_ms, stats->save_ms, stats->load_ms);
+
+				RenderText_FontAtlas_ASCII(&fontAtlas, &fontShader, frame_str, (glm_vec2) {10, height - 2 * fontAtlas.pixelHeight - 8}, (glm_vec3){1.0f, 1.0f, 1.0f});
+			}
 		}
 
 		glEnable(GL_SCISSOR_TEST);
@@ -974,6 +1330,9 @@ int main(int argc, char *argv[])
 			long lowLine = (long) lineIndex - hh;
 			long highLine = (long) lineIndex + hh;
 
+			/* Heat column, scaled by the square root so lukewarm code still shows */
+			uint64_t hottest = nes_profile_hottest();
+
 			for (long i = lowLine; i <= highLine; ++i)
 			{
 				if (i >= 0 && i < debugger_line_count())
@@ -991,6 +1350,30 @@ int main(int argc, char *argv[])
 
 						bool isStepLine = i == lineIndex;
 
+						if (hottest != 0 && nes_profile_address_cycles(addr) != 0)
+						{
+							float heat = sqrtf((float)nes_profile_address_cycles(addr) / (float)hottest);
+
+							AxisAlignedBoundingBox2D box;
+							box.x0 = codeBoxExtents.x0;
+							box.x1 = codeBoxExtents.x0 + DEBUGGER_HEAT_WIDTH;
+							box.y0 = asmOffsetY + 0.25f * fontAtlas.pixelHeight - 0.5f * fontAtlas.pixelHeight;
+							box.y1 = asmOffsetY + 0.25f * fontAtlas.pixelHeight + 0.5f * fontAtlas.pixelHeight;
+
+							glm_mat4 model = Matrix_From_AxisAlignedBoundingBox2D(&box);
+
+							glUseProgram(colorShader.id);
+							glUniformMatrix4fv(glGetUniformLocation(colorShader.id, "uProjection"), 1, GL_FALSE, &proj.elem[0][0]);
+							glUniformMatrix4fv(glGetUniformLocation(colorShader.id, "uModel"), 1, GL_FALSE, &model.elem[0][0]);
+
+							glm_vec4 color;
+							color.rgb = glm_vec3(0.2f + 0.8f * heat, 0.5f - 0.3f * heat, 0.2f);
+							color.a = 0.4f + 0.6f * heat;
+
+							glUniform4fv(glGetUniformLocation(colorShader.id, "uColor"), 1, &color.elem[0]);
+							render_mesh(&quadMesh);
+						}
+
 						char addr_str[25];
 						sprintf(addr_str, "%04X", addr);
 
@@ -1051,10 +1434,77 @@ int main(int argc, char *argv[])
 
 		glDisable(GL_SCISSOR_TEST);
 
+		{
+			// Render the NES screen in the top right corner, as large as it fits in half the code box at a whole scale
+			int scale = (int)(codeBoxExtents.x1 - codeBoxExtents.x0) / (2 * 256);
+
+			if (scale > (int)(codeBoxExtents.y1 - codeBoxExtents.y0) / 240)
+				scale = (int)(codeBoxExtents.y1 - codeBoxExtents.y0) / 240;
+			if (scale < 1)
+				scale = 1;
+
+			AxisAlignedBoundingBox2D screenBox;
+			screenBox.x1 = codeBoxExtents.x1;
+			screenBox.x0 = codeBoxExtents.x1 - 256 * scale;
+			screenBox.y1 = codeBoxExtents.y1;
+			screenBox.y0 = codeBoxExtents.y1 - 240 * scale;
+
+			glm_mat4 model = Matrix_From_AxisAlignedBoundingBox2D(&screenBox);
+
+			glUseProgram(screenShader.id);
+			glUniformMatrix4fv(glGetUniformLocation(screenShader.id, "uProjection"), 1, GL_FALSE, &proj.elem[0][0]);
+			glUniformMatrix4fv(glGetUniformLocation(screenShader.id, "uModel"), 1, GL_FALSE, &model.elem[0][0]);
+
+			glActiveTexture(GL_TEXTURE0);
+			glBindTexture(GL_TEXTURE_2D, nesScreen.indexTexture);
+			glUniform1i(glGetUniformLocation(screenShader.id, "uScreen"), 0);
+
+			glActiveTexture(GL_TEXTURE1);
+			glBindTexture(GL_TEXTURE_2D, nesScreen.paletteTexture);
+			glUniform1i(glGetUniformLocation(screenShader.id, "uPalette"), 1);
+
+			render_mesh(&quadMesh);
+			glActiveTexture(GL_TEXTURE0);
+		}
+
+#ifdef NES_TRACE
+		render_trace_overlay(&fontAtlas, &fontShader, &colorShader, &quadMesh, &proj, &codeBoxExtents);
+#endif
+
+		NES_TRACE_END();
+
+		NES_TRACE_BEGIN(NES_TRACE_PRESENT);
 		glfwSwapBuffers(window);
+		NES_TRACE_END();
 	}
 
 	glfwTerminate();
 
+	if (profile_path != NULL)
+		nes_profile_write(profile_path, positional[0]);
+
+	if (cdl_path != NULL && nes_coverage_write(cdl_path) == 0)
+	{
+		size_t code, data;
+		nes_coverage_count(&code, &data);
+
+		printf("Code/data log: %zu code and %zu data bytes of %zu PRG-ROM bytes\n", code, data, nes_current->cartridge.PRG_ROM_size);
+	}
+
+#ifdef NES_TRACE
+	if (trace_path != NULL)
+		nes_trace_write(trace_path);
+#endif
+
+	nes_framehash_close(hash_log);
+	nes_audio_sink_close(audio_sink);
+	nes_audio_ring_destroy(audio_ring);
+
+	if (record_path != NULL)
+		nes_movie_save(movie, record_path);
+	nes_movie_destroy(movie);
+	nes_runahead_destroy(runahead);
+	nes_machine_destroy(machine);
+
 	return EXIT_SUCCESS;
 }
\ No newline at end of file
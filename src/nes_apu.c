@@ -0,0 +1,573 @@
+#include <string.h>
+
+#include "nes_cpu.h"
+#include "nes_apu.h"
+#include "nes_audio_ring.h"
+
+/* Linear mixer weights, full volume on every channel comes out at about 24000 */
+#define APU_PULSE_WEIGHT    211
+#define APU_TRIANGLE_WEIGHT 238
+#define APU_NOISE_WEIGHT    138
+#define APU_DMC_WEIGHT      94
+
+static const uint8_t apu_length_table[32] =
+{
+    10, 254, 20,  2, 40,  4, 80,  6, 160,  8, 60, 10, 14, 12, 26, 14,
+    12,  16, 24, 18, 48, 20, 96, 22, 192, 24, 72, 26, 16, 28, 32, 30
+};
+
+static const uint8_t apu_duty_table[4][8] =
+{
+    { 0, 1, 0, 0, 0, 0, 0, 0 },
+    { 0, 1, 1, 0, 0, 0, 0, 0 },
+    { 0, 1, 1, 1, 1, 0, 0, 0 },
+    { 1, 0, 0, 1, 1, 1, 1, 1 }
+};
+
+static const uint8_t apu_triangle_table[32] =
+{
+    15, 14, 13, 12, 11, 10,  9,  8,  7,  6,  5,  4,  3,  2,  1,  0,
+     0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14, 15
+};
+
+/* NTSC periods in CPU cycles */
+static const uint16_t apu_noise_periods[16] =
+{
+    4, 8, 16, 32, 64, 96, 128, 160, 202, 254, 380, 508, 762, 1016, 2034, 4068
+};
+
+static const uint16_t apu_dmc_periods[16] =
+{
+    428, 380, 340, 320, 286, 254, 226, 214, 190, 160, 142, 128, 106, 84, 72, 54
+};
+
+/* Frame counter events, in CPU cycles since reset, the last one wraps the sequence */
+static const int32_t apu_frame_events[2][5] =
+{
+    { 7457, 14913, 22371, 29829, 29830 },
+    { 7457, 14913, 22371, 29829, 37282 }
+};
+
+/* Move a channel's output to 'level' at 'time' (CPU cycles into the audio frame) */
+static inline void apu_output(uint8_t * output, uint8_t level, int32_t weight, uint32_t time)
+{
+    if (level == *output)
+        return;
+
+    if (!nes_current->audio.mute && nes_current->audio.blip != NULL)
+        nes_blip_add_delta(nes_current->audio.blip, time, ((int32_t)level - *output) * weight);
+
+    *output = level;
+}
+
+/* Cycles after 'time' that a timer starting 'timer' cycles from now steps, if it does before 'end' */
+static inline uint32_t apu_skip_steps(uint32_t * time, uint32_t end, uint32_t period)
+{
+    if (*time >= end)
+        return 0;
+
+    uint32_t steps = (end - *time - 1) / period + 1;
+    *time += steps * period;
+
+    return steps;
+}
+
+static inline uint16_t apu_sweep_target(const _nes_apu_pulse * pulse, int channel)
+{
+    uint16_t change = pulse->period >> pulse->sweep_shift;
+
+    if (!pulse->sweep_negate)
+        return pulse->period + change;
+
+    /* Pulse 1 negates with ones' complement */
+    return pulse->period - change - (channel == 0);
+}
+
+static inline bool apu_pulse_muted(const _nes_apu_pulse * pulse, int channel)
+{
+    return pulse->period < 8 || apu_sweep_target(pulse, channel) > 0x7FF || pulse->length == 0;
+}
+
+static inline uint8_t apu_envelope_level(const _nes_apu_envelope * envelope)
+{
+    return envelope->constant ? envelope->volume : envelope->decay;
+}
+
+static void apu_run_pulse(_nes_apu_pulse * pulse, int channel, uint32_t time, uint32_t end)
+{
+    uint32_t period = (pulse->period + 1) * 2;
+    uint8_t  level  = apu_pulse_muted(pulse, channel) ? 0 : apu_envelope_level(&pulse->envelope);
+    const uint8_t * duty = apu_duty_table[pulse->duty];
+
+    apu_output(&pulse->output, duty[pulse->step] ? level : 0, APU_PULSE_WEIGHT, time);
+    time += pulse->timer;
+
+    /* Silent, only keep the sequencer's phase */
+    if (level == 0)
+        pulse->step = (pulse->step + apu_skip_steps(&time, end, period)) & 7;
+
+    for (; time < end; time += period)
+    {
+        pulse->step = (pulse->step + 1) & 7;
+        apu_output(&pulse->output, duty[pulse->step] ? level : 0, APU_PULSE_WEIGHT, time);
+    }
+
+    pulse->timer = time - end;
+}
+
+static void apu_run_triangle(_nes_apu_triangle * triangle, uint32_t time, uint32_t end)
+{
+    uint32_t period = triangle->period + 1;
+
+    time += triangle->timer;
+
+    /*
+        The sequencer only moves while both counters are non-zero. Ultrasonic periods are
+        left frozen too instead of averaging out, which is what most emulators do to avoid pops
+    */
+    if (triangle->length == 0 || triangle->linear == 0 || triangle->period < 2)
+        apu_skip_steps(&time, end, period);
+
+    for (; time < end; time += period)
+    {
+        triangle->step = (triangle->step + 1) & 31;
+        apu_output(&triangle->output, apu_triangle_table[triangle->step], APU_TRIANGLE_WEIGHT, time);
+    }
+
+    triangle->timer = time - end;
+}
+
+static void apu_run_noise(_nes_apu_noise * noise, uint32_t time, uint32_t end)
+{
+    uint32_t period = noise->period;
+    uint8_t  level  = noise->length ? apu_envelope_level(&noise->envelope) : 0;
+    int      tap    = noise->mode ? 6 : 1;
+
+    apu_output(&noise->output, (noise->shift & 1) ? 0 : level, APU_NOISE_WEIGHT, time);
+
+    for (time += noise->timer; time < end; time += period)
+    {
+        uint16_t feedback = (noise->shift ^ (noise->shift >> tap)) & 1;
+        noise->shift = (noise->shift >> 1) | (feedback << 14);
+
+        apu_output(&noise->output, (noise->shift & 1) ? 0 : level, APU_NOISE_WEIGHT, time);
+    }
+
+    noise->timer = time - end;
+}
+
+/* Fetch the next sample byte if the buffer is empty and there is one */
+static void apu_dmc_fetch(_nes_apu_dmc * dmc)
+{
+    if (dmc->buffer_full || dmc->remaining == 0)
+        return;
+
+    /* TO-DO: the fetch stalls the CPU for up to 4 cycles */
+    dmc->buffer      = PEEK(dmc->addr);
+    NES_COVERAGE_MARK(dmc->addr, NES_CDL_DATA | NES_CDL_PCM);
+    dmc->buffer_full = true;
+    dmc->addr        = dmc->addr == 0xFFFF ? 0x8000 : dmc->addr + 1;
+
+    if (--dmc->remaining == 0)
+    {
+        if (dmc->loop)
+        {
+            dmc->addr      = dmc->sample_addr;
+            dmc->remaining = dmc->sample_length;
+        }
+        else if (dmc->irq_enabled)
+            dmc->irq = true;
+    }
+}
+
+static void apu_run_dmc(_nes_apu_dmc * dmc, uint32_t time, uint32_t end)
+{
+    for (time += dmc->timer; time < end; time += dmc->period)
+    {
+        if (!dmc->silence)
+        {
+            if (dmc->shift & 1)
+            {
+                if (dmc->output <= 125)
+                    apu_output(&dmc->output, dmc->output + 2, APU_DMC_WEIGHT, time);
+            }
+            else if (dmc->output >= 2)
+                apu_output(&dmc->output, dmc->output - 2, APU_DMC_WEIGHT, time);
+        }
+
+        dmc->shift >>= 1;
+
+        if (--dmc->bits == 0)
+        {
+            dmc->bits    = 8;
+            dmc->silence = !dmc->buffer_full;
+            dmc->shift   = dmc->buffer;
+
+            dmc->buffer_full = false;
+            apu_dmc_fetch(dmc);
+        }
+    }
+
+    dmc->timer = time - end;
+}
+
+static void apu_clock_envelope(_nes_apu_envelope * envelope)
+{
+    if (envelope->start)
+    {
+        envelope->start   = false;
+        envelope->decay   = 15;
+        envelope->divider = envelope->volume;
+    }
+    else if (envelope->divider == 0)
+    {
+        envelope->divider = envelope->volume;
+
+        if (envelope->decay > 0)
+            envelope->decay--;
+        else if (envelope->loop)
+            envelope->decay = 15;
+    }
+    else
+        envelope->divider--;
+}
+
+static void apu_clock_sweep(_nes_apu_pulse * pulse, int channel)
+{
+    if (pulse->sweep_divider == 0 && pulse->sweep_enabled && pulse->sweep_shift > 0 && !apu_pulse_muted(pulse, channel))
+        pulse->period = apu_sweep_target(pulse, channel);
+
+    if (pulse->sweep_divider == 0 || pulse->sweep_reload)
+    {
+        pulse->sweep_divider = pulse->sweep_period;
+        pulse->sweep_reload  = false;
+    }
+    else
+        pulse->sweep_divider--;
+}
+
+/* Envelopes and the triangle's linear counter */
+static void apu_quarter_frame(_nes_apu * apu)
+{
+    apu_clock_envelope(&apu->pulse[0].envelope);
+    apu_clock_envelope(&apu->pulse[1].envelope);
+    apu_clock_envelope(&apu->noise.envelope);
+
+    _nes_apu_triangle * triangle = &apu->triangle;
+
+    if (triangle->linear_reload)
+        triangle->linear = triangle->linear_period;
+    else if (triangle->linear > 0)
+        triangle->linear--;
+
+    if (!triangle->control)
+        triangle->linear_reload = false;
+}
+
+/* Length counters and sweeps */
+static void apu_half_frame(_nes_apu * apu)
+{
+    for (int i = 0; i < 2; i++)
+    {
+        if (apu->pulse[i].length > 0 && !apu->pulse[i].envelope.loop)
+            apu->pulse[i].length--;
+
+        apu_clock_sweep(&apu->pulse[i], i);
+    }
+
+    if (apu->triangle.length > 0 && !apu->triangle.control)
+        apu->triangle.length--;
+
+    if (apu->noise.length > 0 && !apu->noise.envelope.loop)
+        apu->noise.length--;
+}
+
+static void apu_update_irq(_nes_apu * apu)
+{
+    nes_cpu_irq(NES_IRQ_APU_FRAME, apu->frame_irq);
+    nes_cpu_irq(NES_IRQ_APU_DMC, apu->dmc.irq);
+}
+
+/*
+    Schedule the frame counter and DMC interrupts for the cycles the APU, run up to that cycle,
+    would raise them, unless something changes before then. Either needs the APU caught up to
+    show, which the event does.
+*/
+static void apu_schedule(_nes_apu * apu)
+{
+    _nes_apu_dmc * dmc = &apu->dmc;
+
+    /* The 4-step sequence never gets past step 3, the one with the interrupt */
+    if (!apu->frame_mode && !apu->frame_irq_inhibit)
+        nes_sched_at(NES_EVENT_APU_FRAME, apu->cycle + (uint32_t)(apu_frame_events[0][3] - apu->frame_cycle));
+    else
+        nes_sched_cancel(NES_EVENT_APU_FRAME);
+
+    /* Every 8th step of the timer empties the buffer and fetches a byte, the one fetching the last byte
+       raises it, a step at the cycle the APU is run up to only shows running past it */
+    if (dmc->irq_enabled && !dmc->loop && !dmc->irq && dmc->remaining > 0)
+        nes_sched_at(NES_EVENT_APU_DMC, apu->cycle + dmc->timer + (uint64_t)(dmc->bits - 1 + (dmc->remaining - 1) * 8) * dmc->period + 1);
+    else
+        nes_sched_cancel(NES_EVENT_APU_DMC);
+}
+
+static void apu_clock_frame_counter(_nes_apu * apu)
+{
+    uint8_t step = apu->frame_step;
+
+    /* 4-step: Q, QH, Q, QH + IRQ. 5-step: Q, QH, Q, -, QH */
+    if (step == 0 || step == 2)
+        apu_quarter_frame(apu);
+    else if (step == 1 || (step == 3 && !apu->frame_mode) || step == 4)
+    {
+        apu_quarter_frame(apu);
+        apu_half_frame(apu);
+    }
+
+    if (step == 3 && !apu->frame_mode && !apu->frame_irq_inhibit)
+    {
+        apu->frame_irq = true;
+        apu_update_irq(apu);
+    }
+
+    /* The last event is one cycle before the sequence wraps, so this leaves frame_cycle at -1 */
+    if (++apu->frame_step == (apu->frame_mode ? 5 : 4))
+    {
+        apu->frame_step   = 0;
+        apu->frame_cycle -= apu_frame_events[apu->frame_mode][4];
+    }
+}
+
+/* Catch the APU up to CPU cycle 'cycle' */
+void nes_apu_run(uint64_t cycle)
+{
+    _nes_apu * apu = &nes_current->apu;
+
+    while (apu->cycle < cycle)
+    {
+        /* Run the channels up to the next frame counter event, or 'cycle' if that comes first */
+        int32_t  event = apu_frame_events[apu->frame_mode][apu->frame_step];
+        uint64_t end   = apu->cycle + (uint32_t)(event - apu->frame_cycle);
+
+        if (end > cycle)
+            end = cycle;
+
+        uint32_t from = (uint32_t)(apu->cycle - apu->frame_start);
+        uint32_t to   = (uint32_t)(end - apu->frame_start);
+
+        apu_run_pulse(&apu->pulse[0], 0, from, to);
+        apu_run_pulse(&apu->pulse[1], 1, from, to);
+        apu_run_triangle(&apu->triangle, from, to);
+        apu_run_noise(&apu->noise, from, to);
+        apu_run_dmc(&apu->dmc, from, to);
+
+        apu->frame_cycle += (int32_t)(end - apu->cycle);
+        apu->cycle = end;
+
+        if (apu->frame_cycle == event)
+            apu_clock_frame_counter(apu);
+    }
+
+    /* The DMC may have raised its interrupt on the way */
+    apu_update_irq(apu);
+    apu_schedule(apu);
+}
+
+/* Power on state of the bound machine's APU */
+void nes_apu_init(void)
+{
+    _nes_apu * apu = &nes_current->apu;
+
+    memset(apu, 0, sizeof(_nes_apu));
+
+    apu->noise.shift  = 1;
+    apu->noise.period = apu_noise_periods[0];
+    apu->dmc.period   = apu_dmc_periods[0];
+    apu->dmc.bits     = 8;
+    apu->dmc.silence  = true;
+
+    if (nes_current->audio.blip != NULL)
+        nes_blip_init(nes_current->audio.blip, NES_APU_CLOCK_RATE, NES_APU_SAMPLE_RATE);
+
+    apu_schedule(apu);
+}
+
+static void apu_write_pulse(_nes_apu * apu, int channel, uint8_t reg, uint8_t data)
+{
+    _nes_apu_pulse * pulse = &apu->pulse[channel];
+
+    switch (reg)
+    {
+        case 0:
+            pulse->duty              = data >> 6;
+            pulse->envelope.loop     = data & 0x20;
+            pulse->envelope.constant = data & 0x10;
+            pulse->envelope.volume   = data & 0x0F;
+            break;
+        case 1:
+            pulse->sweep_enabled = data & 0x80;
+            pulse->sweep_period  = (data >> 4) & 0x07;
+            pulse->sweep_negate  = data & 0x08;
+            pulse->sweep_shift   = data & 0x07;
+            pulse->sweep_reload  = true;
+            break;
+        case 2:
+            pulse->period = (pulse->period & 0x700) | data;
+            break;
+        case 3:
+            pulse->period = (pulse->period & 0x0FF) | (uint16_t)(data & 0x07) << 8;
+            if (apu->enabled & (1 << channel))
+                pulse->length = apu_length_table[data >> 3];
+            pulse->step = 0;
+            pulse->envelope.start = true;
+            break;
+    }
+}
+
+/* CPU write to $4000-$4013, $4015 or $4017 */
+void nes_apu_write(uint16_t addr, uint8_t data)
+{
+    _nes_apu * apu = &nes_current->apu;
+
+    nes_apu_run(nes_current->cpu_registers.Total_Cycles);
+
+    switch (addr)
+    {
+        case 0x4000: case 0x4001: case 0x4002: case 0x4003:
+        case 0x4004: case 0x4005: case 0x4006: case 0x4007:
+            apu_write_pulse(apu, (addr >> 2) & 1, addr & 3, data);
+            break;
+
+        case 0x4008:
+            apu->triangle.control       = data & 0x80;
+            apu->triangle.linear_period = data & 0x7F;
+            break;
+        case 0x400A:
+            apu->triangle.period = (apu->triangle.period & 0x700) | data;
+            break;
+        case 0x400B:
+            apu->triangle.period = (apu->triangle.period & 0x0FF) | (uint16_t)(data & 0x07) << 8;
+            if (apu->enabled & 0x04)
+                apu->triangle.length = apu_length_table[data >> 3];
+            apu->triangle.linear_reload = true;
+            break;
+
+        case 0x400C:
+            apu->noise.envelope.loop     = data & 0x20;
+            apu->noise.envelope.constant = data & 0x10;
+            apu->noise.envelope.volume   = data & 0x0F;
+            break;
+        case 0x400E:
+            apu->noise.mode   = data & 0x80;
+            apu->noise.period = apu_noise_periods[data & 0x0F];
+            break;
+        case 0x400F:
+            if (apu->enabled & 0x08)
+                apu->noise.length = apu_length_table[data >> 3];
+            apu->noise.envelope.start = true;
+            break;
+
+        case 0x4010:
+            apu->dmc.irq_enabled = data & 0x80;
+            apu->dmc.loop        = data & 0x40;
+            apu->dmc.period      = apu_dmc_periods[data & 0x0F];
+            if (!apu->dmc.irq_enabled)
+                apu->dmc.irq = false;
+            break;
+        case 0x4011:
+            apu_output(&apu->dmc.output, data & 0x7F, APU_DMC_WEIGHT, (uint32_t)(apu->cycle - apu->frame_start));
+            break;
+        case 0x4012:
+            apu->dmc.sample_addr = 0xC000 + (uint16_t)data * 64;
+            break;
+        case 0x4013:
+            apu->dmc.sample_length = (uint16_t)data * 16 + 1;
+            break;
+
+        case 0x4015:
+            apu->enabled = data & 0x1F;
+
+            if (!(data & 0x01)) apu->pulse[0].length = 0;
+            if (!(data & 0x02)) apu->pulse[1].length = 0;
+            if (!(data & 0x04)) apu->triangle.length = 0;
+            if (!(data & 0x08)) apu->noise.length    = 0;
+
+            if (!(data & 0x10))
+                apu->dmc.remaining = 0;
+            else if (apu->dmc.remaining == 0)
+            {
+                apu->dmc.addr      = apu->dmc.sample_addr;
+                apu->dmc.remaining = apu->dmc.sample_length;
+                apu_dmc_fetch(&apu->dmc);
+            }
+
+            apu->dmc.irq = false;
+            break;
+
+        case 0x4017:
+            apu->frame_mode        = data & 0x80;
+            apu->frame_irq_inhibit = data & 0x40;
+            apu->frame_step        = 0;
+            apu->frame_cycle       = 0;
+
+            if (apu->frame_irq_inhibit)
+                apu->frame_irq = false;
+
+            /* The 5-step sequence clocks everything right away */
+            if (apu->frame_mode)
+            {
+                apu_quarter_frame(apu);
+                apu_half_frame(apu);
+            }
+            break;
+    }
+
+    apu_update_irq(apu);
+    apu_schedule(apu);
+}
+
+/* CPU read of $4015, clears the frame interrupt */
+uint8_t nes_apu_read_status(void)
+{
+    _nes_apu * apu = &nes_current->apu;
+
+    nes_apu_run(nes_current->cpu_registers.Total_Cycles);
+
+    uint8_t status = (apu->pulse[0].length > 0)
+                   | (apu->pulse[1].length > 0) << 1
+                   | (apu->triangle.length > 0) << 2
+                   | (apu->noise.length    > 0) << 3
+                   | (apu->dmc.remaining   > 0) << 4
+                   | apu->frame_irq << 6
+                   | apu->dmc.irq   << 7;
+
+    apu->frame_irq = false;
+    apu_update_irq(apu);
+
+    return status;
+}
+
+/* Catch up to the CPU and pass the frame's samples on to the audio ring */
+void nes_apu_end_frame(void)
+{
+    _nes_apu   * apu   = &nes_current->apu;
+    _nes_audio * audio = &nes_current->audio;
+
+    nes_apu_run(nes_current->cpu_registers.Total_Cycles);
+
+    uint32_t clocks = (uint32_t)(apu->cycle - apu->frame_start);
+    apu->frame_start = apu->cycle;
+
+    /* Rolled back frames leave the buffer alone, as if they never happened, headless machines have none */
+    if (audio->mute || audio->blip == NULL)
+        return;
+
+    nes_blip_end_frame(audio->blip, clocks);
+
+    int16_t samples[1024];
+    int count;
+
+    while ((count = nes_blip_read(audio->blip, samples, 1024)) > 0)
+        if (audio->ring != NULL)
+            nes_audio_ring_write(audio->ring, samples, count);
+}
@@ -0,0 +1,27 @@
+#pragma once
+
+/*
+    nes_apu.h: 2A03 APU, two pulse channels, triangle, noise and DMC
+
+    Nothing here is ticked per cycle. The APU remembers the CPU cycle it was last run up to
+    and only catches up to cpu_registers.Total_Cycles when the CPU touches $4000-$4017 or a
+    frame ends. Catching up walks from one frame counter event to the next, and within that
+    each channel jumps straight from one timer expiry to the next, so the cost depends on how
+    often channels step rather than on the 1.79 MHz clock.
+
+    Every change of a channel's output level goes into the machine's blip buffer (nes_blip.h)
+    as a delta, weighted with the linear approximation of the mixer from the nesdev wiki. At
+    the end of each frame the buffer is resampled to NES_APU_SAMPLE_RATE and handed to
+    audio.ring, if there is one.
+*/
+
+#include <stdint.h>
+
+#define NES_APU_CLOCK_RATE  1789773.0   /* NTSC CPU clock */
+#define NES_APU_SAMPLE_RATE 48000
+
+void    nes_apu_init(void);
+void    nes_apu_run(uint64_t cycle);
+void    nes_apu_write(uint16_t addr, uint8_t data);
+uint8_t nes_apu_read_status(void);
+void    nes_apu_end_frame(void);
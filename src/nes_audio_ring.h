@@ -0,0 +1,133 @@
+#pragma once
+
+/*
+    nes_audio_ring.h: Lock-free single producer, single consumer sample ring
+
+    The emulation thread writes a frame's worth of samples after every frame, the audio
+    thread (or device callback) reads whenever it needs more. Neither side ever waits: a full
+    ring drops the newest samples and an empty one returns fewer than asked for, so a hiccup
+    on one side costs a click instead of a stall.
+
+    'write' is only stored by the producer and 'read' only by the consumer, each on its own
+    cache line. Both count up forever and are masked on access, so full and empty can be told
+    apart without wasting a slot.
+*/
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <malloc.h>
+#endif
+
+typedef struct nes_audio_ring
+{
+    int16_t       * samples;
+    size_t          size;                   /* Power of two */
+
+    _Alignas(64) atomic_size_t write;
+    _Alignas(64) atomic_size_t read;
+}
+nes_audio_ring;
+
+/*
+    malloc() only aligns for the standard types, the counters need their own cache lines. The
+    size of an over-aligned struct is already a multiple of its alignment, as aligned_alloc()
+    wants. Windows' C library has no aligned_alloc(), it has _aligned_malloc() instead.
+*/
+static inline nes_audio_ring * nes_audio_ring_alloc(void)
+{
+#ifdef _WIN32
+    return _aligned_malloc(sizeof(nes_audio_ring), _Alignof(nes_audio_ring));
+#else
+    return aligned_alloc(_Alignof(nes_audio_ring), sizeof(nes_audio_ring));
+#endif
+}
+
+static inline void nes_audio_ring_free(nes_audio_ring * ring)
+{
+#ifdef _WIN32
+    _aligned_free(ring);
+#else
+    free(ring);
+#endif
+}
+
+/* Ring holding at least 'size' samples, NULL if out of memory */
+static inline nes_audio_ring * nes_audio_ring_create(size_t size)
+{
+    nes_audio_ring * ring = nes_audio_ring_alloc();
+    size_t capacity = 1;
+
+    while (capacity < size)
+        capacity <<= 1;
+
+    if (ring == NULL || (ring->samples = malloc(capacity * sizeof(int16_t))) == NULL)
+    {
+        nes_audio_ring_free(ring);
+        return NULL;
+    }
+
+    ring->size = capacity;
+    atomic_init(&ring->write, 0);
+    atomic_init(&ring->read, 0);
+
+    return ring;
+}
+
+static inline void nes_audio_ring_destroy(nes_audio_ring * ring)
+{
+    if (ring == NULL)
+        return;
+
+    free(ring->samples);
+    nes_audio_ring_free(ring);
+}
+
+/* Samples waiting to be read, exact for the consumer, a lower bound for the producer */
+static inline size_t nes_audio_ring_count(nes_audio_ring * ring)
+{
+    return atomic_load_explicit(&ring->write, memory_order_acquire) - atomic_load_explicit(&ring->read, memory_order_acquire);
+}
+
+/* Producer: append up to 'count' samples, returns how many fit */
+static inline size_t nes_audio_ring_write(nes_audio_ring * ring, const int16_t * samples, size_t count)
+{
+    size_t write = atomic_load_explicit(&ring->write, memory_order_relaxed);
+    size_t read  = atomic_load_explicit(&ring->read, memory_order_acquire);
+    size_t space = ring->size - (write - read);
+
+    if (count > space)
+        count = space;
+
+    size_t start = write & (ring->size - 1);
+    size_t first = ring->size - start < count ? ring->size - start : count;
+
+    memcpy(&ring->samples[start], samples, first * sizeof(int16_t));
+    memcpy(ring->samples, samples + first, (count - first) * sizeof(int16_t));
+
+    atomic_store_explicit(&ring->write, write + count, memory_order_release);
+    return count;
+}
+
+/* Consumer: take up to 'count' samples, returns how many there were */
+static inline size_t nes_audio_ring_read(nes_audio_ring * ring, int16_t * samples, size_t count)
+{
+    size_t read  = atomic_load_explicit(&ring->read, memory_order_relaxed);
+    size_t write = atomic_load_explicit(&ring->write, memory_order_acquire);
+
+    if (count > write - read)
+        count = write - read;
+
+    size_t start = read & (ring->size - 1);
+    size_t first = ring->size - start < count ? ring->size - start : count;
+
+    memcpy(samples, &ring->samples[start], first * sizeof(int16_t));
+    memcpy(samples + first, ring->samples, (count - first) * sizeof(int16_t));
+
+    atomic_store_explicit(&ring->read, read + count, memory_order_release);
+    return count;
+}
@@ -0,0 +1,291 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#include <mmsystem.h>
+#endif
+
+#include "nes_cpu.h"
+#include "nes_audio_sink.h"
+
+#define SINK_CHUNK 1024
+
+static nes_audio_sink * sink_create(nes_audio_ring * ring)
+{
+    nes_audio_sink * sink = calloc(1, sizeof(nes_audio_sink));
+    if (sink == NULL)
+        return NULL;
+
+    sink->ring = ring;
+    nes_hash_init(&sink->hash, 0);
+
+    return sink;
+}
+
+/* Read up to 'count' samples off the ring, keeping the count and hash up to date */
+static size_t sink_consume(nes_audio_sink * sink, int16_t * samples, size_t count)
+{
+    count = nes_audio_ring_read(sink->ring, samples, count);
+
+    nes_hash_update(&sink->hash, samples, count * sizeof(int16_t));
+    sink->samples += count;
+
+    return count;
+}
+
+/* Null sink */
+
+static void sink_null_pump(nes_audio_sink * sink)
+{
+    int16_t samples[SINK_CHUNK];
+
+    while (sink_consume(sink, samples, SINK_CHUNK) > 0)
+        ;
+}
+
+nes_audio_sink * nes_audio_sink_null(nes_audio_ring * ring)
+{
+    nes_audio_sink * sink = sink_create(ring);
+
+    if (sink != NULL)
+        sink->pump = sink_null_pump;
+
+    return sink;
+}
+
+/* WAV file sink */
+
+static void sink_put_u16(uint8_t * p, uint16_t v) { p[0] = (uint8_t)v; p[1] = (uint8_t)(v >> 8); }
+static void sink_put_u32(uint8_t * p, uint32_t v) { sink_put_u16(p, (uint16_t)v); sink_put_u16(p + 2, (uint16_t)(v >> 16)); }
+
+/* Canonical 44-byte header for 'samples' 16-bit mono samples */
+static void sink_wav_header(uint8_t header[44], uint32_t samples)
+{
+    memcpy(&header[0], "RIFF", 4);
+    sink_put_u32(&header[4], 36 + samples * 2);
+    memcpy(&header[8], "WAVEfmt ", 8);
+    sink_put_u32(&header[16], 16);
+    sink_put_u16(&header[20], 1);                           /* PCM */
+    sink_put_u16(&header[22], 1);                           /* Mono */
+    sink_put_u32(&header[24], NES_APU_SAMPLE_RATE);
+    sink_put_u32(&header[28], NES_APU_SAMPLE_RATE * 2);
+    sink_put_u16(&header[32], 2);
+    sink_put_u16(&header[34], 16);
+    memcpy(&header[36], "data", 4);
+    sink_put_u32(&header[40], samples * 2);
+}
+
+static void sink_wav_pump(nes_audio_sink * sink)
+{
+    int16_t samples[SINK_CHUNK];
+    uint8_t bytes[SINK_CHUNK * 2];
+    size_t  count;
+
+    while ((count = sink_consume(sink, samples, SINK_CHUNK)) > 0)
+    {
+        for (size_t i = 0; i < count; i++)
+            sink_put_u16(&bytes[i * 2], (uint16_t)samples[i]);
+
+        fwrite(bytes, 2, count, sink->data);
+    }
+}
+
+/* Fill in the sizes now that they are known */
+static void sink_wav_close(nes_audio_sink * sink)
+{
+    uint8_t header[44];
+
+    sink_wav_pump(sink);
+    sink_wav_header(header, (uint32_t)sink->samples);
+
+    fseek(sink->data, 0, SEEK_SET);
+    fwrite(header, 1, sizeof(header), sink->data);
+    fclose(sink->data);
+}
+
+nes_audio_sink * nes_audio_sink_wav(nes_audio_ring * ring, const char * path)
+{
+    FILE * file = fopen(path, "wb");
+    if (file == NULL)
+    {
+        fprintf(stderr, "error: failed to open %s for writing: %s\n", path, strerror(errno));
+        return NULL;
+    }
+
+    nes_audio_sink * sink = sink_create(ring);
+    if (sink == NULL)
+    {
+        fclose(file);
+        return NULL;
+    }
+
+    uint8_t header[44];
+    sink_wav_header(header, 0);
+    fwrite(header, 1, sizeof(header), file);
+
+    sink->pump  = sink_wav_pump;
+    sink->close = sink_wav_close;
+    sink->data  = file;
+
+    return sink;
+}
+
+/* Real-time device sink */
+
+#ifdef _WIN32
+
+#define SINK_DEVICE_BUFFERS 4
+#define SINK_DEVICE_SAMPLES 512
+
+typedef struct sink_device
+{
+    HWAVEOUT        wave;
+    HANDLE          event, thread;
+    volatile LONG   running;
+    int16_t         last;                   /* Held through underruns, dropping to 0 would pop */
+
+    WAVEHDR         headers[SINK_DEVICE_BUFFERS];
+    int16_t         buffers[SINK_DEVICE_BUFFERS][SINK_DEVICE_SAMPLES];
+}
+sink_device;
+
+static void sink_device_fill(nes_audio_sink * sink, WAVEHDR * header)
+{
+    sink_device * device  = sink->data;
+    int16_t     * samples = (int16_t *)header->lpData;
+    size_t count = sink_consume(sink, samples, SINK_DEVICE_SAMPLES);
+
+    if (count > 0)
+        device->last = samples[count - 1];
+
+    for (size_t i = count; i < SINK_DEVICE_SAMPLES; i++)
+        samples[i] = device->last;
+
+    waveOutWrite(device->wave, header, sizeof(WAVEHDR));
+}
+
+/* Refill every buffer the device is done with, whenever it signals */
+static DWORD WINAPI sink_device_thread(LPVOID arg)
+{
+    nes_audio_sink * sink   = arg;
+    sink_device    * device = sink->data;
+
+    while (device->running)
+    {
+        WaitForSingleObject(device->event, INFINITE);
+
+        for (int i = 0; i < SINK_DEVICE_BUFFERS && device->running; i++)
+            if (device->headers[i].dwFlags & WHDR_DONE)
+                sink_device_fill(sink, &device->headers[i]);
+    }
+
+    return 0;
+}
+
+static void sink_device_close(nes_audio_sink * sink)
+{
+    sink_device * device = sink->data;
+
+    InterlockedExchange(&device->running, 0);
+    SetEvent(device->event);
+    WaitForSingleObject(device->thread, INFINITE);
+
+    waveOutReset(device->wave);
+    for (int i = 0; i < SINK_DEVICE_BUFFERS; i++)
+        waveOutUnprepareHeader(device->wave, &device->headers[i], sizeof(WAVEHDR));
+    waveOutClose(device->wave);
+
+    CloseHandle(device->thread);
+    CloseHandle(device->event);
+    free(device);
+}
+
+nes_audio_sink * nes_audio_sink_device(nes_audio_ring * ring)
+{
+    WAVEFORMATEX format = { WAVE_FORMAT_PCM, 1, NES_APU_SAMPLE_RATE, NES_APU_SAMPLE_RATE * 2, 2, 16, 0 };
+    nes_audio_sink * sink   = sink_create(ring);
+    sink_device    * device = calloc(1, sizeof(sink_device));
+
+    if (sink == NULL || device == NULL)
+        goto fail;
+
+    device->event = CreateEvent(NULL, FALSE, FALSE, NULL);
+    if (waveOutOpen(&device->wave, WAVE_MAPPER, &format, (DWORD_PTR)device->event, 0, CALLBACK_EVENT) != MMSYSERR_NOERROR)
+    {
+        fprintf(stderr, "error: failed to open the audio device\n");
+        CloseHandle(device->event);
+        goto fail;
+    }
+
+    sink->close   = sink_device_close;
+    sink->data    = device;
+    device->running = 1;
+
+    /* Start with every buffer queued (silence until the ring fills) */
+    for (int i = 0; i < SINK_DEVICE_BUFFERS; i++)
+    {
+        device->headers[i].lpData         = (LPSTR)device->buffers[i];
+        device->headers[i].dwBufferLength = sizeof(device->buffers[i]);
+        waveOutPrepareHeader(device->wave, &device->headers[i], sizeof(WAVEHDR));
+        sink_device_fill(sink, &device->headers[i]);
+    }
+
+    device->thread = CreateThread(NULL, 0, sink_device_thread, sink, 0, NULL);
+    return sink;
+
+fail:
+    free(device);
+    free(sink);
+    return NULL;
+}
+
+#else
+
+/* TO-DO: a device sink for other platforms (ALSA, PulseAudio or CoreAudio) */
+nes_audio_sink * nes_audio_sink_device(nes_audio_ring * ring)
+{
+    (void)ring;
+    fprintf(stderr, "error: no audio device support on this platform\n");
+    return NULL;
+}
+
+#endif
+
+/* Call after every frame, see the top of nes_audio_sink.h */
+void nes_audio_sink_frame(nes_audio_sink * sink)
+{
+    if (sink->pump != NULL)
+    {
+        sink->pump(sink);
+        return;
+    }
+
+    /* Emptier than half full: make a little more audio per frame, fuller: a little less */
+    double fill = (double)nes_audio_ring_count(sink->ring) / sink->ring->size;
+
+    sink->rate_adjust = NES_AUDIO_MAX_RATE_DELTA * (1.0 - 2.0 * fill);
+    if (nes_current->audio.blip != NULL)
+        nes_blip_set_rates(nes_current->audio.blip, NES_APU_CLOCK_RATE, NES_APU_SAMPLE_RATE * (1.0 + sink->rate_adjust));
+}
+
+uint64_t nes_audio_sink_hash(const nes_audio_sink * sink)
+{
+    return nes_hash_final(&sink->hash);
+}
+
+/* Drain whatever is left and free the sink */
+void nes_audio_sink_close(nes_audio_sink * sink)
+{
+    if (sink == NULL)
+        return;
+
+    if (sink->close != NULL)
+        sink->close(sink);
+    else if (sink->pump != NULL)
+        sink->pump(sink);
+
+    free(sink);
+}
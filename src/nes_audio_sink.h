@@ -0,0 +1,48 @@
+#pragma once
+
+/*
+    nes_audio_sink.h: Where the APU's samples end up
+
+    A sink is the consumer end of the machine's audio ring (nes_audio_ring.h):
+
+        null    drains and discards, so headless benchmarks still pay for the whole audio path
+        wav     drains into a 16-bit mono WAV file, for golden-file comparisons
+        device  plays in real time on its own thread (waveOut on Windows, NULL elsewhere)
+
+    Call nes_audio_sink_frame() after every emulated frame. File and null sinks drain the ring
+    right there. For the device sink it does dynamic rate control instead: the device and the
+    emulator never run at exactly the same rate, so the resampling ratio is nudged by up to
+    NES_AUDIO_MAX_RATE_DELTA to keep the ring half full. That fixes drift without pops.
+
+    Every sink hashes what it consumes, so runs can be compared without keeping the audio.
+*/
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "nes_audio_ring.h"
+#include "nes_hash.h"
+
+#define NES_AUDIO_MAX_RATE_DELTA 0.005
+
+typedef struct nes_audio_sink
+{
+    nes_audio_ring * ring;
+
+    void (*pump)(struct nes_audio_sink *);      /* Drains the ring on the emulation thread, NULL for device sinks */
+    void (*close)(struct nes_audio_sink *);
+    void * data;
+
+    uint64_t        samples;                    /* Samples consumed so far */
+    nes_hash_state  hash;                       /* ...and their hash */
+    double          rate_adjust;                /* Last dynamic rate correction, device sinks only */
+}
+nes_audio_sink;
+
+nes_audio_sink * nes_audio_sink_null(nes_audio_ring * ring);
+nes_audio_sink * nes_audio_sink_wav(nes_audio_ring * ring, const char * path);
+nes_audio_sink * nes_audio_sink_device(nes_audio_ring * ring);
+
+void nes_audio_sink_frame(nes_audio_sink * sink);
+uint64_t nes_audio_sink_hash(const nes_audio_sink * sink);
+void nes_audio_sink_close(nes_audio_sink * sink);
@@ -0,0 +1,103 @@
+#include <math.h>
+#include <string.h>
+
+#include "nes_blip.h"
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+/* Set up 'blip' empty, for 'clock_rate' clocks/s in and 'sample_rate' samples/s out */
+void nes_blip_init(nes_blip * blip, double clock_rate, double sample_rate)
+{
+    memset(blip, 0, sizeof(nes_blip));
+    nes_blip_set_rates(blip, clock_rate, sample_rate);
+
+    /* Blackman windowed sinc, cut off a little below the output Nyquist frequency */
+    const double cutoff = 0.45;
+    const double half   = NES_BLIP_TAPS / 2;
+
+    for (int p = 0; p < NES_BLIP_PHASES; p++)
+    {
+        double taps[NES_BLIP_TAPS], sum = 0.0;
+        int    total = 0, peak = 0;
+
+        for (int i = 0; i < NES_BLIP_TAPS; i++)
+        {
+            double x = i - (half - 1) - (double)p / NES_BLIP_PHASES;
+            double sinc   = x == 0.0 ? 1.0 : sin(2.0 * M_PI * cutoff * x) / (2.0 * M_PI * cutoff * x);
+            double window = 0.42 + 0.5 * cos(M_PI * x / half) + 0.08 * cos(2.0 * M_PI * x / half);
+
+            taps[i] = sinc * window;
+            sum    += taps[i];
+        }
+
+        /* Normalise so every phase adds up to exactly one unit, rounding error goes to the peak */
+        for (int i = 0; i < NES_BLIP_TAPS; i++)
+        {
+            blip->kernel[p][i] = (int16_t)lround(taps[i] / sum * (1 << NES_BLIP_UNIT_BITS));
+            total += blip->kernel[p][i];
+
+            if (blip->kernel[p][i] > blip->kernel[p][peak])
+                peak = i;
+        }
+
+        blip->kernel[p][peak] += (1 << NES_BLIP_UNIT_BITS) - total;
+    }
+}
+
+/* Change the rates without losing buffered samples, used for dynamic rate control */
+void nes_blip_set_rates(nes_blip * blip, double clock_rate, double sample_rate)
+{
+    blip->factor = (uint64_t)(sample_rate / clock_rate * 4294967296.0 + 0.5);
+}
+
+/* The frame ends after 'clocks', the next one starts at clock 0 */
+void nes_blip_end_frame(nes_blip * blip, uint32_t clocks)
+{
+    blip->offset += clocks * blip->factor;
+
+    if ((blip->offset >> 32) > NES_BLIP_SIZE)
+        blip->offset = (uint64_t)NES_BLIP_SIZE << 32 | (uint32_t)blip->offset;
+}
+
+int nes_blip_samples_avail(const nes_blip * blip)
+{
+    return (int)(blip->offset >> 32);
+}
+
+/* Integrate up to 'count' finished samples into 'out', returns how many */
+int nes_blip_read(nes_blip * blip, int16_t * out, int count)
+{
+    int avail = nes_blip_samples_avail(blip);
+    if (count > avail)
+        count = avail;
+
+    int32_t sum = blip->integrator;
+
+    for (int i = 0; i < count; i++)
+    {
+        sum += blip->buffer[i];
+
+        int32_t s = sum >> NES_BLIP_UNIT_BITS;
+
+        if (s < INT16_MIN)
+            s = INT16_MIN;
+        if (s > INT16_MAX)
+            s = INT16_MAX;
+
+        out[i] = (int16_t)s;
+        sum   -= s << (NES_BLIP_UNIT_BITS - NES_BLIP_BASS_SHIFT);
+    }
+
+    blip->integrator = sum;
+
+    /* Shift what is left, including the tails of steps near the end, to the front */
+    int left = avail - count + NES_BLIP_TAPS;
+
+    memmove(blip->buffer, &blip->buffer[count], left * sizeof(int32_t));
+    memset(&blip->buffer[left], 0, count * sizeof(int32_t));
+    blip->offset -= (uint64_t)count << 32;
+
+    return count;
+}
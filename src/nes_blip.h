@@ -0,0 +1,59 @@
+#pragma once
+
+/*
+    nes_blip.h: Band-limited step synthesis, blip_buf style
+
+    The APU's channels only ever jump between levels, so instead of generating 1.79 million
+    samples a second and filtering them down, every jump is added to a buffer at the output
+    rate as a band-limited step (a windowed sinc impulse into a buffer of differences, picked
+    from NES_BLIP_PHASES sub-sample positions). Reading the buffer integrates it back into
+    samples, so mixing and resampling to 48 kHz happen in one pass and cost only as much as
+    the number of level changes.
+
+        nes_blip_add_delta(blip, clock, delta);     (clock counted from the start of the frame)
+        nes_blip_end_frame(blip, clocks);           (clocks in the frame, makes samples available)
+        nes_blip_read(blip, out, count);
+*/
+
+#include <stdint.h>
+
+#define NES_BLIP_PHASES     32          /* Sub-sample positions of a step */
+#define NES_BLIP_TAPS       16          /* Width of a step's impulse in output samples */
+#define NES_BLIP_SIZE       4096        /* Samples held, a frame at 48 kHz is ~800 */
+#define NES_BLIP_UNIT_BITS  15          /* Kernel taps of a phase add up to 1 << NES_BLIP_UNIT_BITS */
+#define NES_BLIP_BASS_SHIFT 9           /* DC removal, about 15 Hz at 48 kHz */
+
+typedef struct nes_blip
+{
+    uint64_t    factor;                 /* Output samples per clock, 32.32 fixed point */
+    uint64_t    offset;                 /* Output position of clock 0 of the current frame, 32.32 */
+    int32_t     integrator;
+
+    int16_t     kernel[NES_BLIP_PHASES][NES_BLIP_TAPS];
+    int32_t     buffer[NES_BLIP_SIZE + NES_BLIP_TAPS];
+}
+nes_blip;
+
+void nes_blip_init(nes_blip * blip, double clock_rate, double sample_rate);
+void nes_blip_set_rates(nes_blip * blip, double clock_rate, double sample_rate);
+void nes_blip_end_frame(nes_blip * blip, uint32_t clocks);
+int  nes_blip_samples_avail(const nes_blip * blip);
+int  nes_blip_read(nes_blip * blip, int16_t * out, int count);
+
+/* Add a step of 'delta' at 'clock' clocks into the current frame */
+static inline void nes_blip_add_delta(nes_blip * blip, uint32_t clock, int32_t delta)
+{
+    uint64_t position = blip->offset + clock * blip->factor;
+    uint32_t index    = (uint32_t)(position >> 32);
+    uint32_t phase    = (uint32_t)(position >> (32 - 5)) & (NES_BLIP_PHASES - 1);
+
+    /* A frame far longer than NES_BLIP_SIZE samples, drop it rather than write past the end */
+    if (index >= NES_BLIP_SIZE)
+        return;
+
+    int32_t       * out    = &blip->buffer[index];
+    const int16_t * kernel = blip->kernel[phase];
+
+    for (int i = 0; i < NES_BLIP_TAPS; i++)
+        out[i] += kernel[i] * delta;
+}
@@ -1,46 +1,33 @@
 #pragma once
-//#include "nes_ppu.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
 
-/* NES Cartridge data */
-typedef struct _nes_cartridge
-{
-    size_t  CHR_ROM_size,
-            PRG_ROM_size;
-    
-    /* Pointer to NES address space */
-    uint8_t * nes_mem;
-}
-_nes_cartridge;
-_nes_cartridge nes_cartridge;
-
-/* Function pointers to select method of memory access */
-uint8_t (*PEEK_MAPPER)(uint16_t);
-void    (*POKE_MAPPER)(uint16_t, uint8_t);
-
+#include "nes_machine.h"
+#include "nes_controller.h"
+#include "nes_apu.h"
 
 /* Mapper 000 PEEK */
 static uint8_t PEEK_000(uint16_t addr)
 {
     /* Internal NES memory */
     if (addr >= 0x0 && addr < 0x2000)
-        return nes_cartridge.nes_mem[(addr & 0x07FF)];
-    /* PPU Registers */
-    if (addr >= 0x2000 && addr < 0x4000)
-    {
-        //USE_REGS((addr & 0x7), 0, 0x0);
-        //return nes_ppu.PPU_registers[(addr & 0x7)];
-    }
+        return nes_current->cpu_mem.ram[(addr & 0x07FF)];
+    /* APU status */
+    if (addr == 0x4015)
+        return nes_apu_read_status();
+    /* Controllers */
+    if (addr == 0x4016 || addr == 0x4017)
+        return nes_controller_read(addr & 1);
     
     /* Mirror if PRG_ROM is only 16 KiB */
     if (addr >= 0x8000)
     {
-        if (nes_cartridge.PRG_ROM_size == 0x4000)
-            return nes_cartridge.nes_mem[(addr & 0x3FFF) + 0x8000];
+        if (nes_current->cartridge.PRG_ROM_size == 0x4000)
+            return nes_current->cartridge.PRG_ROM[addr & 0x3FFF];
         else
-            return nes_cartridge.nes_mem[addr];
+            return nes_current->cartridge.PRG_ROM[addr & 0x7FFF];
     }
 }
 
@@ -49,33 +36,32 @@ static void POKE_000(uint16_t addr, uint8_t data)
 {
     /* Internal NES memory */
     if (addr >= 0x0 && addr < 0x2000)
-        nes_cartridge.nes_mem[(addr & 0x07FF)] = data;
-    /* PPU Registers */
-    if (addr >= 0x2000 && addr < 0x4000)
-        //USE_REGS((addr & 0x7), 1, data);
-    /* Mirror if PRG_ROM is only 16 KiB */
-    if (addr >= 0x8000)
-    {
-        if (nes_cartridge.PRG_ROM_size == 0x4000)
-            nes_cartridge.nes_mem[(addr & 0x3FFF) + 0x8000] = data;
-        else
-            nes_cartridge.nes_mem[addr] = data;
-    }
+        nes_current->cpu_mem.ram[(addr & 0x07FF)] = data;
+    /* APU */
+    if ((addr >= 0x4000 && addr <= 0x4013) || addr == 0x4015 || addr == 0x4017)
+        nes_apu_write(addr, data);
+    /* Controller strobe */
+    if (addr == 0x4016)
+        nes_controller_write(data);
+    /* PRG-ROM can't be written, NROM has no registers */
 }
 
 /* Mapper 000 */
 static void mapper_000(FILE * rom)
 {
     /* Set PEEK and POKE functions respectively */
-    PEEK_MAPPER = PEEK_000;
-    POKE_MAPPER = POKE_000;
+    nes_current->PEEK_MAPPER = PEEK_000;
+    nes_current->POKE_MAPPER = POKE_000;
 
-    /* Program ROM, loaded in the range $8000-$FFFF */
-    if (fread(&nes_cartridge.nes_mem[0x8000], sizeof(uint8_t), nes_cartridge.PRG_ROM_size, rom) != nes_cartridge.PRG_ROM_size)
-    {
-        fprintf(stderr, "error: Failed to copy PRG-ROM: %s. exiting\n", strerror(errno));
+    /* Program ROM, in the range $8000-$FFFF, shared with other machines running the same ROM */
+    if ((nes_current->cartridge.image = nes_rom_share(rom, nes_current->cartridge.PRG_ROM_size)) == NULL)
         return;
-    }
+
+    nes_current->cartridge.PRG_ROM = nes_current->cartridge.image->data;
+
+    /* Reads come straight from PRG-ROM, 16 KiB carts are mirrored, writes are ignored by POKE_000 (it's mapped read-only) */
+    for (uint32_t addr = 0x8000; addr < 0x10000 && nes_current->cartridge.PRG_ROM_size > 0; addr += nes_current->cartridge.PRG_ROM_size)
+        nes_cpu_map((uint16_t)addr, nes_current->cartridge.PRG_ROM_size, (uint8_t *)nes_current->cartridge.PRG_ROM, false);
 
     printf("Successfully mapped memory (mapper_000)!\n");
 }
@@ -0,0 +1,47 @@
+#pragma once
+
+/*
+    nes_controller.h: Standard controllers on $4016/$4017
+
+    Writing 1 to bit 0 of $4016 (strobe) latches the held buttons of both pads into 8-bit
+    shift registers, each read of $4016/$4017 then returns the next button of pad 1/2 in bit 0,
+    in the order A, B, Select, Start, Up, Down, Left, Right, which is also the bit order of
+    nes_machine.pad. After all 8 an official controller returns 1s. While strobe is held high
+    every read returns the current state of A.
+
+    The upper bits are open bus, almost always $40 left over from the high byte of the address.
+*/
+
+#include <stdint.h>
+
+#include "nes_machine.h"
+
+#define NES_CONTROLLER_OPEN_BUS 0x40
+
+static inline uint8_t nes_controller_read(uint8_t port)
+{
+    _nes_controllers * controllers = &nes_current->controllers;
+
+    if (controllers->strobe)
+        return NES_CONTROLLER_OPEN_BUS | (nes_current->pad[port] & 1);
+
+    uint8_t bit = controllers->shift[port] & 1;
+    controllers->shift[port] = (controllers->shift[port] >> 1) | 0x80;
+
+    return NES_CONTROLLER_OPEN_BUS | bit;
+}
+
+/* $4016 write, only the strobe bit is connected */
+static inline void nes_controller_write(uint8_t data)
+{
+    _nes_controllers * controllers = &nes_current->controllers;
+
+    controllers->strobe = data & 1;
+
+    /* The latch stays transparent while strobe is high, the last reload wins */
+    if (controllers->strobe)
+    {
+        controllers->shift[0] = nes_current->pad[0];
+        controllers->shift[1] = nes_current->pad[1];
+    }
+}
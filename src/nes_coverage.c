@@ -0,0 +1,140 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "nes_machine.h"
+#include "nes_coverage.h"
+
+/* Start a code/data log of the bound machine, once its cartridge is loaded */
+bool nes_coverage_enable(void)
+{
+#ifndef NES_COVERAGE
+    fprintf(stderr, "error: Built without NES_COVERAGE, there would be nothing in the code/data log\n");
+    return false;
+#else
+    if (nes_current->coverage != NULL)
+        return true;
+
+    nes_coverage * coverage = calloc(1, sizeof(nes_coverage));
+
+    if (coverage == NULL || (coverage->prg = calloc(nes_current->cartridge.PRG_ROM_size + 1, 1)) == NULL)
+    {
+        fprintf(stderr, "error: Out of memory for the code/data log\n");
+        free(coverage);
+        return false;
+    }
+
+    coverage->prg_size = nes_current->cartridge.PRG_ROM_size;
+    coverage->chr_size = nes_current->cartridge.CHR_ROM_size;
+
+    nes_current->coverage = coverage;
+
+    for (size_t page = 0; page < 256; page++)
+        nes_coverage_map((uint8_t)page);
+
+    return true;
+#endif
+}
+
+void nes_coverage_disable(void)
+{
+    nes_coverage * coverage = nes_current->coverage;
+
+    nes_current->coverage = NULL;
+
+#ifdef NES_COVERAGE
+    for (size_t page = 0; page < 256; page++)
+        nes_coverage_map((uint8_t)page);
+#endif
+
+    nes_coverage_free(coverage);
+}
+
+void nes_coverage_free(nes_coverage * coverage)
+{
+    if (coverage == NULL)
+        return;
+
+    free(coverage->prg);
+    free(coverage);
+}
+
+#ifdef NES_COVERAGE
+/*
+    Point CPU page 'page' at its coverage bytes, from whatever nes_cpu_map() backed it with: PRG-ROM
+    into the PRG-ROM log, RAM into the CPU address log where it sits in cpu_mem, so mirrors share
+    it, and anything left to the mapper by its own address.
+*/
+void nes_coverage_map(uint8_t page)
+{
+    nes_coverage * coverage = nes_current->coverage;
+
+    if (coverage == NULL)
+    {
+        nes_current->cdl_page[page] = nes_current->cdl_sink;
+        return;
+    }
+
+    const uint8_t * host = nes_current->cpu_read_page[page];
+    uintptr_t rom = (uintptr_t)host - (uintptr_t)nes_current->cartridge.PRG_ROM;
+    uintptr_t ram = (uintptr_t)host - (uintptr_t)nes_current->cpu_mem.ram;
+
+    if (host != NULL && nes_current->cartridge.PRG_ROM != NULL && rom < coverage->prg_size)
+        nes_current->cdl_page[page] = &coverage->prg[rom];
+    else if (host != NULL && ram < sizeof(nes_current->cpu_mem.ram))
+        nes_current->cdl_page[page] = &coverage->cpu[ram];
+    else
+        nes_current->cdl_page[page] = &coverage->cpu[page << 8];
+}
+#endif
+
+/* Save the code/data log as a CDL file, PRG-ROM then CHR-ROM, 0 on success */
+int nes_coverage_write(const char * path)
+{
+    nes_coverage * coverage = nes_current->coverage;
+
+    if (coverage == NULL)
+    {
+        fprintf(stderr, "error: No code/data log to write to %s\n", path);
+        return -1;
+    }
+
+    FILE * file = fopen(path, "wb");
+
+    if (file == NULL)
+    {
+        fprintf(stderr, "error: failed to open %s for writing: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    /* Writes to ROM are mapper registers, CDL has no flag for those */
+    for (size_t i = 0; i < coverage->prg_size; i++)
+        fputc(coverage->prg[i] & ~NES_CDL_WRITTEN, file);
+
+    for (size_t i = 0; i < coverage->chr_size; i++)
+        fputc(0, file);
+
+    if (fclose(file) != 0)
+    {
+        fprintf(stderr, "error: failed to write %s\n", path);
+        return -1;
+    }
+
+    return 0;
+}
+
+/* PRG-ROM bytes marked as code and as data so far, a byte can be both */
+void nes_coverage_count(size_t * code, size_t * data)
+{
+    nes_coverage * coverage = nes_current->coverage;
+
+    *code = 0;
+    *data = 0;
+
+    for (size_t i = 0; coverage != NULL && i < coverage->prg_size; i++)
+    {
+        *code += (coverage->prg[i] & NES_CDL_CODE) != 0;
+        *data += (coverage->prg[i] & NES_CDL_DATA) != 0;
+    }
+}
@@ -0,0 +1,93 @@
+#pragma once
+
+/*
+    nes_coverage.h: Which bytes the emulated program ran, read and wrote
+
+    With NES_COVERAGE defined, the interpreter marks every byte it runs as code (opcode and
+    operands) and every byte it reads or writes as data by OR-ing a flag into that byte's
+    coverage. Coverage is found through cdl_page, a page table like cpu_read_page, so a mark is
+    a shift, a load and an OR, without a branch. ROM pages lead into a log of PRG-ROM, so bank
+    switches made with nes_cpu_map() land in the right bank. Every other page leads into a 64
+    KiB log by CPU address, with RAM mirrors folded onto $0000-$07FF. Until
+    nes_coverage_enable() every page leads into a scratch page nobody reads, and without
+    NES_COVERAGE the marks compile to nothing.
+
+    nes_coverage_write() saves the PRG-ROM log in the CDL (code/data log) format FCEUX and Mesen
+    read and disassemblers take hints from, followed by the CHR-ROM part, all zero as nothing
+    fetches CHR yet. Flags per byte:
+
+        bit 0       code
+        bit 1       data
+        bits 2-3    the 8 KiB window of $8000-$FFFF it was accessed through
+        bit 4       code reached indirectly (not marked yet)
+        bit 5       data read through an (indirect) pointer
+        bit 6       DMC sample data
+        bit 7       written, only kept in the CPU address log
+
+    Translated code reads and writes memory without going through the interpreter, so
+    nes_run_frame() doesn't run the JIT while coverage is on. Skipped idle loops have already
+    run one pass through the interpreter, so their bytes are marked.
+*/
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "nes_machine.h"
+
+#define NES_CDL_CODE            0x01
+#define NES_CDL_DATA            0x02
+#define NES_CDL_WINDOW          0x0C
+#define NES_CDL_INDIRECT_CODE   0x10
+#define NES_CDL_INDIRECT_DATA   0x20
+#define NES_CDL_PCM             0x40
+#define NES_CDL_WRITTEN         0x80
+
+typedef struct nes_coverage
+{
+    uint8_t   * prg;            /* One byte per PRG-ROM byte */
+    size_t      prg_size;
+    size_t      chr_size;
+
+    uint8_t     cpu[0x10000];   /* Everything else, by CPU address */
+}
+nes_coverage;
+
+bool nes_coverage_enable(void);
+void nes_coverage_disable(void);
+void nes_coverage_free(nes_coverage * coverage);
+
+int nes_coverage_write(const char * path);
+void nes_coverage_count(size_t * code, size_t * data);
+
+#ifdef NES_COVERAGE
+
+void nes_coverage_map(uint8_t page);
+
+/* OR 'flags' into the coverage of 'addr', along with its window if there are any flags */
+static inline void nes_coverage_mark(uint16_t addr, uint8_t flags)
+{
+    uint8_t window = (uint8_t)((addr >> 11) & NES_CDL_WINDOW) & (uint8_t)-(flags != 0);
+
+    nes_current->cdl_page[addr >> 8][addr & 0xFF] |= flags | window;
+}
+
+/* An instruction of 'bytes' bytes ran from 'pc', bytes past its end get no flags rather than a branch */
+static inline void nes_coverage_code(uint16_t pc, uint8_t bytes)
+{
+    nes_coverage_mark(pc, NES_CDL_CODE);
+    nes_coverage_mark(pc + 1, NES_CDL_CODE & (uint8_t)-(bytes > 1));
+    nes_coverage_mark(pc + 2, NES_CDL_CODE & (uint8_t)-(bytes > 2));
+}
+
+#define NES_COVERAGE_ON()                   (nes_current->coverage != NULL)
+#define NES_COVERAGE_CODE(pc, bytes)        nes_coverage_code(pc, bytes)
+#define NES_COVERAGE_MARK(addr, flags)      nes_coverage_mark(addr, flags)
+
+#else
+
+#define NES_COVERAGE_ON()                   false
+#define NES_COVERAGE_CODE(pc, bytes)        ((void)0)
+#define NES_COVERAGE_MARK(addr, flags)      ((void)0)
+
+#endif
@@ -8,22 +8,25 @@
 #include <errno.h>
 
 #include "nes_cpu.h"
-
-size_t file_size;
+#include "nes_profile.h"
 
 /* init NES cpu internals */
 int nes_init_cpu(void)
 {
-    nes_cpu_registers.A = 0x00;
-    nes_cpu_registers.X = 0x00;
-    nes_cpu_registers.Y = 0x00;
-    nes_cpu_registers.S = 0x34;
+    nes_current->cpu_registers.A = 0x00;
+    nes_current->cpu_registers.X = 0x00;
+    nes_current->cpu_registers.Y = 0x00;
+    nes_cpu_set_status(&nes_current->cpu_registers, 0x34);
     
-    nes_cpu_registers.SP = 0xFD;
-    nes_cpu_registers.PC = 0xFFFC;
+    nes_current->cpu_registers.SP = 0xFD;
+    nes_current->cpu_registers.PC = 0xFFFC;
+
+    nes_current->cpu_bus.AB = 0x0000;
+    nes_current->cpu_bus.DB = 0x0000;
 
-    nes_cpu_bus.AB = 0x0000;
-    nes_cpu_bus.DB = 0x0000;
+    /* 2 KiB of internal RAM, mirrored up to $1FFF */
+    for (uint16_t mirror = 0x0000; mirror < 0x2000; mirror += 0x800)
+        nes_cpu_map(mirror, 0x800, nes_current->cpu_mem.ram, true);
 
     return 0;
 }
@@ -73,6 +76,7 @@ int nes_load_rom(const char * filename, _nes_cartridge * cart)
 
     /* Debug info to measure # of bytes copied */
     size_t bytes_copied = 0;
+    size_t file_size;
 
     /* If the file pointer is empty, something went wrong with opening it. */
     FILE * rom;
@@ -100,8 +104,10 @@ int nes_load_rom(const char * filename, _nes_cartridge * cart)
         return -1;
     }
 
-    /* Set cartridge address space to the NES address space */
-    cart->nes_mem = nes_cpu_mem.mem;
+    /* Whatever was loaded before goes back to the machines sharing it */
+    nes_rom_release(cart->image);
+    cart->image   = NULL;
+    cart->PRG_ROM = NULL;
 
     /* Check if iNES or NES 2.0 format, shameful copy/paste from https://wiki.nesdev.com/w/index.php/NES_2.0 */
     if ((uint32_t)(header[0] << 24 | header[1] << 16 | header[2] << 8 | header[3]) == 0x4E45531A)
@@ -137,9 +143,23 @@ int nes_load_rom(const char * filename, _nes_cartridge * cart)
 
             /* TO-DO: check other flags in 6 & 7 */
 
-            /* Check for trainer, load it into address space $7000 */
+            /* Skip the trainer, there is no PRG-RAM at $7000 for it to go into */
             if (flags & 0x4)
-                fread(&nes_cpu_mem.mem[0x7000], sizeof(uint8_t), 0x200, rom);
+                fseek(rom, 0x200, SEEK_CUR);
+
+            /* Four-screen boards bring 2 KiB of nametables, the console only has room for two */
+            if ((flags & 0x8) && cart->four_screen == NULL && (cart->four_screen = calloc(1, 0x800)) == NULL)
+            {
+                fprintf(stderr, "error: Out of memory for four-screen nametables\n");
+                fclose(rom);
+                return -1;
+            }
+
+            /* Nametable mirroring as soldered on the board, mappers that can switch it do so from here on */
+            if (flags & 0x8)
+                nes_ppu_mirror(NES_MIRROR_FOUR_SCREEN);
+            else
+                nes_ppu_mirror((flags & 0x1) ? NES_MIRROR_VERTICAL : NES_MIRROR_HORIZONTAL);
 
             /* Load rom according to which mapper is being used */
             if(mapper_ID > 0)
@@ -153,6 +173,12 @@ int nes_load_rom(const char * filename, _nes_cartridge * cart)
                 (*mapper[mapper_ID])(rom);
             }
 
+            if (cart->PRG_ROM == NULL)
+            {
+                fclose(rom);
+                return -1;
+            }
+
             /* TO-DO: load CHR-ROM/RAM into memory and map memory accordingly. */
         }
 
@@ -167,795 +193,766 @@ int nes_load_rom(const char * filename, _nes_cartridge * cart)
     /* Finally, clear the file pointer and return 0 */
     fclose(rom);
 
-    //nes_cpu_registers.PC = (uint16_t)PEEK(nes_cpu_registers.PC + 1) << 8 | PEEK(nes_cpu_registers.PC);
-    nes_cpu_registers.PC = 0x8000;
+    //nes_current->cpu_registers.PC = (uint16_t)PEEK(nes_current->cpu_registers.PC + 1) << 8 | PEEK(nes_current->cpu_registers.PC);
+    nes_current->cpu_registers.PC = 0x8000;
     return 0;
 }
 
-/* literally copy and paste assembled 6502 code here */
-void test_emu(uint8_t * program, size_t size)
+/*
+    Instruction handlers, one per opcode, the predecode cache points each decoded instruction at
+    its own. NES_CPU_OP_PAGE adds the base cycles to the page crossing INDY may have charged.
+*/
+#define NES_CPU_OP(name, mode, instruction, cycles)             \
+static void op_##name(const nes_cpu_decoded * insn)             \
+{                                                               \
+    nes_cpu_address(mode, insn->operand);                       \
+    instruction();                                              \
+    nes_current->cpu_registers.Cycles = cycles;                 \
+}
+
+#define NES_CPU_OP_PAGE(name, mode, instruction, cycles)        \
+static void op_##name(const nes_cpu_decoded * insn)             \
+{                                                               \
+    nes_cpu_address(mode, insn->operand);                       \
+    instruction();                                              \
+    nes_current->cpu_registers.Cycles += cycles;                \
+}
+
+/* JMP and JSR only want the address, the byte ABS reads from it is not data (see nes_coverage.h) */
+#define NES_CPU_OP_JUMP(name, instruction, cycles)              \
+static void op_##name(const nes_cpu_decoded * insn)             \
+{                                                               \
+    nes_current->current_addr_mode = ABS;                       \
+    nes_current->cpu_bus.AB = insn->operand;                    \
+    nes_current->cpu_bus.DB = PEEK(insn->operand);              \
+    nes_current->PC_offset = 3;                                 \
+    instruction();                                              \
+    nes_current->cpu_registers.Cycles = cycles;                 \
+}
+
+/* Shifts and rotates on the accumulator work on the data bus, which goes back into A */
+#define NES_CPU_OP_ACC(name, instruction)                       \
+static void op_##name(const nes_cpu_decoded * insn)             \
+{                                                               \
+    nes_cpu_address(ACC, insn->operand);                        \
+    instruction();                                              \
+    nes_current->cpu_registers.A = nes_current->cpu_bus.DB;     \
+    nes_current->cpu_registers.Cycles = 2;                      \
+}
+
+NES_CPU_OP     (BRK_IMP,  IMP,  BRK, 7)
+NES_CPU_OP     (ORA_INDX, INDX, ORA, 6)
+NES_CPU_OP     (ORA_ZP,   ZP,   ORA, 3)
+NES_CPU_OP     (ASL_ZP,   ZP,   ASL, 5)
+NES_CPU_OP     (PHP_IMP,  IMP,  PHP, 3)
+NES_CPU_OP     (ORA_IMM,  IMM,  ORA, 2)
+NES_CPU_OP     (ORA_ABS,  ABS,  ORA, 4)
+NES_CPU_OP     (ASL_ABS,  ABS,  ASL, 6)
+NES_CPU_OP     (BPL_REL,  REL,  BPL, 2)
+NES_CPU_OP_PAGE(ORA_INDY, INDY, ORA, 5)
+NES_CPU_OP     (ORA_ZPX,  ZPX,  ORA, 4)
+NES_CPU_OP     (ASL_ZPX,  ZPX,  ASL, 6)
+NES_CPU_OP     (CLC_IMP,  IMP,  CLC, 2)
+NES_CPU_OP_PAGE(ORA_ABSY, ABSY, ORA, 4)
+NES_CPU_OP_PAGE(ORA_ABSX, ABSX, ORA, 4)
+NES_CPU_OP     (ASL_ABSX, ABSX, ASL, 7)
+NES_CPU_OP_JUMP(JSR_ABS,        JSR, 6)
+NES_CPU_OP     (AND_INDX, INDX, AND, 6)
+NES_CPU_OP     (BIT_ZP,   ZP,   BIT, 3)
+NES_CPU_OP     (AND_ZP,   ZP,   AND, 3)
+NES_CPU_OP     (ROL_ZP,   ZP,   ROL, 5)
+NES_CPU_OP     (PLP_IMP,  IMP,  PLP, 4)
+NES_CPU_OP     (AND_IMM,  IMM,  AND, 2)
+NES_CPU_OP     (BIT_ABS,  ABS,  BIT, 4)
+NES_CPU_OP     (AND_ABS,  ABS,  AND, 4)
+NES_CPU_OP     (ROL_ABS,  ABS,  ROL, 6)
+NES_CPU_OP     (BMI_REL,  REL,  BMI, 2)
+NES_CPU_OP_PAGE(AND_INDY, INDY, AND, 5)
+NES_CPU_OP     (AND_ZPX,  ZPX,  AND, 4)
+NES_CPU_OP     (ROL_ZPX,  ZPX,  ROL, 6)
+NES_CPU_OP     (SEC_IMP,  IMP,  SEC, 2)
+NES_CPU_OP_PAGE(AND_ABSY, ABSY, AND, 4)
+NES_CPU_OP_PAGE(AND_ABSX, ABSX, AND, 4)
+NES_CPU_OP     (ROL_ABSX, ABSX, ROL, 7)
+NES_CPU_OP     (RTI_IMP,  IMP,  RTI, 6)
+NES_CPU_OP     (EOR_INDX, INDX, EOR, 6)
+NES_CPU_OP     (EOR_ZP,   ZP,   EOR, 3)
+NES_CPU_OP     (LSR_ZP,   ZP,   LSR, 5)
+NES_CPU_OP     (PHA_IMP,  IMP,  PHA, 3)
+NES_CPU_OP     (EOR_IMM,  IMM,  EOR, 2)
+NES_CPU_OP_JUMP(JMP_ABS,        JMP, 3)
+NES_CPU_OP     (EOR_ABS,  ABS,  EOR, 4)
+NES_CPU_OP     (LSR_ABS,  ABS,  LSR, 6)
+NES_CPU_OP_PAGE(BVC_REL,  REL,  BVC, 2)
+NES_CPU_OP_PAGE(EOR_INDY, INDY, EOR, 5)
+NES_CPU_OP     (EOR_ZPX,  ZPX,  EOR, 4)
+NES_CPU_OP     (LSR_ZPX,  ZPX,  LSR, 6)
+NES_CPU_OP     (CLI_IMP,  IMP,  CLI, 2)
+NES_CPU_OP_PAGE(EOR_ABSY, ABSY, EOR, 4)
+NES_CPU_OP_PAGE(EOR_ABSX, ABSX, EOR, 4)
+NES_CPU_OP     (LSR_ABSX, ABSX, LSR, 7)
+NES_CPU_OP     (RTS_IMP,  IMP,  RTS, 6)
+NES_CPU_OP     (ADC_INDX, INDX, ADC, 6)
+NES_CPU_OP     (ADC_ZP,   ZP,   ADC, 3)
+NES_CPU_OP     (ROR_ZP,   ZP,   ROR, 5)
+NES_CPU_OP     (PLA_IMP,  IMP,  PLA, 4)
+NES_CPU_OP     (ADC_IMM,  IMM,  ADC, 2)
+NES_CPU_OP     (JMP_IND,  IND,  JMP, 5)
+NES_CPU_OP     (ADC_ABS,  ABS,  ADC, 4)
+NES_CPU_OP     (ROR_ABS,  ABS,  ROR, 6)
+NES_CPU_OP_PAGE(BVS_REL,  REL,  BVS, 2)
+NES_CPU_OP_PAGE(ADC_INDY, INDY, ADC, 5)
+NES_CPU_OP     (ADC_ZPX,  ZPX,  ADC, 4)
+NES_CPU_OP     (ROR_ZPX,  ZPX,  ROR, 6)
+NES_CPU_OP     (SEI_IMP,  IMP,  SEI, 2)
+NES_CPU_OP_PAGE(ADC_ABSY, ABSY, ADC, 4)
+NES_CPU_OP_PAGE(ADC_ABSX, ABSX, ADC, 4)
+NES_CPU_OP     (ROR_ABSX, ABSX, ROR, 7)
+NES_CPU_OP     (STA_INDX, INDX, STA, 6)
+NES_CPU_OP     (STY_ZP,   ZP,   STY, 3)
+NES_CPU_OP     (STA_ZP,   ZP,   STA, 3)
+NES_CPU_OP     (STX_ZP,   ZP,   STX, 3)
+NES_CPU_OP     (DEY_IMP,  IMP,  DEY, 2)
+NES_CPU_OP     (TXA_IMP,  IMP,  TXA, 2)
+NES_CPU_OP     (STY_ABS,  ABS,  STY, 4)
+NES_CPU_OP     (STA_ABS,  ABS,  STA, 4)
+NES_CPU_OP     (STX_ABS,  ABS,  STX, 4)
+NES_CPU_OP     (BCC_REL,  REL,  BCC, 2)
+NES_CPU_OP     (STA_INDY, INDY, STA, 6)
+NES_CPU_OP     (STY_ZPX,  ZPX,  STY, 4)
+NES_CPU_OP     (STA_ZPX,  ZPX,  STA, 4)
+NES_CPU_OP     (STX_ZPY,  ZPY,  STX, 4)
+NES_CPU_OP     (TYA_IMP,  IMP,  TYA, 2)
+NES_CPU_OP     (STA_ABSY, ABSY, STA, 5)
+NES_CPU_OP     (TXS_IMP,  IMP,  TXS, 2)
+NES_CPU_OP     (STA_ABSX, ABSX, STA, 5)
+NES_CPU_OP     (LDY_IMM,  IMM,  LDY, 2)
+NES_CPU_OP     (LDA_INDX, INDX, LDA, 6)
+NES_CPU_OP     (LDX_IMM,  IMM,  LDX, 2)
+NES_CPU_OP     (LDY_ZP,   ZP,   LDY, 3)
+NES_CPU_OP     (LDA_ZP,   ZP,   LDA, 3)
+NES_CPU_OP     (LDX_ZP,   ZP,   LDX, 3)
+NES_CPU_OP     (TAY_IMP,  IMP,  TAY, 2)
+NES_CPU_OP     (LDA_IMM,  IMM,  LDA, 2)
+NES_CPU_OP     (TAX_IMP,  IMP,  TAX, 2)
+NES_CPU_OP     (LDY_ABS,  ABS,  LDY, 4)
+NES_CPU_OP     (LDA_ABS,  ABS,  LDA, 4)
+NES_CPU_OP     (LDX_ABS,  ABS,  LDX, 4)
+NES_CPU_OP     (BCS_REL,  REL,  BCS, 2)
+NES_CPU_OP_PAGE(LDA_INDY, INDY, LDA, 5)
+NES_CPU_OP     (LDY_ZPX,  ZPX,  LDY, 4)
+NES_CPU_OP     (LDA_ZPX,  ZPX,  LDA, 4)
+NES_CPU_OP     (LDX_ZPY,  ZPY,  LDX, 4)
+NES_CPU_OP     (CLV_IMP,  IMP,  CLV, 2)
+NES_CPU_OP_PAGE(LDA_ABSY, ABSY, LDA, 4)
+NES_CPU_OP_PAGE(LDY_ABSX, ABSX, LDY, 4)
+NES_CPU_OP_PAGE(LDA_ABSX, ABSX, LDA, 4)
+NES_CPU_OP_PAGE(LDX_ABSY, ABSY, LDX, 4)
+NES_CPU_OP     (CPY_IMM,  IMM,  CPY, 2)
+NES_CPU_OP     (CMP_INDX, INDX, CMP, 6)
+NES_CPU_OP     (CPY_ZP,   ZP,   CPY, 3)
+NES_CPU_OP     (CMP_ZP,   ZP,   CMP, 3)
+NES_CPU_OP     (DEC_ZP,   ZP,   DEC, 5)
+NES_CPU_OP     (INY_IMP,  IMP,  INY, 2)
+NES_CPU_OP     (CMP_IMM,  IMM,  CMP, 2)
+NES_CPU_OP     (DEX_IMP,  IMP,  DEX, 2)
+NES_CPU_OP     (CPY_ABS,  ABS,  CPY, 4)
+NES_CPU_OP     (CMP_ABS,  ABS,  CMP, 4)
+NES_CPU_OP     (DEC_ABS,  ABS,  DEC, 6)
+NES_CPU_OP     (BNE_REL,  REL,  BNE, 2)
+NES_CPU_OP_PAGE(CMP_INDY, INDY, CMP, 5)
+NES_CPU_OP     (CMP_ZPX,  ZPX,  CMP, 4)
+NES_CPU_OP     (DEC_ZPX,  ZPX,  DEC, 6)
+NES_CPU_OP     (CLD_IMP,  IMP,  CLD, 2)
+NES_CPU_OP_PAGE(CMP_ABSY, ABSY, CMP, 4)
+NES_CPU_OP_PAGE(CMP_ABSX, ABSX, CMP, 4)
+NES_CPU_OP     (DEC_ABSX, ABSX, DEC, 7)
+NES_CPU_OP     (CPX_IMM,  IMM,  CPX, 2)
+NES_CPU_OP     (SBC_INDX, INDX, SBC, 6)
+NES_CPU_OP     (CPX_ZP,   ZP,   CPX, 3)
+NES_CPU_OP     (SBC_ZP,   ZP,   SBC, 3)
+NES_CPU_OP     (INC_ZP,   ZP,   INC, 5)
+NES_CPU_OP     (INX_IMP,  IMP,  INX, 2)
+NES_CPU_OP     (SBC_IMM,  IMM,  SBC, 2)
+NES_CPU_OP     (NOP_IMP,  IMP,  NOP, 2)
+NES_CPU_OP     (CPX_ABS,  ABS,  CPX, 4)
+NES_CPU_OP     (SBC_ABS,  ABS,  SBC, 4)
+NES_CPU_OP     (INC_ABS,  ABS,  INC, 6)
+NES_CPU_OP     (BEQ_REL,  REL,  BEQ, 2)
+NES_CPU_OP_PAGE(SBC_INDY, INDY, SBC, 5)
+NES_CPU_OP     (SBC_ZPX,  ZPX,  SBC, 4)
+NES_CPU_OP     (INC_ZPX,  ZPX,  INC, 6)
+NES_CPU_OP     (SED_IMP,  IMP,  SED, 2)
+NES_CPU_OP_PAGE(SBC_ABSY, ABSY, SBC, 4)
+NES_CPU_OP_PAGE(SBC_ABSX, ABSX, SBC, 4)
+NES_CPU_OP     (INC_ABSX, ABSX, INC, 7)
+
+NES_CPU_OP_ACC(ASL_ACC, ASL)
+NES_CPU_OP_ACC(ROL_ACC, ROL)
+NES_CPU_OP_ACC(LSR_ACC, LSR)
+NES_CPU_OP_ACC(ROR_ACC, ROR)
+
+/*
+    TSX skips the addressing mode and leaves PC_offset as the last instruction set it. This moves the
+    PC on by one, then interpret_step() adds that stale PC_offset on top, as the original loop did.
+*/
+static void op_TSX_IMP(const nes_cpu_decoded * insn)
+{
+    (void)insn;
+
+    TSX();
+    nes_current->cpu_registers.Cycles = 2;
+    nes_current->cpu_registers.PC += 1;
+}
+
+static void op_unknown(const nes_cpu_decoded * insn)
 {
-    nes_cpu_registers.PC = 0x8000;
-    memcpy(&nes_cpu_mem.mem[nes_cpu_registers.PC], program, size);
+    fprintf(stderr, "error: unknown opcode 0x%02X\n", insn->opcode);
 }
 
-bool interpret_step(void)
+/* Handler, addressing mode and base cycles of every opcode, unknown ones are left empty */
+static const struct
 {
-    /* Fetch opcode from memory */
-    uint8_t opcode = PEEK(nes_cpu_registers.PC);
-    
-    /* Decode and execute the opcode */
-    switch (opcode)
+    void    (*execute)(const nes_cpu_decoded * insn);
+    uint8_t mode;
+    uint8_t cycles;
+}
+nes_cpu_ops[256] = {
+    [BRK_IMP]  = { op_BRK_IMP,  IMP,  7 },
+    [ORA_INDX] = { op_ORA_INDX, INDX, 6 },
+    [ORA_ZP]   = { op_ORA_ZP,   ZP,   3 },
+    [ASL_ZP]   = { op_ASL_ZP,   ZP,   5 },
+    [PHP_IMP]  = { op_PHP_IMP,  IMP,  3 },
+    [ORA_IMM]  = { op_ORA_IMM,  IMM,  2 },
+    [ASL_ACC]  = { op_ASL_ACC,  ACC,  2 },
+    [ORA_ABS]  = { op_ORA_ABS,  ABS,  4 },
+    [ASL_ABS]  = { op_ASL_ABS,  ABS,  6 },
+    [BPL_REL]  = { op_BPL_REL,  REL,  2 },
+    [ORA_INDY] = { op_ORA_INDY, INDY, 5 },
+    [ORA_ZPX]  = { op_ORA_ZPX,  ZPX,  4 },
+    [ASL_ZPX]  = { op_ASL_ZPX,  ZPX,  6 },
+    [CLC_IMP]  = { op_CLC_IMP,  IMP,  2 },
+    [ORA_ABSY] = { op_ORA_ABSY, ABSY, 4 },
+    [ORA_ABSX] = { op_ORA_ABSX, ABSX, 4 },
+    [ASL_ABSX] = { op_ASL_ABSX, ABSX, 7 },
+    [JSR_ABS]  = { op_JSR_ABS,  ABS,  6 },
+    [AND_INDX] = { op_AND_INDX, INDX, 6 },
+    [BIT_ZP]   = { op_BIT_ZP,   ZP,   3 },
+    [AND_ZP]   = { op_AND_ZP,   ZP,   3 },
+    [ROL_ZP]   = { op_ROL_ZP,   ZP,   5 },
+    [PLP_IMP]  = { op_PLP_IMP,  IMP,  4 },
+    [AND_IMM]  = { op_AND_IMM,  IMM,  2 },
+    [ROL_ACC]  = { op_ROL_ACC,  ACC,  2 },
+    [BIT_ABS]  = { op_BIT_ABS,  ABS,  4 },
+    [AND_ABS]  = { op_AND_ABS,  ABS,  4 },
+    [ROL_ABS]  = { op_ROL_ABS,  ABS,  6 },
+    [BMI_REL]  = { op_BMI_REL,  REL,  2 },
+    [AND_INDY] = { op_AND_INDY, INDY, 5 },
+    [AND_ZPX]  = { op_AND_ZPX,  ZPX,  4 },
+    [ROL_ZPX]  = { op_ROL_ZPX,  ZPX,  6 },
+    [SEC_IMP]  = { op_SEC_IMP,  IMP,  2 },
+    [AND_ABSY] = { op_AND_ABSY, ABSY, 4 },
+    [AND_ABSX] = { op_AND_ABSX, ABSX, 4 },
+    [ROL_ABSX] = { op_ROL_ABSX, ABSX, 7 },
+    [RTI_IMP]  = { op_RTI_IMP,  IMP,  6 },
+    [EOR_INDX] = { op_EOR_INDX, INDX, 6 },
+    [EOR_ZP]   = { op_EOR_ZP,   ZP,   3 },
+    [LSR_ZP]   = { op_LSR_ZP,   ZP,   5 },
+    [PHA_IMP]  = { op_PHA_IMP,  IMP,  3 },
+    [EOR_IMM]  = { op_EOR_IMM,  IMM,  2 },
+    [LSR_ACC]  = { op_LSR_ACC,  ACC,  2 },
+    [JMP_ABS]  = { op_JMP_ABS,  ABS,  3 },
+    [EOR_ABS]  = { op_EOR_ABS,  ABS,  4 },
+    [LSR_ABS]  = { op_LSR_ABS,  ABS,  6 },
+    [BVC_REL]  = { op_BVC_REL,  REL,  2 },
+    [EOR_INDY] = { op_EOR_INDY, INDY, 5 },
+    [EOR_ZPX]  = { op_EOR_ZPX,  ZPX,  4 },
+    [LSR_ZPX]  = { op_LSR_ZPX,  ZPX,  6 },
+    [CLI_IMP]  = { op_CLI_IMP,  IMP,  2 },
+    [EOR_ABSY] = { op_EOR_ABSY, ABSY, 4 },
+    [EOR_ABSX] = { op_EOR_ABSX, ABSX, 4 },
+    [LSR_ABSX] = { op_LSR_ABSX, ABSX, 7 },
+    [RTS_IMP]  = { op_RTS_IMP,  IMP,  6 },
+    [ADC_INDX] = { op_ADC_INDX, INDX, 6 },
+    [ADC_ZP]   = { op_ADC_ZP,   ZP,   3 },
+    [ROR_ZP]   = { op_ROR_ZP,   ZP,   5 },
+    [PLA_IMP]  = { op_PLA_IMP,  IMP,  4 },
+    [ADC_IMM]  = { op_ADC_IMM,  IMM,  2 },
+    [ROR_ACC]  = { op_ROR_ACC,  ACC,  2 },
+    [JMP_IND]  = { op_JMP_IND,  IND,  5 },
+    [ADC_ABS]  = { op_ADC_ABS,  ABS,  4 },
+    [ROR_ABS]  = { op_ROR_ABS,  ABS,  6 },
+    [BVS_REL]  = { op_BVS_REL,  REL,  2 },
+    [ADC_INDY] = { op_ADC_INDY, INDY, 5 },
+    [ADC_ZPX]  = { op_ADC_ZPX,  ZPX,  4 },
+    [ROR_ZPX]  = { op_ROR_ZPX,  ZPX,  6 },
+    [SEI_IMP]  = { op_SEI_IMP,  IMP,  2 },
+    [ADC_ABSY] = { op_ADC_ABSY, ABSY, 4 },
+    [ADC_ABSX] = { op_ADC_ABSX, ABSX, 4 },
+    [ROR_ABSX] = { op_ROR_ABSX, ABSX, 7 },
+    [STA_INDX] = { op_STA_INDX, INDX, 6 },
+    [STY_ZP]   = { op_STY_ZP,   ZP,   3 },
+    [STA_ZP]   = { op_STA_ZP,   ZP,   3 },
+    [STX_ZP]   = { op_STX_ZP,   ZP,   3 },
+    [DEY_IMP]  = { op_DEY_IMP,  IMP,  2 },
+    [TXA_IMP]  = { op_TXA_IMP,  IMP,  2 },
+    [STY_ABS]  = { op_STY_ABS,  ABS,  4 },
+    [STA_ABS]  = { op_STA_ABS,  ABS,  4 },
+    [STX_ABS]  = { op_STX_ABS,  ABS,  4 },
+    [BCC_REL]  = { op_BCC_REL,  REL,  2 },
+    [STA_INDY] = { op_STA_INDY, INDY, 6 },
+    [STY_ZPX]  = { op_STY_ZPX,  ZPX,  4 },
+    [STA_ZPX]  = { op_STA_ZPX,  ZPX,  4 },
+    [STX_ZPY]  = { op_STX_ZPY,  ZPY,  4 },
+    [TYA_IMP]  = { op_TYA_IMP,  IMP,  2 },
+    [STA_ABSY] = { op_STA_ABSY, ABSY, 5 },
+    [TXS_IMP]  = { op_TXS_IMP,  IMP,  2 },
+    [STA_ABSX] = { op_STA_ABSX, ABSX, 5 },
+    [LDY_IMM]  = { op_LDY_IMM,  IMM,  2 },
+    [LDA_INDX] = { op_LDA_INDX, INDX, 6 },
+    [LDX_IMM]  = { op_LDX_IMM,  IMM,  2 },
+    [LDY_ZP]   = { op_LDY_ZP,   ZP,   3 },
+    [LDA_ZP]   = { op_LDA_ZP,   ZP,   3 },
+    [LDX_ZP]   = { op_LDX_ZP,   ZP,   3 },
+    [TAY_IMP]  = { op_TAY_IMP,  IMP,  2 },
+    [LDA_IMM]  = { op_LDA_IMM,  IMM,  2 },
+    [TAX_IMP]  = { op_TAX_IMP,  IMP,  2 },
+    [LDY_ABS]  = { op_LDY_ABS,  ABS,  4 },
+    [LDA_ABS]  = { op_LDA_ABS,  ABS,  4 },
+    [LDX_ABS]  = { op_LDX_ABS,  ABS,  4 },
+    [BCS_REL]  = { op_BCS_REL,  REL,  2 },
+    [LDA_INDY] = { op_LDA_INDY, INDY, 5 },
+    [LDY_ZPX]  = { op_LDY_ZPX,  ZPX,  4 },
+    [LDA_ZPX]  = { op_LDA_ZPX,  ZPX,  4 },
+    [LDX_ZPY]  = { op_LDX_ZPY,  ZPY,  4 },
+    [CLV_IMP]  = { op_CLV_IMP,  IMP,  2 },
+    [LDA_ABSY] = { op_LDA_ABSY, ABSY, 4 },
+    [TSX_IMP]  = { op_TSX_IMP,  NONE, 2 },
+    [LDY_ABSX] = { op_LDY_ABSX, ABSX, 4 },
+    [LDA_ABSX] = { op_LDA_ABSX, ABSX, 4 },
+    [LDX_ABSY] = { op_LDX_ABSY, ABSY, 4 },
+    [CPY_IMM]  = { op_CPY_IMM,  IMM,  2 },
+    [CMP_INDX] = { op_CMP_INDX, INDX, 6 },
+    [CPY_ZP]   = { op_CPY_ZP,   ZP,   3 },
+    [CMP_ZP]   = { op_CMP_ZP,   ZP,   3 },
+    [DEC_ZP]   = { op_DEC_ZP,   ZP,   5 },
+    [INY_IMP]  = { op_INY_IMP,  IMP,  2 },
+    [CMP_IMM]  = { op_CMP_IMM,  IMM,  2 },
+    [DEX_IMP]  = { op_DEX_IMP,  IMP,  2 },
+    [CPY_ABS]  = { op_CPY_ABS,  ABS,  4 },
+    [CMP_ABS]  = { op_CMP_ABS,  ABS,  4 },
+    [DEC_ABS]  = { op_DEC_ABS,  ABS,  6 },
+    [BNE_REL]  = { op_BNE_REL,  REL,  2 },
+    [CMP_INDY] = { op_CMP_INDY, INDY, 5 },
+    [CMP_ZPX]  = { op_CMP_ZPX,  ZPX,  4 },
+    [DEC_ZPX]  = { op_DEC_ZPX,  ZPX,  6 },
+    [CLD_IMP]  = { op_CLD_IMP,  IMP,  2 },
+    [CMP_ABSY] = { op_CMP_ABSY, ABSY, 4 },
+    [CMP_ABSX] = { op_CMP_ABSX, ABSX, 4 },
+    [DEC_ABSX] = { op_DEC_ABSX, ABSX, 7 },
+    [CPX_IMM]  = { op_CPX_IMM,  IMM,  2 },
+    [SBC_INDX] = { op_SBC_INDX, INDX, 6 },
+    [CPX_ZP]   = { op_CPX_ZP,   ZP,   3 },
+    [SBC_ZP]   = { op_SBC_ZP,   ZP,   3 },
+    [INC_ZP]   = { op_INC_ZP,   ZP,   5 },
+    [INX_IMP]  = { op_INX_IMP,  IMP,  2 },
+    [SBC_IMM]  = { op_SBC_IMM,  IMM,  2 },
+    [NOP_IMP]  = { op_NOP_IMP,  IMP,  2 },
+    [CPX_ABS]  = { op_CPX_ABS,  ABS,  4 },
+    [SBC_ABS]  = { op_SBC_ABS,  ABS,  4 },
+    [INC_ABS]  = { op_INC_ABS,  ABS,  6 },
+    [BEQ_REL]  = { op_BEQ_REL,  REL,  2 },
+    [SBC_INDY] = { op_SBC_INDY, INDY, 5 },
+    [SBC_ZPX]  = { op_SBC_ZPX,  ZPX,  4 },
+    [INC_ZPX]  = { op_INC_ZPX,  ZPX,  6 },
+    [SED_IMP]  = { op_SED_IMP,  IMP,  2 },
+    [SBC_ABSY] = { op_SBC_ABSY, ABSY, 4 },
+    [SBC_ABSX] = { op_SBC_ABSX, ABSX, 4 },
+    [INC_ABSX] = { op_INC_ABSX, ABSX, 7 },
+};
+
+/* Length of an instruction in each addressing mode, opcode included */
+static const uint8_t nes_cpu_mode_bytes[] = {
+    [ABSX] = 3, [ABSY] = 3, [INDX] = 2, [INDY] = 2, [ZPX] = 2, [ZPY] = 2, [ACC] = 1,
+    [IMM]  = 2, [ZP]   = 2, [ABS]  = 3, [REL]  = 2, [IND] = 3, [IMP] = 1, [NONE] = 1,
+};
+
+/* Fill in 'insn' for the instruction at 'pc' */
+static void cpu_decode(nes_cpu_decoded * insn, uint16_t pc)
+{
+    uint8_t opcode = PEEK(pc);
+    uint8_t hi     = PEEK(pc + 2);
+    uint8_t lo     = PEEK(pc + 1);
+
+    insn->operand = (uint16_t)hi << 8 | lo;
+    insn->opcode  = opcode;
+    insn->mode    = nes_cpu_ops[opcode].mode;
+    insn->cycles  = nes_cpu_ops[opcode].cycles;
+    insn->execute = nes_cpu_ops[opcode].execute ? nes_cpu_ops[opcode].execute : op_unknown;
+}
+
+/* Memory an idle loop may read: plain memory and PPUSTATUS, which only changes on PPU events */
+static bool cpu_idle_readable(uint16_t addr)
+{
+    return nes_current->cpu_read_page[addr >> 8] != NULL || (addr >= 0x2000 && addr < 0x4000 && (addr & 7) == PPUSTATUS);
+}
+
+/* Note the pages an idle loop reads, its verdict only holds while they stay mapped as they are */
+static void cpu_idle_polled(const uint8_t * pages, uint8_t count)
+{
+    for (uint8_t i = 0; i < count; i++)
+        nes_current->idle_polled[pages[i] >> 3] |= 1 << (pages[i] & 7);
+}
+
+/*
+    Whether 'head' starts a loop of at most NES_CPU_IDLE_INSNS instructions, all in its page, that
+    only reads memory cpu_idle_readable() allows and only changes registers and flags, closed by a
+    branch or JMP back to 'head'. Branches anywhere else must leave the loop.
+*/
+static bool cpu_idle_loop(uint16_t head)
+{
+    uint16_t pc = head;
+    uint8_t polled[NES_CPU_IDLE_INSNS], reads = 0;
+
+    for (uint8_t i = 0; i < NES_CPU_IDLE_INSNS && (pc & 0xFF) < 0xFE && (pc >> 8) == (head >> 8); i++)
     {
-        case BRK_IMP:   
-            get_operand_AM(IMP);
-            BRK();
-            nes_cpu_registers.Cycles = 7;
-            break;
-        case ORA_INDX:  
-            get_operand_AM(INDX);
-            ORA();
-            nes_cpu_registers.Cycles = 6;
-            break;
-        case ORA_ZP:    
-            get_operand_AM(ZP);
-            ORA(); 
-            nes_cpu_registers.Cycles = 3; 
-            break;
-        case ASL_ZP:    
-            get_operand_AM(ZP);
-            ASL(); 
-            nes_cpu_registers.Cycles = 5; 
-            break;
-        case PHP_IMP:   
-            get_operand_AM(IMP); 
-            PHP();
-            nes_cpu_registers.Cycles = 3; 
-            break;
-        case ORA_IMM:   
-            get_operand_AM(IMM);
-            ORA(); 
-            nes_cpu_registers.Cycles = 2; 
-            break;
-        case ASL_ACC:   
-            get_operand_AM(ACC); 
-            ASL();
-            nes_cpu_registers.A = nes_cpu_bus.DB;
-             
-            nes_cpu_registers.Cycles = 2; 
-            break;
-        case ORA_ABS:   
-            get_operand_AM(ABS);
-            ORA(); 
-            nes_cpu_registers.Cycles = 4; 
-            break;
-        case ASL_ABS:   
-            get_operand_AM(ABS);
-            ASL();
-            nes_cpu_registers.Cycles = 6; 
-            break;
-        case BPL_REL:   
-            get_operand_AM(REL); 
-            BPL();
-            nes_cpu_registers.Cycles = 2; 
-            break;
-        case ORA_INDY:  
-            get_operand_AM(INDY); 
-            ORA();
-            nes_cpu_registers.Cycles += 5; 
-            break;
-        case ORA_ZPX:   
-            get_operand_AM(ZPX); 
-            ORA();
-            nes_cpu_registers.Cycles = 4; 
-            break;
-        case ASL_ZPX:   
-            get_operand_AM(ZPX); 
-            ASL();
-            nes_cpu_registers.Cycles = 6; 
-            break;
-        case CLC_IMP:   
-            get_operand_AM(IMP); 
-            CLC();
-            nes_cpu_registers.Cycles = 2; 
-            break;
-        case ORA_ABSY:  
-            get_operand_AM(ABSY); 
-            ORA();
-            nes_cpu_registers.Cycles += 4; 
-            break;
-        case ORA_ABSX:  
-            get_operand_AM(ABSX); 
-            ORA();
-            nes_cpu_registers.Cycles += 4; 
-            break;
-        case ASL_ABSX:  
-            get_operand_AM(ABSX); 
-            ASL();
-            nes_cpu_registers.Cycles = 7; 
-            break;
-        case JSR_ABS:   
-            get_operand_AM(ABS); 
-            JSR();
-            nes_cpu_registers.Cycles = 6; 
-            break;
-        case AND_INDX:  
-            get_operand_AM(INDX); 
-            AND();
-            nes_cpu_registers.Cycles = 6; 
-            break;
-        case BIT_ZP:    
-            get_operand_AM(ZP); 
-            BIT();
-            nes_cpu_registers.Cycles = 3; 
-            break;
-        case AND_ZP:    
-            get_operand_AM(ZP); 
-            AND();
-            nes_cpu_registers.Cycles = 3; 
-            break;
-        case ROL_ZP:    
-            get_operand_AM(ZP); 
-            ROL();
-            nes_cpu_registers.Cycles = 5; 
-            break;
-        case PLP_IMP:   
-            get_operand_AM(IMP);
-            PLP();
-            nes_cpu_registers.Cycles = 4; 
-            break;
-        case AND_IMM:   
-            get_operand_AM(IMM); 
-            AND();
-            nes_cpu_registers.Cycles = 2; 
-            break;
-        case ROL_ACC:   
-            get_operand_AM(ACC);
-            ROL(); 
-            nes_cpu_registers.A = nes_cpu_bus.DB;
-             
-            nes_cpu_registers.Cycles = 2; 
-            break;
-        case BIT_ABS:   
-            get_operand_AM(ABS); 
-            BIT();
-            nes_cpu_registers.Cycles = 4; 
-            break;
-        case AND_ABS:   
-            get_operand_AM(ABS); 
-            AND();
-            nes_cpu_registers.Cycles = 4; 
-            break;
-        case ROL_ABS:   
-            get_operand_AM(ABS); 
-            ROL();
-            nes_cpu_registers.Cycles = 6; 
-            break;
-        case BMI_REL:   
-            get_operand_AM(REL); 
-            BMI();
-            nes_cpu_registers.Cycles = 2; 
-            break;
-        case AND_INDY:  
-            get_operand_AM(INDY); 
-            AND();
-            nes_cpu_registers.Cycles += 5; 
-            break;
-        case AND_ZPX:   
-            get_operand_AM(ZPX); 
-            AND();
-            nes_cpu_registers.Cycles = 4; 
-            break;
-        case ROL_ZPX:   
-            get_operand_AM(ZPX); 
-            ROL();
-            nes_cpu_registers.Cycles = 6; 
-            break;
-        case SEC_IMP:   
-            get_operand_AM(IMP);
-            SEC();
-            nes_cpu_registers.Cycles = 2; 
-            break;
-        case AND_ABSY:  
-            get_operand_AM(ABSY); 
-            AND();
-            nes_cpu_registers.Cycles += 4; 
-            break;
-        case AND_ABSX:  
-            get_operand_AM(ABSX); 
-            AND();
-            nes_cpu_registers.Cycles += 4; 
-            break;
-        case ROL_ABSX:  
-            get_operand_AM(ABSX); 
-            ROL();
-            nes_cpu_registers.Cycles = 7; 
-            break;
-        case RTI_IMP:   
-            get_operand_AM(IMP);
-            RTI();
-            nes_cpu_registers.Cycles = 6;
-            break;
-        case EOR_INDX:  
-            get_operand_AM(INDX); 
-            EOR();
-            nes_cpu_registers.Cycles = 6; 
-            break;
-        case EOR_ZP:    
-            get_operand_AM(ZP); 
-            EOR();
-            nes_cpu_registers.Cycles = 3; 
-            break;
-        case LSR_ZP:    
-            get_operand_AM(ZP); 
-            LSR();
-            nes_cpu_registers.Cycles = 5; 
-            break;
-        case PHA_IMP:  
-            get_operand_AM(IMP); 
-            PHA();
-            nes_cpu_registers.Cycles = 3;
-            break;
-        case EOR_IMM:   
-            get_operand_AM(IMM); 
-            EOR();
-            nes_cpu_registers.Cycles = 2; 
-            break;
-        case LSR_ACC:   
-            get_operand_AM(ACC);
-            LSR(); 
-            nes_cpu_registers.A = nes_cpu_bus.DB;
-             
-            nes_cpu_registers.Cycles = 2; 
-            break;
-        case JMP_ABS:   
-            get_operand_AM(ABS); 
-            JMP();
-            nes_cpu_registers.Cycles = 3; 
-            break;
-        case EOR_ABS:   
-            get_operand_AM(ABS); 
-            EOR();
-            nes_cpu_registers.Cycles = 4; 
-            break;
-        case LSR_ABS:   
-            get_operand_AM(ABS); 
-            LSR();
-            nes_cpu_registers.Cycles = 6; 
-            break;
-        case BVC_REL:   
-            get_operand_AM(REL); 
-            BVC();
-            nes_cpu_registers.Cycles += 2; 
-            break;
-        case EOR_INDY:  
-            get_operand_AM(INDY); 
-            EOR();
-            nes_cpu_registers.Cycles += 5; 
-            break;
-        case EOR_ZPX:   
-            get_operand_AM(ZPX); 
-            EOR();
-            nes_cpu_registers.Cycles = 4; 
-            break;
-        case LSR_ZPX:   
-            get_operand_AM(ZPX); 
-            LSR();
-            nes_cpu_registers.Cycles = 6; 
-            break;
-        case CLI_IMP:   
-            get_operand_AM(IMP);
-            CLI();
-            nes_cpu_registers.Cycles = 2;
-            break;
-        case EOR_ABSY:  
-            get_operand_AM(ABSY); 
-            EOR();
-            nes_cpu_registers.Cycles += 4; 
-            break;
-        case EOR_ABSX:  
-            get_operand_AM(ABSX); 
-            EOR();
-            nes_cpu_registers.Cycles += 4; 
-            break;
-        case LSR_ABSX:  
-            get_operand_AM(ABSX); 
-            LSR();
-            nes_cpu_registers.Cycles = 7; 
-            break;
-        case RTS_IMP:   
-            get_operand_AM(IMP);
-            RTS();
-            nes_cpu_registers.Cycles = 6;
-            break;
-        case ADC_INDX:  
-            get_operand_AM(INDX); 
-            ADC();
-            nes_cpu_registers.Cycles = 6; 
-            break;
-        case ADC_ZP:    
-            get_operand_AM(ZP); 
-            ADC();
-            nes_cpu_registers.Cycles = 3; 
-            break;
-        case ROR_ZP:    
-            get_operand_AM(ZP); 
-            ROR();
-            nes_cpu_registers.Cycles = 5; 
-            break;
-        case PLA_IMP:   
-            get_operand_AM(IMP);
-            PLA();
-            nes_cpu_registers.Cycles = 4;
-            break;
-        case ADC_IMM:   
-            get_operand_AM(IMM); 
-            ADC();
-            nes_cpu_registers.Cycles = 2; 
-            break;
-        case ROR_ACC:   
-            get_operand_AM(ACC);
-            ROR(); 
-            nes_cpu_registers.A = nes_cpu_bus.DB;
-             
-            nes_cpu_registers.Cycles = 2; 
-            break;
-        case JMP_IND: 
-            get_operand_AM(IND); 
-            JMP();
-            nes_cpu_registers.Cycles = 5; 
-            break;
-        case ADC_ABS:   
-            get_operand_AM(ABS); 
-            ADC();
-            nes_cpu_registers.Cycles = 4; 
-            break;
-        case ROR_ABS:   
-            get_operand_AM(ABS); 
-            ROR();
-            nes_cpu_registers.Cycles = 6; 
-            break;
-        case BVS_REL:   
-            get_operand_AM(REL); 
-            BVS();
-            nes_cpu_registers.Cycles += 2; 
-            break;
-        case ADC_INDY:  
-            get_operand_AM(INDY); 
-            ADC();
-            nes_cpu_registers.Cycles += 5; 
-            break;
-        case ADC_ZPX:   
-            get_operand_AM(ZPX); 
-            ADC();
-            nes_cpu_registers.Cycles = 4; 
-            break;
-        case ROR_ZPX:   
-            get_operand_AM(ZPX); 
-            ROR();
-            nes_cpu_registers.Cycles = 6; 
-            break;
-        case SEI_IMP:   
-            get_operand_AM(IMP);
-            SEI();
-            nes_cpu_registers.Cycles = 2;
-            break;
-        case ADC_ABSY:  
-            get_operand_AM(ABSY); 
-            ADC();
-            nes_cpu_registers.Cycles += 4; 
-            break;
-        case ADC_ABSX:  
-            get_operand_AM(ABSX); 
-            ADC();
-            nes_cpu_registers.Cycles += 4; 
-            break;
-        case ROR_ABSX:  
-            get_operand_AM(ABSX); 
-            ROR();
-            nes_cpu_registers.Cycles = 7; 
-            break;
-        case STA_INDX:  
-            get_operand_AM(INDX); 
-            STA();
-            nes_cpu_registers.Cycles = 6; 
-            break;
-        case STY_ZP:    
-            get_operand_AM(ZP); 
-            STY();
-            nes_cpu_registers.Cycles = 3; 
-            break;
-        case STA_ZP:    
-            get_operand_AM(ZP); 
-            STA();
-            nes_cpu_registers.Cycles = 3; 
-            break;
-        case STX_ZP:    
-            get_operand_AM(ZP); 
-            STX();
-            nes_cpu_registers.Cycles = 3; 
-            break;
-        case DEY_IMP:   
-            get_operand_AM(IMP);
-            DEY();
-            nes_cpu_registers.Cycles = 2;
-            break;
-        case TXA_IMP:   
-            get_operand_AM(IMP);
-            TXA();
-            nes_cpu_registers.Cycles = 2;
-            break;
-        case STY_ABS:   
-            get_operand_AM(ABS); 
-            STY();
-            nes_cpu_registers.Cycles = 4; 
-            break;
-        case STA_ABS:   
-            get_operand_AM(ABS); 
-            STA();
-            nes_cpu_registers.Cycles = 4; 
-            break;
-        case STX_ABS:   
-            get_operand_AM(ABS); 
-            STX();
-            nes_cpu_registers.Cycles = 4; 
-            break;
-        case BCC_REL:   
-            get_operand_AM(REL); 
-            BCC();
-            nes_cpu_registers.Cycles = 2; 
-            break;
-        case STA_INDY:  
-            get_operand_AM(INDY); 
-            STA();
-            nes_cpu_registers.Cycles = 6; 
-            break;
-        case STY_ZPX:   
-            get_operand_AM(ZPX); 
-            STY();
-            nes_cpu_registers.Cycles = 4; 
-            break;
-        case STA_ZPX:   
-            get_operand_AM(ZPX); 
-            STA();
-            nes_cpu_registers.Cycles = 4; 
-            break;
-        case STX_ZPY:   
-            get_operand_AM(ZPY); 
-            STX();
-            nes_cpu_registers.Cycles = 4; 
-            break;
-        case TYA_IMP:   
-            get_operand_AM(IMP);
-            TYA();
-            nes_cpu_registers.Cycles = 2;
-            break;
-        case STA_ABSY:  
-            get_operand_AM(ABSY); 
-            STA();
-            nes_cpu_registers.Cycles = 5; 
-            break;
-        case TXS_IMP:   
-            get_operand_AM(IMP);
-            TXS();
-            nes_cpu_registers.Cycles = 2;
-            break;
-        case STA_ABSX:  
-            get_operand_AM(ABSX); 
-            STA();
-            nes_cpu_registers.Cycles = 5; 
-            break;
-        case LDY_IMM:   
-            get_operand_AM(IMM); 
-            LDY();
-            nes_cpu_registers.Cycles = 2; 
-            break;
-        case LDA_INDX:  
-            get_operand_AM(INDX); 
-            LDA();
-            nes_cpu_registers.Cycles = 6; 
-            break;
-        case LDX_IMM:   
-            get_operand_AM(IMM); 
-            LDX();
-            nes_cpu_registers.Cycles = 2; 
-            break;
-        case LDY_ZP:    
-            get_operand_AM(ZP); 
-            LDY();
-            nes_cpu_registers.Cycles = 3; 
-            break;
-        case LDA_ZP:    
-            get_operand_AM(ZP); 
-            LDA();
-            nes_cpu_registers.Cycles = 3; 
-            break;
-        case LDX_ZP:    
-            get_operand_AM(ZP); 
-            LDX();
-            nes_cpu_registers.Cycles = 3; 
-            break;
-        case TAY_IMP:   
-            get_operand_AM(IMP);
-            TAY();
-            nes_cpu_registers.Cycles = 2;
-            break;
-        case LDA_IMM:   
-            get_operand_AM(IMM); 
-            LDA();
-            nes_cpu_registers.Cycles = 2; 
-            break;
-        case TAX_IMP:   
-            get_operand_AM(IMP);
-            TAX();
-            nes_cpu_registers.Cycles = 2; 
-            break;
-        case LDY_ABS:   
-            get_operand_AM(ABS); 
-            LDY();
-            nes_cpu_registers.Cycles = 4; 
-            break;
-        case LDA_ABS:   
-            get_operand_AM(ABS); 
-            LDA();
-            nes_cpu_registers.Cycles = 4; 
-            break;
-        case LDX_ABS:   
-            get_operand_AM(ABS); 
-            LDX();
-            nes_cpu_registers.Cycles = 4; 
-            break;
-        case BCS_REL:   
-            get_operand_AM(REL); 
-            BCS();
-            nes_cpu_registers.Cycles = 2; 
-            break;
-        case LDA_INDY:  
-            get_operand_AM(INDY); 
-            LDA();
-            nes_cpu_registers.Cycles += 5; 
-            break;
-        case LDY_ZPX:   
-            get_operand_AM(ZPX); 
-            LDY();
-            nes_cpu_registers.Cycles = 4; 
-            break;
-        case LDA_ZPX:   
-            get_operand_AM(ZPX); 
-            LDA();
-            nes_cpu_registers.Cycles = 4; 
-            break;
-        case LDX_ZPY:   
-            get_operand_AM(ZPY); 
-            LDX();
-            nes_cpu_registers.Cycles = 4; 
-            break;
-        case CLV_IMP:   
-            get_operand_AM(IMP); 
-            CLV();
-            nes_cpu_registers.Cycles = 2; 
-            break;
-        case LDA_ABSY:  
-            get_operand_AM(ABSY); 
-            LDA();
-            nes_cpu_registers.Cycles += 4; 
-            break;
-        case TSX_IMP:   
-            TSX();
-            nes_cpu_registers.Cycles = 2;
-            nes_cpu_registers.PC += 1; 
-            break;
-        case LDY_ABSX:  
-            get_operand_AM(ABSX); 
-            LDY();
-            nes_cpu_registers.Cycles += 4; 
-            break;
-        case LDA_ABSX:  
-            get_operand_AM(ABSX); 
-            LDA();
-            nes_cpu_registers.Cycles += 4; 
-            break;
-        case LDX_ABSY:  
-            get_operand_AM(ABSY); 
-            LDX();
-            nes_cpu_registers.Cycles += 4; 
-            break;
-        case CPY_IMM:   
-            get_operand_AM(IMM); 
-            CPY();
-            nes_cpu_registers.Cycles = 2; 
-            break;
-        case CMP_INDX:  
-            get_operand_AM(INDX); 
-            CMP();
-            nes_cpu_registers.Cycles = 6; 
-            break;
-        case CPY_ZP:    
-            get_operand_AM(ZP); 
-            CPY();
-            nes_cpu_registers.Cycles = 3; 
-            break;
-        case CMP_ZP:    
-            get_operand_AM(ZP); 
-            CMP();
-            nes_cpu_registers.Cycles = 3; 
-            break;
-        case DEC_ZP:    
-            get_operand_AM(ZP); 
-            DEC();
-            nes_cpu_registers.Cycles = 5; 
-            break;
-        case INY_IMP:   
-            get_operand_AM(IMP); 
-            INY();
-            nes_cpu_registers.Cycles = 2; 
-            break;
-        case CMP_IMM:   
-            get_operand_AM(IMM); 
-            CMP();
-            nes_cpu_registers.Cycles = 2; 
-            break;
-        case DEX_IMP:   
-            get_operand_AM(IMP); 
-            DEX();
-            nes_cpu_registers.Cycles = 2; 
-            break;
-        case CPY_ABS:   
-            get_operand_AM(ABS); 
-            CPY();
-            nes_cpu_registers.Cycles = 4; 
-            break;
-        case CMP_ABS:   
-            get_operand_AM(ABS); 
-            CMP();
-            nes_cpu_registers.Cycles = 4; 
-            break;
-        case DEC_ABS:   
-            get_operand_AM(ABS); 
-            DEC();
-            nes_cpu_registers.Cycles = 6; 
-            break;
-        case BNE_REL:   
-            get_operand_AM(REL); 
-            BNE();
-            nes_cpu_registers.Cycles = 2; 
-            break;
-        case CMP_INDY:  
-            get_operand_AM(INDY); 
-            CMP();
-            nes_cpu_registers.Cycles += 5; 
-            break;
-        case CMP_ZPX:   
-            get_operand_AM(ZPX); 
-            CMP();
-            nes_cpu_registers.Cycles = 4; 
-            break;
-        case DEC_ZPX:   
-            get_operand_AM(ZPX); 
-            DEC();
-            nes_cpu_registers.Cycles = 6; 
-            break;
-        case CLD_IMP:   
-            get_operand_AM(IMP); 
-            CLD();
-            nes_cpu_registers.Cycles = 2; 
-            break;
-        case CMP_ABSY:  
-            get_operand_AM(ABSY); 
-            CMP();
-            nes_cpu_registers.Cycles += 4; 
-            break;
-        case CMP_ABSX:  
-            get_operand_AM(ABSX); 
-            CMP();
-            nes_cpu_registers.Cycles += 4; 
-            break;
-        case DEC_ABSX:  
-            get_operand_AM(ABSX); 
-            DEC();
-            nes_cpu_registers.Cycles = 7; 
-            break;
-        case CPX_IMM:   
-            get_operand_AM(IMM); 
-            CPX();
-            nes_cpu_registers.Cycles = 2; 
-            break;
-        case SBC_INDX:  
-            get_operand_AM(INDX); 
-            SBC();
-            nes_cpu_registers.Cycles = 6; 
-            break;
-        case CPX_ZP:    
-            get_operand_AM(ZP); 
-            CPX();
-            nes_cpu_registers.Cycles = 3; 
-            break;
-        case SBC_ZP:    
-            get_operand_AM(ZP); 
-            SBC();
-            nes_cpu_registers.Cycles = 3; 
-            break;
-        case INC_ZP:    
-            get_operand_AM(ZP); 
-            INC();
-            nes_cpu_registers.Cycles = 5; 
-            break;
-        case INX_IMP:   
-            get_operand_AM(IMP); 
-            INX();
-            nes_cpu_registers.Cycles = 2; 
-            break;
-        case SBC_IMM:   
-            get_operand_AM(IMM); 
-            SBC();
-            nes_cpu_registers.Cycles = 2; 
-            break;
-        case NOP_IMP:   
-            get_operand_AM(IMP); 
-            NOP();
-            nes_cpu_registers.Cycles = 2; 
-            break;
-        case CPX_ABS:   
-            get_operand_AM(ABS); 
-            CPX();
-            nes_cpu_registers.Cycles = 4; 
-            break;
-        case SBC_ABS:   
-            get_operand_AM(ABS); 
-            SBC();
-            nes_cpu_registers.Cycles = 4; 
-            break;
-        case INC_ABS:   
-            get_operand_AM(ABS); 
-            INC();
-            nes_cpu_registers.Cycles = 6; 
-            break;
-        case BEQ_REL:   
-            get_operand_AM(REL); 
-            BEQ();
-            nes_cpu_registers.Cycles = 2; 
-            break;
-        case SBC_INDY:  
-            get_operand_AM(INDY); 
-            SBC();
-            nes_cpu_registers.Cycles += 5; 
-            break;
-        case SBC_ZPX:   
-            get_operand_AM(ZPX); 
-            SBC();
-            nes_cpu_registers.Cycles = 4; 
-            break;
-        case INC_ZPX:   
-            get_operand_AM(ZPX); 
-            INC();
-            nes_cpu_registers.Cycles = 6; 
-            break;
-        case SED_IMP:   
-            get_operand_AM(IMP);
-            SED();
-            nes_cpu_registers.Cycles = 2;
-            break;
-        case SBC_ABSY:  
-            get_operand_AM(ABSY); 
-            SBC();
-            nes_cpu_registers.Cycles += 4; 
-            break;
-        case SBC_ABSX:  
-            get_operand_AM(ABSX); 
-            SBC();
-            nes_cpu_registers.Cycles += 4; 
+        nes_cpu_decoded insn;
+        cpu_decode(&insn, pc);
+
+        switch (insn.opcode)
+        {
+            case LDA_IMM: case LDX_IMM: case LDY_IMM:
+            case AND_IMM: case ORA_IMM: case EOR_IMM:
+            case CMP_IMM: case CPX_IMM: case CPY_IMM:
+            case LDA_ZP:  case LDX_ZP:  case LDY_ZP:
+            case AND_ZP:  case ORA_ZP:  case EOR_ZP:
+            case CMP_ZP:  case CPX_ZP:  case CPY_ZP:  case BIT_ZP:
+            case TAX_IMP: case TAY_IMP: case TXA_IMP: case TYA_IMP:
+            case CLC_IMP: case SEC_IMP: case CLV_IMP: case NOP_IMP:
+                break;
+            case LDA_ABS: case LDX_ABS: case LDY_ABS:
+            case AND_ABS: case ORA_ABS: case EOR_ABS:
+            case CMP_ABS: case CPX_ABS: case CPY_ABS: case BIT_ABS:
+                if (!cpu_idle_readable(insn.operand))
+                    return false;
+                polled[reads++] = insn.operand >> 8;
+                break;
+            case BPL_REL: case BMI_REL: case BVC_REL: case BVS_REL:
+            case BCC_REL: case BCS_REL: case BNE_REL: case BEQ_REL:
+            {
+                /* Where TAKE_BRANCH ends up */
+                uint16_t target = pc + (int8_t)(2 + (int8_t)(insn.operand & 0xFF));
+
+                if (target == head)
+                {
+                    cpu_idle_polled(polled, reads);
+                    return true;
+                }
+                if (target > head && target <= pc)
+                    return false;
+            }
             break;
-        case INC_ABSX:  
-            get_operand_AM(ABSX); 
-            INC();
-            nes_cpu_registers.Cycles = 7; 
+            case JMP_ABS:
+                if (insn.operand != head)
+                    return false;
+                cpu_idle_polled(polled, reads);
+                return true;
+            default:
+                return false;
+        }
+
+        pc += nes_cpu_mode_bytes[insn.mode];
+    }
+
+    return false;
+}
+
+/*
+    Decode the instruction at 'pc' into the cache of its page and return it. Pages are only cached
+    while nothing can change them behind the cache's back: ROM (remapping goes through
+    nes_cpu_map()) and internal RAM outside zero page and the stack, which is watched for writes.
+    Anything else, registers and PRG RAM included, is decoded into a scratch entry every time.
+*/
+const nes_cpu_decoded * nes_cpu_predecode(uint16_t pc)
+{
+    uint8_t page = pc >> 8;
+    nes_cpu_decoded * insn = &nes_current->decode_scratch;
+    bool cacheable = nes_current->cpu_read_page[page] != NULL
+                  && nes_current->cpu_read_page[(uint8_t)((pc + 2) >> 8)] != NULL;
+
+    if (pc < 0x2000)
+    {
+        uint8_t ram_page = page & 7;
+
+        /* The operand bytes must come from the same, watched page */
+        cacheable = cacheable && ram_page >= 2 && (pc & 0xFF) < 0xFE
+                 && nes_current->code_rewrites[ram_page] < NES_CPU_CODE_REWRITES;
+    }
+    else
+    {
+        cacheable = cacheable && !nes_cpu_writable(page);
+    }
+
+    if (cacheable && nes_current->decoded[page] == NULL)
+        nes_current->decoded[page] = calloc(0x100, sizeof(nes_cpu_decoded));
+
+    if (cacheable && nes_current->decoded[page] != NULL)
+    {
+        if (pc < 0x2000)
+            nes_cpu_watch_code(pc);
+
+        insn = &nes_current->decoded[page][pc & 0xFF];
+    }
+
+    cpu_decode(insn, pc);
+    insn->idle = (insn != &nes_current->decode_scratch) && cpu_idle_loop(pc);
+
+    return insn;
+}
+
+/* Forget the instructions decoded from CPU page 'page' */
+static void cpu_forget_page(uint8_t page)
+{
+    if (nes_current->decoded[page] != NULL)
+        memset(nes_current->decoded[page], 0, 0x100 * sizeof(nes_cpu_decoded));
+}
+
+/* Forget the instructions decoded from RAM page 'ram_page' through any of its mirrors */
+static void cpu_forget_ram_page(uint8_t ram_page)
+{
+    for (uint8_t page = ram_page; page < 0x20; page += 8)
+        cpu_forget_page(page);
+}
+
+/* Make writes to the RAM page holding 'addr' (and its mirrors) go through POKE_MAPPER, so POKE() reports them to nes_cpu_code_written() */
+void nes_cpu_watch_code(uint16_t addr)
+{
+    uint8_t ram_page = (addr >> 8) & 7;
+
+    if (nes_current->code_pages & (1 << ram_page))
+        return;
+
+    /* Blocks translated so far may store to it directly */
+    if (nes_current->jit != NULL)
+        nes_jit_flush();
+
+    for (uint8_t page = ram_page; page < 0x20; page += 8)
+        nes_current->cpu_writable[page >> 3] &= ~(1 << (page & 7));
+
+    nes_current->code_pages |= 1 << ram_page;
+}
+
+/* The CPU wrote to a RAM page holding code, decoded and translated code from it is stale */
+void nes_cpu_code_written(uint16_t addr)
+{
+    uint8_t ram_page = (addr >> 8) & 7;
+
+    /* Writable again until code from it runs again */
+    for (uint8_t page = ram_page; page < 0x20; page += 8)
+        nes_current->cpu_writable[page >> 3] |= 1 << (page & 7);
+
+    nes_current->code_pages &= ~(1 << ram_page);
+
+    if (nes_current->code_rewrites[ram_page] < UINT8_MAX)
+        nes_current->code_rewrites[ram_page]++;
+
+    cpu_forget_ram_page(ram_page);
+
+    if (nes_current->jit != NULL)
+        nes_jit_write(addr);
+}
+
+/* RAM was replaced wholesale (nes_load_state()), the watched pages stay watched but their code is stale */
+void nes_cpu_code_reloaded(void)
+{
+    for (uint8_t ram_page = 0; ram_page < 8; ram_page++)
+    {
+        if (nes_current->code_pages & (1 << ram_page))
+            cpu_forget_ram_page(ram_page);
+    }
+
+    if (nes_current->jit != NULL)
+        nes_jit_state_loaded();
+}
+
+/* Send every loop decoded as idle back through cpu_idle_loop() the next time it runs */
+static void cpu_forget_idle_loops(void)
+{
+    for (size_t page = 0; page < 0x100; page++)
+    {
+        nes_cpu_decoded * decoded = nes_current->decoded[page];
+
+        for (size_t i = 0; decoded != NULL && i < 0x100; i++)
+        {
+            if (decoded[i].idle)
+                decoded[i] = (nes_cpu_decoded){ 0 };
+        }
+    }
+
+    memset(nes_current->idle_polled, 0, sizeof(nes_current->idle_polled));
+}
+
+/*
+    Pages from 'addr' on were remapped, so was anything decoded from them or with operand bytes in
+    them, and any idle loop that reads them, which may not be idle any more
+*/
+void nes_cpu_forget_code(uint16_t addr, size_t size)
+{
+    bool polled = false;
+
+    for (size_t offset = 0; offset < size; offset += 0x100)
+    {
+        uint8_t page = (uint8_t)((addr + offset) >> 8);
+
+        cpu_forget_page(page);
+        polled = polled || (nes_current->idle_polled[page >> 3] & (1 << (page & 7)));
+    }
+
+    cpu_forget_page((uint8_t)((addr >> 8) - 1));
+
+    if (polled)
+        cpu_forget_idle_loops();
+}
+
+/*
+    $4014 written: copy CPU page 'page' into OAM at once rather than as 256 reads and writes.
+    Pages backed by host memory (RAM, PRG-ROM) are copied straight from it, anything else is read
+    through PEEK() like the DMA would. The CPU is only halted once the instruction ends, see
+    cpu_interpret().
+*/
+void nes_cpu_oam_dma(uint8_t page)
+{
+    const uint8_t * source = nes_current->cpu_read_page[page];
+    uint8_t bytes[0x100];
+
+    if (source == NULL)
+    {
+        for (size_t i = 0; i < 0x100; i++)
+            bytes[i] = PEEK((uint16_t)(page << 8 | i));
+
+        source = bytes;
+    }
+
+    for (size_t i = 0; NES_COVERAGE_ON() && i < 0x100; i++)
+        NES_COVERAGE_MARK((uint16_t)(page << 8 | i), NES_CDL_DATA);
+
+    NES_TRACE_BEGIN(NES_TRACE_PPU);
+    PPU_OAM_DMA(source);
+    NES_TRACE_END();
+
+    nes_current->cpu_bus.DMA = true;
+}
+
+/* Interpret one instruction, returns the cycles it took */
+static uint32_t cpu_interpret(void)
+{
+    NES_TRACE_BEGIN(NES_TRACE_CPU);
+    interpret_step();
+    NES_TRACE_END();
+
+    /* Unknown opcodes don't set a cycle count, charge them like a NOP so the frame still ends */
+    uint32_t cycles = nes_current->cpu_registers.Cycles ? nes_current->cpu_registers.Cycles : 2;
+    nes_current->cpu_registers.Cycles = 0;
+
+    /*
+        An OAM DMA halts the CPU for 256 reads and 256 writes plus a cycle to halt, and one more
+        to line the reads up if it starts on an odd cycle. They are added to the instruction that
+        started it, so the PPU catches up with them in one go and events due meanwhile are taken
+        after it, as the halted CPU would.
+    */
+    if (nes_current->cpu_bus.DMA)
+    {
+        nes_current->cpu_bus.DMA = false;
+        cycles += 513 + ((nes_current->cpu_registers.Total_Cycles + cycles) & 1);
+    }
+
+    return cycles;
+}
+
+/* Let the PPU catch up with 'cycles' CPU cycles */
+static void cpu_catch_up(uint32_t cycles)
+{
+    uint32_t dots = cycles * 3;
+
+    nes_current->cpu_registers.Total_Cycles += cycles;
+
+    NES_TRACE_BEGIN(NES_TRACE_PPU);
+    while (dots-- > 0)
+        PPU_tick();
+    NES_TRACE_END();
+}
+
+/* Whether 'pc' is the top of a loop cpu_idle_loop() accepted */
+static inline bool cpu_idle_head(uint16_t pc)
+{
+    const nes_cpu_decoded * page = nes_current->decoded[pc >> 8];
+
+    return page != NULL && page[pc & 0xFF].idle;
+}
+
+/*
+    PC is at the top of an idle loop, run one pass of it. If that leaves the CPU exactly as it was,
+    every further pass reads the same memory and does the same until a PPU event changes PPUSTATUS
+    (or the frame ends), so all passes up to that event, or a scheduled one (see nes_sched.h) if
+    that comes first, are skipped and the PPU catches up in one go. The loop then runs into the
+    event one instruction at a time, as it would have anyway.
+    Reading PPUSTATUS clears vblank, which a pass that saw it set and still ended up as it
+    started has already done, so further reads see the same.
+*/
+static void cpu_skip_idle(void)
+{
+    _6502_cpu_registers registers = nes_current->cpu_registers;
+    _6502_cpu_bus bus = nes_current->cpu_bus;
+    int8_t PC_offset = nes_current->PC_offset;
+    uint32_t event = PPU_dots_to_next_event();
+
+    for (uint8_t i = 0; i < NES_CPU_IDLE_INSNS; i++)
+    {
+        cpu_catch_up(cpu_interpret());
+
+        if (nes_current->ppu.frame_complete || nes_current->cpu_registers.PC == registers.PC || nes_sched_due())
             break;
-        default:
-            fprintf(stderr, "error: unknown opcode 0x%02X\n", opcode);
     }
-    
+
+    const _6502_cpu_registers * now = &nes_current->cpu_registers;
+
+    if (nes_current->ppu.frame_complete || nes_sched_due() || now->PC != registers.PC
+        || now->A != registers.A || now->X != registers.X || now->Y != registers.Y
+        || now->SP != registers.SP || nes_cpu_status(now) != nes_cpu_status(&registers) || nes_current->PC_offset != PC_offset
+        || nes_current->cpu_bus.AB != bus.AB || nes_current->cpu_bus.DB != bus.DB
+        || nes_current->cpu_bus.IRQ != bus.IRQ || nes_current->cpu_bus.NMI != bus.NMI || nes_current->cpu_bus.RES != bus.RES)
+        return;
+
+    uint32_t pass = (uint32_t)(now->Total_Cycles - registers.Total_Cycles);
+
+    /* An event during the pass may have changed PPUSTATUS after the loop read it */
+    if (pass * 3 >= event)
+        return;
+
+    uint32_t passes = PPU_dots_to_next_event() / (pass * 3);
+    uint64_t until  = nes_sched_cycles_left() / pass;
+
+    if (passes > until)
+        passes = (uint32_t)until;
+
+    nes_current->cpu_registers.Total_Cycles += (uint64_t)passes * pass;
+
+    NES_TRACE_BEGIN(NES_TRACE_PPU);
+    PPU_skip(passes * pass * 3);
+    NES_TRACE_END();
+}
+
+bool interpret_step(void)
+{
+    /* Fetch and decode come out of the predecode cache, the handler does the rest */
+    uint16_t pc = nes_current->cpu_registers.PC;
+    const nes_cpu_decoded * insn = nes_cpu_decode(pc);
+
+    insn->execute(insn);
+    NES_COVERAGE_CODE(pc, nes_cpu_mode_bytes[insn->mode]);
+
     /* Increment the program counter accordingly */
-    nes_cpu_registers.PC += PC_offset;
+    nes_current->cpu_registers.PC += nes_current->PC_offset;
 
     return true; /* no breaks */
 }
@@ -972,6 +969,138 @@ void interpret(void)
     }
 }
 
+/*
+    Handle the events due by now (see nes_sched.h), then take the interrupt they left pending if
+    there is one, returning its cycles. RES beats NMI, which beats IRQ, an IRQ taken while I is
+    set waits for cpu_irq_unmasked().
+*/
+static uint32_t cpu_events(void)
+{
+    uint64_t now = nes_current->cpu_registers.Total_Cycles;
+    nes_event event;
+
+    while ((event = nes_sched_pop(now)) != NES_EVENT_COUNT)
+    {
+        switch (event)
+        {
+            case NES_EVENT_NMI:
+                nes_current->cpu_bus.NMI = true;
+                PPU_schedule_nmi();
+            break;
+            case NES_EVENT_APU_FRAME:
+            case NES_EVENT_APU_DMC:
+                NES_TRACE_BEGIN(NES_TRACE_APU);
+                nes_apu_run(now);
+                NES_TRACE_END();
+            break;
+            case NES_EVENT_MAPPER:
+                if (nes_current->MAPPER_EVENT != NULL)
+                    nes_current->MAPPER_EVENT();
+            break;
+            case NES_EVENT_SPRITE0:
+                PPU_sprite0_event();
+            break;
+            default: /* NES_EVENT_IRQ and NES_EVENT_RESET only get the pins looked at */
+            break;
+        }
+    }
+
+    if (nes_current->cpu_bus.RES)
+    {
+        nes_current->cpu_bus.RES = false;
+        nes_current->cpu_bus.NMI = false;
+        RESET();
+    }
+    else if (nes_current->cpu_bus.NMI)
+    {
+        nes_current->cpu_bus.NMI = false;
+        NMI();
+    }
+    else if (nes_current->cpu_bus.IRQ)
+        IRQ();
+
+    uint32_t cycles = nes_current->cpu_registers.Cycles;
+    nes_current->cpu_registers.Cycles = 0;
+
+    return cycles;
+}
+
+/* Press RES, the CPU resets before its next instruction */
+void nes_cpu_reset(void)
+{
+    nes_current->cpu_bus.RES = true;
+    nes_sched_at(NES_EVENT_RESET, nes_current->cpu_registers.Total_Cycles);
+}
+
+/* Run the CPU with the PPU catching up after every instruction, until the PPU completes a frame */
+void nes_run_frame(void)
+{
+    NES_TRACE_BEGIN(NES_TRACE_EMULATE);
+    nes_current->ppu.frame_complete = false;
+
+    if (nes_current->render != NULL)
+        nes_render_frame_start();
+
+    while (!nes_current->ppu.frame_complete)
+    {
+        /* The one check per instruction for interrupts and other hardware events */
+        if (nes_sched_due())
+        {
+            uint32_t cycles = cpu_events();
+
+            if (cycles > 0)
+            {
+                cpu_catch_up(cycles);
+                continue;
+            }
+        }
+
+        uint16_t pc    = nes_current->cpu_registers.PC;
+        uint8_t  sp    = nes_current->cpu_registers.SP;
+        uint64_t start = nes_current->cpu_registers.Total_Cycles;
+
+        /* Loops that only wait for the PPU are skipped ahead to its next event */
+        if (cpu_idle_head(pc))
+            cpu_skip_idle();
+        else
+        {
+            uint32_t cycles = 0;
+
+            /* Translated blocks don't touch the PPU, so it can catch up afterwards, as long as they end with the frame at the latest */
+            /* and before the next event, which they couldn't notice */
+            /* They read and write memory without coverage marks, so they sit out while a code/data log is kept */
+            if (nes_current->jit != NULL && !NES_COVERAGE_ON())
+            {
+                uint64_t budget = PPU_dots_to_frame_end() / 3;
+
+                if (budget > nes_sched_cycles_left())
+                    budget = nes_sched_cycles_left();
+
+                NES_TRACE_BEGIN(NES_TRACE_JIT);
+                cycles = nes_jit_run((uint32_t)budget);
+                NES_TRACE_END();
+            }
+
+            if (cycles == 0)
+                cycles = cpu_interpret();
+
+            cpu_catch_up(cycles);
+        }
+
+        if (nes_current->profile != NULL)
+            nes_profile_step(nes_current->profile, pc, sp, (uint32_t)(nes_current->cpu_registers.Total_Cycles - start));
+    }
+
+    NES_TRACE_BEGIN(NES_TRACE_APU);
+    nes_apu_end_frame();
+    NES_TRACE_END();
+
+    if (nes_current->render != NULL)
+        nes_render_frame_end();
+
+    NES_TRACE_END();
+}
+
 #if 0
 /* Driver code */
 int main(int argc, char** argv)
@@ -995,7 +1124,7 @@ int main(int argc, char** argv)
     else
     {
         /* Load the rom into NES memory */  
-        if (nes_load_rom(argv[1], &nes_cartridge) != 0) 
+        if (nes_load_rom(argv[1], &nes_current->cartridge) != 0) 
         {
             return -1;
         }
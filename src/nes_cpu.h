@@ -3,71 +3,13 @@
 #include <stdbool.h> 
 #include <stdint.h>
 
+#include "nes_machine.h"
+#include "nes_ppu.h"
 #include "nes_cartridge.h"
-
-/* Program Counter Offset, how much to increment it by after using the appropriate addressing mode */
-static int8_t PC_offset;
-
-/* Break flag (just give up and die when you hit a BRK) */
-static bool Break_and_die = false;
-
-/* Address and Data Bus of 6502 CPU, IRQ, NMI, and RES pins */
-typedef struct _6502_cpu_bus
-{
-    uint16_t AB;
-    uint8_t DB;
-    bool IRQ;
-    bool NMI;
-    bool RES;
-}
-_6502_cpu_bus;
-
-/* 
-Memory with zero page and ram access
-
-Memory map (from https://wiki.nesdev.com/w/index.php/CPU_memory_map)
-
-Address range   Size    Device
-
-$0000-$07FF 	$0800 	2KB internal RAM 
-$0800-$0FFF 	$0800 	
-$1000-$17FF 	$0800   Mirrors of $0000-$07FF
-$1800-$1FFF 	$0800
-$2000-$2007 	$0008 	NES PPU registers
-$2008-$3FFF 	$1FF8 	Mirrors of $2000-2007 (repeats every 8 bytes)
-$4000-$4017 	$0018 	NES APU and I/O registers
-$4018-$401F 	$0008 	APU and I/O functionality that is normally disabled. See CPU Test Mode.
-$4020-$FFFF 	$BFE0 	Cartridge space: PRG ROM, PRG RAM, and mapper registers (See Note)
-
-($4020-$4FFF is rarely used, $5000-$5FFF is rarely used but is used in some cartridges as bank
-switching registers, $6000-$7FFF is often cartridge WRAM, $8000-$FFFF is the main cartridge 
-address space.)
-*/
-typedef struct _6502_cpu_mem
-{
-    union
-    {
-        uint8_t mem[0x10000];
-        uint8_t ram[0x800];
-        uint8_t zp[0x100];
-    };
-
-    uint8_t APU_IO_Regs[24];
-}
-_6502_cpu_mem;
-
-/* Registers for the 6502 */
-typedef struct _6502_cpu_registers
-{
-    uint8_t A;
-    uint8_t X, Y;
-    uint8_t SP;
-    uint8_t S;
-
-    uint16_t PC;
-    uint16_t Cycles;
-}
-_6502_cpu_registers;
+#include "nes_jit.h"
+#include "nes_trace.h"
+#include "nes_coverage.h"
+#include "nes_sched.h"
 
 /* Flags for the NES 6502 CPU, the NES 6502 lacks decimal mode */
 typedef enum nes_cpu_flags
@@ -520,11 +462,6 @@ static const char * nes_cpu_opcode_debug_str[256] = {
     "???",      
 };
 
-/* Instantiating structs for CPU bus, memory, and registers*/
-_6502_cpu_bus        nes_cpu_bus;
-_6502_cpu_mem        nes_cpu_mem;
-_6502_cpu_registers  nes_cpu_registers;
-
 /* Debug function to print zero page memory */
 static inline void print_zp()
 {
@@ -537,7 +474,7 @@ static inline void print_zp()
         for(size_t j = 0; j <= 0xF; j++)
         {
             temp_addr = (uint8_t) (i << 4) | j;
-            printf("%02X ", nes_cpu_mem.zp[temp_addr]);
+            printf("%02X ", nes_current->cpu_mem.zp[temp_addr]);
         }
         printf("\n");
     }
@@ -549,54 +486,144 @@ static inline void print_zp()
 /* Peek (read) byte from memory at address 'addr' */
 static inline uint8_t PEEK(uint16_t addr)
 {
-    return PEEK_MAPPER(addr);
+    const uint8_t * page = nes_current->cpu_read_page[addr >> 8];
+
+    if (page != NULL)
+        return page[addr & 0xFF];
+
+    /* The PPU's registers sit on the console's bus, not the cartridge's */
+    if ((addr & 0xE000) == 0x2000)
+        return PPU_REG_PEEK(addr);
+
+    NES_TRACE_BEGIN(NES_TRACE_MAPPER);
+    uint8_t data = nes_current->PEEK_MAPPER(addr);
+    NES_TRACE_END();
+
+    return data;
 }
 
 /* Peek (read) byte from memory at address 'addr' */
 static inline uint8_t PEEK_ZP(uint16_t addr)
 {
-    return nes_cpu_mem.zp[(uint8_t)(addr & 0x00FF)];
+    return nes_current->cpu_mem.zp[(uint8_t)(addr & 0x00FF)];
+}
+
+void nes_cpu_code_written(uint16_t addr);
+void nes_cpu_oam_dma(uint8_t page);
+
+/* Whether writes to CPU page 'page' go straight to the host memory cpu_read_page has for it, see nes_cpu_map() */
+static inline bool nes_cpu_writable(uint8_t page)
+{
+    return nes_current->cpu_writable[page >> 3] & (1 << (page & 7));
 }
 
 /* Poke (write) byte in memory at address 'addr' */
 static inline void POKE(uint16_t addr, uint8_t data)
 {
-    POKE_MAPPER(addr, data);
+    NES_COVERAGE_MARK(addr, NES_CDL_WRITTEN);
+
+    if (nes_cpu_writable(addr >> 8))
+    {
+        nes_current->cpu_read_page[addr >> 8][addr & 0xFF] = data;
+        return;
+    }
+
+    if ((addr & 0xE000) == 0x2000)
+    {
+        PPU_REG_POKE(addr, data);
+        return;
+    }
+
+    /* Sprite DMA is in the 2A03, not on the cartridge */
+    if (addr == 0x4014)
+    {
+        nes_cpu_oam_dma(data);
+        return;
+    }
+
+    NES_TRACE_BEGIN(NES_TRACE_MAPPER);
+    nes_current->POKE_MAPPER(addr, data);
+    NES_TRACE_END();
+
+    /* RAM pages holding decoded or translated code are unmapped, so their writes end up here */
+    if (addr < 0x2000 && (nes_current->code_pages & (1 << ((addr >> 8) & 7))))
+        nes_cpu_code_written(addr);
 }
 
 /* Poke (write) byte in zero page at address ('addr' & 0x00FF) */
 static inline void POKE_ZP(uint16_t addr, uint8_t data)
 {
-    nes_cpu_mem.zp[addr & 0xFF] = data;
+    nes_current->cpu_mem.zp[addr & 0xFF] = data;
 }
 
 
+/*
+    Lazy flags: N, Z, C and V aren't kept in S, which every ALU op would read, modify and write
+    several times over. N and Z are left in the result byte that sets them, C and V as their own
+    bytes, so an op stores what it computed and a branch tests it as is. nes_cpu_status() packs
+    the P byte when something needs it whole: PHP, BRK and interrupts pushing it, the debugger,
+    the JIT and state hashes. nes_cpu_set_status() unpacks one, for PLP and RTI.
+*/
+static inline uint8_t nes_cpu_status(const _6502_cpu_registers * registers)
+{
+    return (registers->S & (U | B | D | I))
+         | (registers->S_n & N)
+         | (registers->S_v ? V : 0)
+         | (registers->S_z ? 0 : Z)
+         | (registers->S_c ? C : 0);
+}
+
+static inline void nes_cpu_set_status(_6502_cpu_registers * registers, uint8_t status)
+{
+    registers->S   = status;
+    registers->S_n = status;
+    registers->S_z = (uint8_t)(~status & Z);
+    registers->S_c = (uint8_t)(status & C);
+    registers->S_v = (uint8_t)(status & V);
+}
+
+/* N and Z from 'result' */
+static inline void set_nz(uint8_t result)
+{
+    nes_current->cpu_registers.S_n = result;
+    nes_current->cpu_registers.S_z = result;
+}
+
 /* Set 6502 flags */
 static inline void test_flag(nes_cpu_flags flag, uint16_t condition)
 {
-    nes_cpu_registers.S = (condition > 0) ? (nes_cpu_registers.S | flag) : (nes_cpu_registers.S & (~flag));
+    switch (flag)
+    {
+        case N: nes_current->cpu_registers.S_n = (condition > 0) ? N : 0; break;
+        case Z: nes_current->cpu_registers.S_z = (condition > 0) ? 0 : Z; break;
+        case C: nes_current->cpu_registers.S_c = (condition > 0); break;
+        case V: nes_current->cpu_registers.S_v = (condition > 0); break;
+        default:
+            nes_current->cpu_registers.S = (condition > 0) ? (nes_current->cpu_registers.S | flag) : (nes_current->cpu_registers.S & (~flag));
+    }
 }
 
 /* Clear 6502 flags */
 static inline void clear_flag(nes_cpu_flags flag)
 {
-    nes_cpu_registers.S &= ~flag;
+    test_flag(flag, 0);
 }
 
 /* Push value on top of stack */
 static inline void PUSH(uint8_t data)
 {
-    nes_cpu_registers.SP--;
-    POKE((nes_cpu_registers.SP + 0x100), data);
+    nes_current->cpu_registers.SP--;
+    POKE((nes_current->cpu_registers.SP + 0x100), data);
 }
 
 /* Pop top-most value off stack and return it */
 static inline uint8_t POP()
 {
-    uint8_t val = PEEK(nes_cpu_registers.SP + 0x100);
+    uint8_t val = PEEK(nes_current->cpu_registers.SP + 0x100);
+    NES_COVERAGE_MARK(nes_current->cpu_registers.SP + 0x100, NES_CDL_DATA);
 
-    POKE((nes_cpu_registers.SP + 0x100), 0x00);
-    nes_cpu_registers.SP++;
+    POKE((nes_current->cpu_registers.SP + 0x100), 0x00);
+    nes_current->cpu_registers.SP++;
 
     return val;
 }
@@ -606,12 +633,12 @@ static inline bool get_flag(nes_cpu_flags flag)
 {
     switch (flag)
     {
-        case N: return(nes_cpu_registers.S & flag) >> 7;
-        case V: return(nes_cpu_registers.S & flag) >> 6;
-        case B: return(nes_cpu_registers.S & flag) >> 4;
-        case I: return(nes_cpu_registers.S & flag) >> 3;
-        case Z: return(nes_cpu_registers.S & flag) >> 1;
-        case C: return(nes_cpu_registers.S & flag);
+        case N: return (nes_current->cpu_registers.S_n & N) != 0;
+        case V: return nes_current->cpu_registers.S_v != 0;
+        case Z: return nes_current->cpu_registers.S_z == 0;
+        case C: return nes_current->cpu_registers.S_c != 0;
+        case B: return (nes_current->cpu_registers.S & flag) >> 4;
+        case I: return (nes_current->cpu_registers.S & flag) >> 2;
         case U: return 1;
         case D: return 0;
         default: fprintf(stderr, "error: unknown flag %02X, ignoring", flag);
@@ -628,279 +655,163 @@ static inline bool get_flag(nes_cpu_flags flag)
 #define DOES_OVERFLOW(Val)      (Val > 127 | Val < -128)
 
 /* Takes the branch */
-#define TAKE_BRANCH             (PC_offset += (int8_t)nes_cpu_bus.DB)
-
-#define CLEAR_OP_STRING         {\
-op_string[0] = ' ';\
-op_string[1] = ' ';\
-op_string[2] = ' ';\
-op_string[3] = ' ';\
-op_string[4] = ' ';\
-op_string[5] = ' ';\
-op_string[6] = ' ';\
-op_string[7] = ' ';\
-}
+#define TAKE_BRANCH             (nes_current->PC_offset += (int8_t)nes_current->cpu_bus.DB)
 
-/* Current addressing mode */
-static uint8_t current_addr_mode = NONE;
-
-/* String used in disassembly of rom to display operand */
-char op_string[9];
-
-/* Get operand using different address modes */
-static inline void get_operand_AM(nes_cpu_addr_modes mode)
+/* Get operand using different address modes, 'operand' is the two bytes after the opcode (the second one in the high half) */
+static inline void nes_cpu_address(nes_cpu_addr_modes mode, uint16_t operand)
 {
-    current_addr_mode = mode;
-    CLEAR_OP_STRING;
+    uint8_t hi = operand >> 8;
+    uint8_t lo = operand & 0xFF;
+
+    nes_current->current_addr_mode = mode;
     switch (mode)
     {
         case ABS:
-        {
-            uint8_t hi = PEEK(nes_cpu_registers.PC + 2);
-            uint8_t lo = PEEK(nes_cpu_registers.PC + 1);
-
-            nes_cpu_bus.AB = (uint16_t) hi << 8 | lo;
-            nes_cpu_bus.DB = PEEK(nes_cpu_bus.AB);
-            PC_offset = 3;
-
-            /* Set Operand string (TO-DO: fix this) */
-            op_string[0] = '$';
-
-            op_string[1] = "0123456789ABCDEF"[(hi & 0xF0) >> 4];
-            op_string[2] = "0123456789ABCDEF"[(hi & 0x0F)];
-
-            op_string[3] = "0123456789ABCDEF"[(lo & 0xF0) >> 4];
-            op_string[4] = "0123456789ABCDEF"[(lo & 0x0F)];
-        }
+            nes_current->cpu_bus.AB = operand;
+            nes_current->cpu_bus.DB = PEEK(nes_current->cpu_bus.AB);
+            NES_COVERAGE_MARK(nes_current->cpu_bus.AB, NES_CDL_DATA);
+            nes_current->PC_offset = 3;
         break;
         case REL: 
-        {
-            int8_t offset  = PEEK(nes_cpu_registers.PC + 1);
-            nes_cpu_bus.DB = offset;
-            PC_offset = 2;
-
-            /* Set Operand string (TO-DO: fix this) */
-            op_string[0] = '$';
-            op_string[1] = "0123456789ABCDEF"[(uint8_t)(offset & 0xF0) >> 4];
-            op_string[2] = "0123456789ABCDEF"[(uint8_t)(offset & 0x0F)];
-        }
+            nes_current->cpu_bus.DB = lo;
+            nes_current->PC_offset = 2;
         break;
         case ZP:
-        {
-            uint16_t addr = PEEK(nes_cpu_registers.PC + 1);
-            
-            nes_cpu_bus.DB = PEEK_ZP(addr);
-            PC_offset = 2;
-
-            /* Set Operand string (TO-DO: fix this) */
-            op_string[0] = '$';
-            op_string[1] = "0123456789ABCDEF"[(uint8_t)(addr & 0xF0) >> 4];
-            op_string[2] = "0123456789ABCDEF"[(uint8_t)(addr & 0x0F)];
-        }
+            nes_current->cpu_bus.DB = PEEK_ZP(lo);
+            NES_COVERAGE_MARK(lo, NES_CDL_DATA);
+            nes_current->PC_offset = 2;
         break;
         case ABSX:
-        {
-            uint8_t hi = PEEK(nes_cpu_registers.PC + 2);
-            uint8_t lo = PEEK(nes_cpu_registers.PC + 1);
-
-            nes_cpu_bus.AB = (uint16_t) hi << 8 | lo;
-            nes_cpu_bus.DB = PEEK(nes_cpu_bus.AB + nes_cpu_registers.X);
-            PC_offset = 3;
-
-            /* Set Operand string (TO-DO: fix this) */
-            op_string[0] = '$';
-            op_string[5] = ','; 
-
-            op_string[1] = "0123456789ABCDEF"[(hi & 0xF0) >> 4];
-            op_string[2] = "0123456789ABCDEF"[(hi & 0x0F)];
-
-            op_string[3] = "0123456789ABCDEF"[(lo & 0xF0) >> 4];
-            op_string[4] = "0123456789ABCDEF"[(lo & 0x0F)];
-
-            op_string[6] = 'X';
-        }
+            nes_current->cpu_bus.AB = operand;
+            nes_current->cpu_bus.DB = PEEK(nes_current->cpu_bus.AB + nes_current->cpu_registers.X);
+            NES_COVERAGE_MARK(nes_current->cpu_bus.AB + nes_current->cpu_registers.X, NES_CDL_DATA);
+            nes_current->PC_offset = 3;
         break;
         case ABSY:
-        {
-            uint8_t hi = PEEK(nes_cpu_registers.PC + 2);
-            uint8_t lo = PEEK(nes_cpu_registers.PC + 1);
-
-            nes_cpu_bus.AB = (uint16_t) hi << 8 | lo;
-            nes_cpu_bus.DB = PEEK(nes_cpu_bus.AB + nes_cpu_registers.Y);
-            PC_offset = 3;
-
-            /* Set Operand string (TO-DO: fix this) */
-            op_string[0] = '$';
-            op_string[5] = ','; 
-
-            op_string[1] = "0123456789ABCDEF"[(hi & 0xF0) >> 4];
-            op_string[2] = "0123456789ABCDEF"[(hi & 0x0F)];
-
-            op_string[3] = "0123456789ABCDEF"[(lo & 0xF0) >> 4];
-            op_string[4] = "0123456789ABCDEF"[(lo & 0x0F)];
-
-            op_string[6] = 'Y';
-        }
+            nes_current->cpu_bus.AB = operand;
+            nes_current->cpu_bus.DB = PEEK(nes_current->cpu_bus.AB + nes_current->cpu_registers.Y);
+            NES_COVERAGE_MARK(nes_current->cpu_bus.AB + nes_current->cpu_registers.Y, NES_CDL_DATA);
+            nes_current->PC_offset = 3;
         break;
         case ZPX:
-        {
-            uint16_t addr = PEEK(nes_cpu_registers.PC + 1) + nes_cpu_registers.X;
-            
-            nes_cpu_bus.DB = PEEK_ZP(addr);
-            PC_offset = 2;
-
-            /* Set Operand string (TO-DO: fix this) */
-            op_string[0] = '$';
-            op_string[3] = ',';
-            op_string[4] = 'X';
-
-            op_string[1] = "0123456789ABCDEF"[(uint8_t)(addr & 0xF0) >> 4];
-            op_string[2] = "0123456789ABCDEF"[(uint8_t)(addr & 0x0F)];
-        }
+            nes_current->cpu_bus.DB = PEEK_ZP(lo + nes_current->cpu_registers.X);
+            NES_COVERAGE_MARK((uint8_t)(lo + nes_current->cpu_registers.X), NES_CDL_DATA);
+            nes_current->PC_offset = 2;
         break;
         case ZPY:
-        {
-            uint16_t addr = PEEK(nes_cpu_registers.PC + 1) + nes_cpu_registers.Y;
-            
-            nes_cpu_bus.DB = PEEK_ZP(addr);
-            PC_offset = 2;
-
-            /* Set Operand string (TO-DO: fix this) */
-            op_string[0] = '$';
-            op_string[3] = ',';
-            op_string[4] = 'Y';
-
-            op_string[1] = "0123456789ABCDEF"[(uint8_t)(addr & 0xF0) >> 4];
-            op_string[2] = "0123456789ABCDEF"[(uint8_t)(addr & 0x0F)];
-        }
+            nes_current->cpu_bus.DB = PEEK_ZP(lo + nes_current->cpu_registers.Y);
+            NES_COVERAGE_MARK((uint8_t)(lo + nes_current->cpu_registers.Y), NES_CDL_DATA);
+            nes_current->PC_offset = 2;
         break;
         case ACC:
-            nes_cpu_bus.DB = nes_cpu_registers.A; 
-            PC_offset = 1;
-
-            op_string[0] = 'A';
+            nes_current->cpu_bus.DB = nes_current->cpu_registers.A; 
+            nes_current->PC_offset = 1;
         break;
         case IMM: 
-            nes_cpu_bus.DB = PEEK(nes_cpu_registers.PC + 1);
-            PC_offset = 2;
-
-            /* Set Operand string (TO-DO: fix this) */
-            op_string[0] = '#';
-            op_string[1] = '$';
-            
-            op_string[2] = "0123456789ABCDEF"[(nes_cpu_bus.DB & 0xF0) >> 4];
-            op_string[3] = "0123456789ABCDEF"[(nes_cpu_bus.DB & 0x0F)];
+            nes_current->cpu_bus.DB = lo;
+            nes_current->PC_offset = 2;
         break;
         case IND: 
-        {
-            uint8_t hi = PEEK(nes_cpu_registers.PC + 2);
-            uint8_t lo = PEEK(nes_cpu_registers.PC + 1);
-
-            uint16_t ind_addr = (uint16_t)hi << 8 | lo;
-            nes_cpu_bus.DB = PEEK(ind_addr);
-            PC_offset = 3;
-
-            /* Set Operand string (TO-DO: fix this) */
-            op_string[0] = '(';
-            op_string[1] = '$';
-            op_string[7] = ')';
-
-            op_string[2] = "0123456789ABCDEF"[(hi & 0xF0) >> 4];
-            op_string[3] = "0123456789ABCDEF"[(hi & 0x0F)];
-
-            op_string[4] = "0123456789ABCDEF"[(lo & 0xF0) >> 4];
-            op_string[5] = "0123456789ABCDEF"[(lo & 0x0F)];
-        }
+            nes_current->cpu_bus.DB = PEEK(operand);
+            NES_COVERAGE_MARK(operand, NES_CDL_DATA);
+            nes_current->PC_offset = 3;
         break;
         case INDX:
         {
             /* Index X is added to third and second byte of the instruction, then used to fetch the corresponding bytes from zero page */
-            uint8_t hi = PEEK_ZP(PEEK(nes_cpu_registers.PC + 2) + nes_cpu_registers.X);
-            uint8_t lo = PEEK_ZP(PEEK(nes_cpu_registers.PC + 1) + nes_cpu_registers.X);
-
-            uint16_t index_addr = ((uint16_t)hi << 8 | lo);
-            nes_cpu_bus.DB = PEEK(index_addr);
-            PC_offset = 3;
-
-            /* Set Operand string (TO-DO: fix this) */
-            op_string[0] = '(';
-            op_string[1] = '$';
-            op_string[4] = ',';
-            op_string[7] = ')';
-
-            op_string[2] = "0123456789ABCDEF"[(lo & 0xF0) >> 4];
-            op_string[3] = "0123456789ABCDEF"[(lo & 0x0F)];
-
-            op_string[5] = 'X';
+            uint8_t index_hi = PEEK_ZP(hi + nes_current->cpu_registers.X);
+            uint8_t index_lo = PEEK_ZP(lo + nes_current->cpu_registers.X);
+
+            uint16_t index_addr = ((uint16_t)index_hi << 8 | index_lo);
+            nes_current->cpu_bus.DB = PEEK(index_addr);
+            NES_COVERAGE_MARK((uint8_t)(hi + nes_current->cpu_registers.X), NES_CDL_DATA);
+            NES_COVERAGE_MARK((uint8_t)(lo + nes_current->cpu_registers.X), NES_CDL_DATA);
+            NES_COVERAGE_MARK(index_addr, NES_CDL_DATA | NES_CDL_INDIRECT_DATA);
+            nes_current->PC_offset = 3;
         }
         break;
         case INDY:
         {
             /* Get high and low byte from zero page (using bytes from the instruction) and add contents of Y register to them. */
-            uint8_t hi = PEEK_ZP(PEEK(nes_cpu_registers.PC + 2));
-            uint8_t lo = PEEK_ZP(PEEK(nes_cpu_registers.PC + 1));
+            uint8_t indir_hi = PEEK_ZP(hi);
+            uint8_t indir_lo = PEEK_ZP(lo);
             
-            uint16_t indir_addr = ((uint16_t)hi << 8 | lo) + nes_cpu_registers.Y;
-            if((indir_addr & 0xFF00) != hi)
+            uint16_t indir_addr = ((uint16_t)indir_hi << 8 | indir_lo) + nes_current->cpu_registers.Y;
+            if((indir_addr & 0xFF00) != indir_hi)
             {
-                nes_cpu_registers.Cycles += 1;
+                nes_current->cpu_registers.Cycles += 1;
             }
             
-            nes_cpu_bus.DB = PEEK(indir_addr);
-            PC_offset = 3;
-
-            /* Set Operand string (TO-DO: fix this) */
-            op_string[0] = '(';
-            op_string[1] = '$';
-            op_string[4] = ')';
-            op_string[5] = ',';
-
-            op_string[2] = "0123456789ABCDEF"[(lo & 0xF0) >> 4];
-            op_string[3] = "0123456789ABCDEF"[(lo & 0x0F)];
-
-            op_string[6] = 'Y';
+            nes_current->cpu_bus.DB = PEEK(indir_addr);
+            NES_COVERAGE_MARK(hi, NES_CDL_DATA);
+            NES_COVERAGE_MARK(lo, NES_CDL_DATA);
+            NES_COVERAGE_MARK(indir_addr, NES_CDL_DATA | NES_CDL_INDIRECT_DATA);
+            nes_current->PC_offset = 3;
         }
         break;
         case IMP:
-            PC_offset = 1;
+            nes_current->PC_offset = 1;
         break;
     }
 }
 
-/* Debug function to print opcode and operand (incomplete) */
-static inline void debug_print_opcode(nes_cpu_opcodes opcode)
+/* Debug function to print opcode and operand bytes of a decoded instruction */
+static inline void debug_print_opcode(const nes_cpu_decoded * insn)
 {
-    printf("0x%02X: %s %s\n", opcode, nes_cpu_opcode_debug_str[opcode], op_string);
+    printf("0x%02X: %s $%04X\n", insn->opcode, nes_cpu_opcode_debug_str[insn->opcode], insn->operand);
 }
 
 
 /* 6502 interrupts */
 
+/*
+    Interrupts are taken between instructions, with PC at the next one. RTI adds the 1 every
+    implied instruction adds to PC, so the return address pushed is one short of it.
+*/
+
 /* IRQ */
 static inline void IRQ()
 {
     if (!get_flag(I))
     {
-        uint8_t PC_hi = ((nes_cpu_registers.PC + 2) >> 8 & 0x00FF);
-        uint8_t PC_lo = ((nes_cpu_registers.PC + 2) & 0x00FF); 
-        PUSH(PC_hi);
-        PUSH(PC_lo);
-        PUSH(nes_cpu_registers.S);
-
-        nes_cpu_registers.PC = (uint16_t)PEEK(0xFFFF) << 8 | PEEK(0xFFFE);
-        test_flag(B, 1);
+        uint16_t ret = nes_current->cpu_registers.PC - 1;
+        PUSH((uint8_t)(ret >> 8));
+        PUSH((uint8_t)ret);
+        PUSH((nes_cpu_status(&nes_current->cpu_registers) & ~B) | U);
+
+        nes_current->cpu_registers.PC = (uint16_t)PEEK(0xFFFF) << 8 | PEEK(0xFFFE);
+        NES_COVERAGE_MARK(0xFFFE, NES_CDL_DATA);
+        NES_COVERAGE_MARK(0xFFFF, NES_CDL_DATA);
         test_flag(I, 1);
 
-        nes_cpu_registers.Cycles = 7;
+        nes_current->cpu_registers.Cycles = 7;
     }
 }
 
+/* Hold the IRQ line for 'source' (NES_IRQ_*) or let go of it, the CPU looks at it once it goes low */
+static inline void nes_cpu_irq(uint8_t source, bool held)
+{
+    uint8_t line = held ? (nes_current->cpu_bus.IRQ | source) : (nes_current->cpu_bus.IRQ & ~source);
+
+    if (line && !nes_current->cpu_bus.IRQ)
+        nes_sched_at(NES_EVENT_IRQ, nes_current->cpu_registers.Total_Cycles);
+
+    nes_current->cpu_bus.IRQ = line;
+}
+
+/* I may have just been cleared, an IRQ held meanwhile is taken before the next instruction */
+static inline void cpu_irq_unmasked(void)
+{
+    if (nes_current->cpu_bus.IRQ && !get_flag(I))
+        nes_sched_at(NES_EVENT_IRQ, nes_current->cpu_registers.Total_Cycles);
+}
+
 /* Decrement # of cycles and wait for a period of time */
 static inline void CPU_tick()
 {
-    while (nes_cpu_registers.Cycles != 0)
+    while (nes_current->cpu_registers.Cycles != 0)
     {
-        nes_cpu_registers.Cycles -= 1;
+        nes_current->cpu_registers.Cycles -= 1;
         /* some kind of wait() function here */
     }
 }
@@ -908,36 +819,39 @@ static inline void CPU_tick()
 /* Non-maskable interrupt */
 static inline void NMI()
 {
-    uint8_t PC_hi = ((nes_cpu_registers.PC + 2) >> 8 & 0x00FF);
-    uint8_t PC_lo = ((nes_cpu_registers.PC + 2) & 0x00FF); 
-    PUSH(PC_hi);
-    PUSH(PC_lo);
-    PUSH(nes_cpu_registers.S);
+    uint16_t ret = nes_current->cpu_registers.PC - 1;
+    PUSH((uint8_t)(ret >> 8));
+    PUSH((uint8_t)ret);
+    PUSH((nes_cpu_status(&nes_current->cpu_registers) & ~B) | U);
     
-    nes_cpu_registers.PC = (uint16_t)PEEK(0xFFFB) << 8 | PEEK(0xFFFA);
-    test_flag(B, 1);
+    nes_current->cpu_registers.PC = (uint16_t)PEEK(0xFFFB) << 8 | PEEK(0xFFFA);
+    NES_COVERAGE_MARK(0xFFFA, NES_CDL_DATA);
+    NES_COVERAGE_MARK(0xFFFB, NES_CDL_DATA);
+    test_flag(I, 1);
 
-    nes_cpu_registers.Cycles = 8;
+    nes_current->cpu_registers.Cycles = 7;
 }
 
 /* Reset registers */
 static inline void RESET()
 {
-    nes_cpu_registers.PC = (uint16_t)PEEK(0xFFFD) << 8 | PEEK(0xFFFC);
+    nes_current->cpu_registers.PC = (uint16_t)PEEK(0xFFFD) << 8 | PEEK(0xFFFC);
+    NES_COVERAGE_MARK(0xFFFC, NES_CDL_DATA);
+    NES_COVERAGE_MARK(0xFFFD, NES_CDL_DATA);
     
-    nes_cpu_registers.SP = 0xFF;
-    nes_cpu_registers.S  = U;
-    nes_cpu_registers.A  = 0x00;
-    nes_cpu_registers.X  = 0x00;
-    nes_cpu_registers.Y  = 0x00;
+    nes_current->cpu_registers.SP = 0xFF;
+    nes_cpu_set_status(&nes_current->cpu_registers, U);
+    nes_current->cpu_registers.A  = 0x00;
+    nes_current->cpu_registers.X  = 0x00;
+    nes_current->cpu_registers.Y  = 0x00;
     
-    nes_cpu_bus.AB = 0x00;
-    nes_cpu_bus.DB = 0x00;
+    nes_current->cpu_bus.AB = 0x00;
+    nes_current->cpu_bus.DB = 0x00;
     
     test_flag(B, 1);
     test_flag(I, 1);
 
-    nes_cpu_registers.Cycles = 8;
+    nes_current->cpu_registers.Cycles = 8;
 }
 
 /* 6502 instructions (Interpreter mode only)) */
@@ -945,103 +859,103 @@ static inline void RESET()
 /* Add with Carry, Adds memory to Accumulator  */
 static inline void ADC()
 {
-    uint16_t sum = (uint16_t) (nes_cpu_bus.DB + nes_cpu_registers.A);
-    nes_cpu_registers.A = (uint8_t) sum;
+    uint16_t sum = (uint16_t) (nes_current->cpu_bus.DB + nes_current->cpu_registers.A);
+    nes_current->cpu_registers.A = (uint8_t) sum;
 
-    test_flag(N, IS_NEGATIVE(sum)); 
-    test_flag(Z, (sum == 0x00)); 
-    test_flag(V, DOES_OVERFLOW(sum));     
-    test_flag(C, (sum > 0xFF)); 
+    /* The carry out is bit 8, Z only when it's clear as well */
+    nes_current->cpu_registers.S_n = (uint8_t)sum;
+    nes_current->cpu_registers.S_z = (uint8_t)sum | (uint8_t)(sum >> 8);
+    nes_current->cpu_registers.S_v = DOES_OVERFLOW(sum);
+    nes_current->cpu_registers.S_c = (uint8_t)(sum >> 8);
 }
 
 /* Bitwise AND with Accumulator */
 static inline void AND()
 {
-    nes_cpu_registers.A &= nes_cpu_bus.DB;
+    nes_current->cpu_registers.A &= nes_current->cpu_bus.DB;
 
-    test_flag(N, IS_NEGATIVE(nes_cpu_registers.A));
-    test_flag(Z, (nes_cpu_registers.A == 0x00)); 
+    set_nz(nes_current->cpu_registers.A);
 }
 
 /* Arithmetic shift left */
 static inline void ASL()
 {
-    test_flag(C, IS_NEGATIVE(nes_cpu_bus.DB));
-    nes_cpu_bus.DB <<= 1;
+    test_flag(C, IS_NEGATIVE(nes_current->cpu_bus.DB));
+    nes_current->cpu_bus.DB <<= 1;
 
-    test_flag(N, IS_NEGATIVE(nes_cpu_bus.DB)); 
-    test_flag(Z, (nes_cpu_bus.DB == 0x00));  
+    set_nz(nes_current->cpu_bus.DB);
 }
 
 /* Test Bits */
 static inline void BIT()
 {
-    test_flag(N, IS_NEGATIVE(nes_cpu_bus.DB));
-    test_flag(V, (nes_cpu_bus.DB & 0x40 == 0x40));
-    test_flag(Z, (nes_cpu_bus.DB == 0x00));
+    set_nz(nes_current->cpu_bus.DB);
+    test_flag(V, (nes_current->cpu_bus.DB & 0x40 == 0x40));
 }
 
 /* Branch on Carry Clear */
 static inline void BCC()
 {
-    if ( !get_flag(C) ) { TAKE_BRANCH; }
+    if ( !nes_current->cpu_registers.S_c ) { TAKE_BRANCH; }
 }
 
 /* Branch on Carry Set */
 static inline void BCS()
 {
-    if ( get_flag(C) ) { TAKE_BRANCH; }
+    if ( nes_current->cpu_registers.S_c ) { TAKE_BRANCH; }
 }
 
 /* Branch on Result Zero */
 static inline void BEQ()
 {
-    if ( get_flag(Z) ) { TAKE_BRANCH; }
+    if ( !nes_current->cpu_registers.S_z ) { TAKE_BRANCH; }
 }
 
 /* Branch on Result Negative */
 static inline void BMI()
 {
-    if ( get_flag(N) ) { TAKE_BRANCH; }
+    if ( nes_current->cpu_registers.S_n & N ) { TAKE_BRANCH; }
 }
 
 /* Branch on Result not Zero*/
 static inline void BNE()
 {
-    if ( !get_flag(Z) ) { TAKE_BRANCH; }
+    if ( nes_current->cpu_registers.S_z ) { TAKE_BRANCH; }
 }
 
 /* Branch on Result Positive */
 static inline void BPL()
 {
-    if ( !get_flag(N) ) { TAKE_BRANCH; }
+    if ( !(nes_current->cpu_registers.S_n & N) ) { TAKE_BRANCH; }
 }
 
 /* Branch on Overflow Clear */
 static inline void BVC()
 {
-    if ( !get_flag(V) ) { TAKE_BRANCH; }
+    if ( !nes_current->cpu_registers.S_v ) { TAKE_BRANCH; }
 }
 
 /* Branch on Overflow Set */
 static inline void BVS()
 {
-    if ( get_flag(V) ) { TAKE_BRANCH; }
+    if ( nes_current->cpu_registers.S_v ) { TAKE_BRANCH; }
 }
 
 /* Force break */
 static inline void BRK()
 {
     /* Dirty hack pls fix ty :) */
-    Break_and_die = true;
+    nes_current->Break_and_die = true;
 
-    uint8_t PC_hi = (uint8_t)(nes_cpu_registers.PC + 2) >> 8;
-    uint8_t PC_lo = (uint8_t)(nes_cpu_registers.PC + 2);
+    uint8_t PC_hi = (uint8_t)(nes_current->cpu_registers.PC + 2) >> 8;
+    uint8_t PC_lo = (uint8_t)(nes_current->cpu_registers.PC + 2);
     PUSH(PC_hi);
     PUSH(PC_lo);
-    PUSH(nes_cpu_registers.S);
+    PUSH(nes_cpu_status(&nes_current->cpu_registers));
 
-    nes_cpu_registers.PC = (uint16_t)PEEK(0xFFFF) << 8 | PEEK(0xFFFE);
+    nes_current->cpu_registers.PC = (uint16_t)PEEK(0xFFFF) << 8 | PEEK(0xFFFE);
+    NES_COVERAGE_MARK(0xFFFE, NES_CDL_DATA);
+    NES_COVERAGE_MARK(0xFFFF, NES_CDL_DATA);
     test_flag(B, 1);
 }
 
@@ -1061,6 +975,7 @@ static inline void CLD()
 static inline void CLI()
 {
     clear_flag(I);
+    cpu_irq_unmasked();
 }
 
 /* CLear Overflow Flag */
@@ -1072,142 +987,130 @@ static inline void CLV()
 /* Compare Memory with Accumulator */
 static inline void CMP()
 {
-    uint16_t sub = nes_cpu_registers.A - nes_cpu_bus.DB;
+    uint16_t sub = nes_current->cpu_registers.A - nes_current->cpu_bus.DB;
 
-    test_flag(N, IS_NEGATIVE((uint8_t)sub));
-    test_flag(Z, (uint8_t)sub == 0x00);
-    test_flag(C, ( sub > 0xFF ));
+    set_nz((uint8_t)sub);
+    nes_current->cpu_registers.S_c = ( sub > 0xFF );
 }
 
 /* Compare Memory and Index X */
 static inline void CPX()
 {
-    uint16_t sub = nes_cpu_registers.X - nes_cpu_bus.DB;
+    uint16_t sub = nes_current->cpu_registers.X - nes_current->cpu_bus.DB;
 
-    test_flag(N, IS_NEGATIVE((uint8_t)sub));
-    test_flag(Z, (uint8_t)sub == 0x00);
-    test_flag(C, ( sub > 0xFF ));
+    set_nz((uint8_t)sub);
+    nes_current->cpu_registers.S_c = ( sub > 0xFF );
 }
 
 /* Compare Memory and Index Y */
 static inline void CPY()
 {
-    uint16_t sub = nes_cpu_registers.Y - nes_cpu_bus.DB;
+    uint16_t sub = nes_current->cpu_registers.Y - nes_current->cpu_bus.DB;
 
-    test_flag(N, IS_NEGATIVE((uint8_t)sub));
-    test_flag(Z, (uint8_t)sub == 0x00);
-    test_flag(C, ( sub > 0xFF ));
+    set_nz((uint8_t)sub);
+    nes_current->cpu_registers.S_c = ( sub > 0xFF );
 }
 
 /* DECrement memory */
 static inline void DEC()
 {
-    uint8_t mem = PEEK(nes_cpu_registers.PC + 1) - 1;
-    POKE(nes_cpu_bus.AB, mem);
+    uint8_t mem = PEEK(nes_current->cpu_registers.PC + 1) - 1;
+    POKE(nes_current->cpu_bus.AB, mem);
 
-    test_flag(N, IS_NEGATIVE(nes_cpu_bus.DB));
-    test_flag(Z, ( nes_cpu_bus.DB == 0x00 ));
+    set_nz(nes_current->cpu_bus.DB);
 }
 
 /* Decrement Index X by One */
 static inline void DEX()
 {
-    nes_cpu_registers.X--;
+    nes_current->cpu_registers.X--;
 
-    test_flag(N, IS_NEGATIVE(nes_cpu_registers.X));
-    test_flag(Z, (nes_cpu_registers.A == 0x00)); 
+    nes_current->cpu_registers.S_n = nes_current->cpu_registers.X;
+    nes_current->cpu_registers.S_z = nes_current->cpu_registers.A;
 }
 
 /* Decrement Index Y by One */
 static inline void DEY()
 {
-    nes_cpu_registers.Y--;
+    nes_current->cpu_registers.Y--;
 
-    test_flag(N, IS_NEGATIVE(nes_cpu_registers.Y));
-    test_flag(Z, (nes_cpu_registers.Y == 0x00));
+    set_nz(nes_current->cpu_registers.Y);
 }
 
 /* Exclusive OR (XOR) memory with accumulator */
 static inline void EOR()
 {
-    nes_cpu_registers.A ^= nes_cpu_bus.DB;
+    nes_current->cpu_registers.A ^= nes_current->cpu_bus.DB;
 
-    test_flag(N, IS_NEGATIVE(nes_cpu_registers.A));
-    test_flag(Z, (nes_cpu_registers.A == 0x00));
+    set_nz(nes_current->cpu_registers.A);
 }
 
 /* Increment memory by one */
 static inline void INC()
 {
-    nes_cpu_bus.DB++;
+    nes_current->cpu_bus.DB++;
 
-    test_flag(N, IS_NEGATIVE(nes_cpu_bus.DB));
-    test_flag(Z, (nes_cpu_bus.DB == 0x00));
+    set_nz(nes_current->cpu_bus.DB);
 }
 
 /* Increment X by one */
 static inline void INX()
 {
-    nes_cpu_registers.X++;
+    nes_current->cpu_registers.X++;
 
-    test_flag(N, IS_NEGATIVE(nes_cpu_registers.X));
-    test_flag(Z, (nes_cpu_registers.X == 0x00));
+    set_nz(nes_current->cpu_registers.X);
 }
 
 /* Increment Y by one */
 static inline void INY()
 {
-    nes_cpu_registers.Y++;
+    nes_current->cpu_registers.Y++;
 
-    test_flag(N, IS_NEGATIVE(nes_cpu_registers.Y));
-    test_flag(Z, (nes_cpu_registers.Y == 0x00));
+    set_nz(nes_current->cpu_registers.Y);
 }
 
 /* Jump to new location */
 static inline void JMP()
 {
-    nes_cpu_registers.PC = nes_cpu_bus.AB;
-    PC_offset = 0; /* Dirty hack pls fix ty :) */
+    nes_current->cpu_registers.PC = nes_current->cpu_bus.AB;
+    nes_current->PC_offset = 0; /* Dirty hack pls fix ty :) */
 }
 
 /* Jump saving return address */
 static inline void JSR()
 {
-    uint8_t hi = ((nes_cpu_registers.PC + 3) >> 8) & 0x00FF;
-    uint8_t lo = ((nes_cpu_registers.PC + 3) & 0x00FF);
+    uint8_t hi = ((nes_current->cpu_registers.PC + 3) >> 8) & 0x00FF;
+    uint8_t lo = ((nes_current->cpu_registers.PC + 3) & 0x00FF);
 
     PUSH(hi);
     PUSH(lo);
 
-    nes_cpu_registers.PC = nes_cpu_bus.AB; 
-    PC_offset = 0; /* Dirty hack pls fix ty :) */
+    nes_current->cpu_registers.PC = nes_current->cpu_bus.AB; 
+    nes_current->PC_offset = 0; /* Dirty hack pls fix ty :) */
 }
 
 /* Load accumulator with memory */
 static inline void LDA()
 {
-    nes_cpu_registers.A = nes_cpu_bus.DB;
+    nes_current->cpu_registers.A = nes_current->cpu_bus.DB;
 
-    test_flag(N, IS_NEGATIVE(nes_cpu_registers.A));
-    test_flag(Z, (nes_cpu_registers.A == 0x00));
+    set_nz(nes_current->cpu_registers.A);
 }
 
 /* Load index X with memory */
 static inline void LDX()
 {
-    nes_cpu_registers.X = nes_cpu_bus.DB;
+    nes_current->cpu_registers.X = nes_current->cpu_bus.DB;
 
-    test_flag(N, IS_NEGATIVE(nes_cpu_registers.X));
-    test_flag(Z, (nes_cpu_registers.X == 0x00));
+    set_nz(nes_current->cpu_registers.X);
 }
 
 /* Load index Y with memory */
 static inline void LDY()
 {
-    nes_cpu_registers.Y = nes_cpu_bus.DB;
+    nes_current->cpu_registers.Y = nes_current->cpu_bus.DB;
 
-    test_flag(N, IS_NEGATIVE(nes_cpu_registers.Y));
-    test_flag(Z, (nes_cpu_registers.Y == 0x00));
+    set_nz(nes_current->cpu_registers.Y);
 }
 
 /* Logical shift right (memory or accumulator)*/
@@ -1215,11 +1118,11 @@ static inline void LSR()
 {
     clear_flag(N);
 
-    test_flag(C, (nes_cpu_bus.DB & 0x01));
-    nes_cpu_bus.DB >>= 1;
+    test_flag(C, (nes_current->cpu_bus.DB & 0x01));
+    nes_current->cpu_bus.DB >>= 1;
 
-    test_flag(Z, (nes_cpu_bus.DB == 0x00));
-    POKE(nes_cpu_bus.AB, nes_cpu_bus.DB);
+    nes_current->cpu_registers.S_z = nes_current->cpu_bus.DB;
+    POKE(nes_current->cpu_bus.AB, nes_current->cpu_bus.DB);
 }
 
 /* No operation */
@@ -1231,68 +1134,66 @@ static inline void NOP()
 /* OR memory with Accumulator */
 static inline void ORA()
 {
-    nes_cpu_registers.A |= nes_cpu_bus.DB;
+    nes_current->cpu_registers.A |= nes_current->cpu_bus.DB;
 
-    test_flag(N, IS_NEGATIVE(nes_cpu_registers.A));
-    test_flag(Z, (nes_cpu_registers.A == 0x00)); 
+    set_nz(nes_current->cpu_registers.A);
 }
 
 /* Push Accumulator on Stack */
 static inline void PHA()
 {
-    PUSH(nes_cpu_registers.A);
+    PUSH(nes_current->cpu_registers.A);
 }
 
 /* Push Processor Status on Stack */
 static inline void PHP()
 {
-    PUSH(nes_cpu_registers.S);
+    PUSH(nes_cpu_status(&nes_current->cpu_registers));
 }
 
 /* Pull Accumulator from Stack */
 static inline void PLA()
 {
-    nes_cpu_registers.A = POP();
+    nes_current->cpu_registers.A = POP();
 
-    test_flag(N, IS_NEGATIVE(nes_cpu_registers.A));
-    test_flag(Z, (nes_cpu_registers.A == 0x00));
+    set_nz(nes_current->cpu_registers.A);
 }
 
 /* Pull Processor Status from Stack */
 static inline void PLP()
 {
-    nes_cpu_registers.S = POP();
+    nes_cpu_set_status(&nes_current->cpu_registers, POP());
+    cpu_irq_unmasked();
 }
 
 /* Rotate one bit left */
 static inline void ROL()
 {
-    test_flag(C, (nes_cpu_bus.DB & 0x01));
-    nes_cpu_bus.DB = (nes_cpu_bus.DB << 1) | (IS_NEGATIVE(nes_cpu_bus.DB));
+    test_flag(C, (nes_current->cpu_bus.DB & 0x01));
+    nes_current->cpu_bus.DB = (nes_current->cpu_bus.DB << 1) | (IS_NEGATIVE(nes_current->cpu_bus.DB));
     
-    test_flag(N, IS_NEGATIVE(nes_cpu_bus.DB));
-    test_flag(Z, (nes_cpu_bus.DB == 0x00));    
+    set_nz(nes_current->cpu_bus.DB);
 }
 
 /* Rotate one bit right */
 static inline void ROR()
 {
-    test_flag(C, (nes_cpu_bus.DB & 0x01));
+    test_flag(C, (nes_current->cpu_bus.DB & 0x01));
     /* TO-DO: Test if this code would work */
-    nes_cpu_bus.DB = (nes_cpu_bus.DB >> 1) | ((nes_cpu_bus.DB & 0x01) ? 0x80 : 0x00);
+    nes_current->cpu_bus.DB = (nes_current->cpu_bus.DB >> 1) | ((nes_current->cpu_bus.DB & 0x01) ? 0x80 : 0x00);
     
-    test_flag(N, IS_NEGATIVE(nes_cpu_bus.DB));
-    test_flag(Z, (nes_cpu_bus.DB == 0x00));
+    set_nz(nes_current->cpu_bus.DB);
 }
 
 /* Return from interrupt */
 static inline void RTI()
 {
-    nes_cpu_registers.S = POP();
+    nes_cpu_set_status(&nes_current->cpu_registers, POP());
     uint8_t lo = POP();
     uint8_t hi = POP();
     
-    nes_cpu_registers.PC = (uint16_t)(hi << 8) | lo;
+    nes_current->cpu_registers.PC = (uint16_t)(hi << 8) | lo;
+    cpu_irq_unmasked();
 }
 
 /* Return from subroutine */
@@ -1301,13 +1202,13 @@ static inline void RTS()
     uint8_t lo = POP();
     uint8_t hi = POP();
 
-    nes_cpu_registers.PC = (uint16_t)(hi << 8) | lo;
+    nes_current->cpu_registers.PC = (uint16_t)(hi << 8) | lo;
 }
 
 /* Subtract with carry */
 static inline void SBC()
 {
-    nes_cpu_bus.DB = TWOS_COMP(nes_cpu_bus.DB);
+    nes_current->cpu_bus.DB = TWOS_COMP(nes_current->cpu_bus.DB);
     ADC();
 }
 
@@ -1332,73 +1233,67 @@ static inline void SEI()
 /* Store accumulator in memory */
 static inline void STA()
 {
-    POKE(nes_cpu_bus.AB, nes_cpu_registers.A);
+    POKE(nes_current->cpu_bus.AB, nes_current->cpu_registers.A);
 }
 
 /* Store Index X in memory */
 static inline void STX()
 {
-    POKE(nes_cpu_bus.AB, nes_cpu_registers.X);
+    POKE(nes_current->cpu_bus.AB, nes_current->cpu_registers.X);
 }
 
 /* Store Index Y in memory */
 static inline void STY()
 {
-    POKE(nes_cpu_bus.AB, nes_cpu_registers.Y);
+    POKE(nes_current->cpu_bus.AB, nes_current->cpu_registers.Y);
 }
 
 /* Transfer accumulator to X */
 static inline void TAX()
 {
-    test_flag(N, IS_NEGATIVE(nes_cpu_registers.A));
-    test_flag(Z, (nes_cpu_registers.A == 0x00));
+    set_nz(nes_current->cpu_registers.A);
 
-    nes_cpu_registers.X = nes_cpu_registers.A;
+    nes_current->cpu_registers.X = nes_current->cpu_registers.A;
 }
 
 /* Transfer accumulator to Y */
 static inline void TAY()
 {
-    test_flag(N, IS_NEGATIVE(nes_cpu_registers.A));
-    test_flag(Z, (nes_cpu_registers.A == 0x00));
+    set_nz(nes_current->cpu_registers.A);
 
-    nes_cpu_registers.Y = nes_cpu_registers.A;
+    nes_current->cpu_registers.Y = nes_current->cpu_registers.A;
 }
 
 /* Transfer stack pointer to X */
 static inline void TSX()
 {
-    test_flag(N, IS_NEGATIVE(nes_cpu_bus.DB));
-    test_flag(Z, (nes_cpu_bus.DB == 0x00));
+    set_nz(nes_current->cpu_bus.DB);
 
-    nes_cpu_registers.X = nes_cpu_registers.SP;
+    nes_current->cpu_registers.X = nes_current->cpu_registers.SP;
 }
 
 /* Transfer X to Accumulator */
 static inline void TXA()
 {
-    test_flag(N, IS_NEGATIVE(nes_cpu_registers.X));
-    test_flag(Z, (nes_cpu_registers.X == 0x00));
+    set_nz(nes_current->cpu_registers.X);
 
-    nes_cpu_registers.A = nes_cpu_registers.X;
+    nes_current->cpu_registers.A = nes_current->cpu_registers.X;
 }
 
 /* Transfer X to Stack Pointer */
 static inline void TXS()
 {
-    test_flag(N, IS_NEGATIVE(nes_cpu_registers.X));
-    test_flag(Z, (nes_cpu_registers.X == 0x00));
+    set_nz(nes_current->cpu_registers.X);
 
-    nes_cpu_registers.SP = nes_cpu_registers.X;
+    nes_current->cpu_registers.SP = nes_current->cpu_registers.X;
 }
 
 /* Transfer Y to Accumulator */
 static inline void TYA()
 {
-    test_flag(N, IS_NEGATIVE(nes_cpu_registers.Y));
-    test_flag(Z, (nes_cpu_registers.Y == 0x00));
+    set_nz(nes_current->cpu_registers.Y);
 
-    nes_cpu_registers.A = nes_cpu_registers.Y;
+    nes_current->cpu_registers.A = nes_current->cpu_registers.Y;
 }
 
 int nes_init_cpu(void);
@@ -1663,4 +1558,28 @@ static const char * nes_cpu_opcode_str[256] = {
     NULL,
 };
 
-bool interpret_step(void);
\ No newline at end of file
+/* Overwrites of a RAM page's code before it's no longer cached or translated */
+#define NES_CPU_CODE_REWRITES 4
+
+/* Instructions in the longest loop that can be skipped as idle, see nes_run_frame() */
+#define NES_CPU_IDLE_INSNS    8
+
+const nes_cpu_decoded * nes_cpu_predecode(uint16_t pc);
+void nes_cpu_watch_code(uint16_t addr);
+void nes_cpu_code_reloaded(void);
+void nes_cpu_forget_code(uint16_t addr, size_t size);
+
+/* The instruction at 'pc' out of the predecode cache, decoding it first if it isn't there */
+static inline const nes_cpu_decoded * nes_cpu_decode(uint16_t pc)
+{
+    const nes_cpu_decoded * page = nes_current->decoded[pc >> 8];
+
+    if (page != NULL && page[pc & 0xFF].execute != NULL)
+        return &page[pc & 0xFF];
+
+    return nes_cpu_predecode(pc);
+}
+
+bool interpret_step(void);
+void nes_run_frame(void);
+void nes_cpu_reset(void);
\ No newline at end of file
@@ -0,0 +1,76 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "nes_cpu.h"
+#include "nes_hash.h"
+#include "nes_framehash.h"
+
+/*
+    Hash of the visible 256x240 part of the bound machine's screen buffer, with each line's
+    emphasis, 0 if headless. A row of pixels is exactly 4 stripes, so every row goes straight
+    through the stripe loop, the emphasis bytes are gathered up and hashed after the last one.
+    Hashing 257 bytes a row instead left every row after the first to be copied through the
+    partial stripe buffer.
+*/
+uint64_t nes_framehash_screen(void)
+{
+    const uint8_t * screen = nes_current->ppu.screen_buffer;
+    uint8_t emphasis[240];
+    nes_hash_state state;
+
+    if (screen == NULL)
+        return 0;
+
+    nes_hash_init(&state, 0);
+    for (size_t y = 0; y < 240; y++)
+    {
+        nes_hash_update(&state, &screen[y * PPU_SCREEN_STRIDE], PPU_SCREEN_EMPHASIS);
+        emphasis[y] = screen[y * PPU_SCREEN_STRIDE + PPU_SCREEN_EMPHASIS];
+    }
+
+    nes_hash_update(&state, emphasis, sizeof(emphasis));
+
+    return nes_hash_final(&state);
+}
+
+/* Hash of the bound machine's 2 KiB of CPU RAM */
+uint64_t nes_framehash_ram(void)
+{
+    return nes_hash(nes_current->cpu_mem.ram, sizeof(nes_current->cpu_mem.ram), 0);
+}
+
+/* Start a new log at 'path', 'rom' is only recorded in the header */
+nes_framehash_log * nes_framehash_open(const char * path, const char * rom)
+{
+    nes_framehash_log * log = malloc(sizeof(nes_framehash_log));
+
+    if (log == NULL || (log->file = fopen(path, "w")) == NULL)
+    {
+        fprintf(stderr, "error: failed to open %s for writing: %s\n", path, strerror(errno));
+        free(log);
+        return NULL;
+    }
+
+    log->frame = 0;
+    fprintf(log->file, "# nes framehash v3 %s\n# frame screen ram\n", rom);
+
+    return log;
+}
+
+/* Append the hashes of the frame that just finished */
+void nes_framehash_write(nes_framehash_log * log, uint64_t screen, uint64_t ram)
+{
+    fprintf(log->file, "%llu %016llX %016llX\n", (unsigned long long)log->frame,
+        (unsigned long long)screen, (unsigned long long)ram);
+    log->frame++;
+}
+
+void nes_framehash_close(nes_framehash_log * log)
+{
+    if (log == NULL)
+        return;
+
+    fclose(log->file);
+    free(log);
+}
@@ -0,0 +1,32 @@
+#pragma once
+
+/*
+    nes_framehash.h: Per-frame hash logs for golden-output testing
+
+    After every frame the visible part of the screen buffer and CPU RAM are hashed with
+    nes_hash() and appended to a text log, one "FRAME SCREEN RAM" line per frame. Record a
+    golden log with a known-good build, then compare a new build's log against it with
+    nesframecmp, which reports the first frame where the two diverge.
+
+    Frames that weren't drawn (fast-forward, nesfarm -s) log a screen hash of 0. Comparing
+    with nesframecmp -ram checks that skipping them left RAM exactly as drawing them did.
+
+    Hashing a frame costs a few microseconds, so it can stay on during benchmark runs.
+*/
+
+#include <stdint.h>
+#include <stdio.h>
+
+typedef struct nes_framehash_log
+{
+    FILE      * file;
+    uint64_t    frame;
+}
+nes_framehash_log;
+
+uint64_t nes_framehash_screen(void);
+uint64_t nes_framehash_ram(void);
+
+nes_framehash_log * nes_framehash_open(const char * path, const char * rom);
+void nes_framehash_write(nes_framehash_log * log, uint64_t screen, uint64_t ram);
+void nes_framehash_close(nes_framehash_log * log);
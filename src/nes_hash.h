@@ -0,0 +1,262 @@
+#pragma once
+
+/*
+    nes_hash.h: Fast non-cryptographic 64-bit hash for frames and memory
+
+    Laid out like XXH3: 8 64-bit accumulators eat a 64-byte stripe at a time, each word is
+    mixed with a per-stripe key and folded in with a single 32x32->64 multiply, which plain
+    SSE2 already has (pmuludq), so the stripe loop vectorises without -march flags. Every
+    16 stripes (1 KiB, exactly one row of the screen buffer) the accumulators are scrambled so
+    the order of the stripes matters. The tail and final mix use xxHash64's round and avalanche.
+    The output is NOT compatible with xxHash, it is only meant for comparing our own runs
+    against each other.
+
+    Streaming use:
+
+        nes_hash_state h;
+        nes_hash_init(&h, 0);
+        nes_hash_update(&h, data, size);    (any number of times)
+        uint64_t hash = nes_hash_final(&h);
+*/
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define NES_HASH_SSE2
+#endif
+
+#define NES_HASH_LANES      8
+#define NES_HASH_STRIPE     (NES_HASH_LANES * 8)
+#define NES_HASH_STRIPES    16                  /* Stripes between scrambles */
+
+#define NES_HASH_PRIME32_1  0x9E3779B1U
+#define NES_HASH_PRIME64_1  0x9E3779B185EBCA87ULL
+#define NES_HASH_PRIME64_2  0xC2B2AE3D27D4EB4FULL
+#define NES_HASH_PRIME64_3  0x165667B19E3779F9ULL
+#define NES_HASH_PRIME64_4  0x85EBCA77C2B2AE63ULL
+#define NES_HASH_PRIME64_5  0x27D4EB2F165667C5ULL
+
+/* Stripe n uses keys [n, n + 8), the scramble uses the last 8 (splitmix64 output) */
+static const uint64_t nes_hash_keys[NES_HASH_STRIPES + NES_HASH_LANES] =
+{
+    0xE220A8397B1DCDAFULL, 0x6E789E6AA1B965F4ULL, 0x06C45D188009454FULL, 0xF88BB8A8724C81ECULL,
+    0x1B39896A51A8749BULL, 0x53CB9F0C747EA2EAULL, 0x2C829ABE1F4532E1ULL, 0xC584133AC916AB3CULL,
+    0x3EE5789041C98AC3ULL, 0xF3B8488C368CB0A6ULL, 0x657EECDD3CB13D09ULL, 0xC2D326E0055BDEF6ULL,
+    0x8621A03FE0BBDB7BULL, 0x8E1F7555983AA92FULL, 0xB54E0F1600CC4D19ULL, 0x84BB3F97971D80ABULL,
+    0x7D29825C75521255ULL, 0xC3CF17102B7F7F86ULL, 0x3466E9A083914F64ULL, 0xD81A8D2B5A4485ACULL,
+    0xDB01602B100B9ED7ULL, 0xA9038A921825F10DULL, 0xEDF5F1D90DCA2F6AULL, 0x54496AD67BD2634CULL,
+};
+
+typedef struct nes_hash_state
+{
+    uint64_t    lanes[NES_HASH_LANES];
+    uint8_t     buffer[NES_HASH_STRIPE];    /* Partial stripe carried over between updates */
+    size_t      buffered;
+    size_t      stripe;                     /* Stripes since the last scramble */
+    uint64_t    length;
+    uint64_t    seed;
+}
+nes_hash_state;
+
+static inline uint64_t nes_hash_rotl64(uint64_t x, int r) { return (x << r) | (x >> (64 - r)); }
+
+static inline void nes_hash_init(nes_hash_state * state, uint64_t seed)
+{
+    for (int i = 0; i < NES_HASH_LANES; i++)
+        state->lanes[i] = seed + NES_HASH_PRIME64_1 * (uint64_t)(i + 1);
+
+    state->buffered = 0;
+    state->stripe   = 0;
+    state->length   = 0;
+    state->seed     = seed;
+}
+
+#ifdef NES_HASH_SSE2
+/* Two lanes of a stripe, 'pair' picks which 16 bytes. Compilers won't vectorise the multiply at -O2 */
+static inline __m128i nes_hash_pair(__m128i acc, const uint8_t * data, const uint64_t * keys, int pair)
+{
+    __m128i word  = _mm_loadu_si128((const __m128i *)data + pair);
+    __m128i mixed = _mm_xor_si128(word, _mm_loadu_si128((const __m128i *)keys + pair));
+    __m128i high  = _mm_shuffle_epi32(mixed, _MM_SHUFFLE(0, 3, 0, 1));
+
+    acc = _mm_add_epi64(acc, _mm_shuffle_epi32(word, _MM_SHUFFLE(1, 0, 3, 2)));
+    return _mm_add_epi64(acc, _mm_mul_epu32(mixed, high));
+}
+#else
+/* Fold one stripe into the lanes */
+static inline void nes_hash_stripe(uint64_t * restrict lanes, const uint8_t * restrict data, const uint64_t * keys)
+{
+    for (int i = 0; i < NES_HASH_LANES; i++)
+    {
+        uint64_t word, mixed;
+        memcpy(&word, data + i * 8, 8);
+
+        mixed = word ^ keys[i];
+        lanes[i ^ 1] += word;
+        lanes[i]     += (mixed & 0xFFFFFFFFU) * (mixed >> 32);
+    }
+}
+#endif
+
+static inline void nes_hash_scramble(uint64_t * lanes)
+{
+    const uint64_t * keys = &nes_hash_keys[NES_HASH_STRIPES];
+
+    for (int i = 0; i < NES_HASH_LANES; i++)
+        lanes[i] = (lanes[i] ^ (lanes[i] >> 47) ^ keys[i]) * NES_HASH_PRIME32_1;
+}
+
+static inline void nes_hash_stripes(nes_hash_state * state, const uint8_t * data, size_t stripes)
+{
+    size_t stripe = state->stripe;
+
+#ifdef NES_HASH_SSE2
+    /* The lanes stay in four registers and only go through memory for the scramble. GCC doesn't
+       unroll a loop over the pairs, it kept them on the stack, one store and reload per stripe */
+    __m128i * lanes = (__m128i *)state->lanes;
+    __m128i acc0 = _mm_loadu_si128(lanes + 0), acc1 = _mm_loadu_si128(lanes + 1);
+    __m128i acc2 = _mm_loadu_si128(lanes + 2), acc3 = _mm_loadu_si128(lanes + 3);
+
+    for (; stripes > 0; stripes--, data += NES_HASH_STRIPE)
+    {
+        const uint64_t * keys = &nes_hash_keys[stripe];
+
+        acc0 = nes_hash_pair(acc0, data, keys, 0);
+        acc1 = nes_hash_pair(acc1, data, keys, 1);
+        acc2 = nes_hash_pair(acc2, data, keys, 2);
+        acc3 = nes_hash_pair(acc3, data, keys, 3);
+
+        if (++stripe == NES_HASH_STRIPES)
+        {
+            _mm_storeu_si128(lanes + 0, acc0);
+            _mm_storeu_si128(lanes + 1, acc1);
+            _mm_storeu_si128(lanes + 2, acc2);
+            _mm_storeu_si128(lanes + 3, acc3);
+
+            nes_hash_scramble(state->lanes);
+
+            acc0 = _mm_loadu_si128(lanes + 0);
+            acc1 = _mm_loadu_si128(lanes + 1);
+            acc2 = _mm_loadu_si128(lanes + 2);
+            acc3 = _mm_loadu_si128(lanes + 3);
+            stripe = 0;
+        }
+    }
+
+    _mm_storeu_si128(lanes + 0, acc0);
+    _mm_storeu_si128(lanes + 1, acc1);
+    _mm_storeu_si128(lanes + 2, acc2);
+    _mm_storeu_si128(lanes + 3, acc3);
+#else
+    uint64_t lanes[NES_HASH_LANES];
+
+    memcpy(lanes, state->lanes, sizeof(lanes));
+
+    for (; stripes > 0; stripes--, data += NES_HASH_STRIPE)
+    {
+        nes_hash_stripe(lanes, data, &nes_hash_keys[stripe]);
+
+        if (++stripe == NES_HASH_STRIPES)
+        {
+            nes_hash_scramble(lanes);
+            stripe = 0;
+        }
+    }
+
+    memcpy(state->lanes, lanes, sizeof(lanes));
+#endif
+
+    state->stripe = stripe;
+}
+
+static inline void nes_hash_update(nes_hash_state * state, const void * data, size_t size)
+{
+    const uint8_t * bytes = data;
+    state->length += size;
+
+    /* Top up a partial stripe first */
+    if (state->buffered > 0)
+    {
+        size_t take = NES_HASH_STRIPE - state->buffered;
+        if (take > size)
+            take = size;
+
+        memcpy(state->buffer + state->buffered, bytes, take);
+        state->buffered += take;
+        bytes += take;
+        size  -= take;
+
+        if (state->buffered < NES_HASH_STRIPE)
+            return;
+
+        nes_hash_stripes(state, state->buffer, 1);
+        state->buffered = 0;
+    }
+
+    nes_hash_stripes(state, bytes, size / NES_HASH_STRIPE);
+    bytes += size & ~(size_t)(NES_HASH_STRIPE - 1);
+    size  &= NES_HASH_STRIPE - 1;
+
+    memcpy(state->buffer, bytes, size);
+    state->buffered = size;
+}
+
+/* xxHash64 style 8 byte round */
+static inline uint64_t nes_hash_round64(uint64_t hash, uint64_t k)
+{
+    k *= NES_HASH_PRIME64_2;
+    k  = nes_hash_rotl64(k, 31);
+    k *= NES_HASH_PRIME64_1;
+
+    hash ^= k;
+    return nes_hash_rotl64(hash, 27) * NES_HASH_PRIME64_1 + NES_HASH_PRIME64_4;
+}
+
+static inline uint64_t nes_hash_final(const nes_hash_state * state)
+{
+    uint64_t hash = state->seed + NES_HASH_PRIME64_5 + state->length;
+
+    /* Fold in the lanes */
+    for (int i = 0; i < NES_HASH_LANES; i++)
+        hash = nes_hash_round64(hash, state->lanes[i]);
+
+    /* Then the leftover bytes */
+    const uint8_t * tail = state->buffer;
+    size_t size = state->buffered;
+
+    for (; size >= 8; size -= 8, tail += 8)
+    {
+        uint64_t k;
+        memcpy(&k, tail, 8);
+        hash = nes_hash_round64(hash, k);
+    }
+
+    for (; size > 0; size--, tail++)
+    {
+        hash ^= *tail * NES_HASH_PRIME64_5;
+        hash  = nes_hash_rotl64(hash, 11) * NES_HASH_PRIME64_1;
+    }
+
+    /* Avalanche */
+    hash ^= hash >> 33;
+    hash *= NES_HASH_PRIME64_2;
+    hash ^= hash >> 29;
+    hash *= NES_HASH_PRIME64_3;
+    hash ^= hash >> 32;
+
+    return hash;
+}
+
+/* One-shot hash of a buffer */
+static inline uint64_t nes_hash(const void * data, size_t size, uint64_t seed)
+{
+    nes_hash_state state;
+
+    nes_hash_init(&state, seed);
+    nes_hash_update(&state, data, size);
+
+    return nes_hash_final(&state);
+}
@@ -0,0 +1,977 @@
+/* MAP_ANONYMOUS is hidden in strict C modes */
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+
+#include "nes_cpu.h"
+#include "nes_jit.h"
+
+#if defined(__x86_64__) && !defined(_WIN32)
+#define NES_JIT_X64
+#include <sys/mman.h>
+#endif
+
+#ifdef NES_JIT_X64
+
+#define JIT_BLOCK_BYTES     8192        /* Worst case host code for one block */
+
+typedef uint32_t (*nes_jit_code)(nes_machine * machine, uint32_t budget);
+
+typedef struct nes_jit_block
+{
+    nes_jit_code    code;
+    uint32_t        cycles;     /* One pass through the block, the least budget it runs with */
+}
+nes_jit_block;
+
+struct nes_jit
+{
+    uint8_t       * buffer;
+    size_t          used;
+
+    nes_jit_block * block[0x10000];     /* By PC, NULL until the PC gets hot */
+    uint8_t         hits[0x10000];
+
+    bool            ram_code[8];        /* Pages of internal RAM code was translated from */
+
+    nes_jit_stats   stats;
+};
+
+/* Stands in for PCs that can't be translated, no budget is ever big enough to run it */
+static nes_jit_block jit_refused = { NULL, UINT32_MAX };
+
+/* What a translated instruction does, the interpreter's bugs included */
+typedef enum jit_op
+{
+    JIT_NONE,
+    JIT_LDA, JIT_LDX, JIT_LDY,
+    JIT_AND, JIT_ORA, JIT_EOR,
+    JIT_CMP, JIT_CPX, JIT_CPY,
+    JIT_BIT,
+    JIT_STA, JIT_STX, JIT_STY,
+    JIT_TAX, JIT_TAY, JIT_TXA, JIT_TYA, JIT_TXS,
+    JIT_INX, JIT_INY, JIT_DEX, JIT_DEY,
+    JIT_ASL,
+    JIT_CLEAR, JIT_SET,
+    JIT_NOP,
+
+    /* These end a block */
+    JIT_BRANCH_CLEAR, JIT_BRANCH_SET,
+    JIT_JMP, JIT_JSR, JIT_RTS
+}
+jit_op;
+
+typedef struct jit_insn
+{
+    uint8_t op;
+    uint8_t mode;
+    uint8_t cycles;     /* As interpret_step() charges them */
+    uint8_t flag;       /* Flag set, cleared or tested */
+}
+jit_insn;
+
+static const jit_insn jit_insns[256] =
+{
+    [LDA_IMM]  = { JIT_LDA, IMM,  2 }, [LDA_ZP]   = { JIT_LDA, ZP,   3 }, [LDA_ZPX]  = { JIT_LDA, ZPX,  4 },
+    [LDA_ABS]  = { JIT_LDA, ABS,  4 }, [LDA_ABSX] = { JIT_LDA, ABSX, 4 }, [LDA_ABSY] = { JIT_LDA, ABSY, 4 },
+    [LDX_IMM]  = { JIT_LDX, IMM,  2 }, [LDX_ZP]   = { JIT_LDX, ZP,   3 }, [LDX_ZPY]  = { JIT_LDX, ZPY,  4 },
+    [LDX_ABS]  = { JIT_LDX, ABS,  4 }, [LDX_ABSY] = { JIT_LDX, ABSY, 4 },
+    [LDY_IMM]  = { JIT_LDY, IMM,  2 }, [LDY_ZP]   = { JIT_LDY, ZP,   3 }, [LDY_ZPX]  = { JIT_LDY, ZPX,  4 },
+    [LDY_ABS]  = { JIT_LDY, ABS,  4 }, [LDY_ABSX] = { JIT_LDY, ABSX, 4 },
+
+    [AND_IMM]  = { JIT_AND, IMM,  2 }, [AND_ZP]   = { JIT_AND, ZP,   3 }, [AND_ZPX]  = { JIT_AND, ZPX,  4 },
+    [AND_ABS]  = { JIT_AND, ABS,  4 }, [AND_ABSX] = { JIT_AND, ABSX, 4 }, [AND_ABSY] = { JIT_AND, ABSY, 4 },
+    [ORA_IMM]  = { JIT_ORA, IMM,  2 }, [ORA_ZP]   = { JIT_ORA, ZP,   3 }, [ORA_ZPX]  = { JIT_ORA, ZPX,  4 },
+    [ORA_ABS]  = { JIT_ORA, ABS,  4 }, [ORA_ABSX] = { JIT_ORA, ABSX, 4 }, [ORA_ABSY] = { JIT_ORA, ABSY, 4 },
+    [EOR_IMM]  = { JIT_EOR, IMM,  2 }, [EOR_ZP]   = { JIT_EOR, ZP,   3 }, [EOR_ZPX]  = { JIT_EOR, ZPX,  4 },
+    [EOR_ABS]  = { JIT_EOR, ABS,  4 }, [EOR_ABSX] = { JIT_EOR, ABSX, 4 }, [EOR_ABSY] = { JIT_EOR, ABSY, 4 },
+
+    [CMP_IMM]  = { JIT_CMP, IMM,  2 }, [CMP_ZP]   = { JIT_CMP, ZP,   3 }, [CMP_ZPX]  = { JIT_CMP, ZPX,  4 },
+    [CMP_ABS]  = { JIT_CMP, ABS,  4 }, [CMP_ABSX] = { JIT_CMP, ABSX, 4 }, [CMP_ABSY] = { JIT_CMP, ABSY, 4 },
+    [CPX_IMM]  = { JIT_CPX, IMM,  2 }, [CPX_ZP]   = { JIT_CPX, ZP,   3 }, [CPX_ABS]  = { JIT_CPX, ABS,  4 },
+    [CPY_IMM]  = { JIT_CPY, IMM,  2 }, [CPY_ZP]   = { JIT_CPY, ZP,   3 }, [CPY_ABS]  = { JIT_CPY, ABS,  4 },
+    [BIT_ZP]   = { JIT_BIT, ZP,   3 }, [BIT_ABS]  = { JIT_BIT, ABS,  4 },
+
+    [STA_ABS]  = { JIT_STA, ABS,  4 }, [STX_ABS]  = { JIT_STX, ABS,  4 }, [STY_ABS]  = { JIT_STY, ABS,  4 },
+
+    [TAX_IMP]  = { JIT_TAX, IMP,  2 }, [TAY_IMP]  = { JIT_TAY, IMP,  2 }, [TXA_IMP]  = { JIT_TXA, IMP,  2 },
+    [TYA_IMP]  = { JIT_TYA, IMP,  2 }, [TXS_IMP]  = { JIT_TXS, IMP,  2 },
+    [INX_IMP]  = { JIT_INX, IMP,  2 }, [INY_IMP]  = { JIT_INY, IMP,  2 }, [DEX_IMP]  = { JIT_DEX, IMP,  2 },
+    [DEY_IMP]  = { JIT_DEY, IMP,  2 }, [ASL_ACC]  = { JIT_ASL, ACC,  2 }, [NOP_IMP]  = { JIT_NOP, IMP,  2 },
+
+    [CLC_IMP]  = { JIT_CLEAR, IMP, 2, C }, [SEC_IMP] = { JIT_SET, IMP, 2, C },
+    [CLI_IMP]  = { JIT_CLEAR, IMP, 2, I }, [SEI_IMP] = { JIT_SET, IMP, 2, I },
+    [CLD_IMP]  = { JIT_CLEAR, IMP, 2, D }, [SED_IMP] = { JIT_SET, IMP, 2, D },
+    [CLV_IMP]  = { JIT_CLEAR, IMP, 2, V },
+
+    [BPL_REL]  = { JIT_BRANCH_CLEAR, REL, 2, N }, [BMI_REL] = { JIT_BRANCH_SET, REL, 2, N },
+    [BVC_REL]  = { JIT_BRANCH_CLEAR, REL, 2, V }, [BVS_REL] = { JIT_BRANCH_SET, REL, 2, V },
+    [BCC_REL]  = { JIT_BRANCH_CLEAR, REL, 2, C }, [BCS_REL] = { JIT_BRANCH_SET, REL, 2, C },
+    [BNE_REL]  = { JIT_BRANCH_CLEAR, REL, 2, Z }, [BEQ_REL] = { JIT_BRANCH_SET, REL, 2, Z },
+
+    [JMP_ABS]  = { JIT_JMP, ABS,  3 }, [JSR_ABS]  = { JIT_JSR, ABS,  6 }, [RTS_IMP]  = { JIT_RTS, IMP,  6 },
+};
+
+static uint8_t jit_insn_size(uint8_t mode)
+{
+    switch (mode)
+    {
+        case ABS: case ABSX: case ABSY:             return 3;
+        case IMM: case ZP: case ZPX: case ZPY: case REL: return 2;
+        default:                                    return 1;
+    }
+}
+
+/* x86-64 registers */
+enum { RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI, R8, R9, R10, R11, R12, R13 };
+
+/* Where the 6502 lives while a block runs, all caller-saved but RBX and R13, which the block saves */
+#define JIT_MACHINE     RDI     /* First argument */
+#define JIT_ROM         R13     /* The cartridge's PRG-ROM, which isn't part of the machine */
+#define JIT_BUDGET      RSI     /* Second argument, free for RTS once a block can't loop */
+#define JIT_CYCLES      RAX     /* Return value */
+#define JIT_A           R8
+#define JIT_X           R9
+#define JIT_Y           R10
+#define JIT_P           R11
+#define JIT_DB          RDX
+#define JIT_T0          RCX     /* Scratch, also the index register of memory operands */
+#define JIT_T1          RBX     /* Scratch */
+
+/* ALU operations: "op r/m32, r32" is (op * 8 + 1), "op r/m32, imm32" is 81 /op */
+enum { ALU_ADD = 0, ALU_OR = 1, ALU_SBB = 3, ALU_AND = 4, ALU_SUB = 5, ALU_XOR = 6, ALU_CMP = 7 };
+
+/* Shifts, C1 /op ib */
+enum { SHIFT_SHL = 4, SHIFT_SHR = 5 };
+
+/* Condition codes */
+enum { CC_Z = 0x4, CC_NZ = 0x5, CC_BE = 0x6 };
+
+#define JIT_OFFSET(field)   ((int32_t)offsetof(nes_machine, field))
+#define JIT_STACK           (JIT_OFFSET(cpu_mem.ram) + 0x100)
+
+/* A byte of 6502 memory as translated code reaches it, 'disp' from JIT_MACHINE or JIT_ROM */
+typedef struct jit_ref
+{
+    int         base;
+    int32_t     disp;
+}
+jit_ref;
+
+typedef struct jit_emitter
+{
+    uint8_t * p;
+}
+jit_emitter;
+
+static void emit8(jit_emitter * e, uint8_t byte)
+{
+    *e->p++ = byte;
+}
+
+static void emit32(jit_emitter * e, uint32_t value)
+{
+    memcpy(e->p, &value, 4);
+    e->p += 4;
+}
+
+static void emit64(jit_emitter * e, uint64_t value)
+{
+    memcpy(e->p, &value, 8);
+    e->p += 8;
+}
+
+/* REX prefix for the extended registers, left out when empty */
+static void emit_rex(jit_emitter * e, int reg, int base)
+{
+    uint8_t rex = 0x40 | (reg & 8) >> 1 | (base & 8) >> 3;
+
+    if (rex != 0x40)
+        emit8(e, rex);
+}
+
+/* 'opcode' with a register and the byte at [base + disp], or [base + T0 + disp]. Neither base needs a SIB byte of its own */
+static void emit_mem(jit_emitter * e, uint16_t opcode, int reg, int base, bool indexed, int32_t disp)
+{
+    emit_rex(e, reg, base);
+
+    if (opcode > 0xFF)
+        emit8(e, opcode >> 8);
+    emit8(e, opcode & 0xFF);
+
+    if (indexed)
+    {
+        emit8(e, 0x80 | (reg & 7) << 3 | 4);
+        emit8(e, (JIT_T0 & 7) << 3 | (base & 7));
+    }
+    else
+        emit8(e, 0x80 | (reg & 7) << 3 | (base & 7));
+
+    emit32(e, (uint32_t)disp);
+}
+
+/* movzx reg32, byte [machine + ...] */
+static void emit_load(jit_emitter * e, int reg, bool indexed, int32_t disp)
+{
+    emit_mem(e, 0x0FB6, reg, JIT_MACHINE, indexed, disp);
+}
+
+/* movzx reg32, byte [...], from wherever 'ref' is */
+static void emit_load_ref(jit_emitter * e, int reg, bool indexed, jit_ref ref)
+{
+    emit_mem(e, 0x0FB6, reg, ref.base, indexed, ref.disp);
+}
+
+/* mov byte [machine + ...], reg8 */
+static void emit_store(jit_emitter * e, int reg, bool indexed, int32_t disp)
+{
+    emit_mem(e, 0x88, reg, JIT_MACHINE, indexed, disp);
+}
+
+/* mov byte [machine + ...], imm8 */
+static void emit_store_imm(jit_emitter * e, bool indexed, int32_t disp, uint8_t value)
+{
+    emit_mem(e, 0xC6, 0, JIT_MACHINE, indexed, disp);
+    emit8(e, value);
+}
+
+/* mov word [machine + disp], imm16 */
+static void emit_store16_imm(jit_emitter * e, int32_t disp, uint16_t value)
+{
+    emit8(e, 0x66);
+    emit_mem(e, 0xC7, 0, JIT_MACHINE, false, disp);
+    emit8(e, value & 0xFF);
+    emit8(e, value >> 8);
+}
+
+/* mov word [machine + disp], reg16 */
+static void emit_store16(jit_emitter * e, int reg, int32_t disp)
+{
+    emit8(e, 0x66);
+    emit_mem(e, 0x89, reg, JIT_MACHINE, false, disp);
+}
+
+static void emit_rr(jit_emitter * e, uint8_t opcode, int dst, int src)
+{
+    emit_rex(e, src, dst);
+    emit8(e, opcode);
+    emit8(e, 0xC0 | (src & 7) << 3 | (dst & 7));
+}
+
+static void emit_alu(jit_emitter * e, int op, int dst, int src)
+{
+    emit_rr(e, op * 8 + 1, dst, src);
+}
+
+static void emit_mov(jit_emitter * e, int dst, int src)
+{
+    emit_rr(e, 0x89, dst, src);
+}
+
+static void emit_alu_imm(jit_emitter * e, int op, int dst, uint32_t value)
+{
+    emit_rex(e, 0, dst);
+    emit8(e, 0x81);
+    emit8(e, 0xC0 | op << 3 | (dst & 7));
+    emit32(e, value);
+}
+
+static void emit_shift(jit_emitter * e, int op, int dst, uint8_t count)
+{
+    emit_rex(e, 0, dst);
+    emit8(e, 0xC1);
+    emit8(e, 0xC0 | op << 3 | (dst & 7));
+    emit8(e, count);
+}
+
+static void emit_test_imm(jit_emitter * e, int dst, uint32_t value)
+{
+    emit_rex(e, 0, dst);
+    emit8(e, 0xF7);
+    emit8(e, 0xC0 | (dst & 7));
+    emit32(e, value);
+}
+
+static void emit_mov_imm(jit_emitter * e, int dst, uint32_t value)
+{
+    emit_rex(e, 0, dst);
+    emit8(e, 0xB8 + (dst & 7));
+    emit32(e, value);
+}
+
+/* movabs reg64, imm64 */
+static void emit_mov_imm64(jit_emitter * e, int dst, uint64_t value)
+{
+    emit8(e, 0x48 | (dst & 8) >> 3);
+    emit8(e, 0xB8 + (dst & 7));
+    emit64(e, value);
+}
+
+/* jcc rel32, returns the displacement for jit_patch() */
+static uint8_t * emit_jcc(jit_emitter * e, uint8_t cc)
+{
+    emit8(e, 0x0F);
+    emit8(e, 0x80 | cc);
+    emit32(e, 0);
+
+    return e->p - 4;
+}
+
+/* jmp rel32, returns the displacement for jit_patch() */
+static uint8_t * emit_jmp(jit_emitter * e)
+{
+    emit8(e, 0xE9);
+    emit32(e, 0);
+
+    return e->p - 4;
+}
+
+static void jit_patch(uint8_t * displacement, const uint8_t * target)
+{
+    int32_t rel = (int32_t)(target - (displacement + 4));
+    memcpy(displacement, &rel, 4);
+}
+
+/* Wrap an 8-bit register after arithmetic */
+static void emit_wrap(jit_emitter * e, int reg)
+{
+    emit_alu_imm(e, ALU_AND, reg, 0xFF);
+}
+
+/* test_flag(N, 'n' & 0x80), test_flag(Z, 'z' == 0), 'n' and 'z' only differ for DEX */
+static void emit_nz(jit_emitter * e, int n, int z)
+{
+    emit_alu_imm(e, ALU_AND, JIT_P, (uint8_t)~(N | Z));
+
+    emit_alu_imm(e, ALU_CMP, z, 1);             /* Borrow when zero */
+    emit_alu(e, ALU_SBB, JIT_T1, JIT_T1);
+    emit_alu_imm(e, ALU_AND, JIT_T1, Z);
+    emit_alu(e, ALU_OR, JIT_P, JIT_T1);
+
+    emit_mov(e, JIT_T1, n);
+    emit_alu_imm(e, ALU_AND, JIT_T1, N);
+    emit_alu(e, ALU_OR, JIT_P, JIT_T1);
+}
+
+/*
+    Where translated code finds the host byte behind CPU address 'addr', false unless it's plain
+    memory in the machine or in the PRG-ROM. The ROM is shared between machines (see
+    nes_rom_share()), blocks reach it through JIT_ROM, which the prologue loads. Mappers switch
+    banks with nes_cpu_map(), which flushes every block, so the base never goes stale.
+*/
+static bool jit_host(uint16_t addr, jit_ref * ref)
+{
+    const uint8_t * page = nes_current->cpu_read_page[addr >> 8];
+
+    if (page == NULL)
+        return false;
+
+    uintptr_t host    = (uintptr_t)(page + (addr & 0xFF));
+    uintptr_t machine = (uintptr_t)nes_current;
+    uintptr_t rom     = (uintptr_t)nes_current->cartridge.PRG_ROM;
+
+    if (host >= machine && host - machine < sizeof(nes_machine))
+        *ref = (jit_ref){ JIT_MACHINE, (int32_t)(host - machine) };
+    else if (rom != 0 && host >= rom && host - rom < nes_current->cartridge.PRG_ROM_size)
+        *ref = (jit_ref){ JIT_ROM, (int32_t)(host - rom) };
+    else
+        return false;
+
+    return true;
+}
+
+/* Stores to 'addr' can go straight to jit_host()'s byte, it isn't ROM or RAM watched for code */
+static bool jit_writable(uint16_t addr)
+{
+    return nes_cpu_writable(addr >> 8);
+}
+
+/* The stack page is the machine's RAM, for JSR and RTS to push and pop at JIT_STACK */
+static bool jit_stack(void)
+{
+    jit_ref ref;
+
+    return jit_writable(0x100) && jit_host(0x100, &ref) && ref.base == JIT_MACHINE && ref.disp == JIT_STACK;
+}
+
+/* Fetch the operand onto the data bus like get_operand_AM(), emits nothing and fails if it needs the mapper */
+static bool emit_operand(jit_emitter * e, uint8_t mode, uint16_t operand, int32_t * ab)
+{
+    jit_ref host, last;
+
+    switch (mode)
+    {
+        case IMM:
+            emit_mov_imm(e, JIT_DB, operand & 0xFF);
+            return true;
+        case ZP:
+            emit_load(e, JIT_DB, false, JIT_OFFSET(cpu_mem.zp) + (operand & 0xFF));
+            return true;
+        case ZPX:
+        case ZPY:
+            emit_mov(e, JIT_T0, (mode == ZPX) ? JIT_X : JIT_Y);
+            emit_alu_imm(e, ALU_ADD, JIT_T0, operand & 0xFF);
+            emit_wrap(e, JIT_T0);
+            emit_load(e, JIT_DB, true, JIT_OFFSET(cpu_mem.zp));
+            return true;
+        case ABS:
+            if (!jit_host(operand, &host))
+                return false;
+
+            emit_load_ref(e, JIT_DB, false, host);
+            *ab = operand;
+            return true;
+        case ABSX:
+        case ABSY:
+            /* All 256 possible bytes have to be contiguous host memory */
+            if (!jit_host(operand, &host) ||
+                !jit_host((uint16_t)(operand + 0xFF), &last) ||
+                last.base != host.base || last.disp != host.disp + 0xFF)
+                return false;
+
+            emit_mov(e, JIT_T0, (mode == ABSX) ? JIT_X : JIT_Y);
+            emit_load_ref(e, JIT_DB, true, host);
+            *ab = operand;
+            return true;
+        case ACC:
+            emit_mov(e, JIT_DB, JIT_A);
+            return true;
+        default:
+            return true;
+    }
+}
+
+/* One instruction that doesn't end the block, false if it can't be translated after all */
+static bool emit_insn(jit_emitter * e, const jit_insn * insn, uint16_t operand, int32_t * ab)
+{
+    static const int reg_of[] =
+    {
+        [JIT_LDA] = JIT_A, [JIT_LDX] = JIT_X, [JIT_LDY] = JIT_Y,
+        [JIT_CMP] = JIT_A, [JIT_CPX] = JIT_X, [JIT_CPY] = JIT_Y,
+        [JIT_STA] = JIT_A, [JIT_STX] = JIT_X, [JIT_STY] = JIT_Y,
+    };
+
+    jit_ref target;
+
+    switch (insn->op)
+    {
+        case JIT_LDA: case JIT_LDX: case JIT_LDY:
+            if (!emit_operand(e, insn->mode, operand, ab))
+                return false;
+
+            emit_mov(e, reg_of[insn->op], JIT_DB);
+            emit_nz(e, reg_of[insn->op], reg_of[insn->op]);
+            return true;
+
+        case JIT_AND: case JIT_ORA: case JIT_EOR:
+            if (!emit_operand(e, insn->mode, operand, ab))
+                return false;
+
+            emit_alu(e, (insn->op == JIT_AND) ? ALU_AND : (insn->op == JIT_ORA) ? ALU_OR : ALU_XOR, JIT_A, JIT_DB);
+            emit_nz(e, JIT_A, JIT_A);
+            return true;
+
+        case JIT_CMP: case JIT_CPX: case JIT_CPY:
+            if (!emit_operand(e, insn->mode, operand, ab))
+                return false;
+
+            /* The interpreter sets C when the register is below the operand */
+            emit_alu_imm(e, ALU_AND, JIT_P, (uint8_t)~C);
+            emit_alu(e, ALU_CMP, reg_of[insn->op], JIT_DB);
+            emit_alu(e, ALU_SBB, JIT_T1, JIT_T1);
+            emit_alu_imm(e, ALU_AND, JIT_T1, C);
+            emit_alu(e, ALU_OR, JIT_P, JIT_T1);
+
+            emit_mov(e, JIT_T0, reg_of[insn->op]);
+            emit_alu(e, ALU_SUB, JIT_T0, JIT_DB);
+            emit_wrap(e, JIT_T0);
+            emit_nz(e, JIT_T0, JIT_T0);
+            return true;
+
+        case JIT_BIT:
+            if (!emit_operand(e, insn->mode, operand, ab))
+                return false;
+
+            /* V comes from bit 0, see BIT() */
+            emit_alu_imm(e, ALU_AND, JIT_P, (uint8_t)~V);
+            emit_mov(e, JIT_T1, JIT_DB);
+            emit_alu_imm(e, ALU_AND, JIT_T1, 0x01);
+            emit_shift(e, SHIFT_SHL, JIT_T1, 6);
+            emit_alu(e, ALU_OR, JIT_P, JIT_T1);
+            emit_nz(e, JIT_DB, JIT_DB);
+            return true;
+
+        case JIT_STA: case JIT_STX: case JIT_STY:
+            /* Writes to RAM only, RAM holding code isn't mapped for writing and PRG-ROM never is */
+            if (!jit_writable(operand) || !jit_host(operand, &target) || target.base != JIT_MACHINE ||
+                !emit_operand(e, insn->mode, operand, ab))
+                return false;
+
+            emit_store(e, reg_of[insn->op], false, target.disp);
+            return true;
+
+        case JIT_TAX: emit_nz(e, JIT_A, JIT_A); emit_mov(e, JIT_X, JIT_A); return true;
+        case JIT_TAY: emit_nz(e, JIT_A, JIT_A); emit_mov(e, JIT_Y, JIT_A); return true;
+        case JIT_TXA: emit_nz(e, JIT_X, JIT_X); emit_mov(e, JIT_A, JIT_X); return true;
+        case JIT_TYA: emit_nz(e, JIT_Y, JIT_Y); emit_mov(e, JIT_A, JIT_Y); return true;
+        case JIT_TXS:
+            emit_nz(e, JIT_X, JIT_X);
+            emit_store(e, JIT_X, false, JIT_OFFSET(cpu_registers.SP));
+            return true;
+
+        case JIT_INX: case JIT_INY:
+        case JIT_DEX: case JIT_DEY:
+        {
+            int reg = (insn->op == JIT_INX || insn->op == JIT_DEX) ? JIT_X : JIT_Y;
+
+            emit_alu_imm(e, (insn->op == JIT_INX || insn->op == JIT_INY) ? ALU_ADD : ALU_SUB, reg, 1);
+            emit_wrap(e, reg);
+
+            /* DEX takes Z from A */
+            emit_nz(e, reg, (insn->op == JIT_DEX) ? JIT_A : reg);
+            return true;
+        }
+
+        case JIT_ASL:
+            emit_operand(e, ACC, operand, ab);
+
+            emit_alu_imm(e, ALU_AND, JIT_P, (uint8_t)~C);
+            emit_mov(e, JIT_T1, JIT_DB);
+            emit_shift(e, SHIFT_SHR, JIT_T1, 7);
+            emit_alu(e, ALU_OR, JIT_P, JIT_T1);
+
+            emit_shift(e, SHIFT_SHL, JIT_DB, 1);
+            emit_wrap(e, JIT_DB);
+            emit_nz(e, JIT_DB, JIT_DB);
+            emit_mov(e, JIT_A, JIT_DB);
+            return true;
+
+        case JIT_CLEAR:
+            emit_alu_imm(e, ALU_AND, JIT_P, (uint8_t)~insn->flag);
+            return true;
+        case JIT_SET:
+            emit_alu_imm(e, ALU_OR, JIT_P, insn->flag);
+            return true;
+        case JIT_NOP:
+            return true;
+
+        default:
+            return false;
+    }
+}
+
+/* Leave PC, PC_offset and the address bus as interpret_step() would ('pc' < 0 when already stored) */
+static void emit_exit_state(jit_emitter * e, int32_t pc, int8_t pc_offset, int32_t ab)
+{
+    if (pc >= 0)
+        emit_store16_imm(e, JIT_OFFSET(cpu_registers.PC), (uint16_t)pc);
+    emit_store_imm(e, false, JIT_OFFSET(PC_offset), (uint8_t)pc_offset);
+
+    if (ab >= 0)
+        emit_store16_imm(e, JIT_OFFSET(cpu_bus.AB), (uint16_t)ab);
+}
+
+/* Go round again if another pass of 'cycles' still fits in the budget */
+static void emit_loop(jit_emitter * e, uint32_t cycles, const uint8_t * top)
+{
+    emit_mov(e, JIT_T0, JIT_CYCLES);
+    emit_alu_imm(e, ALU_ADD, JIT_T0, cycles);
+    emit_alu(e, ALU_CMP, JIT_T0, JIT_BUDGET);
+    jit_patch(emit_jcc(e, CC_BE), top);
+}
+
+/* The instruction ending the block, runs from 'pc' and brings the pass to 'cycles' */
+static bool emit_end(jit_emitter * e, const jit_insn * insn, uint16_t pc, uint16_t operand, uint16_t start,
+                     uint32_t cycles, int32_t ab, const uint8_t * top, uint8_t ** exit)
+{
+    jit_ref host;
+
+    switch (insn->op)
+    {
+        case JIT_BRANCH_CLEAR:
+        case JIT_BRANCH_SET:
+        {
+            /* PC_offset is 8 bits, a taken branch wraps it like TAKE_BRANCH does */
+            int8_t   taken_offset = (int8_t)(2 + (int8_t)(operand & 0xFF));
+            uint16_t target       = (uint16_t)(pc + taken_offset);
+
+            emit_mov_imm(e, JIT_DB, operand & 0xFF);
+            emit_alu_imm(e, ALU_ADD, JIT_CYCLES, cycles);
+            emit_test_imm(e, JIT_P, insn->flag);
+
+            uint8_t * taken = emit_jcc(e, (insn->op == JIT_BRANCH_SET) ? CC_NZ : CC_Z);
+
+            emit_exit_state(e, (uint16_t)(pc + 2), 2, ab);
+            *exit = emit_jmp(e);
+
+            jit_patch(taken, e->p);
+            if (target == start)
+                emit_loop(e, cycles, top);
+            emit_exit_state(e, target, taken_offset, ab);
+            return true;
+        }
+
+        case JIT_JMP:
+        case JIT_JSR:
+            /* get_operand_AM(ABS) reads the target */
+            if (!jit_host(operand, &host))
+                return false;
+            if (insn->op == JIT_JSR && !jit_stack())
+                return false;
+
+            emit_load_ref(e, JIT_DB, false, host);
+
+            /* JSR() pushes PC + 3 */
+            if (insn->op == JIT_JSR)
+            {
+                uint16_t ret = (uint16_t)(pc + 3);
+
+                emit_load(e, JIT_T0, false, JIT_OFFSET(cpu_registers.SP));
+                emit_alu_imm(e, ALU_SUB, JIT_T0, 1);
+                emit_wrap(e, JIT_T0);
+                emit_store_imm(e, true, JIT_STACK, ret >> 8);
+                emit_alu_imm(e, ALU_SUB, JIT_T0, 1);
+                emit_wrap(e, JIT_T0);
+                emit_store_imm(e, true, JIT_STACK, ret & 0xFF);
+                emit_store(e, JIT_T0, false, JIT_OFFSET(cpu_registers.SP));
+            }
+
+            emit_alu_imm(e, ALU_ADD, JIT_CYCLES, cycles);
+            if (insn->op == JIT_JMP && operand == start)
+                emit_loop(e, cycles, top);
+            emit_exit_state(e, operand, 0, operand);
+            return true;
+
+        case JIT_RTS:
+            if (!jit_stack())
+                return false;
+
+            /* Two POP()s, which clear the stack behind them, then PC_offset 1 */
+            emit_load(e, JIT_T0, false, JIT_OFFSET(cpu_registers.SP));
+            emit_load(e, JIT_T1, true, JIT_STACK);
+            emit_store_imm(e, true, JIT_STACK, 0);
+            emit_alu_imm(e, ALU_ADD, JIT_T0, 1);
+            emit_wrap(e, JIT_T0);
+            emit_load(e, JIT_BUDGET, true, JIT_STACK);
+            emit_store_imm(e, true, JIT_STACK, 0);
+            emit_alu_imm(e, ALU_ADD, JIT_T0, 1);
+            emit_wrap(e, JIT_T0);
+            emit_store(e, JIT_T0, false, JIT_OFFSET(cpu_registers.SP));
+
+            emit_shift(e, SHIFT_SHL, JIT_BUDGET, 8);
+            emit_alu(e, ALU_OR, JIT_BUDGET, JIT_T1);
+            emit_alu_imm(e, ALU_ADD, JIT_BUDGET, 1);
+            emit_store16(e, JIT_BUDGET, JIT_OFFSET(cpu_registers.PC));
+
+            emit_alu_imm(e, ALU_ADD, JIT_CYCLES, cycles);
+            emit_exit_state(e, -1, 1, ab);
+            return true;
+
+        default:
+            return false;
+    }
+}
+
+static void jit_flush(nes_jit * jit)
+{
+    memset(jit->block, 0, sizeof(jit->block));
+    jit->used = 0;
+
+    memset(jit->ram_code, 0, sizeof(jit->ram_code));
+    jit->stats.flushes++;
+}
+
+/* Translate the block starting at 'start' */
+static nes_jit_block * jit_translate(nes_jit * jit, uint16_t start)
+{
+    bool in_ram = start < 0x2000;
+
+    if (NES_JIT_BUFFER_SIZE - jit->used < JIT_BLOCK_BYTES)
+        jit_flush(jit);
+
+    /* Zero page and the stack are written behind POKE()'s back, self-modifying code is left alone */
+    if (in_ram)
+    {
+        uint8_t page = (start >> 8) & 7;
+
+        if (page < 2 || nes_current->code_rewrites[page] >= NES_CPU_CODE_REWRITES)
+        {
+            jit->stats.refused++;
+            return &jit_refused;
+        }
+
+        /* Writes to it go through POKE_MAPPER from now on, and so to nes_jit_write() */
+        nes_cpu_watch_code(start);
+        jit->ram_code[page] = true;
+    }
+
+    nes_jit_block * block = (nes_jit_block *)(jit->buffer + jit->used);
+    jit_emitter e = { (uint8_t *)(block + 1) };
+    uint8_t * code = e.p;
+    uint8_t * exits[2];
+    size_t exit_count = 0;
+
+    /* Prologue, the 6502 goes into host registers */
+    emit8(&e, 0x53);                    /* push rbx */
+    emit8(&e, 0x41);                    /* push r13 */
+    emit8(&e, 0x55);
+    emit_mov_imm64(&e, JIT_ROM, (uintptr_t)nes_current->cartridge.PRG_ROM);
+    emit_load(&e, JIT_A,  false, JIT_OFFSET(cpu_registers.A));
+    emit_load(&e, JIT_X,  false, JIT_OFFSET(cpu_registers.X));
+    emit_load(&e, JIT_Y,  false, JIT_OFFSET(cpu_registers.Y));
+    emit_load(&e, JIT_P,  false, JIT_OFFSET(cpu_registers.S));
+    emit_load(&e, JIT_DB, false, JIT_OFFSET(cpu_bus.DB));
+    emit_alu(&e, ALU_XOR, JIT_CYCLES, JIT_CYCLES);
+
+    uint8_t * top = e.p;
+    uint16_t pc = start;
+    uint32_t cycles = 0;
+    int32_t ab = -1;
+    uint8_t size = 0;
+    size_t count = 0;
+    bool ended = false;
+
+    while (count < NES_JIT_MAX_INSNS)
+    {
+        jit_ref opcode_host;
+        if (!jit_host(pc, &opcode_host))
+            break;
+
+        const jit_insn * insn = &jit_insns[nes_current->cpu_read_page[pc >> 8][pc & 0xFF]];
+        uint8_t insn_size = jit_insn_size(insn->mode);
+        uint16_t operand = 0;
+        bool fetched = (insn->op != JIT_NONE);
+
+        /* Operand bytes, RAM blocks don't leave their page */
+        for (uint8_t i = 1; fetched && i < insn_size; i++)
+        {
+            uint16_t addr = (uint16_t)(pc + i);
+            jit_ref host;
+
+            if (!jit_host(addr, &host) || (in_ram && (addr >> 8) != (start >> 8)))
+                fetched = false;
+            else
+                operand |= (uint16_t)nes_current->cpu_read_page[addr >> 8][addr & 0xFF] << (8 * (i - 1));
+        }
+
+        if (!fetched)
+            break;
+
+        uint8_t * mark = e.p;
+        int32_t insn_ab = ab;
+
+        if (insn->op >= JIT_BRANCH_CLEAR)
+        {
+            if (!emit_end(&e, insn, pc, operand, start, cycles + insn->cycles, ab, top, &exits[exit_count]))
+            {
+                e.p = mark;
+                break;
+            }
+
+            if (insn->op == JIT_BRANCH_CLEAR || insn->op == JIT_BRANCH_SET)
+                exit_count++;
+
+            cycles += insn->cycles;
+            count++;
+            ended = true;
+            break;
+        }
+
+        if (!emit_insn(&e, insn, operand, &insn_ab))
+        {
+            e.p = mark;
+            break;
+        }
+
+        ab = insn_ab;
+        cycles += insn->cycles;
+        size = insn_size;
+        pc += insn_size;
+        count++;
+    }
+
+    if (count == 0)
+    {
+        jit->stats.refused++;
+        return &jit_refused;
+    }
+
+    /* Ran into something the interpreter has to do, carry on from there */
+    if (!ended)
+    {
+        emit_alu_imm(&e, ALU_ADD, JIT_CYCLES, cycles);
+        emit_exit_state(&e, pc, (int8_t)size, ab);
+    }
+
+    /* Epilogue, shared by all exits */
+    for (size_t i = 0; i < exit_count; i++)
+        jit_patch(exits[i], e.p);
+
+    emit_store(&e, JIT_A,  false, JIT_OFFSET(cpu_registers.A));
+    emit_store(&e, JIT_X,  false, JIT_OFFSET(cpu_registers.X));
+    emit_store(&e, JIT_Y,  false, JIT_OFFSET(cpu_registers.Y));
+    emit_store(&e, JIT_P,  false, JIT_OFFSET(cpu_registers.S));
+    emit_store(&e, JIT_DB, false, JIT_OFFSET(cpu_bus.DB));
+    emit8(&e, 0x41);                    /* pop r13 */
+    emit8(&e, 0x5D);
+    emit8(&e, 0x5B);                    /* pop rbx */
+    emit8(&e, 0xC3);                    /* ret */
+
+    block->code   = (nes_jit_code)(void *)code;
+    block->cycles = cycles;
+
+    /* Keep the next block 16 byte aligned */
+    jit->used = ((size_t)(e.p - jit->buffer) + 15) & ~(size_t)15;
+    jit->stats.blocks++;
+
+    return block;
+}
+
+bool nes_jit_enable(void)
+{
+    if (nes_current->jit != NULL)
+        return true;
+
+    nes_jit * jit = calloc(1, sizeof(nes_jit));
+    if (jit == NULL)
+    {
+        fprintf(stderr, "error: Failed to allocate the JIT\n");
+        return false;
+    }
+
+    jit->buffer = mmap(NULL, NES_JIT_BUFFER_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (jit->buffer == MAP_FAILED)
+    {
+        fprintf(stderr, "error: Failed to map executable memory for the JIT: %s\n", strerror(errno));
+        free(jit);
+        return false;
+    }
+
+    nes_current->jit = jit;
+    return true;
+}
+
+void nes_jit_free(nes_jit * jit)
+{
+    if (jit == NULL)
+        return;
+
+    munmap(jit->buffer, NES_JIT_BUFFER_SIZE);
+    free(jit);
+}
+
+/* Run the block at PC if there is one and it fits in 'budget' CPU cycles, returns the cycles it took, 0 if it didn't run */
+uint32_t nes_jit_run(uint32_t budget)
+{
+    nes_jit * jit = nes_current->jit;
+    uint16_t pc = nes_current->cpu_registers.PC;
+    nes_jit_block * block = jit->block[pc];
+
+    if (block == NULL)
+    {
+        if (++jit->hits[pc] < NES_JIT_THRESHOLD)
+            return 0;
+
+        block = jit->block[pc] = jit_translate(jit, pc);
+    }
+
+    if (block->cycles > budget)
+        return 0;
+
+    /* Translated code keeps P packed in a host register */
+    nes_current->cpu_registers.S = nes_cpu_status(&nes_current->cpu_registers);
+
+    uint32_t cycles = block->code(nes_current, budget);
+    jit->stats.cycles += cycles;
+
+    nes_cpu_set_status(&nes_current->cpu_registers, nes_current->cpu_registers.S);
+    cpu_irq_unmasked();
+
+    return cycles;
+}
+
+void nes_jit_flush(void)
+{
+    jit_flush(nes_current->jit);
+}
+
+/* The CPU wrote to watched RAM (see nes_cpu_code_written()) */
+void nes_jit_write(uint16_t addr)
+{
+    nes_jit * jit = nes_current->jit;
+    uint8_t page = (addr >> 8) & 7;
+
+    if (addr >= 0x2000 || !jit->ram_code[page])
+        return;
+
+    jit->stats.invalidations++;
+    jit_flush(jit);
+}
+
+#else
+
+/* No JIT for this host, nes_current->jit stays NULL so none of the rest is ever called */
+bool nes_jit_enable(void)
+{
+    fprintf(stderr, "error: The JIT needs an x86-64 Linux, BSD or macOS host\n");
+    return false;
+}
+
+void nes_jit_free(nes_jit * jit)
+{
+}
+
+uint32_t nes_jit_run(uint32_t budget)
+{
+    return 0;
+}
+
+void nes_jit_flush(void)
+{
+}
+
+void nes_jit_write(uint16_t addr)
+{
+}
+
+#endif
+
+void nes_jit_disable(void)
+{
+    if (nes_current->jit == NULL)
+        return;
+
+    nes_jit_flush();
+    nes_jit_free(nes_current->jit);
+    nes_current->jit = NULL;
+}
+
+/* nes_load_state() replaced RAM, code translated from it may be stale */
+void nes_jit_state_loaded(void)
+{
+#ifdef NES_JIT_X64
+    nes_jit * jit = nes_current->jit;
+
+    for (uint8_t page = 0; page < 8; page++)
+    {
+        if (jit->ram_code[page])
+        {
+            jit_flush(jit);
+            return;
+        }
+    }
+#endif
+}
+
+const nes_jit_stats * nes_jit_get_stats(void)
+{
+#ifdef NES_JIT_X64
+    return (nes_current->jit != NULL) ? &nes_current->jit->stats : NULL;
+#else
+    return NULL;
+#endif
+}
@@ -0,0 +1,60 @@
+#pragma once
+
+/*
+    nes_jit.h: Optional translation of hot 6502 code to x86-64
+
+    Every PC the interpreter executes is counted, once one has been seen NES_JIT_THRESHOLD times
+    the straight-line code starting there is translated into a host function, with A, X, Y, P and
+    the data bus pinned in host registers. A block runs until its first branch, jump, JSR or RTS;
+    a branch or JMP back to the start of the block loops in host code for as long as the cycle
+    budget allows.
+
+    Blocks only ever touch memory the CPU page table (nes_machine.cpu_read_page/cpu_writable)
+    backs with the machine itself or with the cartridge's shared PRG-ROM image, each addressed
+    from its own host register, so they never see a register, never call out and the PPU can
+    catch up after the whole block. nes_run_frame() only runs a block when it ends before the frame and the
+    next scheduled event (see nes_sched.h) do, everything else (the registers, unmapped pages,
+    indirect modes, read-modify-write, the stack apart from JSR/RTS) is left to interpret_step(). The interpreter's results, its bus values and
+    PC_offset included, are reproduced exactly, so frame hashes match with and without the JIT.
+
+    Translated code goes away when:
+        - a mapper remaps a page with nes_cpu_map() (bank switches),
+        - the CPU writes to a RAM page code was translated from, those pages are watched with
+          nes_cpu_watch_code() so POKE() reports them with nes_jit_write(),
+        - nes_load_state() puts back RAM that code was translated from.
+
+    Only built for x86-64 System V hosts (Linux, BSD, macOS), nes_jit_enable() fails elsewhere.
+*/
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "nes_machine.h"
+
+#define NES_JIT_THRESHOLD   32          /* Interpreted visits of a PC before it gets translated */
+#define NES_JIT_MAX_INSNS   64          /* Instructions per block */
+#define NES_JIT_BUFFER_SIZE (4 << 20)   /* Bytes of host code per machine, flushed when full */
+
+typedef struct nes_jit nes_jit;
+
+typedef struct nes_jit_stats
+{
+    uint64_t    blocks;         /* Blocks translated */
+    uint64_t    refused;        /* Hot PCs whose first instruction can't be translated */
+    uint64_t    flushes;
+    uint64_t    invalidations;  /* Flushes caused by writes to RAM holding code */
+    uint64_t    cycles;         /* CPU cycles run in translated code */
+}
+nes_jit_stats;
+
+bool nes_jit_enable(void);
+void nes_jit_disable(void);
+void nes_jit_free(nes_jit * jit);
+
+uint32_t nes_jit_run(uint32_t budget);
+
+void nes_jit_flush(void);
+void nes_jit_write(uint16_t addr);
+void nes_jit_state_loaded(void);
+
+const nes_jit_stats * nes_jit_get_stats(void);
@@ -0,0 +1,290 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <pthread.h>
+
+#include "nes_cpu.h"
+#include "nes_jit.h"
+#include "nes_profile.h"
+#include "nes_coverage.h"
+#include "nes_render.h"
+#include "nes_sched.h"
+
+_Thread_local nes_machine * nes_current = NULL;
+
+/* Every ROM image some machine holds, see nes_rom_share() */
+static nes_rom_image  * rom_images;
+static pthread_mutex_t  rom_images_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Allocate a powered-on NES with no cartridge, NULL if out of memory */
+nes_machine * nes_machine_create(void)
+{
+    nes_machine * machine  = calloc(1, sizeof(nes_machine));
+    nes_machine * previous = nes_current;
+
+    if (machine == NULL || (machine->ppu.screen_buffer = calloc(240, PPU_SCREEN_STRIDE)) == NULL
+        || (machine->audio.blip = malloc(sizeof(nes_blip))) == NULL
+        || (machine->ppu.sprites = malloc(sizeof(nes_ppu_sprites))) == NULL
+        || (machine->decoded = calloc(256, sizeof(nes_cpu_decoded *))) == NULL)
+    {
+        if (machine != NULL)
+        {
+            free(machine->ppu.sprites);
+            free(machine->audio.blip);
+            free(machine->ppu.screen_buffer);
+        }
+        free(machine);
+        return NULL;
+    }
+
+#ifdef NES_COVERAGE
+    for (size_t page = 0; page < 256; page++)
+        machine->cdl_page[page] = machine->cdl_sink;
+#endif
+
+    /* Initialise it as the current machine, without disturbing whatever this thread runs */
+    nes_current = machine;
+    nes_sched_init();
+    nes_init_cpu();
+    ppu_init();
+    nes_apu_init();
+    nes_current = previous;
+
+    return machine;
+}
+
+void nes_machine_destroy(nes_machine * machine)
+{
+    if (nes_current == machine)
+        nes_current = NULL;
+
+    nes_jit_free(machine->jit);
+    nes_profile_free(machine->profile);
+    nes_coverage_free(machine->coverage);
+    nes_render_free(machine->render);
+    nes_rom_release(machine->cartridge.image);
+
+    for (size_t page = 0; page < 256; page++)
+        free(machine->decoded[page]);
+
+    free(machine->decoded);
+    free(machine->ppu.sprites);
+    free(machine->cartridge.four_screen);
+    free(machine->audio.blip);
+    free(machine->ppu.screen_buffer);
+    free(machine);
+}
+
+/*
+    Free the bound machine's screen buffer and blip buffer, the two largest parts of it, for batches
+    that only look at RAM. Everything but the picture and the sound goes on as before (see
+    PPU_drawing(), the APU runs but makes no samples), there is no way back.
+*/
+void nes_machine_headless(void)
+{
+    free(nes_current->ppu.screen_buffer);
+    nes_current->ppu.screen_buffer = NULL;
+
+    free(nes_current->audio.blip);
+    nes_current->audio.blip = NULL;
+}
+
+/* Make 'machine' the one the core emulates on the calling thread */
+void nes_machine_bind(nes_machine * machine)
+{
+    nes_current = machine;
+}
+
+/*
+    Back 'size' bytes of the CPU address space from 'addr' on (both multiples of 256) with host
+    memory 'mem', NULL to hand the accesses back to the mapper. Writes go to 'mem' too if it's
+    'writable', else to the mapper (ROM). Mappers call this whenever they switch a bank, which
+    also throws away any code decoded or translated from it.
+*/
+void nes_cpu_map(uint16_t addr, size_t size, uint8_t * mem, bool writable)
+{
+    if (nes_current->jit != NULL)
+        nes_jit_flush();
+
+    nes_cpu_forget_code(addr, size);
+
+    for (size_t offset = 0; offset < size; offset += 0x100)
+    {
+        uint8_t page = (uint8_t)((addr + offset) >> 8);
+
+        nes_current->cpu_read_page[page] = mem ? mem + offset : NULL;
+
+        if (mem != NULL && writable)
+            nes_current->cpu_writable[page >> 3] |= 1 << (page & 7);
+        else
+            nes_current->cpu_writable[page >> 3] &= ~(1 << (page & 7));
+
+#ifdef NES_COVERAGE
+        nes_coverage_map(page);
+#endif
+
+        /* RAM mapped afresh is no longer watched for code changes */
+        if (page < 0x20)
+            nes_current->code_pages &= ~(1 << (page & 7));
+    }
+}
+
+/*
+    Back 'size' bytes of the PPU's pattern tables from 'addr' on (both multiples of 1 KiB) with
+    'mem', for mappers to switch CHR banks with. Writes land in it too, CHR-ROM isn't protected.
+    'mem' has to lie in chr_ram, the only CHR memory there is until CHR-ROM gets loaded, the bank
+    number is what save states keep.
+*/
+void nes_ppu_map(uint16_t addr, size_t size, uint8_t * mem)
+{
+    for (size_t offset = 0; offset < size; offset += 0x400)
+    {
+        uint8_t page = ((addr + offset) >> 10) & 0x07;
+
+        nes_current->ppu.PPU_page[page] = mem + offset;
+        nes_current->ppu.chr_bank[page] = (uint8_t)((mem + offset - nes_current->ppu_bus.chr_ram) >> 10);
+
+        if (nes_current->render != NULL)
+            nes_render_log(NES_RENDER_MAP, page, 0, mem + offset);
+    }
+
+    PPU_sprite0_changed();
+}
+
+/* Point the nametable slots and their pages at VRAM for 'mirroring', see nes_ppu_mirror() */
+static void ppu_point_nametables(nes_mirroring mirroring)
+{
+    static const uint8_t slots[][4] =
+    {
+        [NES_MIRROR_HORIZONTAL]  = { 0, 0, 1, 1 },
+        [NES_MIRROR_VERTICAL]    = { 0, 1, 0, 1 },
+        [NES_MIRROR_SINGLE_LOW]  = { 0, 0, 0, 0 },
+        [NES_MIRROR_SINGLE_HIGH] = { 1, 1, 1, 1 },
+        [NES_MIRROR_FOUR_SCREEN] = { 0, 1, 2, 3 },
+    };
+
+    _nes_ppu * ppu = &nes_current->ppu;
+
+    ppu->mirroring = (uint8_t)mirroring;
+
+    for (size_t slot = 0; slot < 4; slot++)
+    {
+        uint8_t   kib  = slots[mirroring][slot];
+        uint8_t * vram = kib < 2 ? &nes_current->ppu_bus.vram[kib * 0x400] : &nes_current->cartridge.four_screen[(kib - 2) * 0x400];
+
+        ppu->PPU_Nametable[slot]   = vram;
+        ppu->PPU_Attribtable[slot] = vram + 0x3C0;
+        ppu->PPU_page[8 + slot]    = vram;
+        ppu->PPU_page[12 + slot]   = vram;
+    }
+}
+
+/*
+    Point the four nametable slots, and their mirrors at $3000-$3EFF, into VRAM the way the
+    cartridge wires it up. Mappers that switch mirroring (MMC1, AxROM) call this whenever it
+    changes, it only swaps pointers and may happen mid-frame. NES_MIRROR_FOUR_SCREEN needs the
+    cartridge's four_screen nametables, nes_load_rom() allocates them for boards that have them.
+*/
+void nes_ppu_mirror(nes_mirroring mirroring)
+{
+    ppu_point_nametables(mirroring);
+
+    if (nes_current->render != NULL)
+        nes_render_log(NES_RENDER_MIRROR, 0, (uint8_t)mirroring, NULL);
+
+    PPU_sprite0_changed();
+}
+
+/*
+    Point every host pointer in the bound machine's PPU back into its own memory, from the
+    mirroring and CHR banks last set. A loaded save state brings the pointers of whichever machine
+    saved it, this is what makes it safe to load into another one. Nothing is logged or scheduled,
+    the state brought its own sprite 0 event and nes_render_reload() copies the whole PPU over.
+*/
+void nes_ppu_relink(void)
+{
+    _nes_ppu * ppu = &nes_current->ppu;
+
+    ppu_point_nametables((nes_mirroring)ppu->mirroring);
+
+    for (size_t page = 0; page < 8; page++)
+        ppu->PPU_page[page] = &nes_current->ppu_bus.chr_ram[(ppu->chr_bank[page] & 7) * 0x400];
+
+    ppu->PPU_Pallete_Data[0] = &nes_current->ppu_bus.palette[0x00];
+    ppu->PPU_Pallete_Data[1] = &nes_current->ppu_bus.palette[0x10];
+    ppu->PPU_OAM_bytes[0]    = ppu->OAM;
+    ppu->PPU_OAM_bytes[1]    = ppu->secondary_OAM;
+}
+
+/*
+    Read 'size' bytes of PRG-ROM from 'rom' for the bound machine, returning the image of another
+    machine holding the same bytes if there is one, NULL on error. Comparing the bytes costs no more
+    than reading them, and needs no idea of which file they came from.
+*/
+nes_rom_image * nes_rom_share(FILE * rom, size_t size)
+{
+    nes_rom_image * image = malloc(sizeof(nes_rom_image) + size);
+
+    if (image == NULL)
+    {
+        fprintf(stderr, "error: Out of memory for %zu bytes of PRG-ROM\n", size);
+        return NULL;
+    }
+
+    if (fread(image->data, sizeof(uint8_t), size, rom) != size)
+    {
+        fprintf(stderr, "error: Failed to copy PRG-ROM: %s. exiting\n", strerror(errno));
+        free(image);
+        return NULL;
+    }
+
+    image->refs = 1;
+    image->size = size;
+
+    pthread_mutex_lock(&rom_images_lock);
+
+    for (nes_rom_image * other = rom_images; other != NULL; other = other->next)
+    {
+        if (other->size == size && memcmp(other->data, image->data, size) == 0)
+        {
+            other->refs++;
+            pthread_mutex_unlock(&rom_images_lock);
+
+            free(image);
+            return other;
+        }
+    }
+
+    image->next = rom_images;
+    rom_images  = image;
+
+    pthread_mutex_unlock(&rom_images_lock);
+
+    return image;
+}
+
+/* A machine is done with 'image' (may be NULL), the last one frees it */
+void nes_rom_release(nes_rom_image * image)
+{
+    if (image == NULL)
+        return;
+
+    pthread_mutex_lock(&rom_images_lock);
+
+    bool last = --image->refs == 0;
+
+    for (nes_rom_image ** link = &rom_images; last && *link != NULL; link = &(*link)->next)
+    {
+        if (*link == image)
+        {
+            *link = image->next;
+            break;
+        }
+    }
+
+    pthread_mutex_unlock(&rom_images_lock);
+
+    if (last)
+        free(image);
+}
@@ -0,0 +1,474 @@
+#pragma once
+
+/*
+    nes_machine.h: Everything that makes up one emulated NES
+
+    All CPU, PPU and cartridge state lives in a nes_machine, so a process can host as many
+    independent consoles as it likes. The core (PEEK/POKE, the interpreter, the PPU and the
+    mappers) works on the machine bound to the calling thread with nes_machine_bind(), which
+    keeps the hot paths free of an extra parameter and lets every thread run its own machine.
+
+    A nes_machine itself is ~15 KiB: 2 KiB of RAM and 2 KiB of VRAM, 8 KiB of CHR-RAM (CHR-ROM
+    isn't loaded yet, so every cartridge gets it), the OAM and registers, and 2 KiB of host page
+    table. What can be worked out again lives apart: the sprite lists (~2 KiB) and the decode
+    table (2 KiB, plus 4 KiB per page code ran from). The screen buffer (~80 KiB) and the blip
+    buffer (~17 KiB) are allocated apart too and dropped by nes_machine_headless(). PRG-ROM is
+    shared by every machine running the same ROM (see nes_rom_share()), four-screen boards add 2 KiB.
+*/
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "nes_blip.h"
+
+/* Devices that can hold the IRQ line, see nes_cpu_irq() */
+#define NES_IRQ_APU_FRAME   0x01
+#define NES_IRQ_APU_DMC     0x02
+#define NES_IRQ_MAPPER      0x04
+
+/* Address and Data Bus of 6502 CPU, IRQ, NMI, RES and RDY pins */
+typedef struct _6502_cpu_bus
+{
+    uint16_t AB;
+    uint8_t DB;
+    uint8_t IRQ;    /* NES_IRQ_* bits of the devices holding it */
+    bool NMI;       /* Edge seen, taken before the next instruction */
+    bool RES;
+    bool DMA;       /* RDY pulled by a $4014 write, the CPU halts once the instruction ends */
+}
+_6502_cpu_bus;
+
+/* Things that happen at a known CPU cycle, see nes_sched.h */
+typedef enum nes_event
+{
+    NES_EVENT_NMI,          /* The PPU enters vblank with NMI enabled */
+    NES_EVENT_IRQ,          /* The IRQ line went low or I was cleared while it was */
+    NES_EVENT_RESET,        /* RES was pressed */
+    NES_EVENT_APU_FRAME,    /* The APU frame counter raises its interrupt */
+    NES_EVENT_APU_DMC,      /* The DMC fetches the last byte of a sample */
+    NES_EVENT_MAPPER,       /* Whatever the mapper scheduled, see MAPPER_EVENT */
+    NES_EVENT_SPRITE0,      /* Sprite 0 hits the background, or the PPU gets to a line it may hit on */
+
+    NES_EVENT_COUNT
+}
+nes_event;
+
+typedef struct nes_sched
+{
+    uint64_t    next;                       /* Cycle of the earliest event, UINT64_MAX if there is none */
+    uint64_t    when[NES_EVENT_COUNT];
+    uint8_t     heap[NES_EVENT_COUNT];      /* Scheduled events, a binary min-heap on 'when' */
+    uint8_t     slot[NES_EVENT_COUNT];      /* Index of each event in 'heap', NES_EVENT_COUNT if it isn't */
+    uint8_t     count;
+}
+nes_sched;
+
+/* 
+Memory with zero page and ram access
+
+Memory map (from https://wiki.nesdev.com/w/index.php/CPU_memory_map)
+
+Address range   Size    Device
+
+$0000-$07FF 	$0800 	2KB internal RAM 
+$0800-$0FFF 	$0800 	
+$1000-$17FF 	$0800   Mirrors of $0000-$07FF
+$1800-$1FFF 	$0800
+$2000-$2007 	$0008 	NES PPU registers
+$2008-$3FFF 	$1FF8 	Mirrors of $2000-2007 (repeats every 8 bytes)
+$4000-$4017 	$0018 	NES APU and I/O registers
+$4018-$401F 	$0008 	APU and I/O functionality that is normally disabled. See CPU Test Mode.
+$4020-$FFFF 	$BFE0 	Cartridge space: PRG ROM, PRG RAM, and mapper registers (See Note)
+
+($4020-$4FFF is rarely used, $5000-$5FFF is rarely used but is used in some cartridges as bank
+switching registers, $6000-$7FFF is often cartridge WRAM, $8000-$FFFF is the main cartridge 
+address space.)
+
+Only the internal RAM is the machine's own, the cartridge space is whatever the mapper points it
+at with nes_cpu_map(), PRG-ROM being shared between machines (see nes_rom_image).
+*/
+typedef struct _6502_cpu_mem
+{
+    union
+    {
+        uint8_t ram[0x800];
+        uint8_t zp[0x100];
+    };
+
+    uint8_t APU_IO_Regs[24];
+}
+_6502_cpu_mem;
+
+/* Registers for the 6502 */
+typedef struct _6502_cpu_registers
+{
+    uint8_t A;
+    uint8_t X, Y;
+    uint8_t SP;
+    uint8_t S;              /* I, D, B and U, the rest is kept apart until nes_cpu_status() packs it */
+
+    uint8_t S_n;            /* Bit 7 is N */
+    uint8_t S_z;            /* Zero when Z is set */
+    uint8_t S_c;            /* Non-zero when C is set */
+    uint8_t S_v;            /* Non-zero when V is set */
+
+    uint16_t PC;
+    uint16_t Cycles;
+
+    uint64_t Total_Cycles;  /* CPU cycles since power on, the APU catches up to it */
+}
+_6502_cpu_registers;
+
+/* How the four nametable slots ($2000, $2400, $2800, $2C00) share the console's 2 KiB of VRAM, see nes_ppu_mirror() */
+typedef enum nes_mirroring
+{
+    NES_MIRROR_HORIZONTAL,      /* $2000 = $2400 and $2800 = $2C00, for vertical scrolling */
+    NES_MIRROR_VERTICAL,        /* $2000 = $2800 and $2400 = $2C00, for horizontal scrolling */
+    NES_MIRROR_SINGLE_LOW,      /* All four are the first KiB */
+    NES_MIRROR_SINGLE_HIGH,     /* All four are the second KiB */
+    NES_MIRROR_FOUR_SCREEN      /* Four KiB, the cartridge brings the other two */
+}
+nes_mirroring;
+
+/* Width of a row in screen_buffer, the column past the 256 visible pixels holds the row's emphasis bits */
+#define PPU_SCREEN_STRIDE   340
+#define PPU_SCREEN_EMPHASIS 256
+
+/* Sprite evaluation's results for every line of the frame, worked out from OAM whenever it or the sprite size has changed, see PPU_sprite_lists() */
+typedef struct nes_ppu_sprites
+{
+    uint8_t     list[240][8];               /* OAM index of the first 8 sprites on each line */
+    uint8_t     count[240];                 /* Sprites on each line, more than 8 sets the overflow flag */
+    uint64_t    overflow[4];                /* Lines with more than 8, bit n & 63 of word n >> 6 */
+}
+nes_ppu_sprites;
+
+/* PPU implementation */
+typedef struct _nes_ppu
+{
+    uint8_t * PPU_page[16];                 /* Host memory behind each KiB of $0000-$3FFF, see nes_ppu_map() */
+    uint8_t * PPU_Nametable[4];             /* Pointers to the 4 nametables */
+    uint8_t * PPU_Attribtable[4];           /* Pointers to the 4 attribute tables ($40 in size) */    
+    uint8_t * PPU_Pallete_Data[2];          /* Pointer to PPU pallete data (0 -> BG, 1-> FG) */
+    
+    union 
+    {
+        uint8_t     * PPU_OAM_bytes[2];     /* OAM and secondary OAM as a byte stream, or as rows of 4*8 = 32 bits */
+        uint32_t    * PPU_OAM_row[2];       /* (Y, tile, attributes, X from the low byte up), one per sprite */
+    };
+
+    /* What the pointers above were built from, so a loaded state can build them again, see nes_ppu_relink() */
+    uint8_t     mirroring;                  /* nes_mirroring of the nametables */
+    uint8_t     chr_bank[8];                /* KiB of chr_ram behind each KiB of the pattern tables */
+
+    uint8_t PPU_registers[9];               /* Registers of the PPU */
+
+    /* Loopy's scroll registers, v and t laid out as 0yyy NNYY YYYX XXXX (fine Y, nametable, coarse Y, coarse X) */
+    uint16_t    v, t;                       /* VRAM address, and the one PPUSCROLL/PPUADDR writes build up */
+    uint8_t     x;                          /* Fine X scroll */
+    bool        w;                          /* Next PPUSCROLL/PPUADDR write is the second of its pair */
+
+    uint8_t     read_buffer;                /* PPUDATA reads return what the previous one fetched */
+    uint8_t     io_latch;                   /* Last byte on the register bus, write-only registers read back as it */
+
+    _Alignas(16) uint8_t OAM[256];          /* Object attribute memory, 4 bytes for each of 64 sprites */
+    _Alignas(16) uint8_t secondary_OAM[32]; /* The sprites found for the next line, $FF after the last */
+
+    bool        sprites_stale;              /* OAM or the sprite size changed since PPU_sprite_lists() */
+    uint32_t    sprite0_hit;                /* scanline * 341 + dot of the predicted sprite 0 hit, UINT32_MAX if none, see PPU_schedule_sprite0() */
+
+    uint16_t    scanline, dot;              /* Current scanline (0-261) and dot (0-340) */
+    uint64_t    frame;                      /* Number of frames completed since power on */
+    bool        frame_complete;             /* Set when the pre-render scanline wraps around */
+    bool        skip_render;                /* Frame nobody looks at, timing and flags only, no pixels, see PPU_drawing() */
+
+    /* Kept last so save states can stop copying before them: the sprite lists and the picture */
+    nes_ppu_sprites * sprites;
+    uint8_t   * screen_buffer;              /* 240 rows of PPU_SCREEN_STRIDE palette indices (NES_palette, see PPU_colour()), NULL if headless */
+}
+_nes_ppu;
+
+/* Bytes of _nes_ppu save states keep, up to the last field before the sprite lists but not the padding after it */
+#define NES_PPU_STATE_SIZE  (offsetof(_nes_ppu, skip_render) + sizeof(bool))
+
+/* 
+NES PPU bus (from https://wiki.nesdev.com/w/index.php/PPU_memory_map)
+
+Address range   Size    Device
+
+$0000-$0FFF 	$1000 	Pattern table 0
+$1000-$1FFF 	$1000 	Pattern table 1
+$2000-$23FF 	$0400 	Nametable 0
+$2400-$27FF 	$0400 	Nametable 1
+$2800-$2BFF 	$0400 	Nametable 2
+$2C00-$2FFF 	$0400 	Nametable 3
+$3000-$3EFF 	$0F00 	Mirrors of $2000-$2EFF
+$3F00-$3F1F 	$0020 	Palette RAM indexes ($3F00-$3F0F is background pallete, 
+                                             $3F10-$3F1F is foreground pallete)
+$3F20-$3FFF 	$00E0 	Mirrors of $3F00-$3F1F
+
+The machine only holds the memory behind it, PPU_page maps the address space onto that.
+*/
+typedef struct _nes_ppu_bus
+{
+    uint8_t chr_ram[0x2000];    /* Pattern tables, CHR-ROM isn't loaded yet so every cartridge gets CHR-RAM */
+    uint8_t vram[0x800];        /* The console's 2 KiB of nametables, four-screen cartridges bring the rest */
+    uint8_t palette[0x20];      /* $3F00-$3F1F, mirrored up to $3FFF */
+    /* 
+    To save on pins, the lower 8 pins of AB were multiplexed with the DB, not so with this emulator.
+    The lower 8 bits of the Address bus are stored somewhere before the data bus is written to, so
+    the multiplexing ion this case is unnecessary
+    */
+    uint16_t    AB;         /* Address, data bus */ 
+    uint8_t     DB;
+    bool        RW;         /* Flags to indicate read or write */
+}
+_nes_ppu_bus;
+
+/*
+PRG-ROM as read from a ROM file. It is never written, so every machine that loads the same bytes
+shares one image and a batch of thousands of machines running a game holds it once. Images are
+found through a list of all of them kept by nes_rom_share(), the last machine to release one
+frees it.
+*/
+typedef struct nes_rom_image
+{
+    struct nes_rom_image * next;
+    size_t  refs;               /* Machines holding it */
+    size_t  size;
+    uint8_t data[];
+}
+nes_rom_image;
+
+/* NES Cartridge data */
+typedef struct _nes_cartridge
+{
+    size_t  CHR_ROM_size,
+            PRG_ROM_size;
+
+    /* PRG-ROM, read-only as every machine running the same ROM shares it, NULL if none is loaded */
+    const uint8_t * PRG_ROM;
+    nes_rom_image * image;
+
+    /* The 2 KiB of extra nametables on four-screen boards, NULL on the others, see nes_ppu_mirror() */
+    uint8_t * four_screen;
+}
+_nes_cartridge;
+
+/* Standard controllers on $4016/$4017 (see nes_controller.h) */
+typedef struct _nes_controllers
+{
+    uint8_t shift[2];       /* Buttons not read out yet, next one in bit 0 */
+    bool    strobe;         /* While set, the shift registers keep reloading from the pads */
+}
+_nes_controllers;
+
+/* Volume envelope of the pulse and noise channels */
+typedef struct _nes_apu_envelope
+{
+    uint8_t volume;         /* Constant volume, or the envelope's period */
+    uint8_t decay;          /* Envelope level, 15 down to 0 */
+    uint8_t divider;
+    bool    start,          /* Restart on the next quarter frame */
+            loop,           /* Also halts the length counter */
+            constant;
+}
+_nes_apu_envelope;
+
+typedef struct _nes_apu_pulse
+{
+    _nes_apu_envelope envelope;
+
+    uint8_t     duty, step;
+    uint16_t    period;     /* 11-bit timer reload */
+    uint32_t    timer;      /* CPU cycles until the next sequencer step */
+    uint8_t     length;
+
+    bool        sweep_enabled, sweep_negate, sweep_reload;
+    uint8_t     sweep_period, sweep_shift, sweep_divider;
+
+    uint8_t     output;     /* Level last sent to the mixer */
+}
+_nes_apu_pulse;
+
+typedef struct _nes_apu_triangle
+{
+    uint8_t     step;
+    uint16_t    period;
+    uint32_t    timer;
+    uint8_t     length;
+
+    bool        control;    /* Halts the length counter, keeps the linear counter reloading */
+    bool        linear_reload;
+    uint8_t     linear, linear_period;
+
+    uint8_t     output;
+}
+_nes_apu_triangle;
+
+typedef struct _nes_apu_noise
+{
+    _nes_apu_envelope envelope;
+
+    bool        mode;       /* Short, 93-step sequence */
+    uint16_t    shift;      /* 15-bit LFSR */
+    uint16_t    period;
+    uint32_t    timer;
+    uint8_t     length;
+
+    uint8_t     output;
+}
+_nes_apu_noise;
+
+typedef struct _nes_apu_dmc
+{
+    bool        irq_enabled, loop, irq;
+    uint16_t    period;
+    uint32_t    timer;
+
+    uint16_t    sample_addr, sample_length;
+    uint16_t    addr, remaining;    /* Sample bytes left to fetch */
+
+    uint8_t     buffer, shift, bits;
+    bool        buffer_full, silence;
+
+    uint8_t     output;     /* 7-bit output level, set directly by $4011 */
+}
+_nes_apu_dmc;
+
+/* 2A03 APU, see nes_apu.h */
+typedef struct _nes_apu
+{
+    _nes_apu_pulse      pulse[2];
+    _nes_apu_triangle   triangle;
+    _nes_apu_noise      noise;
+    _nes_apu_dmc        dmc;
+
+    uint8_t     enabled;            /* $4015 channel enables */
+
+    bool        frame_mode;         /* 5-step sequence */
+    bool        frame_irq_inhibit, frame_irq;
+    uint8_t     frame_step;
+    int32_t     frame_cycle;        /* CPU cycles since the frame counter was reset */
+
+    uint64_t    cycle;              /* Total_Cycles the APU has been run up to */
+    uint64_t    frame_start;        /* Total_Cycles at the start of the current audio frame */
+}
+_nes_apu;
+
+/* Where the APU's samples go, not part of save states */
+typedef struct _nes_audio
+{
+    nes_blip              * blip;   /* NULL on headless machines, see nes_machine_headless() */
+    struct nes_audio_ring * ring;   /* NULL to throw samples away */
+    bool                    mute;   /* No output at all, for frames that get rolled back */
+}
+_nes_audio;
+
+/* One instruction out of the predecode cache, see nes_cpu_decode() */
+typedef struct nes_cpu_decoded
+{
+    void     (*execute)(const struct nes_cpu_decoded * insn);   /* Addressing mode and instruction, NULL until decoded */
+    uint16_t operand;       /* The two bytes after the opcode, whatever the addressing mode uses */
+    uint8_t  opcode;
+    uint8_t  mode;          /* nes_cpu_addr_modes */
+    uint8_t  cycles;        /* Base cycles, without page crossings and taken branches */
+    bool     idle;          /* Top of a loop that only reads memory, see cpu_skip_idle() */
+}
+nes_cpu_decoded;
+
+/* One NES, see nes_machine_create() */
+typedef struct nes_machine
+{
+    _6502_cpu_bus        cpu_bus;
+    _6502_cpu_mem        cpu_mem;
+    _6502_cpu_registers  cpu_registers;
+
+    _nes_cartridge       cartridge;
+
+    _nes_ppu_bus         ppu_bus;
+    _nes_ppu             ppu;
+
+    _nes_controllers     controllers;
+
+    _nes_apu             apu;
+    _nes_audio           audio;
+
+    nes_sched            sched;
+
+    /* Program Counter Offset, how much to increment it by after using the appropriate addressing mode */
+    int8_t  PC_offset;
+
+    /* Current addressing mode */
+    uint8_t current_addr_mode;
+
+    /* Break flag (just give up and die when you hit a BRK) */
+    bool    Break_and_die;
+
+    /* Function pointers to select method of memory access, set by the mapper */
+    uint8_t (*PEEK_MAPPER)(uint16_t);
+    void    (*POKE_MAPPER)(uint16_t, uint8_t);
+
+    /* Called at NES_EVENT_MAPPER, for mappers that count cycles or scanlines, may be NULL */
+    void    (*MAPPER_EVENT)(void);
+
+    /* Host memory behind each 256 byte page of the CPU address space, NULL where the mapper has to
+       handle the access (registers, unmapped space), see nes_cpu_map() */
+    uint8_t * cpu_read_page[256];
+
+    /* CPU pages (bit n % 8 of byte n / 8) whose writes land in cpu_read_page's memory too, the
+       mapper handles writes to the others (ROM, RAM holding code), see nes_cpu_writable() */
+    uint8_t cpu_writable[32];
+
+    /* Instructions decoded so far by CPU page (256 entries), an entry is NULL until code runs from
+       it, see nes_cpu_decode() */
+    nes_cpu_decoded ** decoded;
+    nes_cpu_decoded    decode_scratch;  /* For code the cache can't hold */
+
+    /* CPU pages (bit n % 8 of byte n / 8) read by loops decoded as idle, remapping one of them
+       sends those loops back through cpu_idle_loop(), see nes_cpu_forget_code() */
+    uint8_t idle_polled[32];
+
+    /* Internal RAM pages (bit n for $n00-$nFF) holding decoded or translated code, unmapped for
+       writing while they do so POKE() sees the code change, see nes_cpu_watch_code() */
+    uint8_t code_pages;
+    uint8_t code_rewrites[8];           /* Times the code in each was overwritten */
+
+    /* Translated code, NULL unless the JIT was enabled for this machine (see nes_jit.h) */
+    struct nes_jit * jit;
+
+    /* Guest profile, NULL unless profiling (see nes_profile.h) */
+    struct nes_profile * profile;
+
+    /* Code/data log, NULL unless recording one (see nes_coverage.h) */
+    struct nes_coverage * coverage;
+
+    /* Render thread, NULL while the PPU draws its own scanlines (see nes_render.h) */
+    struct nes_render * render;
+
+#ifdef NES_COVERAGE
+    /* Coverage bytes behind each 256 byte page of the CPU address space, cdl_sink while not recording */
+    uint8_t * cdl_page[256];
+    uint8_t   cdl_sink[0x100];
+#endif
+
+    /* Buttons held on controller 1 and 2, set by the frontend before each frame (bit 0 = A ... bit 7 = Right) */
+    uint8_t pad[2];
+}
+nes_machine;
+
+/* The machine the calling thread is emulating */
+extern _Thread_local nes_machine * nes_current;
+
+nes_machine * nes_machine_create(void);
+void nes_machine_destroy(nes_machine * machine);
+void nes_machine_bind(nes_machine * machine);
+void nes_machine_headless(void);
+void nes_cpu_map(uint16_t addr, size_t size, uint8_t * mem, bool writable);
+void nes_ppu_map(uint16_t addr, size_t size, uint8_t * mem);
+void nes_ppu_mirror(nes_mirroring mirroring);
+void nes_ppu_relink(void);
+nes_rom_image * nes_rom_share(FILE * rom, size_t size);
+void nes_rom_release(nes_rom_image * image);
@@ -0,0 +1,302 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "nes_cpu.h"
+#include "nes_hash.h"
+#include "nes_movie.h"
+
+#define NES_MOVIE_HEADER_SIZE 32
+
+static void movie_put_u32(uint8_t * p, uint32_t v)
+{
+    for (int i = 0; i < 4; i++)
+        p[i] = (uint8_t)(v >> (i * 8));
+}
+
+static void movie_put_u64(uint8_t * p, uint64_t v)
+{
+    for (int i = 0; i < 8; i++)
+        p[i] = (uint8_t)(v >> (i * 8));
+}
+
+static uint32_t movie_get_u32(const uint8_t * p)
+{
+    return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static uint64_t movie_get_u64(const uint8_t * p)
+{
+    return (uint64_t)movie_get_u32(p) | (uint64_t)movie_get_u32(p + 4) << 32;
+}
+
+/* nes_hash() of a whole file */
+int nes_movie_rom_hash(const char * rom, uint64_t * hash)
+{
+    FILE * file = fopen(rom, "rb");
+    if (file == NULL)
+    {
+        fprintf(stderr, "error: failed to open %s for reading: %s\n", rom, strerror(errno));
+        return -1;
+    }
+
+    nes_hash_state state;
+    uint8_t buffer[4096];
+    size_t size;
+
+    nes_hash_init(&state, 0);
+    while ((size = fread(buffer, 1, sizeof(buffer), file)) > 0)
+        nes_hash_update(&state, buffer, size);
+
+    fclose(file);
+    *hash = nes_hash_final(&state);
+
+    return 0;
+}
+
+/*
+    Hash of everything a save state holds on the bound machine, except the pointers at the
+    start of _nes_ppu, which differ between machines
+*/
+uint64_t nes_movie_state_hash(void)
+{
+    const _6502_cpu_registers * r = &nes_current->cpu_registers;
+    const uint8_t * ppu = (const uint8_t *)&nes_current->ppu;
+    nes_hash_state state;
+
+    uint8_t registers[] =
+    {
+        r->A, r->X, r->Y, r->SP, nes_cpu_status(r),
+        (uint8_t)r->PC, (uint8_t)(r->PC >> 8), (uint8_t)r->Cycles, (uint8_t)(r->Cycles >> 8),
+        nes_current->controllers.shift[0], nes_current->controllers.shift[1], nes_current->controllers.strobe
+    };
+
+    nes_hash_init(&state, 0);
+    nes_hash_update(&state, registers, sizeof(registers));
+    nes_hash_update(&state, &nes_current->cpu_mem, sizeof(nes_current->cpu_mem));
+    nes_hash_update(&state, &nes_current->ppu_bus, offsetof(_nes_ppu_bus, AB));
+    if (nes_current->cartridge.four_screen != NULL)
+        nes_hash_update(&state, nes_current->cartridge.four_screen, 0x800);
+    nes_hash_update(&state, ppu + offsetof(_nes_ppu, v), NES_PPU_STATE_SIZE - offsetof(_nes_ppu, v));
+
+    return nes_hash_final(&state);
+}
+
+/* Start recording on the bound machine, which must have just loaded 'rom' */
+nes_movie * nes_movie_create(const char * rom)
+{
+    nes_movie * movie = calloc(1, sizeof(nes_movie));
+    if (movie == NULL)
+        return NULL;
+
+    if (nes_movie_rom_hash(rom, &movie->rom_hash) != 0)
+    {
+        free(movie);
+        return NULL;
+    }
+
+    movie->state_hash = nes_movie_state_hash();
+
+    return movie;
+}
+
+/* Append the pads of the bound machine as the next frame */
+void nes_movie_record_frame(nes_movie * movie)
+{
+    const uint8_t * pad = nes_current->pad;
+    nes_movie_run * last = movie->run_count ? &movie->runs[movie->run_count - 1] : NULL;
+
+    movie->frames++;
+
+    if (last != NULL && last->pad[0] == pad[0] && last->pad[1] == pad[1] && last->length < UINT32_MAX)
+    {
+        last->length++;
+        return;
+    }
+
+    if (movie->run_count == movie->run_capacity)
+    {
+        movie->run_capacity = movie->run_capacity ? movie->run_capacity * 2 : 256;
+        movie->runs = realloc(movie->runs, movie->run_capacity * sizeof(nes_movie_run));
+    }
+
+    movie->runs[movie->run_count++] = (nes_movie_run){ 1, { pad[0], pad[1] } };
+}
+
+int nes_movie_save(const nes_movie * movie, const char * path)
+{
+    FILE * file = fopen(path, "wb");
+    if (file == NULL)
+    {
+        fprintf(stderr, "error: failed to open %s for writing: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    uint8_t header[NES_MOVIE_HEADER_SIZE] = { 'N', 'E', 'S', 'M', NES_MOVIE_VERSION, 2, 0, 0 };
+
+    movie_put_u64(&header[8], movie->rom_hash);
+    movie_put_u64(&header[16], movie->state_hash);
+    movie_put_u32(&header[24], movie->frames);
+    movie_put_u32(&header[28], (uint32_t)movie->run_count);
+    fwrite(header, 1, sizeof(header), file);
+
+    for (size_t i = 0; i < movie->run_count; i++)
+    {
+        uint8_t run[7];
+        size_t size = 0;
+        uint32_t length = movie->runs[i].length;
+
+        /* LEB128, 7 bits at a time, high bit set while more follow */
+        do
+        {
+            run[size++] = (length & 0x7F) | (length > 0x7F ? 0x80 : 0);
+            length >>= 7;
+        }
+        while (length);
+
+        run[size++] = movie->runs[i].pad[0];
+        run[size++] = movie->runs[i].pad[1];
+        fwrite(run, 1, size, file);
+    }
+
+    if (fclose(file) != 0)
+    {
+        fprintf(stderr, "error: failed to write %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+nes_movie * nes_movie_load(const char * path)
+{
+    FILE * file = fopen(path, "rb");
+    if (file == NULL)
+    {
+        fprintf(stderr, "error: failed to open %s for reading: %s\n", path, strerror(errno));
+        return NULL;
+    }
+
+    uint8_t header[NES_MOVIE_HEADER_SIZE];
+    nes_movie * movie = NULL;
+
+    if (fread(header, 1, sizeof(header), file) != sizeof(header) || memcmp(header, "NESM", 4) != 0)
+    {
+        fprintf(stderr, "error: %s is not a movie\n", path);
+        goto fail;
+    }
+
+    if (header[4] != NES_MOVIE_VERSION || header[5] != 2)
+    {
+        fprintf(stderr, "error: %s is a version %u movie with %u ports, only version %u with 2 ports is supported\n",
+            path, header[4], header[5], NES_MOVIE_VERSION);
+        goto fail;
+    }
+
+    movie = calloc(1, sizeof(nes_movie));
+    if (movie == NULL)
+        goto fail;
+
+    movie->rom_hash     = movie_get_u64(&header[8]);
+    movie->state_hash   = movie_get_u64(&header[16]);
+    movie->run_count    = movie_get_u32(&header[28]);
+    movie->run_capacity = movie->run_count;
+    movie->runs         = malloc((movie->run_count ? movie->run_count : 1) * sizeof(nes_movie_run));
+
+    uint32_t frames = movie_get_u32(&header[24]);
+
+    for (size_t i = 0; i < movie->run_count; i++)
+    {
+        uint32_t length = 0;
+        int c, shift = 0;
+
+        do
+        {
+            if ((c = fgetc(file)) == EOF || shift > 28)
+                goto truncated;
+
+            length |= (uint32_t)(c & 0x7F) << shift;
+            shift  += 7;
+        }
+        while (c & 0x80);
+
+        int pad1 = fgetc(file), pad2 = fgetc(file);
+        if (pad2 == EOF)
+            goto truncated;
+
+        movie->runs[i] = (nes_movie_run){ length, { (uint8_t)pad1, (uint8_t)pad2 } };
+        movie->frames += length;
+    }
+
+    if (movie->frames != frames)
+    {
+        fprintf(stderr, "error: %s has %u frames in its runs but %u in its header\n", path, movie->frames, frames);
+        goto fail;
+    }
+
+    fclose(file);
+    return movie;
+
+truncated:
+    fprintf(stderr, "error: %s is truncated\n", path);
+fail:
+    nes_movie_destroy(movie);
+    fclose(file);
+    return NULL;
+}
+
+/* Make sure the bound machine, which must have just loaded 'rom', is where the movie starts */
+int nes_movie_check(const nes_movie * movie, const char * rom)
+{
+    uint64_t rom_hash;
+
+    if (nes_movie_rom_hash(rom, &rom_hash) != 0)
+        return -1;
+
+    if (rom_hash != movie->rom_hash)
+    {
+        fprintf(stderr, "error: the movie was recorded on a different ROM than %s\n", rom);
+        return -1;
+    }
+
+    if (nes_movie_state_hash() != movie->state_hash)
+    {
+        fprintf(stderr, "error: the movie starts from a different machine state, it would desync\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Set the pads of the bound machine for the next frame, false (and no buttons) once the movie is over */
+bool nes_movie_play_frame(nes_movie * movie)
+{
+    while (movie->run < movie->run_count && movie->run_frame == movie->runs[movie->run].length)
+    {
+        movie->run++;
+        movie->run_frame = 0;
+    }
+
+    if (movie->run == movie->run_count)
+    {
+        nes_current->pad[0] = 0;
+        nes_current->pad[1] = 0;
+        return false;
+    }
+
+    nes_current->pad[0] = movie->runs[movie->run].pad[0];
+    nes_current->pad[1] = movie->runs[movie->run].pad[1];
+    movie->run_frame++;
+
+    return true;
+}
+
+void nes_movie_destroy(nes_movie * movie)
+{
+    if (movie == NULL)
+        return;
+
+    free(movie->runs);
+    free(movie);
+}
@@ -0,0 +1,70 @@
+#pragma once
+
+/*
+    nes_movie.h: Input movies, recorded and played back frame by frame
+
+    A movie is the state of both pads for every frame since power-on, so replaying it on the
+    same ROM reproduces a run exactly. That is what drives headless benchmarks and regression
+    runs (nesfarm) with real gameplay.
+
+    File format, all integers little-endian:
+
+        0   "NESM"
+        4   u8  version (1)
+        5   u8  ports (2)
+        6   u16 reserved (0)
+        8   u64 ROM hash, nes_hash() of the whole ROM file
+        16  u64 initial state hash, see nes_movie_state_hash()
+        24  u32 frames
+        28  u32 runs
+        32  runs: LEB128 frame count, pad 1, pad 2
+
+    Pads hold still for long stretches, so run-length encoding keeps an hour of play in a few KiB.
+
+    Recording: nes_movie_create() right after loading the ROM, then nes_movie_record_frame()
+    once per frame after setting the pads, then nes_movie_save().
+    Playback: nes_movie_load(), nes_movie_check() right after loading the ROM, then
+    nes_movie_play_frame() before every frame.
+*/
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define NES_MOVIE_VERSION 1
+
+/* 'length' frames with the same pads */
+typedef struct nes_movie_run
+{
+    uint32_t    length;
+    uint8_t     pad[2];
+}
+nes_movie_run;
+
+typedef struct nes_movie
+{
+    uint64_t        rom_hash;
+    uint64_t        state_hash;
+    uint32_t        frames;
+
+    nes_movie_run * runs;
+    size_t          run_count, run_capacity;
+
+    /* Playback position */
+    size_t          run;
+    uint32_t        run_frame;
+}
+nes_movie;
+
+int nes_movie_rom_hash(const char * rom, uint64_t * hash);
+uint64_t nes_movie_state_hash(void);
+
+nes_movie * nes_movie_create(const char * rom);
+void nes_movie_record_frame(nes_movie * movie);
+int nes_movie_save(const nes_movie * movie, const char * path);
+
+nes_movie * nes_movie_load(const char * path);
+int nes_movie_check(const nes_movie * movie, const char * rom);
+bool nes_movie_play_frame(nes_movie * movie);
+
+void nes_movie_destroy(nes_movie * movie);
@@ -9,6 +9,19 @@
     https://wiki.nesdev.com/w/index.php/PPU_programmer_reference
 */
 
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "nes_machine.h"
+#include "nes_render.h"
+#include "nes_sched.h"
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define NES_PPU_SSE2
+#endif
+
 /* 
     Standard color pallete of the NES, encoded as 32-bit hex values 0x00RRGGBB
 
@@ -19,7 +32,7 @@
     on the screen at one time (under normal circumstances)."
 
 */
-const uint32_t NES_palette[64] = {
+static const uint32_t NES_palette[64] = {
     0x007C7C7C,
     0x000000FC,
     0x000000BC,
@@ -89,6 +102,35 @@ const uint32_t NES_palette[64] = {
     0x00000000
 };
 
+/*
+The PPU doesn't put out RGB but a palette index per pixel, and PPUMASK's colour emphasis bits
+tint the whole picture. screen_buffer keeps it that way, 6-bit indices with each row's emphasis
+bits at PPU_SCREEN_EMPHASIS, so it's a quarter of the size and the frontend looks the colours
+up on the GPU. This is the colour of index + 64 * emphasis (red, green, blue from bit 0 up), the
+emphasized channels are kept and the others darkened.
+*/
+static inline uint32_t PPU_colour(uint16_t index)
+{
+    uint32_t colour   = NES_palette[index & 0x3F];
+    uint8_t  emphasis = (index >> 6) & 0x07;
+    uint32_t result   = 0;
+
+    if (emphasis == 0)
+        return colour;
+
+    for (int channel = 0; channel < 3; channel++)
+    {
+        uint32_t level = (colour >> (16 - channel * 8)) & 0xFF;
+
+        if (!(emphasis & (1 << channel)))
+            level = level * 209 / 256;
+
+        result |= level << (16 - channel * 8);
+    }
+
+    return result;
+}
+
 /*
 Enum of PPU registers (as an index)
 
@@ -118,160 +160,132 @@ typedef enum PPU_REGS
 }
 PPU_REGS;
 
-/* PPU implementation */
-typedef struct _nes_ppu
-{
-    uint8_t * PPU_Nametable[4];             /* Pointers to the 4 nametables */
-    uint8_t * PPU_Attribtable[4];           /* Pointers to the 4 attribute tables ($40 in size) */    
-    uint8_t * PPU_Pallete_Data[2];          /* Pointer to PPU pallete data (0 -> BG, 1-> FG) */
-    
-    union 
-    {
-        uint8_t     * PPU_OAM_bytes[2];     /* OAM access via row data (4*8 = 32 bits) or byte stream */
-        uint32_t    * PPU_OAM_row[2];
-    }
-
-    uint32_t    screen_buffer[340 * 260];   /* All of the on-screen buffer, only visible portion is drawn in SDL */
-    uint16_t    v, h;                       /* Indices for the screen */
-
-    uint8_t PPU_registers[9];               /* Registers of the PPU */
-    bool    clear_vblank,                   /* Flag to set/clear vblank bit on next tick */
-            set_scroll_addr_latch,          /* Flags to set address latch for PPUSCROLL and PPUADDR */
-            set_PPU_addr_latch;
+/*
+The PPU's address space goes through PPU_page, one pointer per KiB: 8 pages of pattern tables
+(CHR banks, see nes_ppu_map()), then the four nametable slots, twice over (see
+nes_ppu_mirror()). Only the palette, mirrored every 32 bytes over the last 256 bytes, is kept
+apart. Its $3F10/$3F14/$3F18/$3F1C are the same bytes as $3F00/$3F04/$3F08/$3F0C, so a write to
+$3F10 sets the backdrop colour.
+*/
 
-    uint16_t scroll_addr;                   /* Address for PPUSCROLL */
+/* Index into ppu_bus.palette of palette address 'addr' ($3F00-$3FFF) */
+static inline uint8_t PPU_palette_index(uint16_t addr)
+{
+    return (addr & 0x13) == 0x10 ? addr & 0x0F : addr & 0x1F;
 }
-_nes_ppu;
-_nes_ppu nes_ppu;
 
-/* 
-NES PPU bus (from https://wiki.nesdev.com/w/index.php/PPU_memory_map)
-
-Address range   Size    Device
-
-$0000-$0FFF 	$1000 	Pattern table 0
-$1000-$1FFF 	$1000 	Pattern table 1
-$2000-$23FF 	$0400 	Nametable 0
-$2400-$27FF 	$0400 	Nametable 1
-$2800-$2BFF 	$0400 	Nametable 2
-$2C00-$2FFF 	$0400 	Nametable 3
-$3000-$3EFF 	$0F00 	Mirrors of $2000-$2EFF
-$3F00-$3F1F 	$0020 	Palette RAM indexes ($3F00-$3F0F is background pallete, 
-                                             $3F10-$3F1F is foreground pallete)
-$3F20-$3FFF 	$00E0 	Mirrors of $3F00-$3F1F
-*/
-typedef struct _nes_ppu_bus
-{
-    uint8_t mem[0x4000];
-    /* 
-    To save on pins, the lower 8 pins of AB were multiplexed with the DB, not so with this emulator.
-    The lower 8 bits of the Address bus are stored somewhere before the data bus is written to, so
-    the multiplexing ion this case is unnecessary
-    */
-    uint16_t    AB;         /* Address, data bus */ 
-    uint8_t     DB;
-    bool        RW;         /* Flags to indicate read or write */
-}
-_nes_ppu_bus;
-_nes_ppu_bus nes_ppu_bus;
-
-/* Read from PPU memory */
+/* Read from PPU memory at 'addr' (below $4000) */
 static inline uint8_t PPU_PEEK(uint16_t addr)
 {
-    /* Name table mirrors */
-    if (addr >= 0x2000 && addr < 0x3F00)
-        return nes_ppu_bus.mem[(addr & 0x0EFF) + 0x2000];
-    /* Pallete mirrors */
-    if (addr >= 0x3F00 && addr < 0x4000)
-        return nes_ppu_bus.mem[(addr & 0x1F) + 0x3F00];
-    return nes_ppu_bus.mem[addr];    
+    if (addr >= 0x3F00)
+        return nes_current->ppu_bus.palette[PPU_palette_index(addr)];
+
+    return nes_current->ppu.PPU_page[addr >> 10][addr & 0x3FF];
 }
 
-/* Write to PPU memory */
+/* Write to PPU memory at 'addr' (below $4000) */
 static inline void PPU_POKE(uint16_t addr, uint8_t data)
 {
-    /* Name table mirrors */
-    if (addr >= 0x2000 && addr < 0x3F00)
-        nes_ppu_bus.mem[(addr & 0x0EFF) + 0x2000] = data;
-    /* Pallete mirrors */
-    else if (addr >= 0x3F00 && addr < 0x4000)
-        nes_ppu_bus.mem[(addr & 0x1F) + 0x3F00] = data;
+    if (addr >= 0x3F00)
+        nes_current->ppu_bus.palette[PPU_palette_index(addr)] = data;
     else
-        nes_ppu_bus.mem[addr] = data;
-}
-
-/* All PPU reg operations */
-static inline void EXEC_PPUCTRL     (void);
-static inline void EXEC_PPUMASK     (void);
-static inline void EXEC_PPUSTATUS   (void);
-static inline void EXEC_OAMADDR     (void);
-static inline void EXEC_OAMDATA     (void);
-static inline void EXEC_PPUSCROLL   (void);
-static inline void EXEC_PPUADDR     (void);
-static inline void EXEC_PPUDATA     (void);
-static inline void EXEC_OAMDMA      (void);
-
-/* Function pointer to execute PPU reg operations */
-void (*REG_EXEC[9])(void) = {
-    EXEC_PPUCTRL,
-    EXEC_PPUMASK,
-    EXEC_PPUSTATUS,
-    EXEC_OAMADDR,
-    EXEC_OAMDATA,
-    EXEC_PPUSCROLL,
-    EXEC_PPUADDR,
-    EXEC_PPUDATA,
-    EXEC_OAMDMA
-};
+        nes_current->ppu.PPU_page[addr >> 10][addr & 0x3FF] = data;
+}
 
-/* 
-    Function to successfully use PPU registers within range $2000 to $2007 
+/* Init the PPU */
+static inline void ppu_init()
+{
+    /* Pattern tables in CHR-RAM at the bottom of the PPU bus, and the nametables (and attribute
+       tables) until the cartridge says how they are mirrored */
+    nes_ppu_map(0x0000, 0x2000, nes_current->ppu_bus.chr_ram);
+    nes_ppu_mirror(NES_MIRROR_HORIZONTAL);
 
-    RW = 0 -> Read mode
-    RW = 1 -> Write mode
+    /* Set pointers to OAM and secondary OAM, nothing has been evaluated from either */
+    nes_current->ppu.PPU_OAM_bytes[0] = nes_current->ppu.OAM;
+    nes_current->ppu.PPU_OAM_bytes[1] = nes_current->ppu.secondary_OAM;
+    nes_current->ppu.sprites_stale    = true;
+    nes_current->ppu.sprite0_hit      = UINT32_MAX;
 
-    Function list is encoded as a string, meaning if the index of the string
-    matches an 'x', the function pointer will execute the function 
-    corresponding to the index, and if '_' then do nothing
+    /* Set pointers to BG/FG pallete indexes */
+    nes_current->ppu.PPU_Pallete_Data[0] = &nes_current->ppu_bus.palette[0x00];
+    nes_current->ppu.PPU_Pallete_Data[1] = &nes_current->ppu_bus.palette[0x10];
+
+    /* Finally, set indices accordingly */
+    nes_current->ppu.scanline        = 0;
+    nes_current->ppu.dot             = 0;
+    nes_current->ppu.frame           = 0;
+    nes_current->ppu.frame_complete  = false;
+}
 
-    "__x_x__x" is all functions that read and "xx_xxxxx" is all functions 
-    that write
+/* Bytes PPUDATA moves the VRAM address by, PPUCTRL bit 2 */
+static inline uint16_t PPU_data_increment(void)
+{
+    return (nes_current->ppu.PPU_registers[PPUCTRL] & 0x04) ? 32 : 1;
+}
+
+/* Registers that can't be read return whatever was last on the register bus */
+static uint8_t PPU_READ_LATCH(void)
+{
+    return nes_current->ppu.io_latch;
+}
+
+/*
+PPUSTATUS: PPU status register (read)
+
+7  bit  0
+---- ----
+VSO. ....
+|||| ||||
+|||+-++++- Stale bits, whatever was last on the register bus
+||+------- Sprite overflow
+|+-------- Sprite 0 hit
++--------- Vertical blank has started, cleared by this read and the pre-render line
+
+Reading it also resets the PPUSCROLL/PPUADDR write pair.
 */
-static inline void USE_REGS(PPU_REGS reg, bool RW, uint8_t data)
+static uint8_t PPU_READ_PPUSTATUS(void)
 {
-    nes_ppu_bus.DB == data;
-    const char * function_list = (RW == 0) ? "__x_x__x" : "xx_xxxxx";
+    _nes_ppu * ppu = &nes_current->ppu;
+    uint8_t status = (ppu->PPU_registers[PPUSTATUS] & 0xE0) | (ppu->io_latch & 0x1F);
+
+    ppu->PPU_registers[PPUSTATUS] &= 0x7F;
+    ppu->w        = false;
+    ppu->io_latch = status;
 
-    if(function_list[reg] == 'x') 
-        (*REG_EXEC[reg])();
+    return status;
 }
 
-/* Init the PPU */
-static inline void ppu_init()
+static uint8_t PPU_READ_OAMDATA(void)
 {
-    /* Set pointers to each nametable */
-    nes_ppu.PPU_Nametable[0] = &nes_ppu_bus.mem[0x2000];
-    nes_ppu.PPU_Nametable[1] = &nes_ppu_bus.mem[0x2400];
-    nes_ppu.PPU_Nametable[2] = &nes_ppu_bus.mem[0x2800];
-    nes_ppu.PPU_Nametable[3] = &nes_ppu_bus.mem[0x2C00];
+    _nes_ppu * ppu = &nes_current->ppu;
 
-    /* Set pointers to each attribute tables */
-    nes_ppu.PPU_Attribtable[0] = &nes_ppu_bus.mem[0x23C0];
-    nes_ppu.PPU_Attribtable[1] = &nes_ppu_bus.mem[0x27C0];    
-    nes_ppu.PPU_Attribtable[2] = &nes_ppu_bus.mem[0x2BC0];
-    nes_ppu.PPU_Attribtable[3] = &nes_ppu_bus.mem[0x2FC0];
+    return ppu->io_latch = ppu->OAM[ppu->PPU_registers[OAMADDR]];
+}
 
-    /* Set pointers to pattern tables/OAM */
-    nes_ppu.PPU_OAM_bytes[0] = &nes_ppu_bus.mem[0x0000];
-    nes_ppu.PPU_OAM_bytes[1] = &nes_ppu_bus.mem[0x1000];
+/*
+PPUDATA reads below the palette come out of a buffer the read refills, so the first read after
+setting PPUADDR returns stale data. Palette reads are immediate, and refill the buffer with the
+nametable byte underneath.
+*/
+static uint8_t PPU_READ_PPUDATA(void)
+{
+    _nes_ppu * ppu = &nes_current->ppu;
+    uint16_t addr = ppu->v & 0x3FFF;
+    uint8_t data;
 
-    /* Set pointers to BG/FG pallete indexes */
-    nes_ppu.PPU_Pallete_Data[0] = &nes_ppu_bus.mem[0x3F00];
-    nes_ppu.PPU_Pallete_Data[1] = &nes_ppu_bus.mem[0x3F10];
+    if (addr < 0x3F00)
+    {
+        data = ppu->read_buffer;
+        ppu->read_buffer = PPU_PEEK(addr);
+    }
+    else
+    {
+        data = (PPU_PEEK(addr) & 0x3F) | (ppu->io_latch & 0xC0);
+        ppu->read_buffer = PPU_PEEK(addr - 0x1000);
+    }
 
-    /* Finally, set indices accordingly */
-    nes_ppu.v = 0;
-    nes_ppu.h = 0;
+    ppu->v = (ppu->v + PPU_data_increment()) & 0x7FFF;
+    return ppu->io_latch = data;
 }
 
 /*
@@ -294,10 +308,196 @@ VPHB SINN
 +--------- Generate an NMI at the start of the
            vertical blanking interval (0: off; 1: on)
 
+The nametable bits go to t, rendering picks them up from there.
 */
-static inline void EXEC_PPUCTRL(uint8_t data)
+/* PPU_tick() calls left before the one that sets vblank, a frame's worth if that was the last one */
+static inline uint32_t PPU_dots_to_vblank(void)
 {
-    nes_ppu.PPU_registers[PPUCTRL] = data;
+    const _nes_ppu * ppu = &nes_current->ppu;
+    uint32_t position = (uint32_t)ppu->scanline * 341 + ppu->dot;
+
+    if (position <= 241 * 341 + 1)
+        return 241 * 341 + 1 - position;
+
+    return 262 * 341 - (position - (241 * 341 + 1));
+}
+
+/*
+    Schedule NMI for the cycle the PPU enters vblank, if PPUCTRL enables it. The PPU has run up
+    to Total_Cycles, the dot that sets vblank is caught up with once the CPU passes it.
+*/
+static inline void PPU_schedule_nmi(void)
+{
+    if (nes_current->ppu.PPU_registers[PPUCTRL] & 0x80)
+        nes_sched_at(NES_EVENT_NMI, nes_current->cpu_registers.Total_Cycles + PPU_dots_to_vblank() / 3 + 1);
+    else
+        nes_sched_cancel(NES_EVENT_NMI);
+}
+
+/*
+Sprite 0 hit: PPUSTATUS bit 6 is set at the first dot where an opaque pixel of sprite 0 is drawn
+over an opaque background pixel, and stays set until the pre-render line. Rather than compare
+pixels as they are drawn, which a PPU that doesn't draw (see PPU_drawing()) never does, the dot is
+worked out from the pattern tables a line ahead, once sprite evaluation and the horizontal scroll
+copy at dot 257 have fixed what the next line shows, and put on the schedule (see nes_sched.h) as
+NES_EVENT_SPRITE0. sprite0_hit holds where it is predicted, UINT32_MAX while the event only marks
+the next line to look at. Anything that changes the picture of a line already looked at (PPUCTRL,
+PPUMASK, OAM, v or memory through PPUADDR and PPUDATA writes, CHR banks, mirroring) works it out
+again.
+
+Sprite priority and the colours don't matter, only opacity. There is no hit at x = 255, nor in
+the leftmost 8 pixels while PPUMASK clips either layer there.
+*/
+
+/* Opaque pixels of the background from screen x on for 8 pixels, pixel x in bit 7, on the line v is at */
+static inline uint8_t PPU_background_opacity(const _nes_ppu * ppu, uint8_t x)
+{
+    uint16_t fine    = ppu->x + x;
+    uint16_t pattern = (uint16_t)(ppu->PPU_registers[PPUCTRL] & 0x10) << 8 | ppu->v >> 12;
+    uint16_t pixels  = 0;
+
+    /* Two tiles, into the next nametable across past column 31 */
+    for (uint16_t tile = fine >> 3; tile <= (fine >> 3) + 1; tile++)
+    {
+        uint16_t column = (ppu->v & 0x001F) + tile;
+        uint16_t name   = 0x2000 | ((ppu->v ^ (column & 0x20) << 5) & 0x0C00) | (ppu->v & 0x03E0) | (column & 0x1F);
+        uint16_t row    = pattern | (uint16_t)PPU_PEEK(name) << 4;
+
+        pixels = (uint16_t)(pixels << 8) | PPU_PEEK(row) | PPU_PEEK(row + 8);
+    }
+
+    return (uint8_t)(pixels << (fine & 7) >> 8);
+}
+
+/* Dot of sprite 0's hit on 'line', which v is set up for, 0 if there is none */
+static inline uint16_t PPU_sprite0_dot(const _nes_ppu * ppu, uint16_t line)
+{
+    const uint8_t * sprite = ppu->OAM;
+    uint8_t height = (ppu->PPU_registers[PPUCTRL] & 0x20) ? 16 : 8;
+    uint16_t row   = line - 1 - sprite[0];
+    uint16_t pattern;
+
+    if (line - 1 < sprite[0] || row >= height)
+        return 0;
+
+    if (sprite[2] & 0x80)
+        row = height - 1 - row;
+
+    /* 8x16 sprites take the table from bit 0 of the tile, and the tile below it for their lower half */
+    if (height == 16)
+        pattern = (uint16_t)(sprite[1] & 0x01) << 12 | (uint16_t)(sprite[1] & 0xFE) << 4 | (row & 0x08) << 1 | (row & 0x07);
+    else
+        pattern = (uint16_t)(ppu->PPU_registers[PPUCTRL] & 0x08) << 9 | (uint16_t)sprite[1] << 4 | row;
+
+    uint8_t pixels = PPU_PEEK(pattern) | PPU_PEEK(pattern + 8);
+
+    if (sprite[2] & 0x40)
+    {
+        pixels = (uint8_t)((pixels & 0xF0) >> 4 | (pixels & 0x0F) << 4);
+        pixels = (uint8_t)((pixels & 0xCC) >> 2 | (pixels & 0x33) << 2);
+        pixels = (uint8_t)((pixels & 0xAA) >> 1 | (pixels & 0x55) << 1);
+    }
+
+    pixels &= PPU_background_opacity(ppu, sprite[3]);
+
+    if (sprite[3] > 247)
+        pixels &= (uint8_t)(0xFF << (sprite[3] - 247));
+    if (sprite[3] < 8 && (ppu->PPU_registers[PPUMASK] & 0x06) != 0x06)
+        pixels &= (uint8_t)(0xFF >> (8 - sprite[3]));
+
+    return pixels ? (uint16_t)(sprite[3] + __builtin_clz(pixels) - 24 + 1) : 0;
+}
+
+/*
+    Schedule NES_EVENT_SPRITE0 for sprite 0's hit on the line the PPU looks at next, if it has
+    one, or else for dot 258 of the line before the next one it could hit on. The PPU has run up
+    to Total_Cycles, so this isn't for PPU_tick().
+*/
+static inline void PPU_schedule_sprite0(void)
+{
+    _nes_ppu * ppu  = &nes_current->ppu;
+    uint16_t top    = ppu->OAM[0] + 1;
+    uint16_t bottom = ppu->OAM[0] + ((ppu->PPU_registers[PPUCTRL] & 0x20) ? 16 : 8);
+    uint32_t position = (uint32_t)ppu->scanline * 341 + ppu->dot;
+    uint32_t target;
+
+    ppu->sprite0_hit = UINT32_MAX;
+
+    if ((ppu->PPU_registers[PPUMASK] & 0x18) != 0x18 || top > 239)
+    {
+        nes_sched_cancel(NES_EVENT_SPRITE0);
+        return;
+    }
+
+    /* v moves on to the next line at dot 257 */
+    uint16_t line = ppu->scanline + (ppu->dot > 257);
+
+    if (bottom > 239)
+        bottom = 239;
+
+    if ((ppu->PPU_registers[PPUSTATUS] & 0x40) || line > bottom)
+        target = (262 + top - 1) * 341 + 258;
+    else if (line < top)
+        target = (top - 1) * 341 + 258;
+    else
+    {
+        uint16_t dot = PPU_sprite0_dot(ppu, line);
+
+        if (dot != 0 && (uint32_t)line * 341 + dot > position)
+            target = ppu->sprite0_hit = (uint32_t)line * 341 + dot;
+        else if (line < bottom)
+            target = (uint32_t)line * 341 + 258;
+        else
+            target = (262 + top - 1) * 341 + 258;
+    }
+
+    nes_sched_at(NES_EVENT_SPRITE0, nes_current->cpu_registers.Total_Cycles + (target - position) / 3 + 1);
+}
+
+/*
+    v, the pattern tables or the nametables changed. Only while the PPU is on a visible line with
+    rendering enabled can that be under sprite 0 before the event looks again, the uploads of
+    vblank and of a blank screen leave the schedule alone.
+*/
+static inline void PPU_sprite0_changed(void)
+{
+    const _nes_ppu * ppu = &nes_current->ppu;
+
+    if (ppu->scanline < 240 && (ppu->PPU_registers[PPUMASK] & 0x18) == 0x18)
+        PPU_schedule_sprite0();
+}
+
+/* NES_EVENT_SPRITE0 is due: the predicted hit has happened, or the next line can be looked at */
+static inline void PPU_sprite0_event(void)
+{
+    _nes_ppu * ppu = &nes_current->ppu;
+
+    if ((uint32_t)ppu->scanline * 341 + ppu->dot >= ppu->sprite0_hit)
+        ppu->PPU_registers[PPUSTATUS] |= 0x40;
+
+    PPU_schedule_sprite0();
+}
+
+static void PPU_WRITE_PPUCTRL(uint8_t data)
+{
+    _nes_ppu * ppu = &nes_current->ppu;
+    bool enabled = ppu->PPU_registers[PPUCTRL] & 0x80;
+
+    /* Sprites have a different height on every line */
+    if ((ppu->PPU_registers[PPUCTRL] ^ data) & 0x20)
+        ppu->sprites_stale = true;
+
+    ppu->PPU_registers[PPUCTRL] = data;
+    ppu->t = (ppu->t & ~0x0C00) | ((uint16_t)(data & 0x03) << 10);
+
+    /* Enabling NMI during vblank raises it right away */
+    if (!enabled && (data & 0x80) && (ppu->PPU_registers[PPUSTATUS] & 0x80))
+        nes_sched_at(NES_EVENT_NMI, nes_current->cpu_registers.Total_Cycles);
+    else
+        PPU_schedule_nmi();
+
+    /* Pattern tables and sprite size */
+    PPU_schedule_sprite0();
 }
 
 /*
@@ -316,70 +516,317 @@ BGRs bMmG
 |+-------- Emphasize green
 +--------- Emphasize blue
 */
-static inline void EXEC_PPUMASK()
+static void PPU_WRITE_PPUMASK(uint8_t data)
+{
+    nes_current->ppu.PPU_registers[PPUMASK] = data;
+    PPU_schedule_sprite0();
+}
+
+/* PPUSTATUS is read-only, the write only reaches the bus */
+static void PPU_WRITE_LATCH(uint8_t data)
 {
-    nes_ppu.PPU_registers[PPUMASK] = data;
+    (void)data;
 }
 
-/* */ 
-static inline void EXEC_PPUSTATUS()
+static void PPU_WRITE_OAMADDR(uint8_t data)
 {
-    nes_ppu.clear_vblank        = 1;   /* Clear vblank bit on next tick */
-    nes_ppu.scroll_addr         = 0x0; /* Clear address latches and flags */
-    nes_ppu_bus.AB              = 0x0;
-    nes_ppu.set_addr_latch      = false;
-    nes_ppu.set_PPU_addr_latch  = false;
+    nes_current->ppu.PPU_registers[OAMADDR] = data;
 }
 
-static inline void EXEC_OAMADDR()
+static void PPU_WRITE_OAMDATA(uint8_t data)
 {
+    _nes_ppu * ppu = &nes_current->ppu;
 
+    uint8_t addr = ppu->PPU_registers[OAMADDR]++;
+
+    ppu->OAM[addr] = data;
+    ppu->sprites_stale = true;
+
+    /* Sprite 0 is the first 4 bytes */
+    if (addr < 4)
+        PPU_schedule_sprite0();
 }
 
-static inline void EXEC_OAMDATA()
+/* OAMDMA: a page written through OAMDATA in one go, from OAMADDR on and wrapping, which ends where it started */
+static inline void PPU_OAM_DMA(const uint8_t * page)
 {
+    _nes_ppu * ppu = &nes_current->ppu;
+    uint8_t start = ppu->PPU_registers[OAMADDR];
+
+    memcpy(&ppu->OAM[start], page, 0x100 - start);
+    memcpy(ppu->OAM, &page[0x100 - start], start);
+    ppu->sprites_stale = true;
+    PPU_schedule_sprite0();
 
+    for (size_t i = 0; nes_current->render != NULL && i < 0x100; i++)
+        nes_render_log(NES_RENDER_OAM, (uint8_t)(start + i), page[i], NULL);
 }
 
-static inline void EXEC_PPUSCROLL()
+/* First write: coarse X into t and fine X into x. Second: coarse and fine Y into t */
+static void PPU_WRITE_PPUSCROLL(uint8_t data)
 {
-    if (nes_ppu.set_scroll_addr_latch == false)
+    _nes_ppu * ppu = &nes_current->ppu;
+
+    if (!ppu->w)
     {
-        nes_ppu.scroll_addr             = (uint16_t) nes_ppu_bus.DB << 8;
-        nes_ppu.set_scroll_addr_latch   = true;
+        ppu->t = (ppu->t & ~0x001F) | (data >> 3);
+        ppu->x = data & 0x07;
     }
     else
     {
-        nes_ppu.scroll_addr |= nes_ppu_bus.DB;
+        ppu->t = (ppu->t & ~0x73E0) | ((uint16_t)(data & 0x07) << 12) | ((uint16_t)(data & 0xF8) << 2);
     }
-    nes_ppu.PPU_registers[PPUSCROLL] = nes_ppu_bus.DB;
+
+    ppu->w = !ppu->w;
 }
 
-static inline void EXEC_PPUADDR()
+/* First write: the high 6 bits of t (clearing bit 14). Second: its low byte, then t goes to v */
+static void PPU_WRITE_PPUADDR(uint8_t data)
 {
-    if (nes_ppu.set_PPU_addr_latch == false)
+    _nes_ppu * ppu = &nes_current->ppu;
+
+    if (!ppu->w)
     {
-        nes_ppu_bus.AB                  = (uint16_t) nes_ppu_bus.DB << 8;
-        nes_ppu.set_PPU_addr_latch      = true;
+        ppu->t = (ppu->t & 0x00FF) | ((uint16_t)(data & 0x3F) << 8);
     }
     else
     {
-        nes_ppu_bus.AB |= nes_ppu_bus.DB;
+        ppu->t = (ppu->t & 0xFF00) | data;
+        ppu->v = ppu->t;
+        PPU_sprite0_changed();
     }
-    nes_ppu.PPU_registers[PPUSCROLL] = nes_ppu_bus.DB;
+
+    ppu->w = !ppu->w;
 }
 
-static inline void EXEC_PPUDATA()
+static void PPU_WRITE_PPUDATA(uint8_t data)
 {
-    if (nes_ppu_bus.RW == 1)
-        PPU_POKE(nes_ppu_bus.AB, nes_ppu_bus.DB)
-    else
-        nes_ppu_bus.DB = PPU_PEEK(nes_ppu_bus.AB);
+    _nes_ppu * ppu = &nes_current->ppu;
+
+    PPU_POKE(ppu->v & 0x3FFF, data);
+    ppu->v = (ppu->v + PPU_data_increment()) & 0x7FFF;
+    PPU_sprite0_changed();
+}
+
+/* Handlers of $2000-$2007 by register, for reads and for writes */
+static uint8_t (* const PPU_REG_READ[8])(void) = {
+    PPU_READ_LATCH,
+    PPU_READ_LATCH,
+    PPU_READ_PPUSTATUS,
+    PPU_READ_LATCH,
+    PPU_READ_OAMDATA,
+    PPU_READ_LATCH,
+    PPU_READ_LATCH,
+    PPU_READ_PPUDATA
+};
+
+static void (* const PPU_REG_WRITE[8])(uint8_t) = {
+    PPU_WRITE_PPUCTRL,
+    PPU_WRITE_PPUMASK,
+    PPU_WRITE_LATCH,
+    PPU_WRITE_OAMADDR,
+    PPU_WRITE_OAMDATA,
+    PPU_WRITE_PPUSCROLL,
+    PPU_WRITE_PPUADDR,
+    PPU_WRITE_PPUDATA
+};
+
+/* Read PPU register 'addr' ($2000-$3FFF, mirrored every 8 bytes) */
+static inline uint8_t PPU_REG_PEEK(uint16_t addr)
+{
+    /* PPUSTATUS and PPUDATA reads move the scroll registers along, the render thread has to follow */
+    if (nes_current->render != NULL && ((addr & 7) == PPUSTATUS || (addr & 7) == PPUDATA))
+        nes_render_log(NES_RENDER_READ, addr & 7, 0, NULL);
+
+    return PPU_REG_READ[addr & 7]();
+}
+
+/* Write PPU register 'addr' ($2000-$3FFF, mirrored every 8 bytes), every write also lands on the register bus */
+static inline void PPU_REG_POKE(uint16_t addr, uint8_t data)
+{
+    if (nes_current->render != NULL)
+        nes_render_log(NES_RENDER_WRITE, addr & 7, data, NULL);
+
+    nes_current->ppu.io_latch = data;
+    PPU_REG_WRITE[addr & 7](data);
+}
+
+/*
+Sprite evaluation: during each visible line the PPU looks through OAM for the sprites whose top
+(byte 0, Y) is at most the sprite height - 1 lines above it, copies the first 8 into secondary
+OAM to be drawn on the next line and sets the overflow flag if there are more. OAM is rewritten
+a few times a frame at most, so rather than search it on every line the lists of all 240 lines
+are worked out in one go when OAM or the sprite size changes and looked up until it changes
+again.
+
+The 64 Y coordinates are gathered from PPU_OAM_row into four 16 byte vectors, after which one
+line is two unsigned compares per vector (line >= Y, and line - Y < height) and a movemask for
+a 64-bit mask of the sprites on it, lowest OAM index first. The overflow flag is set on every
+line with more than 8 sprites, the hardware's buggy diagonal walk through OAM after the 8th
+sprite is not reproduced.
+*/
+static inline void PPU_sprite_lists(_nes_ppu * ppu)
+{
+    uint8_t height = (ppu->PPU_registers[PPUCTRL] & 0x20) ? 16 : 8;
+
+#ifdef NES_PPU_SSE2
+    const __m128i * rows = (const __m128i *)ppu->PPU_OAM_row[0];
+    const __m128i low    = _mm_set1_epi32(0xFF);
+    const __m128i span   = _mm_set1_epi8((char)(height - 1));
+    __m128i y[4];
+
+    for (int i = 0; i < 4; i++)
+    {
+        __m128i y0 = _mm_packs_epi32(_mm_and_si128(rows[i * 4 + 0], low), _mm_and_si128(rows[i * 4 + 1], low));
+        __m128i y1 = _mm_packs_epi32(_mm_and_si128(rows[i * 4 + 2], low), _mm_and_si128(rows[i * 4 + 3], low));
+
+        y[i] = _mm_packus_epi16(y0, y1);
+    }
+#endif
+
+    memset(ppu->sprites->overflow, 0, sizeof(ppu->sprites->overflow));
+
+    for (uint8_t line = 0; line < 240; line++)
+    {
+        uint64_t on = 0;
+
+#ifdef NES_PPU_SSE2
+        const __m128i l = _mm_set1_epi8((char)line);
+
+        for (int i = 0; i < 4; i++)
+        {
+            __m128i below = _mm_sub_epi8(l, y[i]);
+            __m128i above = _mm_cmpeq_epi8(_mm_max_epu8(y[i], l), l);
+            __m128i near  = _mm_cmpeq_epi8(_mm_min_epu8(below, span), below);
+
+            on |= (uint64_t)(uint16_t)_mm_movemask_epi8(_mm_and_si128(above, near)) << (i * 16);
+        }
+#else
+        for (int i = 0; i < 64; i++)
+            on |= (uint64_t)(line >= ppu->OAM[i * 4] && line - ppu->OAM[i * 4] < height) << i;
+#endif
+
+        ppu->sprites->count[line] = (uint8_t)__builtin_popcountll(on);
+
+        for (uint8_t n = 0; on != 0 && n < 8; n++, on &= on - 1)
+            ppu->sprites->list[line][n] = (uint8_t)__builtin_ctzll(on);
+
+        if (on != 0)
+            ppu->sprites->overflow[line >> 6] |= 1ULL << (line & 63);
+    }
+
+    ppu->sprites_stale = false;
 }
 
-static inline void EXEC_OAMDMA()
+/*
+Whether this PPU draws its own scanlines: not in headless or fast-forwarded frames (skip_render),
+not on a machine without a screen buffer (see nes_machine_headless()), nor while a render thread
+draws them (see nes_render.h). Everything else runs either way, the CPU sees the same PPUSTATUS
+at the same dots and only the picture is missing.
+*/
+static inline bool PPU_drawing(const _nes_ppu * ppu)
+{
+    return !ppu->skip_render && nes_current->render == NULL && ppu->screen_buffer != NULL;
+}
+
+/* Sprite evaluation of the current (visible) line is over by dot 257, the overflow flag is all a PPU that doesn't draw needs */
+static inline void PPU_evaluate_sprites(_nes_ppu * ppu)
+{
+    if (!(ppu->PPU_registers[PPUMASK] & 0x18) || ppu->scanline >= 240)
+        return;
+
+    if (ppu->sprites_stale)
+        PPU_sprite_lists(ppu);
+
+    const uint8_t * list = ppu->sprites->list[ppu->scanline];
+    uint8_t count = ppu->sprites->count[ppu->scanline];
+    uint8_t n = 0;
+
+    if (count > 8)
+        ppu->PPU_registers[PPUSTATUS] |= 0x20;
+
+    if (!PPU_drawing(ppu))
+        return;
+
+    for (; n < count && n < 8; n++)
+        ppu->PPU_OAM_row[1][n] = ppu->PPU_OAM_row[0][list[n]];
+    for (; n < 8; n++)
+        ppu->PPU_OAM_row[1][n] = 0xFFFFFFFF;
+}
+
+/* PPU_tick() calls left before sprite evaluation sets the overflow flag this frame, UINT32_MAX if it won't */
+static inline uint32_t PPU_dots_to_sprite_overflow(_nes_ppu * ppu)
+{
+    if (!(ppu->PPU_registers[PPUMASK] & 0x18) || (ppu->PPU_registers[PPUSTATUS] & 0x20))
+        return UINT32_MAX;
+
+    if (ppu->sprites_stale)
+        PPU_sprite_lists(ppu);
+
+    uint32_t position = (uint32_t)ppu->scanline * 341 + ppu->dot;
+
+    for (uint32_t line = ppu->scanline + (ppu->dot > 257); line < 240; line = (line | 63) + 1)
+    {
+        uint64_t lines = ppu->sprites->overflow[line >> 6] >> (line & 63);
+
+        if (lines != 0)
+            return (line + __builtin_ctzll(lines)) * 341 + 257 - position;
+    }
+
+    return UINT32_MAX;
+}
+
+/*
+Render one visible scanline into screen_buffer. Only the backdrop (universal background
+colour at $3F00) for now, tiles and sprites are drawn on top of it once they exist. Greyscale
+(PPUMASK bit 0) leaves only the column of grey in the palette.
+*/
+static inline void PPU_render_scanline(uint16_t scanline)
 {
+    uint8_t * row   = &nes_current->ppu.screen_buffer[scanline * PPU_SCREEN_STRIDE];
+    uint8_t mask    = nes_current->ppu.PPU_registers[PPUMASK];
+    uint8_t colours = (mask & 0x01) ? 0x30 : 0x3F;
 
+    memset(row, nes_current->ppu_bus.palette[0] & colours, 256);
+    row[PPU_SCREEN_EMPHASIS] = mask >> 5;
+}
+
+/*
+While rendering, the PPU moves v along with the picture: at dot 257 of every visible line and
+the pre-render line one row down (fine Y, then coarse Y, into the next nametable down after row
+29) and back to the left edge held in t, and over dots 280-304 of the pre-render line back to
+t's top. Scanlines are drawn whole, so the coarse X steps along a line are left to the renderer.
+*/
+static inline void PPU_scroll(_nes_ppu * ppu, uint16_t dot)
+{
+    if (!(ppu->PPU_registers[PPUMASK] & 0x18))
+        return;
+
+    if (dot == 257 && (ppu->scanline < 240 || ppu->scanline == 261))
+    {
+        uint16_t v = ppu->v;
+
+        if ((v & 0x7000) != 0x7000)
+            v += 0x1000;
+        else
+        {
+            uint16_t y = (v & 0x03E0) >> 5;
+
+            if (y == 29)
+            {
+                y = 0;
+                v ^= 0x0800;
+            }
+            else
+                y = (y + 1) & 0x1F;
+
+            v = (v & ~0x73E0) | (y << 5);
+        }
+
+        ppu->v = (v & ~0x041F) | (ppu->t & 0x041F);
+    }
+    else if (dot == 304 && ppu->scanline == 261)
+        ppu->v = (ppu->v & ~0x7BE0) | (ppu->t & 0x7BE0);
 }
 
 /* 
@@ -410,9 +857,100 @@ Each cycle on the 2A02 (NES CPU) is about 3 PPU cycles
 */
 static inline void PPU_tick()
 {
-    if (nes_ppu.clear_vblank == true)
-        nes_ppu_bus.PPU_registers[PPUSTATUS] &= 0x7F;
+    /* Local copy of the machine pointer, byte stores would otherwise force a reload of nes_current */
+    _nes_ppu * ppu = &nes_current->ppu;
 
-    
+    switch (ppu->dot)
+    {
+        /* Start of vblank, and the pre-render scanline clearing vblank, sprite 0 and overflow */
+        case 1:
+            if (ppu->scanline == 241)
+                ppu->PPU_registers[PPUSTATUS] |= 0x80;
+            else if (ppu->scanline == 261)
+                ppu->PPU_registers[PPUSTATUS] &= 0x1F;
+        break;
+        /* The visible part of the scanline is done, hand it to the renderer */
+        case 256:
+            if (ppu->scanline < 240 && PPU_drawing(ppu))
+                PPU_render_scanline(ppu->scanline);
+        break;
+        case 257:
+            PPU_scroll(ppu, 257);
+            PPU_evaluate_sprites(ppu);
+        break;
+        case 304:
+            PPU_scroll(ppu, 304);
+        break;
+    }
+
+    if (++ppu->dot > 340)
+    {
+        ppu->dot = 0;
+        if (++ppu->scanline > 261)
+        {
+            ppu->scanline = 0;
+            ppu->frame++;
+            ppu->frame_complete = true;
+        }
+    }
 }
 
+/* PPU_tick() calls left until the current frame is complete */
+static inline uint32_t PPU_dots_to_frame_end(void)
+{
+    const _nes_ppu * ppu = &nes_current->ppu;
+
+    return (uint32_t)(261 - ppu->scanline) * 341 + (uint32_t)(341 - ppu->dot);
+}
+
+/* PPU_tick() calls left before the next one that changes PPUSTATUS or completes the frame, sprite 0 hits are on the schedule instead */
+static inline uint32_t PPU_dots_to_next_event(void)
+{
+    _nes_ppu * ppu = &nes_current->ppu;
+    uint32_t position = (uint32_t)ppu->scanline * 341 + ppu->dot;
+    uint32_t overflow = PPU_dots_to_sprite_overflow(ppu);
+    uint32_t dots;
+
+    if (position <= 241 * 341 + 1)
+        dots = 241 * 341 + 1 - position;
+    else if (position <= 261 * 341 + 1)
+        dots = 261 * 341 + 1 - position;
+    else
+        dots = 261 * 341 + 340 - position;
+
+    return overflow < dots ? overflow : dots;
+}
+
+/* Same as 'dots' PPU_tick() calls, a scanline at a time, as long as they stay short of PPU_dots_to_next_event() */
+static inline void PPU_skip(uint32_t dots)
+{
+    _nes_ppu * ppu = &nes_current->ppu;
+
+    while (dots > 0)
+    {
+        uint32_t step = 341 - ppu->dot;
+
+        if (step > dots)
+            step = dots;
+
+        /* Dots 256, 257 and 304 are among the skipped ones */
+        if (ppu->scanline < 240 && PPU_drawing(ppu) && ppu->dot <= 256 && ppu->dot + step > 256)
+            PPU_render_scanline(ppu->scanline);
+        if (ppu->dot <= 257 && ppu->dot + step > 257)
+        {
+            PPU_scroll(ppu, 257);
+            PPU_evaluate_sprites(ppu);
+        }
+        if (ppu->dot <= 304 && ppu->dot + step > 304)
+            PPU_scroll(ppu, 304);
+
+        ppu->dot += step;
+        dots     -= step;
+
+        if (ppu->dot > 340)
+        {
+            ppu->dot = 0;
+            ppu->scanline++;
+        }
+    }
+}
@@ -0,0 +1,466 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "nes_cpu.h"
+#include "nes_profile.h"
+
+/* Start profiling the bound machine, see nes_profile.h for what 'period' means */
+bool nes_profile_enable(uint32_t period)
+{
+    if (nes_current->profile != NULL)
+        return true;
+
+    nes_profile * profile = calloc(1, sizeof(nes_profile));
+
+    if (profile == NULL || (profile->nodes = calloc(64, sizeof(nes_profile_node))) == NULL)
+    {
+        fprintf(stderr, "error: Out of memory for the profiler\n");
+        free(profile);
+        return false;
+    }
+
+    profile->period        = period;
+    profile->node_capacity = 64;
+    profile->node_count    = 1;
+
+    nes_current->profile = profile;
+    return true;
+}
+
+void nes_profile_disable(void)
+{
+    nes_profile_free(nes_current->profile);
+    nes_current->profile = NULL;
+}
+
+void nes_profile_free(nes_profile * profile)
+{
+    if (profile == NULL)
+        return;
+
+    free(profile->nodes);
+    free(profile->sites);
+    free(profile);
+}
+
+static size_t profile_hash(uint64_t key)
+{
+    return (size_t)((key * 0x9E3779B97F4A7C15ULL) >> 32);
+}
+
+/* The slot for 'key' in an open addressing table, added if missing, NULL if out of memory */
+static nes_profile_site * profile_slot(nes_profile_site ** slots, size_t * count, size_t * capacity, uint64_t key)
+{
+    /* Keep it at most half full */
+    if ((*count + 1) * 2 > *capacity)
+    {
+        size_t grown = *capacity ? *capacity * 2 : 1024;
+        nes_profile_site * table = calloc(grown, sizeof(nes_profile_site));
+
+        if (table == NULL)
+            return NULL;
+
+        for (size_t i = 0; i < *capacity; i++)
+        {
+            if ((*slots)[i].key == 0)
+                continue;
+
+            size_t j = profile_hash((*slots)[i].key) & (grown - 1);
+            while (table[j].key != 0)
+                j = (j + 1) & (grown - 1);
+
+            table[j] = (*slots)[i];
+        }
+
+        free(*slots);
+        *slots    = table;
+        *capacity = grown;
+    }
+
+    size_t mask = *capacity - 1;
+
+    for (size_t i = profile_hash(key) & mask; ; i = (i + 1) & mask)
+    {
+        if ((*slots)[i].key == key)
+            return &(*slots)[i];
+
+        if ((*slots)[i].key == 0)
+        {
+            (*slots)[i].key = key;
+            (*count)++;
+            return &(*slots)[i];
+        }
+    }
+}
+
+/* A JSR at 'call_site' (or an interrupt) went to 'entry' */
+static void profile_call(nes_profile * profile, uint16_t call_site, uint16_t entry)
+{
+    if (profile->depth >= NES_PROFILE_MAX_DEPTH)
+    {
+        profile->overflow++;
+        return;
+    }
+
+    uint32_t node = profile->nodes[profile->node].child;
+
+    while (node != 0 && (profile->nodes[node].entry != entry || profile->nodes[node].call_site != call_site))
+        node = profile->nodes[node].sibling;
+
+    if (node == 0)
+    {
+        if (profile->node_count == profile->node_capacity)
+        {
+            nes_profile_node * nodes = realloc(profile->nodes, 2 * profile->node_capacity * sizeof(nes_profile_node));
+
+            if (nodes == NULL)
+            {
+                profile->overflow++;
+                return;
+            }
+
+            profile->nodes = nodes;
+            profile->node_capacity *= 2;
+        }
+
+        node = profile->node_count++;
+        profile->nodes[node] = (nes_profile_node){ entry, call_site, profile->node, 0, profile->nodes[profile->node].child };
+        profile->nodes[profile->node].child = node;
+    }
+
+    profile->node = node;
+    profile->depth++;
+}
+
+static void profile_return(nes_profile * profile)
+{
+    if (profile->overflow > 0)
+        profile->overflow--;
+    else if (profile->node != 0)
+    {
+        profile->node = profile->nodes[profile->node].parent;
+        profile->depth--;
+    }
+}
+
+/* nes_profile_step()'s slow path: take the samples due and follow JSR/RTS */
+void nes_profile_record(nes_profile * profile, uint16_t pc, uint8_t sp)
+{
+    uint64_t samples = 1, cycles = profile->pending;
+
+    if (profile->period > 0)
+    {
+        samples = profile->pending / profile->period;
+        cycles  = samples * profile->period;
+    }
+
+    profile->pending -= (uint32_t)cycles;
+
+    if (samples > 0)
+    {
+        nes_profile_site * site = profile_slot(&profile->sites, &profile->site_count, &profile->site_capacity,
+                                               ((uint64_t)profile->node << 16 | pc) + 1);
+
+        if (site != NULL)
+        {
+            site->cycles  += cycles;
+            site->samples += samples;
+        }
+
+        profile->cycles[pc] += cycles;
+
+        if (profile->cycles[pc] > profile->hottest)
+            profile->hottest = profile->cycles[pc];
+    }
+
+    /* JSR pushes 2 bytes, BRK and interrupts 3, RTS and RTI pop them again */
+    switch ((uint8_t)(nes_current->cpu_registers.SP - sp))
+    {
+        case 0xFE:
+        case 0xFD:
+            profile_call(profile, pc, nes_current->cpu_registers.PC);
+        break;
+        case 0x02:
+        case 0x03:
+            profile_return(profile);
+        break;
+    }
+}
+
+/* Cycles counted at 'addr' so far, 0 when not profiling */
+uint64_t nes_profile_address_cycles(uint16_t addr)
+{
+    return nes_current->profile ? nes_current->profile->cycles[addr] : 0;
+}
+
+/* Cycles at the busiest address, 0 when not profiling */
+uint64_t nes_profile_hottest(void)
+{
+    return nes_current->profile ? nes_current->profile->hottest : 0;
+}
+
+/*
+    pprof output, profile.proto encoded by hand: every message is built in a buffer of its own
+    and then added to its parent as a length-delimited field
+*/
+typedef struct profile_buffer
+{
+    uint8_t   * data;
+    size_t      size, capacity;
+    bool        failed;
+}
+profile_buffer;
+
+static void pb_append(profile_buffer * buffer, const void * data, size_t size)
+{
+    if (buffer->size + size > buffer->capacity)
+    {
+        size_t capacity = buffer->capacity ? buffer->capacity : 256;
+        while (capacity < buffer->size + size)
+            capacity *= 2;
+
+        uint8_t * grown = realloc(buffer->data, capacity);
+        if (grown == NULL)
+        {
+            buffer->failed = true;
+            return;
+        }
+
+        buffer->data     = grown;
+        buffer->capacity = capacity;
+    }
+
+    memcpy(buffer->data + buffer->size, data, size);
+    buffer->size += size;
+}
+
+static void pb_varint(profile_buffer * buffer, uint64_t value)
+{
+    uint8_t bytes[10];
+    size_t size = 0;
+
+    do
+    {
+        bytes[size++] = (uint8_t)(value & 0x7F) | (value > 0x7F ? 0x80 : 0);
+        value >>= 7;
+    }
+    while (value != 0);
+
+    pb_append(buffer, bytes, size);
+}
+
+static void pb_uint(profile_buffer * buffer, uint32_t field, uint64_t value)
+{
+    pb_varint(buffer, (uint64_t)field << 3);
+    pb_varint(buffer, value);
+}
+
+static void pb_bytes(profile_buffer * buffer, uint32_t field, const void * data, size_t size)
+{
+    pb_varint(buffer, (uint64_t)field << 3 | 2);
+    pb_varint(buffer, size);
+    pb_append(buffer, data, size);
+}
+
+/* Add 'message' as field 'field' of 'buffer' and empty it for the next one */
+static void pb_message(profile_buffer * buffer, uint32_t field, profile_buffer * message)
+{
+    pb_bytes(buffer, field, message->data, message->size);
+    buffer->failed |= message->failed;
+    message->size = 0;
+}
+
+/* The string table, strings are added as they come up and written out last */
+typedef struct profile_strings
+{
+    profile_buffer  table;
+    size_t          count;
+}
+profile_strings;
+
+static int64_t profile_string(profile_strings * strings, const char * string)
+{
+    pb_bytes(&strings->table, 6, string, strlen(string));
+    return (int64_t)strings->count++;
+}
+
+/* Everything nes_profile_write() builds */
+typedef struct profile_writer
+{
+    const nes_profile * profile;
+    profile_strings     strings;
+
+    profile_buffer      functions, locations, message, line;
+
+    uint32_t          * function_of_entry;  /* Function ID by subroutine entry, 0 until seen */
+    uint32_t            function_count;
+
+    nes_profile_site  * location_ids;       /* (function << 16 | address) + 1 -> ID in 'cycles' */
+    size_t              location_count, location_capacity;
+}
+profile_writer;
+
+/* Function ID of 'node', the top level is function 1 */
+static uint32_t profile_function(profile_writer * writer, uint32_t node)
+{
+    if (node == 0)
+        return 1;
+
+    uint16_t entry = writer->profile->nodes[node].entry;
+
+    if (writer->function_of_entry[entry] == 0)
+    {
+        char name[16];
+        snprintf(name, sizeof(name), "sub_%04X", entry);
+
+        writer->function_of_entry[entry] = ++writer->function_count;
+
+        pb_uint(&writer->message, 1, writer->function_count);
+        pb_uint(&writer->message, 2, (uint64_t)profile_string(&writer->strings, name));
+        pb_uint(&writer->message, 3, (uint64_t)profile_string(&writer->strings, name));
+        pb_message(&writer->functions, 5, &writer->message);
+    }
+
+    return writer->function_of_entry[entry];
+}
+
+/* Location ID of 'address' inside 'node's function, 0 if out of memory */
+static uint64_t profile_location(profile_writer * writer, uint32_t node, uint16_t address)
+{
+    uint32_t function = profile_function(writer, node);
+    nes_profile_site * slot = profile_slot(&writer->location_ids, &writer->location_count, &writer->location_capacity,
+                                           ((uint64_t)function << 16 | address) + 1);
+
+    if (slot == NULL)
+        return 0;
+
+    if (slot->cycles == 0)
+    {
+        slot->cycles = writer->location_count;
+
+        pb_uint(&writer->line, 1, function);
+
+        pb_uint(&writer->message, 1, slot->cycles);
+        pb_uint(&writer->message, 2, 1);
+        pb_uint(&writer->message, 3, address);
+        pb_message(&writer->message, 4, &writer->line);
+        pb_message(&writer->locations, 4, &writer->message);
+    }
+
+    return slot->cycles;
+}
+
+static void profile_value_type(profile_writer * writer, profile_buffer * out, uint32_t field, const char * type, const char * unit)
+{
+    pb_uint(&writer->message, 1, (uint64_t)profile_string(&writer->strings, type));
+    pb_uint(&writer->message, 2, (uint64_t)profile_string(&writer->strings, unit));
+    pb_message(out, field, &writer->message);
+}
+
+/* Save the bound machine's profile to 'path' in pprof format, 'rom' names the mapping, 0 on success */
+int nes_profile_write(const char * path, const char * rom)
+{
+    const nes_profile * profile = nes_current->profile;
+
+    if (profile == NULL)
+    {
+        fprintf(stderr, "error: No profile to write to %s\n", path);
+        return -1;
+    }
+
+    profile_writer writer = { .profile = profile, .function_count = 1 };
+    profile_buffer out = { 0 }, stack = { 0 }, values = { 0 };
+
+    writer.function_of_entry = calloc(0x10000, sizeof(uint32_t));
+
+    profile_string(&writer.strings, "");
+    int64_t filename = profile_string(&writer.strings, rom ? rom : "");
+
+    profile_value_type(&writer, &out, 1, "samples", "count");
+    profile_value_type(&writer, &out, 1, "cycles", "count");
+    profile_value_type(&writer, &out, 11, "cycles", "count");
+    pb_uint(&out, 12, profile->period ? profile->period : 1);
+
+    /* One mapping for the whole address space, already symbolized */
+    pb_uint(&writer.message, 1, 1);
+    pb_uint(&writer.message, 3, 0x10000);
+    pb_uint(&writer.message, 5, (uint64_t)filename);
+    pb_uint(&writer.message, 7, 1);
+    pb_message(&out, 3, &writer.message);
+
+    /* The top level */
+    int64_t top = profile_string(&writer.strings, "(top level)");
+    pb_uint(&writer.message, 1, 1);
+    pb_uint(&writer.message, 2, (uint64_t)top);
+    pb_uint(&writer.message, 3, (uint64_t)top);
+    pb_message(&writer.functions, 5, &writer.message);
+
+    /* A sample per node and PC, the stack runs from the PC up through the JSRs that got there */
+    for (size_t i = 0; i < profile->site_capacity && writer.function_of_entry != NULL; i++)
+    {
+        const nes_profile_site * site = &profile->sites[i];
+
+        if (site->key == 0)
+            continue;
+
+        uint32_t node = (uint32_t)((site->key - 1) >> 16);
+
+        pb_varint(&stack, profile_location(&writer, node, (uint16_t)(site->key - 1)));
+
+        for (; node != 0; node = profile->nodes[node].parent)
+            pb_varint(&stack, profile_location(&writer, profile->nodes[node].parent, profile->nodes[node].call_site));
+
+        pb_varint(&values, site->samples);
+        pb_varint(&values, site->cycles);
+
+        pb_message(&writer.message, 1, &stack);
+        pb_message(&writer.message, 2, &values);
+        pb_message(&out, 2, &writer.message);
+    }
+
+    pb_append(&out, writer.locations.data, writer.locations.size);
+    pb_append(&out, writer.functions.data, writer.functions.size);
+    pb_append(&out, writer.strings.table.data, writer.strings.table.size);
+
+    bool failed = writer.function_of_entry == NULL || out.failed || writer.locations.failed || writer.functions.failed
+               || writer.strings.table.failed || writer.message.failed;
+
+    free(writer.function_of_entry);
+    free(writer.location_ids);
+    free(writer.functions.data);
+    free(writer.locations.data);
+    free(writer.message.data);
+    free(writer.line.data);
+    free(writer.strings.table.data);
+    free(stack.data);
+    free(values.data);
+
+    if (failed)
+    {
+        fprintf(stderr, "error: Out of memory writing profile %s\n", path);
+        free(out.data);
+        return -1;
+    }
+
+    FILE * file = fopen(path, "wb");
+    if (file == NULL)
+    {
+        fprintf(stderr, "error: failed to open %s for writing: %s\n", path, strerror(errno));
+        free(out.data);
+        return -1;
+    }
+
+    bool written = fwrite(out.data, 1, out.size, file) == out.size;
+    written &= fclose(file) == 0;
+    free(out.data);
+
+    if (!written)
+    {
+        fprintf(stderr, "error: failed to write %s\n", path);
+        return -1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,92 @@
+#pragma once
+
+/*
+    nes_profile.h: Where the emulated game spends its cycles
+
+    While enabled, nes_run_frame() hands every step (one interpreted instruction, one translated
+    block or one skipped idle loop) to nes_profile_step() with the PC it started at. Cycles are
+    attributed to that PC, inside the subroutine the CPU is in at the time:
+
+        - sampling (period > 0): every 'period' cycles the running PC gets one sample worth
+          'period' cycles, which costs next to nothing between samples,
+        - counting (period 0): every step is recorded with its exact cycles.
+
+    Subroutines are tracked from the stack pointer: a step that pushes 2 bytes (JSR) or 3 (BRK,
+    interrupts) enters a callee at the new PC, one that pops 2 (RTS) or 3 (RTI) returns to the
+    caller. This holds for translated blocks too, as they leave all other stack instructions to
+    the interpreter and end at their JSR or RTS. Code that drops return addresses by hand throws
+    the call stack off until it unwinds to the top again; translated blocks and skipped loops
+    count against the PC they started at.
+
+    Per-address cycles feed the heat column next to the disassembly in main.c. nes_profile_write()
+    saves a pprof profile (profile.proto, uncompressed), which pprof and speedscope both read: a
+    sample per PC and call stack, functions named sub_XXXX after their entry point, locations at
+    6502 addresses, in "samples" and "cycles".
+*/
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "nes_machine.h"
+
+#define NES_PROFILE_PERIOD      1009    /* Default cycles between samples, prime so it doesn't beat with loops */
+#define NES_PROFILE_MAX_DEPTH   64      /* Nested subroutines tracked, deeper calls count against the deepest */
+
+/* One subroutine on one call path, node 0 is the top level outside any JSR */
+typedef struct nes_profile_node
+{
+    uint16_t    entry;          /* Address the JSR went to */
+    uint16_t    call_site;      /* Address of the JSR */
+    uint32_t    parent;
+    uint32_t    child;          /* First callee, 0 if none */
+    uint32_t    sibling;        /* Next callee of 'parent', 0 if none */
+}
+nes_profile_node;
+
+/* Cycles and samples of one PC in one node */
+typedef struct nes_profile_site
+{
+    uint64_t    key;            /* (Node << 16 | PC) + 1, 0 for an empty slot */
+    uint64_t    cycles;
+    uint64_t    samples;
+}
+nes_profile_site;
+
+typedef struct nes_profile
+{
+    uint32_t            period;         /* 0 counts every step */
+    uint32_t            pending;        /* Cycles since the last sample */
+
+    uint64_t            cycles[0x10000];    /* By PC, what the heat column shows */
+    uint64_t            hottest;            /* Largest entry of 'cycles' */
+
+    nes_profile_node  * nodes;
+    uint32_t            node_count, node_capacity;
+    uint32_t            node;               /* Where the CPU is now */
+    uint32_t            depth, overflow;    /* Calls deeper than NES_PROFILE_MAX_DEPTH not given a node */
+
+    nes_profile_site  * sites;
+    size_t              site_count, site_capacity;
+}
+nes_profile;
+
+bool nes_profile_enable(uint32_t period);
+void nes_profile_disable(void);
+void nes_profile_free(nes_profile * profile);
+
+void nes_profile_record(nes_profile * profile, uint16_t pc, uint8_t sp);
+
+int nes_profile_write(const char * path, const char * rom);
+
+uint64_t nes_profile_address_cycles(uint16_t addr);
+uint64_t nes_profile_hottest(void);
+
+/* A step that started at 'pc' with the stack pointer at 'sp' took 'cycles', see nes_run_frame() */
+static inline void nes_profile_step(nes_profile * profile, uint16_t pc, uint8_t sp, uint32_t cycles)
+{
+    profile->pending += cycles;
+
+    /* Only sample boundaries and JSR/RTS need the slow path */
+    if (profile->pending >= profile->period || nes_current->cpu_registers.SP != sp)
+        nes_profile_record(profile, pc, sp);
+}
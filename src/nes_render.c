@@ -0,0 +1,331 @@
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <malloc.h>
+#endif
+
+#include "nes_cpu.h"
+#include "nes_render.h"
+
+/* A zeroed nes_render, aligned for its counters' cache lines, which calloc() doesn't promise (see nes_audio_ring_alloc()) */
+static nes_render * render_alloc(void)
+{
+#ifdef _WIN32
+    nes_render * render = _aligned_malloc(sizeof(nes_render), _Alignof(nes_render));
+#else
+    nes_render * render = aligned_alloc(_Alignof(nes_render), sizeof(nes_render));
+#endif
+
+    if (render != NULL)
+        memset(render, 0, sizeof(nes_render));
+
+    return render;
+}
+
+static void render_dealloc(nes_render * render)
+{
+#ifdef _WIN32
+    _aligned_free(render);
+#else
+    free(render);
+#endif
+}
+
+/* The shadow's copy of 'mem', which points into the emulated machine, its four-screen nametables or at memory they share (CHR-ROM) */
+static uint8_t * render_rebase(const nes_render * render, const uint8_t * mem)
+{
+    uintptr_t offset = (uintptr_t)mem - (uintptr_t)render->machine;
+
+    if (offset < sizeof(nes_machine))
+        return (uint8_t *)render->shadow + offset;
+
+    offset = (uintptr_t)mem - (uintptr_t)render->machine->cartridge.four_screen;
+
+    if (render->machine->cartridge.four_screen != NULL && render->shadow->cartridge.four_screen != NULL && offset < 0x800)
+        return render->shadow->cartridge.four_screen + offset;
+
+    return (uint8_t *)mem;
+}
+
+/* Copy the emulated machine's PPU into the shadow, only while the render thread is idle */
+static void render_copy_ppu(nes_render * render)
+{
+    _nes_ppu * ppu = &render->shadow->ppu;
+
+    memcpy(&render->shadow->ppu_bus, &render->machine->ppu_bus, sizeof(_nes_ppu_bus));
+    memcpy(ppu, &render->machine->ppu, offsetof(_nes_ppu, sprites));
+    memcpy(ppu->sprites, render->machine->ppu.sprites, sizeof(nes_ppu_sprites));
+
+    if (render->machine->cartridge.four_screen != NULL && render->shadow->cartridge.four_screen != NULL)
+        memcpy(render->shadow->cartridge.four_screen, render->machine->cartridge.four_screen, 0x800);
+
+    for (size_t i = 0; i < 16; i++)
+        ppu->PPU_page[i] = render_rebase(render, ppu->PPU_page[i]);
+
+    for (size_t i = 0; i < 4; i++)
+    {
+        ppu->PPU_Nametable[i]   = render_rebase(render, ppu->PPU_Nametable[i]);
+        ppu->PPU_Attribtable[i] = render_rebase(render, ppu->PPU_Attribtable[i]);
+    }
+
+    for (size_t i = 0; i < 2; i++)
+    {
+        ppu->PPU_Pallete_Data[i] = render_rebase(render, ppu->PPU_Pallete_Data[i]);
+        ppu->PPU_OAM_bytes[i]    = render_rebase(render, ppu->PPU_OAM_bytes[i]);
+    }
+}
+
+/* Run the shadow PPU on to 'position' of its frame, drawing the scanlines it passes */
+static void render_advance(uint32_t position)
+{
+    const _nes_ppu * ppu = &nes_current->ppu;
+    uint32_t now = (uint32_t)ppu->scanline * 341 + ppu->dot;
+
+    if (position > now)
+        PPU_skip(position - now);
+}
+
+/* Finish the shadow's frame and hand it to the frontend, unless it was skipped */
+static void render_frame(nes_render * render)
+{
+    _nes_ppu * ppu = &nes_current->ppu;
+
+    render_advance(262 * 341);
+
+    ppu->scanline = 0;
+    ppu->dot      = 0;
+    ppu->frame++;
+
+    if (ppu->skip_render)
+        return;
+
+    pthread_mutex_lock(&render->lock);
+    memcpy(render->frame, ppu->screen_buffer, sizeof(render->frame));
+    render->published++;
+    pthread_mutex_unlock(&render->lock);
+}
+
+/* Replay one entry into the shadow, after the scanlines drawn before it */
+static void render_replay(nes_render * render, const nes_render_entry * entry)
+{
+    _nes_ppu * ppu = &nes_current->ppu;
+
+    if (entry->kind == NES_RENDER_FRAME)
+        render_frame(render);
+
+    render_advance(entry->position);
+
+    switch (entry->kind)
+    {
+        case NES_RENDER_WRITE:
+            PPU_REG_POKE(0x2000 | entry->reg, entry->data);
+        break;
+        case NES_RENDER_READ:
+            PPU_REG_PEEK(0x2000 | entry->reg);
+        break;
+        case NES_RENDER_OAM:
+            ppu->OAM[entry->reg] = entry->data;
+            ppu->sprites_stale   = true;
+        break;
+        case NES_RENDER_MAP:
+            nes_ppu_map((uint16_t)(entry->reg << 10), 0x400, render_rebase(render, entry->mem));
+        break;
+        case NES_RENDER_MIRROR:
+            nes_ppu_mirror((nes_mirroring)entry->data);
+        break;
+        case NES_RENDER_SKIP:
+            ppu->skip_render = entry->data;
+        break;
+    }
+}
+
+/* The render thread: replay whatever is in the log, sleep when there is nothing */
+static void * render_main(void * arg)
+{
+    nes_render * render = arg;
+
+    nes_machine_bind(render->shadow);
+
+    for (;;)
+    {
+        size_t read = atomic_load_explicit(&render->read, memory_order_relaxed);
+        bool stop;
+
+        pthread_mutex_lock(&render->lock);
+        while (!render->stop && atomic_load_explicit(&render->write, memory_order_acquire) == read)
+            pthread_cond_wait(&render->wake, &render->lock);
+        stop = render->stop;
+        pthread_mutex_unlock(&render->lock);
+
+        if (stop)
+            break;
+
+        size_t write = atomic_load_explicit(&render->write, memory_order_acquire);
+
+        for (; read != write; read++)
+        {
+            render_replay(render, &render->log[read & (NES_RENDER_LOG_SIZE - 1)]);
+            atomic_store_explicit(&render->read, read + 1, memory_order_release);
+        }
+    }
+
+    return NULL;
+}
+
+static void render_wake(nes_render * render)
+{
+    pthread_mutex_lock(&render->lock);
+    pthread_cond_signal(&render->wake);
+    pthread_mutex_unlock(&render->lock);
+}
+
+/* Draw the bound machine's frames on a thread of their own from now on, false if that can't be done */
+bool nes_render_start(void)
+{
+    if (nes_current->render != NULL)
+        return true;
+
+    if (nes_current->ppu.screen_buffer == NULL)
+    {
+        fprintf(stderr, "error: A headless machine has nothing for the render thread to draw into\n");
+        return false;
+    }
+
+    nes_render * render = render_alloc();
+
+    if (render == NULL || (render->log = malloc(NES_RENDER_LOG_SIZE * sizeof(nes_render_entry))) == NULL
+        || (render->shadow = nes_machine_create()) == NULL
+        || (nes_current->cartridge.four_screen != NULL && (render->shadow->cartridge.four_screen = malloc(0x800)) == NULL))
+    {
+        fprintf(stderr, "error: Out of memory for the render thread\n");
+        if (render != NULL && render->shadow != NULL)
+            nes_machine_destroy(render->shadow);
+        if (render != NULL)
+            free(render->log);
+        render_dealloc(render);
+        return false;
+    }
+
+    render->machine = nes_current;
+    atomic_init(&render->write, 0);
+    atomic_init(&render->read, 0);
+    pthread_mutex_init(&render->lock, NULL);
+    pthread_cond_init(&render->wake, NULL);
+
+    render_copy_ppu(render);
+
+    if (pthread_create(&render->thread, NULL, render_main, render) != 0)
+    {
+        fprintf(stderr, "error: Failed to start the render thread\n");
+        pthread_cond_destroy(&render->wake);
+        pthread_mutex_destroy(&render->lock);
+        nes_machine_destroy(render->shadow);
+        free(render->log);
+        render_dealloc(render);
+        return false;
+    }
+
+    nes_current->render = render;
+    return true;
+}
+
+/* Back to drawing on the emulation thread, frames still in the log are thrown away */
+void nes_render_stop(void)
+{
+    nes_render * render = nes_current->render;
+
+    nes_current->render = NULL;
+    nes_render_free(render);
+}
+
+void nes_render_free(nes_render * render)
+{
+    if (render == NULL)
+        return;
+
+    pthread_mutex_lock(&render->lock);
+    render->stop = true;
+    pthread_cond_signal(&render->wake);
+    pthread_mutex_unlock(&render->lock);
+
+    pthread_join(render->thread, NULL);
+
+    pthread_cond_destroy(&render->wake);
+    pthread_mutex_destroy(&render->lock);
+    nes_machine_destroy(render->shadow);
+    free(render->log);
+    render_dealloc(render);
+}
+
+/* Wait until the render thread has replayed the first 'entries' entries ever logged */
+void nes_render_wait(size_t entries)
+{
+    nes_render * render = nes_current->render;
+
+    render_wake(render);
+
+    while (atomic_load_explicit(&render->read, memory_order_acquire) < entries)
+        sched_yield();
+}
+
+/* The bound machine starts a frame, drawn unless ppu.skip_render is set */
+void nes_render_frame_start(void)
+{
+    nes_render_log(NES_RENDER_SKIP, 0, nes_current->ppu.skip_render, NULL);
+}
+
+/* The bound machine finished a frame, the render thread can finish drawing it */
+void nes_render_frame_end(void)
+{
+    nes_render_log(NES_RENDER_FRAME, 0, 0, NULL);
+    render_wake(nes_current->render);
+}
+
+/*
+    Copy the latest frame the render thread finished into the bound machine's screen buffer,
+    false if there is none since the last call or no render thread. Doesn't wait.
+*/
+bool nes_render_present(void)
+{
+    nes_render * render = nes_current->render;
+    bool fresh;
+
+    if (render == NULL)
+        return false;
+
+    pthread_mutex_lock(&render->lock);
+    fresh = render->published != render->presented;
+    if (fresh)
+    {
+        memcpy(nes_current->ppu.screen_buffer, render->frame, sizeof(render->frame));
+        render->presented = render->published;
+    }
+    pthread_mutex_unlock(&render->lock);
+
+    return fresh;
+}
+
+/* Wait for the render thread to draw everything logged so far and present it, the screen buffer is then what drawing in place would have left */
+void nes_render_sync(void)
+{
+    if (nes_current->render == NULL)
+        return;
+
+    nes_render_wait(atomic_load_explicit(&nes_current->render->write, memory_order_relaxed));
+    nes_render_present();
+}
+
+/* The bound machine's PPU was put back to an earlier state, start the shadow over from it */
+void nes_render_reload(void)
+{
+    nes_render * render = nes_current->render;
+
+    if (render == NULL)
+        return;
+
+    nes_render_wait(atomic_load_explicit(&render->write, memory_order_relaxed));
+    render_copy_ppu(render);
+}
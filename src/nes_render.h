@@ -0,0 +1,109 @@
+#pragma once
+
+/*
+    nes_render.h: Pixels drawn on a second thread from a log of what the CPU did to the PPU
+
+    With nes_render_start() the bound machine's PPU stops drawing scanlines itself. It still
+    runs on the emulation thread for everything the CPU can see (vblank, sprite overflow and its
+    timing, the scroll registers), and every access that changes what ends up on screen is
+    appended to a lock-free single producer, single consumer log along with the dot the PPU was
+    at: register writes, the PPUSTATUS and PPUDATA reads that move the scroll registers along,
+    OAM DMA, and the mapper's CHR banks and mirroring. The render thread keeps a shadow machine
+    with its own copy of the PPU, replays the log into it, running the shadow PPU up to each
+    entry's dot first so every scanline is drawn with the state it had at dot 256, and publishes
+    every finished frame. Frame N is drawn while frame N + 1 is emulated.
+
+    The frontend picks up the latest finished frame with nes_render_present(), which doesn't
+    wait and shows the picture a frame late, or with nes_render_sync(), which waits for the
+    render thread to catch up, for frame hashes. Loading a state (see nes_state.h) also waits,
+    then copies the restored PPU into the shadow, so run-ahead only overlaps the real frame.
+
+    'write' is only stored by the emulation thread and 'read' only by the render thread, each on
+    its own cache line, 'read' is stored once an entry has been replayed. A full log makes the
+    emulation thread wait for the render thread, nothing is dropped. The render thread sleeps
+    while the log is empty, it's woken at the end of every frame.
+*/
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "nes_machine.h"
+
+#define NES_RENDER_LOG_SIZE (1 << 14)   /* Entries, a power of two, a nametable upload and an OAM DMA take ~1300 */
+
+/* What a log entry did */
+typedef enum nes_render_kind
+{
+    NES_RENDER_WRITE,       /* Register 'reg' written with 'data' */
+    NES_RENDER_READ,        /* Register 'reg' read */
+    NES_RENDER_OAM,         /* OAM byte 'reg' set to 'data' by OAM DMA */
+    NES_RENDER_MAP,         /* KiB 'reg' of the pattern tables backed by 'mem', see nes_ppu_map() */
+    NES_RENDER_MIRROR,      /* Nametables mirrored as 'data', see nes_ppu_mirror() */
+    NES_RENDER_SKIP,        /* The frame starting is drawn (0) or not (1), see skip_render */
+    NES_RENDER_FRAME        /* The frame is over, 'position' is already in the next one */
+}
+nes_render_kind;
+
+typedef struct nes_render_entry
+{
+    const uint8_t * mem;
+    uint32_t        position;   /* scanline * 341 + dot of the PPU at the time */
+    uint8_t         kind;       /* nes_render_kind */
+    uint8_t         reg;
+    uint8_t         data;
+}
+nes_render_entry;
+
+typedef struct nes_render
+{
+    nes_machine       * machine;    /* The emulated machine */
+    nes_machine       * shadow;     /* The render thread's, only its PPU is used */
+    nes_render_entry  * log;
+
+    pthread_t           thread;
+    pthread_mutex_t     lock;       /* For 'wake', 'stop' and the published frame */
+    pthread_cond_t      wake;
+    bool                stop;
+
+    uint64_t            published;  /* Frames finished, and the last one handed to the frontend */
+    uint64_t            presented;
+    uint8_t             frame[240 * PPU_SCREEN_STRIDE];
+
+    _Alignas(64) atomic_size_t write;
+    _Alignas(64) atomic_size_t read;
+}
+nes_render;
+
+bool nes_render_start(void);
+void nes_render_stop(void);
+void nes_render_free(nes_render * render);
+
+void nes_render_wait(size_t entries);
+void nes_render_frame_start(void);
+void nes_render_frame_end(void);
+bool nes_render_present(void);
+void nes_render_sync(void);
+void nes_render_reload(void);
+
+/* Append an entry at the PPU's current dot, only while nes_current->render is set */
+static inline void nes_render_log(nes_render_kind kind, uint8_t reg, uint8_t data, const uint8_t * mem)
+{
+    nes_render * render = nes_current->render;
+    size_t write = atomic_load_explicit(&render->write, memory_order_relaxed);
+
+    if (write - atomic_load_explicit(&render->read, memory_order_acquire) == NES_RENDER_LOG_SIZE)
+        nes_render_wait(write - NES_RENDER_LOG_SIZE + 1);
+
+    nes_render_entry * entry = &render->log[write & (NES_RENDER_LOG_SIZE - 1)];
+
+    entry->mem      = mem;
+    entry->position = (uint32_t)nes_current->ppu.scanline * 341 + nes_current->ppu.dot;
+    entry->kind     = (uint8_t)kind;
+    entry->reg      = reg;
+    entry->data     = data;
+
+    atomic_store_explicit(&render->write, write + 1, memory_order_release);
+}
@@ -0,0 +1,125 @@
+/* clock_gettime() is POSIX, not C */
+#define _POSIX_C_SOURCE 199309L
+
+#include <stdlib.h>
+#include <time.h>
+
+#include "nes_runahead.h"
+#include "nes_state.h"
+#include "nes_trace.h"
+
+struct nes_runahead
+{
+    nes_state           state;      /* The machine right after the real frame, loaded back after the ones ahead */
+    nes_runahead_stats  stats;
+};
+
+/* Host time in milliseconds, from a clock that never steps back */
+static double runahead_now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (double)ts.tv_sec * 1000.0 + (double)ts.tv_nsec / 1000000.0;
+}
+
+/* Run-ahead for one machine, NULL if out of memory */
+nes_runahead * nes_runahead_create(void)
+{
+    return calloc(1, sizeof(nes_runahead));
+}
+
+void nes_runahead_destroy(nes_runahead * runahead)
+{
+    free(runahead);
+}
+
+/* Emulate one host frame, running 'frames' frames ahead of the real one (input must already be set) */
+void nes_runahead_frame(nes_runahead * runahead, uint8_t frames)
+{
+    nes_runahead_stats * stats = &runahead->stats;
+    double start = runahead_now_ms(), t0, t1;
+
+    if (frames == 0)
+    {
+        nes_current->ppu.skip_render = false;
+        nes_run_frame();
+
+        t0 = runahead_now_ms();
+        stats->real_ms  = t0 - start;
+        stats->save_ms  = 0.0;
+        stats->ahead_ms = 0.0;
+        stats->load_ms  = 0.0;
+    }
+    else
+    {
+        /* The real frame, nobody sees it */
+        nes_current->ppu.skip_render = true;
+        nes_run_frame();
+
+        t0 = runahead_now_ms();
+        NES_TRACE_BEGIN(NES_TRACE_STATE);
+        nes_save_state(&runahead->state);
+        NES_TRACE_END();
+
+        t1 = runahead_now_ms();
+        stats->real_ms = t0 - start;
+        stats->save_ms = t1 - t0;
+
+        /* Frames ahead, only the last one is drawn and none are heard, they get rolled back */
+        nes_current->audio.mute = true;
+
+        for (uint8_t i = 1; i <= frames; i++)
+        {
+            nes_current->ppu.skip_render = (i != frames);
+            nes_run_frame();
+        }
+
+        nes_current->audio.mute = false;
+
+        t0 = runahead_now_ms();
+        NES_TRACE_BEGIN(NES_TRACE_STATE);
+        nes_load_state(&runahead->state);
+        NES_TRACE_END();
+
+        stats->ahead_ms = t0 - t1;
+        stats->load_ms  = runahead_now_ms() - t0;
+    }
+
+    nes_current->ppu.skip_render = false;
+
+    stats->total_ms     = runahead_now_ms() - start;
+    stats->frames_ahead = frames;
+    stats->frames++;
+
+    /* Exponential moving average, so the number stays readable on screen */
+    if (stats->frames == 1)
+        stats->average_total_ms = stats->total_ms;
+    else
+        stats->average_total_ms += (stats->total_ms - stats->average_total_ms) * 0.05;
+
+    if (stats->total_ms > stats->max_total_ms)
+        stats->max_total_ms = stats->total_ms;
+}
+
+/* Emulate one frame nobody sees or hears, for fast-forward */
+void nes_runahead_skip_frame(void)
+{
+    nes_current->ppu.skip_render = true;
+    nes_current->audio.mute      = true;
+
+    nes_run_frame();
+
+    nes_current->ppu.skip_render = false;
+    nes_current->audio.mute      = false;
+}
+
+const nes_runahead_stats * nes_runahead_get_stats(const nes_runahead * runahead)
+{
+    return &runahead->stats;
+}
+
+void nes_runahead_reset_stats(nes_runahead * runahead)
+{
+    runahead->stats = (nes_runahead_stats){ 0 };
+}
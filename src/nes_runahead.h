@@ -0,0 +1,50 @@
+#pragma once
+
+/*
+    nes_runahead.h: Run-ahead input latency reduction
+
+    Games usually react to input a frame or two after reading it. Run-ahead hides that lag
+    by emulating the frames in between and showing the last one, then rewinding:
+
+        1. run the real frame with the current input, without rendering
+        2. save state
+        3. run 'frames' frames ahead with the same input, only the last one is rendered
+        4. load the state saved in 2
+
+    With 'frames' == 0 this is a plain rendered frame. It only pays off if the core can run
+    frames + 1 frames well within a host frame, so every call is timed, see nes_runahead_stats.
+    The state to go back to and the timings live in a nes_runahead the caller owns, one per
+    machine, so machines on other threads can run ahead too.
+
+    Fast-forward runs the frames between two host frames with nes_runahead_skip_frame(), which
+    neither draws nor plays them, and the one after that as usual. A skipped frame leaves
+    everything the CPU can see as a drawn one would, so input movies and RAM hashes don't notice.
+*/
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Host time spent in each part of the last run-ahead frame, in milliseconds */
+typedef struct nes_runahead_stats
+{
+    double      real_ms;        /* The frame that actually advances the game */
+    double      save_ms;        /* nes_save_state() */
+    double      ahead_ms;       /* All of the frames run ahead */
+    double      load_ms;        /* nes_load_state() */
+    double      total_ms;
+
+    double      average_total_ms;
+    double      max_total_ms;
+    uint64_t    frames;         /* Host frames measured */
+    uint8_t     frames_ahead;   /* Frames run ahead during the last host frame */
+}
+nes_runahead_stats;
+
+typedef struct nes_runahead nes_runahead;
+
+nes_runahead * nes_runahead_create(void);
+void nes_runahead_destroy(nes_runahead * runahead);
+void nes_runahead_frame(nes_runahead * runahead, uint8_t frames);
+void nes_runahead_skip_frame(void);
+const nes_runahead_stats * nes_runahead_get_stats(const nes_runahead * runahead);
+void nes_runahead_reset_stats(nes_runahead * runahead);
@@ -0,0 +1,122 @@
+#include "nes_sched.h"
+
+/* Nothing scheduled on the bound machine */
+void nes_sched_init(void)
+{
+    nes_sched * sched = &nes_current->sched;
+
+    sched->next  = UINT64_MAX;
+    sched->count = 0;
+
+    for (uint8_t event = 0; event < NES_EVENT_COUNT; event++)
+        sched->slot[event] = NES_EVENT_COUNT;
+}
+
+static void sched_place(nes_sched * sched, uint8_t index, uint8_t event)
+{
+    sched->heap[index] = event;
+    sched->slot[event] = index;
+}
+
+/* Move the event at 'index' towards the root while it's due before its parent */
+static void sched_up(nes_sched * sched, uint8_t index)
+{
+    uint8_t event = sched->heap[index];
+
+    while (index > 0)
+    {
+        uint8_t parent = (index - 1) / 2;
+
+        if (sched->when[sched->heap[parent]] <= sched->when[event])
+            break;
+
+        sched_place(sched, index, sched->heap[parent]);
+        index = parent;
+    }
+
+    sched_place(sched, index, event);
+}
+
+/* Move the event at 'index' towards the leaves while a child is due before it */
+static void sched_down(nes_sched * sched, uint8_t index)
+{
+    uint8_t event = sched->heap[index];
+
+    for (;;)
+    {
+        uint8_t child = index * 2 + 1;
+
+        if (child >= sched->count)
+            break;
+        if (child + 1 < sched->count && sched->when[sched->heap[child + 1]] < sched->when[sched->heap[child]])
+            child++;
+        if (sched->when[event] <= sched->when[sched->heap[child]])
+            break;
+
+        sched_place(sched, index, sched->heap[child]);
+        index = child;
+    }
+
+    sched_place(sched, index, event);
+}
+
+static void sched_update_next(nes_sched * sched)
+{
+    sched->next = sched->count > 0 ? sched->when[sched->heap[0]] : UINT64_MAX;
+}
+
+/* Have 'event' happen once Total_Cycles reaches 'cycle', instead of whenever it was going to */
+void nes_sched_at(nes_event event, uint64_t cycle)
+{
+    nes_sched * sched = &nes_current->sched;
+    uint8_t index = sched->slot[event];
+
+    sched->when[event] = cycle;
+
+    if (index == NES_EVENT_COUNT)
+    {
+        index = sched->count++;
+        sched_place(sched, index, event);
+    }
+
+    sched_up(sched, index);
+    sched_down(sched, sched->slot[event]);
+    sched_update_next(sched);
+}
+
+void nes_sched_cancel(nes_event event)
+{
+    nes_sched * sched = &nes_current->sched;
+    uint8_t index = sched->slot[event];
+
+    if (index == NES_EVENT_COUNT)
+        return;
+
+    sched->slot[event] = NES_EVENT_COUNT;
+
+    /* The last event fills the hole, from where it may have to go either way */
+    if (index < --sched->count)
+    {
+        uint8_t last = sched->heap[sched->count];
+
+        sched_place(sched, index, last);
+        sched_up(sched, index);
+        sched_down(sched, sched->slot[last]);
+    }
+
+    sched_update_next(sched);
+}
+
+/* Take the earliest event off the schedule if it is due at 'now', NES_EVENT_COUNT if none is */
+nes_event nes_sched_pop(uint64_t now)
+{
+    nes_sched * sched = &nes_current->sched;
+
+    if (sched->next > now)
+        return NES_EVENT_COUNT;
+
+    nes_event event = (nes_event)sched->heap[0];
+
+    nes_sched_cancel(event);
+    return event;
+}
@@ -0,0 +1,41 @@
+#pragma once
+
+/*
+    nes_sched.h: Hardware events at known CPU cycles
+
+    Devices don't get polled from the CPU loop. Whatever will happen at a cycle that can be
+    worked out in advance (the PPU entering vblank with NMI enabled or sprite 0 hitting the
+    background, the APU frame counter or the DMC raising an interrupt, a mapper's counter
+    running out) is put on the bound machine's schedule with nes_sched_at(), keyed on
+    cpu_registers.Total_Cycles, and moved or cancelled when a register write changes it.
+    nes_run_frame() compares Total_Cycles with sched.next once per instruction and only when
+    that is due pops the events with nes_sched_pop() and takes any interrupt they left pending.
+    Translated blocks and skipped idle loops stop short of sched.next as they stop short of the
+    end of the frame.
+
+    The master clock is the CPU cycle counter rather than the 21.47 MHz crystal, the PPU's dots
+    are rounded up to the CPU cycle they fall in, as the CPU only looks between instructions
+    anyway. There is one slot per nes_event, so scheduling an event again moves it. The
+    schedule is part of the machine and of save states.
+*/
+
+#include <stdint.h>
+
+#include "nes_machine.h"
+
+void nes_sched_init(void);
+void nes_sched_at(nes_event event, uint64_t cycle);
+void nes_sched_cancel(nes_event event);
+nes_event nes_sched_pop(uint64_t now);
+
+/* Whether an event is due before the next instruction */
+static inline bool nes_sched_due(void)
+{
+    return nes_current->cpu_registers.Total_Cycles >= nes_current->sched.next;
+}
+
+/* CPU cycles that can run before the next event is due, 0 if it already is */
+static inline uint64_t nes_sched_cycles_left(void)
+{
+    return nes_sched_due() ? 0 : nes_current->sched.next - nes_current->cpu_registers.Total_Cycles;
+}
@@ -0,0 +1,57 @@
+#include <string.h>
+
+#include "nes_render.h"
+#include "nes_state.h"
+
+/* Snapshot the running machine into 'state' */
+void nes_save_state(nes_state * state)
+{
+    state->cpu_bus       = nes_current->cpu_bus;
+    state->cpu_registers = nes_current->cpu_registers;
+    state->controllers   = nes_current->controllers;
+    state->apu           = nes_current->apu;
+    state->sched         = nes_current->sched;
+
+    state->PC_offset         = nes_current->PC_offset;
+    state->current_addr_mode = nes_current->current_addr_mode;
+    state->Break_and_die     = nes_current->Break_and_die;
+
+    memcpy(&state->cpu_mem, &nes_current->cpu_mem, sizeof(nes_current->cpu_mem));
+    memcpy(&state->ppu_bus, &nes_current->ppu_bus, sizeof(nes_current->ppu_bus));
+    memcpy(state->ppu, &nes_current->ppu, sizeof(state->ppu));
+
+    if (nes_current->cartridge.four_screen != NULL)
+        memcpy(state->four_screen, nes_current->cartridge.four_screen, sizeof(state->four_screen));
+}
+
+/* Restore the running machine from 'state', the screen buffer is left untouched */
+void nes_load_state(const nes_state * state)
+{
+    nes_current->cpu_bus       = state->cpu_bus;
+    nes_current->cpu_registers = state->cpu_registers;
+    nes_current->controllers   = state->controllers;
+    nes_current->apu           = state->apu;
+    nes_current->sched         = state->sched;
+
+    nes_current->PC_offset         = state->PC_offset;
+    nes_current->current_addr_mode = state->current_addr_mode;
+    nes_current->Break_and_die     = state->Break_and_die;
+
+    memcpy(&nes_current->cpu_mem, &state->cpu_mem, sizeof(nes_current->cpu_mem));
+    memcpy(&nes_current->ppu_bus, &state->ppu_bus, sizeof(nes_current->ppu_bus));
+    memcpy(&nes_current->ppu, state->ppu, sizeof(state->ppu));
+    nes_current->ppu.sprites_stale = true;
+
+    /* The pointers copied over are the saving machine's, this one's go back in from the banks */
+    nes_ppu_relink();
+
+    if (nes_current->cartridge.four_screen != NULL)
+        memcpy(nes_current->cartridge.four_screen, state->four_screen, sizeof(state->four_screen));
+
+    /* Code decoded or translated from RAM may have been replaced */
+    nes_cpu_code_reloaded();
+
+    /* The render thread's PPU has to go back with this one */
+    if (nes_current->render != NULL)
+        nes_render_reload();
+}
@@ -0,0 +1,46 @@
+#pragma once
+
+/*
+    nes_state.h: In-memory save states
+
+    A save state is a plain copy of everything the CPU and PPU can change, so saving and
+    loading are a handful of memcpy()s and cheap enough to do several times per frame
+    (see nes_runahead.h). The screen buffer is not part of the state, loading a state
+    leaves whatever was last rendered on screen, and neither are the sprite lists, which are
+    worked out again from OAM. PRG-ROM is shared and never written, what's left is under
+    16 KiB, the better part of it CHR-RAM and VRAM. The PPU's host pointers come along with
+    the rest but are rebuilt on load from its mirroring and CHR banks (nes_ppu_relink()), so
+    a state may be loaded into any machine running the same cartridge.
+*/
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "nes_cpu.h"
+
+typedef struct nes_state
+{
+    _6502_cpu_bus        cpu_bus;
+    _6502_cpu_registers  cpu_registers;
+    _6502_cpu_mem        cpu_mem;
+    _nes_ppu_bus         ppu_bus;
+    _nes_controllers     controllers;
+    _nes_apu             apu;
+    nes_sched            sched;
+
+    /* Left over from the last instruction, TSX and unknown opcodes move the PC by it */
+    int8_t               PC_offset;
+    uint8_t              current_addr_mode;
+    bool                 Break_and_die;
+
+    /* The cartridge's extra nametables, only saved and loaded on four-screen boards */
+    uint8_t              four_screen[0x800];
+
+    /* Everything in _nes_ppu up to (not including) the sprite lists and the screen buffer */
+    uint8_t              ppu[NES_PPU_STATE_SIZE];
+}
+nes_state;
+
+void nes_save_state(nes_state * state);
+void nes_load_state(const nes_state * state);
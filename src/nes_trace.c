@@ -0,0 +1,177 @@
+#ifdef NES_TRACE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <stdatomic.h>
+
+#include "nes_trace.h"
+
+#define NES_TRACE_THREADS   64      /* Threads whose events nes_trace_write() can dump */
+
+const nes_trace_zone_info nes_trace_zones[NES_TRACE_ZONE_COUNT] = {
+    [NES_TRACE_OTHER]   = { "other",    false },
+    [NES_TRACE_EMULATE] = { "emulate",  true  },
+    [NES_TRACE_CPU]     = { "cpu",      false },
+    [NES_TRACE_JIT]     = { "jit",      false },
+    [NES_TRACE_MAPPER]  = { "mapper",   false },
+    [NES_TRACE_PPU]     = { "ppu",      false },
+    [NES_TRACE_APU]     = { "apu",      true  },
+    [NES_TRACE_AUDIO]   = { "audio",    true  },
+    [NES_TRACE_STATE]   = { "state",    true  },
+    [NES_TRACE_UI]      = { "ui",       true  },
+    [NES_TRACE_TEXT]    = { "text",     false },
+    [NES_TRACE_PRESENT] = { "present",  true  },
+};
+
+_Thread_local nes_trace_thread nes_trace_self;
+
+static atomic_flag      trace_lock = ATOMIC_FLAG_INIT;
+static nes_trace_log  * trace_logs[NES_TRACE_THREADS];
+static uint32_t         trace_log_count;
+
+static uint64_t         trace_epoch;        /* Ticks at the first nes_trace_attach() */
+static double           trace_ns_per_tick;
+
+static uint64_t trace_now_ns(void)
+{
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+/* First zone on this thread: set up its event log, and time ticks against the wall clock if nobody has yet */
+void nes_trace_attach(void)
+{
+    nes_trace_thread * self = &nes_trace_self;
+
+    self->attached = true;
+    self->zone     = NES_TRACE_OTHER;
+    self->log      = calloc(1, sizeof(nes_trace_log));
+
+    while (atomic_flag_test_and_set(&trace_lock))
+        ;
+
+    if (trace_ns_per_tick == 0.0)
+    {
+#if defined(__x86_64__)
+        /* 10 ms is plenty for rdtsc, which runs at a constant rate on anything recent */
+        uint64_t ns = trace_now_ns(), ticks = nes_trace_ticks(), elapsed;
+
+        while ((elapsed = trace_now_ns() - ns) < 10000000)
+            ;
+
+        trace_ns_per_tick = (double)elapsed / (double)(nes_trace_ticks() - ticks);
+#else
+        trace_ns_per_tick = 1.0;
+#endif
+        trace_epoch = nes_trace_ticks();
+    }
+
+    if (self->log != NULL)
+    {
+        if (trace_log_count < NES_TRACE_THREADS)
+        {
+            self->log->thread = trace_log_count;
+            trace_logs[trace_log_count++] = self->log;
+        }
+        else
+        {
+            free(self->log);
+            self->log = NULL;
+        }
+    }
+
+    atomic_flag_clear(&trace_lock);
+
+    self->last = nes_trace_ticks();
+
+    if (self->log == NULL)
+        fprintf(stderr, "error: No trace log for this thread, its zones are only counted\n");
+}
+
+/* Close the calling thread's host frame, nes_trace_frame_ms() breaks it down */
+void nes_trace_frame(void)
+{
+    nes_trace_thread * self = &nes_trace_self;
+
+    if (!self->attached)
+        nes_trace_attach();
+
+    uint64_t now = nes_trace_ticks();
+
+    self->ticks[self->zone] += now - self->last;
+    self->last = now;
+
+    for (size_t zone = 0; zone < NES_TRACE_ZONE_COUNT; zone++)
+    {
+        self->frame_ms[zone]    = (double)self->ticks[zone] * trace_ns_per_tick / 1000000.0;
+        self->frame_calls[zone] = self->calls[zone];
+        self->ticks[zone]       = 0;
+        self->calls[zone]       = 0;
+    }
+}
+
+/* Milliseconds in each zone during the calling thread's last frame */
+const double * nes_trace_frame_ms(void)
+{
+    return nes_trace_self.frame_ms;
+}
+
+/* Times each zone was entered during the calling thread's last frame */
+const uint64_t * nes_trace_frame_calls(void)
+{
+    return nes_trace_self.frame_calls;
+}
+
+/* Dump every thread's logged events to 'path' as Chrome trace JSON, 0 on success. Threads should be idle by now */
+int nes_trace_write(const char * path)
+{
+    FILE * file = fopen(path, "w");
+
+    if (file == NULL)
+    {
+        fprintf(stderr, "error: failed to open %s for writing: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    fprintf(file, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+
+    bool first = true;
+    double us_per_tick = trace_ns_per_tick / 1000.0;
+
+    for (uint32_t i = 0; i < trace_log_count; i++)
+    {
+        const nes_trace_log * log = trace_logs[i];
+        uint64_t count = log->count < NES_TRACE_EVENTS ? log->count : NES_TRACE_EVENTS;
+
+        fprintf(file, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%u,\"args\":{\"name\":\"thread %u\"}}",
+                first ? "" : ",\n", log->thread, log->thread);
+        first = false;
+
+        for (uint64_t n = log->count - count; n < log->count; n++)
+        {
+            const nes_trace_event * event = &log->events[n % NES_TRACE_EVENTS];
+
+            fprintf(file, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"depth\":%u}}",
+                    nes_trace_zones[event->zone].name, log->thread,
+                    (double)(int64_t)(event->start - trace_epoch) * us_per_tick,
+                    (double)(event->end - event->start) * us_per_tick, event->depth);
+        }
+    }
+
+    fprintf(file, "\n]}\n");
+
+    if (fclose(file) != 0)
+    {
+        fprintf(stderr, "error: failed to write %s\n", path);
+        return -1;
+    }
+
+    return 0;
+}
+
+#endif
@@ -0,0 +1,196 @@
+#pragma once
+
+/*
+    nes_trace.h: Where the host's time goes
+
+    Hot paths are bracketed with NES_TRACE_BEGIN(zone) / NES_TRACE_END() (or NES_TRACE_SCOPE(zone)
+    for the rest of a block). These only exist when NES_TRACE is defined, which the Debug build
+    does (see CMakeLists.txt); everywhere else they compile to nothing.
+
+    Every thread keeps its own counters, no locks or atomics on the way in. Time is read with
+    rdtsc on x86-64 (timespec_get elsewhere) and charged to the innermost open zone only, so the
+    zones of a frame add up to the frame: a mapper callback made while interpreting counts as
+    mapper time, not CPU time. The timers' own cost lands in the enclosing zone, mostly inflating
+    "emulate" around the per-instruction zones. nes_trace_frame() closes a host frame, after
+    which nes_trace_frame_ms() gives the breakdown main.c draws over the debugger.
+
+    Coarse zones (flagged in nes_trace_zones) also log an event per call into a fixed ring of
+    NES_TRACE_EVENTS per thread, which nes_trace_write() dumps as Chrome trace JSON for
+    chrome://tracing, Perfetto or speedscope. Fine grained ones (an instruction, a mapper access)
+    are only counted, logging them would fill the ring in a fraction of a frame.
+*/
+
+#include <stdbool.h>
+#include <stdint.h>
+
+typedef enum nes_trace_zone
+{
+    NES_TRACE_OTHER,        /* Outside every zone: event polling, waiting for vsync */
+    NES_TRACE_EMULATE,      /* nes_run_frame() itself: dispatch, idle loop checks */
+    NES_TRACE_CPU,          /* Interpreted instructions */
+    NES_TRACE_JIT,          /* Translated blocks, and translating them */
+    NES_TRACE_MAPPER,       /* PEEK_MAPPER / POKE_MAPPER callbacks */
+    NES_TRACE_PPU,          /* PPU dots, scanline rendering and palette lookup */
+    NES_TRACE_APU,          /* APU catch-up and band-limited synthesis */
+    NES_TRACE_AUDIO,        /* Handing a frame of audio to the sink */
+    NES_TRACE_STATE,        /* Run-ahead save and load */
+    NES_TRACE_UI,           /* Debugger drawing, text aside */
+    NES_TRACE_TEXT,         /* Text layout and glyph quads */
+    NES_TRACE_PRESENT,      /* Swapping buffers */
+
+    NES_TRACE_ZONE_COUNT
+}
+nes_trace_zone;
+
+#define NES_TRACE_EVENTS    65536   /* Events kept per thread, older ones are overwritten */
+#define NES_TRACE_DEPTH     16      /* Nested zones, deeper ones are ignored */
+
+#ifdef NES_TRACE
+
+#if defined(__x86_64__)
+#include <x86intrin.h>
+#else
+#include <time.h>
+#endif
+
+typedef struct nes_trace_zone_info
+{
+    const char * name;
+    bool         events;    /* Log an event per call for nes_trace_write() */
+}
+nes_trace_zone_info;
+
+extern const nes_trace_zone_info nes_trace_zones[NES_TRACE_ZONE_COUNT];
+
+typedef struct nes_trace_event
+{
+    uint64_t    start, end;     /* In ticks */
+    uint32_t    zone;
+    uint32_t    depth;
+}
+nes_trace_event;
+
+/* A thread's events, kept after the thread is gone so nes_trace_write() still finds them */
+typedef struct nes_trace_log
+{
+    uint32_t            thread;
+    uint64_t            count;      /* Events ever logged, the ring holds the last NES_TRACE_EVENTS */
+    nes_trace_event     events[NES_TRACE_EVENTS];
+}
+nes_trace_log;
+
+typedef struct nes_trace_thread
+{
+    bool                attached;
+    nes_trace_log     * log;            /* NULL if it couldn't be allocated */
+
+    nes_trace_zone      zone;           /* Innermost open zone */
+    uint64_t            last;           /* Ticks when time was last charged to it */
+    uint32_t            depth, overflow;
+
+    struct
+    {
+        nes_trace_zone  parent;
+        uint64_t        start;
+    }
+    stack[NES_TRACE_DEPTH];
+
+    uint64_t            ticks[NES_TRACE_ZONE_COUNT];    /* Since the last nes_trace_frame() */
+    uint64_t            calls[NES_TRACE_ZONE_COUNT];
+
+    double              frame_ms[NES_TRACE_ZONE_COUNT]; /* The last complete frame */
+    uint64_t            frame_calls[NES_TRACE_ZONE_COUNT];
+}
+nes_trace_thread;
+
+extern _Thread_local nes_trace_thread nes_trace_self;
+
+void nes_trace_attach(void);
+void nes_trace_frame(void);
+const double * nes_trace_frame_ms(void);
+const uint64_t * nes_trace_frame_calls(void);
+int nes_trace_write(const char * path);
+
+static inline uint64_t nes_trace_ticks(void)
+{
+#if defined(__x86_64__)
+    return __rdtsc();
+#else
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+#endif
+}
+
+static inline void nes_trace_begin(nes_trace_zone zone)
+{
+    nes_trace_thread * self = &nes_trace_self;
+
+    if (!self->attached)
+        nes_trace_attach();
+
+    if (self->depth == NES_TRACE_DEPTH)
+    {
+        self->overflow++;
+        return;
+    }
+
+    uint64_t now = nes_trace_ticks();
+
+    self->ticks[self->zone] += now - self->last;
+    self->stack[self->depth].parent = self->zone;
+    self->stack[self->depth].start  = now;
+    self->depth++;
+
+    self->zone = zone;
+    self->last = now;
+    self->calls[zone]++;
+}
+
+static inline void nes_trace_end(void)
+{
+    nes_trace_thread * self = &nes_trace_self;
+
+    if (self->overflow > 0)
+    {
+        self->overflow--;
+        return;
+    }
+
+    uint64_t now = nes_trace_ticks();
+
+    self->ticks[self->zone] += now - self->last;
+    self->depth--;
+
+    if (self->log != NULL && nes_trace_zones[self->zone].events)
+    {
+        nes_trace_event * event = &self->log->events[self->log->count++ % NES_TRACE_EVENTS];
+
+        event->start = self->stack[self->depth].start;
+        event->end   = now;
+        event->zone  = self->zone;
+        event->depth = self->depth;
+    }
+
+    self->zone = self->stack[self->depth].parent;
+    self->last = now;
+}
+
+static inline void nes_trace_end_scope(int * scope)
+{
+    (void)scope;
+    nes_trace_end();
+}
+
+#define NES_TRACE_BEGIN(zone)   nes_trace_begin(zone)
+#define NES_TRACE_END()         nes_trace_end()
+#define NES_TRACE_SCOPE(zone)   __attribute__((cleanup(nes_trace_end_scope))) int nes_trace_scope_ = (nes_trace_begin(zone), 0)
+
+#else
+
+#define NES_TRACE_BEGIN(zone)   ((void)0)
+#define NES_TRACE_END()         ((void)0)
+#define NES_TRACE_SCOPE(zone)   ((void)0)
+
+#endif
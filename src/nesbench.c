@@ -0,0 +1,503 @@
+/*
+    nesbench: Microbenchmarks of the emulator's hot kernels
+
+    USAGE: nesbench [-o REPORT] [-f FILTER] [-s SAMPLES]
+
+    Every benchmark times a kernel over enough operations for a sample to take at least
+    BENCH_SAMPLE_NS, then takes SAMPLES samples (default 25) and reports the minimum, median and
+    99th percentile time per operation in nanoseconds. -f only runs benchmarks whose name holds
+    FILTER. The report is JSON, one benchmark per line, for nesbenchcmp:
+
+        cpu/XX_OPC_MODE     every official opcode the interpreter implements, run over and over
+        frame/interp|jit    a whole frame of a small ALU/RAM loop, CPU and PPU
+        mem/peek|poke_*     PEEK()/POKE() into RAM, ROM, PPU and I/O registers
+        mem/oam_dma         a $4014 write copying a page of RAM into OAM
+        ppu/...             scanline rendering, single dots, idle skips, sprite evaluation and sprite 0 hits
+        apu/end_frame       synthesizing a frame of audio
+        state/save|load     run-ahead snapshots
+        hash/screen|ram     frame hashes
+
+    Each benchmark runs on a machine of its own with a synthetic mapper 0 program, so the numbers
+    don't depend on any ROM.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include "nes_cpu.h"
+#include "nes_state.h"
+#include "nes_framehash.h"
+
+#define BENCH_SAMPLE_NS     1000000     /* Shortest sample, so the clock's resolution doesn't matter */
+#define BENCH_MAX_SAMPLES   1001
+
+static FILE *       bench_out;
+static const char * bench_filter;
+static uint32_t     bench_samples = 25;
+static bool         bench_first   = true;
+
+/* Keeps reads from being optimized away */
+static volatile uint8_t bench_sink;
+
+static const char * bench_mode_str[] = {
+    [ABSX] = "ABSX", [ABSY] = "ABSY", [INDX] = "INDX", [INDY] = "INDY", [ZPX] = "ZPX", [ZPY] = "ZPY", [ACC] = "ACC",
+    [IMM]  = "IMM",  [ZP]   = "ZP",   [ABS]  = "ABS",  [REL]  = "REL",  [IND] = "IND", [IMP] = "IMP", [NONE] = "NONE",
+};
+
+static uint64_t bench_now_ns(void)
+{
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static int bench_compare(const void * a, const void * b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+
+    return (x > y) - (x < y);
+}
+
+static bool bench_selected(const char * name)
+{
+    return bench_filter == NULL || strstr(name, bench_filter) != NULL;
+}
+
+/* Time 'run' on the bound machine and add a line to the report */
+static void bench_measure(const char * name, void (*run)(uint64_t ops))
+{
+    static double samples[BENCH_MAX_SAMPLES];
+    uint64_t ops = 1, elapsed;
+
+    /* Warm up (decode caches, translated blocks) while finding how many operations fill a sample */
+    for (;;)
+    {
+        uint64_t start = bench_now_ns();
+        run(ops);
+        elapsed = bench_now_ns() - start;
+
+        if (elapsed >= BENCH_SAMPLE_NS || ops >= (1ULL << 40))
+            break;
+
+        ops *= elapsed < BENCH_SAMPLE_NS / 16 ? 8 : 2;
+    }
+
+    for (uint32_t i = 0; i < bench_samples; i++)
+    {
+        uint64_t start = bench_now_ns();
+        run(ops);
+        samples[i] = (double)(bench_now_ns() - start) / (double)ops;
+    }
+
+    qsort(samples, bench_samples, sizeof(double), bench_compare);
+
+    uint32_t p99 = (bench_samples * 99 + 99) / 100 - 1;
+
+    fprintf(bench_out, "%s{\"name\": \"%s\", \"ops\": %llu, \"samples\": %u, \"min_ns\": %.3f, \"median_ns\": %.3f, \"p99_ns\": %.3f}",
+            bench_first ? "" : ",\n", name, (unsigned long long)ops, bench_samples,
+            samples[0], samples[bench_samples / 2], samples[p99]);
+    fflush(bench_out);
+
+    bench_first = false;
+}
+
+/* A machine running mapper 0 with 'prg' as its 32 KiB PRG-ROM, from $8000, left as it is while the machine runs */
+static nes_machine * bench_machine(const uint8_t * prg)
+{
+    nes_machine * machine = nes_machine_create();
+
+    if (machine == NULL)
+    {
+        fprintf(stderr, "error: Failed to allocate a machine\n");
+        exit(EXIT_FAILURE);
+    }
+
+    nes_machine_bind(machine);
+
+    machine->cartridge.PRG_ROM      = prg;
+    machine->cartridge.PRG_ROM_size = 0x8000;
+    machine->PEEK_MAPPER = PEEK_000;
+    machine->POKE_MAPPER = POKE_000;
+
+    nes_cpu_map(0x8000, 0x8000, (uint8_t *)prg, false);
+
+    machine->cpu_registers.PC = 0x8000;
+    machine->cpu_registers.SP = 0xFF;
+
+    return machine;
+}
+
+/* The instruction at $8000 over and over, from the same registers so jumps and returns don't wander off */
+static void bench_cpu(uint64_t ops)
+{
+    while (ops-- > 0)
+    {
+        interpret_step();
+
+        nes_current->cpu_registers.PC     = 0x8000;
+        nes_current->cpu_registers.SP     = 0xFD;
+        nes_current->cpu_registers.Cycles = 0;
+    }
+}
+
+static void bench_opcodes(uint8_t * prg)
+{
+    for (int opcode = 0; opcode < 256; opcode++)
+    {
+        if (nes_cpu_opcode_str[opcode] == NULL)
+            continue;
+
+        /*
+            Operands are $0300 for absolute modes, $10 for zero page ones and $10/$11 as the pointer
+            to $0300 for indirect ones, X and Y stay 0. Branches go to the next instruction taken
+            or not.
+        */
+        memset(prg, 0xEA, 0x8000);
+        memcpy(prg, (uint8_t[]){ (uint8_t)opcode, 0x00, 0x03 }, 3);
+
+        nes_machine * machine = bench_machine(prg);
+        const nes_cpu_decoded * insn = nes_cpu_predecode(0x8000);
+
+        switch (insn->mode)
+        {
+            case ZP: case ZPX: case ZPY:    prg[1] = 0x10;                  break;
+            case INDX: case INDY:           prg[1] = 0x10; prg[2] = 0x11;   break;
+            case IMM:                       prg[1] = 0x01;                  break;
+            case REL:                       prg[1] = 0x00;                  break;
+        }
+
+        char name[64];
+        snprintf(name, sizeof(name), "cpu/%02X_%s_%s", opcode, nes_cpu_opcode_str[opcode], bench_mode_str[insn->mode]);
+
+        /* Named but not implemented, the interpreter would only complain about it */
+        bool known = insn->cycles != 0;
+
+        nes_machine_destroy(machine);
+
+        if (!known || !bench_selected(name))
+            continue;
+
+        machine = bench_machine(prg);
+        machine->cpu_mem.ram[0x10] = 0x00;
+        machine->cpu_mem.ram[0x11] = 0x03;
+        machine->cpu_registers.SP  = 0xFD;
+
+        bench_measure(name, bench_cpu);
+        nes_machine_destroy(machine);
+    }
+}
+
+static void bench_frame(uint64_t ops)
+{
+    while (ops-- > 0)
+        nes_run_frame();
+}
+
+/* Sums a table in RAM into another, the kind of loop games spend their frames in */
+static const uint8_t bench_loop[] = {
+    0xA2, 0x00,         /* LDX #$00     */
+    0xBD, 0x00, 0x03,   /* LDA $0300,X  */
+    0x18,               /* CLC          */
+    0x7D, 0x00, 0x04,   /* ADC $0400,X  */
+    0x9D, 0x00, 0x05,   /* STA $0500,X  */
+    0xE8,               /* INX          */
+    0xD0, 0xF3,         /* BNE -13      */
+    0xE6, 0x10,         /* INC $10      */
+    0x4C, 0x00, 0x80,   /* JMP $8000    */
+};
+
+static void bench_frames(uint8_t * prg)
+{
+    memset(prg, 0xEA, 0x8000);
+    memcpy(prg, bench_loop, sizeof(bench_loop));
+
+    if (bench_selected("frame/interp"))
+    {
+        nes_machine * machine = bench_machine(prg);
+        bench_measure("frame/interp", bench_frame);
+        nes_machine_destroy(machine);
+    }
+
+    /* The same frames with nothing drawn, as fast-forward and headless runs skip them */
+    if (bench_selected("frame/skip_render"))
+    {
+        nes_machine * machine = bench_machine(prg);
+
+        machine->ppu.skip_render = true;
+        bench_measure("frame/skip_render", bench_frame);
+
+        nes_machine_destroy(machine);
+    }
+
+    if (bench_selected("frame/jit"))
+    {
+        nes_machine * machine = bench_machine(prg);
+
+        if (nes_jit_enable())
+        {
+            bench_measure("frame/jit", bench_frame);
+
+            /* The loop runs from PRG-ROM, without blocks this only timed the interpreter again */
+            if (nes_jit_get_stats()->blocks == 0)
+            {
+                fprintf(stderr, "error: frame/jit translated no blocks\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+
+        nes_machine_destroy(machine);
+    }
+}
+
+static uint16_t bench_addr;
+static uint16_t bench_mask;
+
+static void bench_peek(uint64_t ops)
+{
+    uint8_t sum = 0;
+
+    for (uint64_t i = 0; i < ops; i++)
+        sum += PEEK(bench_addr + (uint16_t)(i & bench_mask));
+
+    bench_sink = sum;
+}
+
+static void bench_poke(uint64_t ops)
+{
+    for (uint64_t i = 0; i < ops; i++)
+        POKE(bench_addr + (uint16_t)(i & bench_mask), (uint8_t)i);
+}
+
+/* Sprite DMA from RAM, as games do every frame */
+static void bench_oam_dma(uint64_t ops)
+{
+    for (uint64_t i = 0; i < ops; i++)
+        POKE(0x4014, 0x02);
+}
+
+static void bench_memory(uint8_t * prg)
+{
+    /* Controller reads and strobes stand in for the I/O registers, they are the cheapest to touch */
+    static const struct
+    {
+        const char * name;
+        void       (*run)(uint64_t ops);
+        uint16_t     addr, mask;
+    }
+    benches[] = {
+        { "mem/peek_ram",  bench_peek, 0x0000, 0x07FF },
+        { "mem/peek_rom",  bench_peek, 0x8000, 0x7FFF },
+        { "mem/peek_io",   bench_peek, 0x4016, 0x0000 },
+        { "mem/peek_ppu",  bench_peek, 0x2002, 0x0000 },
+        { "mem/poke_ram",  bench_poke, 0x0000, 0x07FF },
+        { "mem/poke_rom",  bench_poke, 0x8000, 0x7FFF },
+        { "mem/poke_io",   bench_poke, 0x4016, 0x0000 },
+        { "mem/poke_ppu",  bench_poke, 0x2006, 0x0000 },
+        { "mem/oam_dma",   bench_oam_dma, 0x4014, 0x0000 },
+    };
+
+    memset(prg, 0xEA, 0x8000);
+
+    for (size_t i = 0; i < sizeof(benches) / sizeof(benches[0]); i++)
+    {
+        if (!bench_selected(benches[i].name))
+            continue;
+
+        nes_machine * machine = bench_machine(prg);
+
+        bench_addr = benches[i].addr;
+        bench_mask = benches[i].mask;
+        bench_measure(benches[i].name, benches[i].run);
+
+        nes_machine_destroy(machine);
+    }
+}
+
+static void bench_render_scanline(uint64_t ops)
+{
+    for (uint64_t i = 0; i < ops; i++)
+        PPU_render_scanline((uint16_t)(i % 240));
+}
+
+static void bench_ppu_tick(uint64_t ops)
+{
+    while (ops-- > 0)
+        PPU_tick();
+}
+
+static void bench_ppu_skip(uint64_t ops)
+{
+    while (ops-- > 0)
+        PPU_skip(PPU_dots_to_next_event());
+}
+
+/* Sprite lists of a whole frame worked out again, as after every OAM DMA */
+static void bench_sprite_eval(uint64_t ops)
+{
+    _nes_ppu * ppu = &nes_current->ppu;
+
+    /* Sprites spread down the screen, so some lines have none and some more than 8 */
+    for (int i = 0; i < 64; i++)
+        ppu->OAM[i * 4] = (uint8_t)(i * 37 % 240);
+
+    while (ops-- > 0)
+    {
+        ppu->sprites_stale = true;
+        PPU_sprite_lists(ppu);
+    }
+}
+
+/* Sprite 0's hit on a line worked out from the pattern tables, as at dot 257 of every line above it */
+static void bench_sprite0(uint64_t ops)
+{
+    _nes_ppu * ppu = &nes_current->ppu;
+
+    /* Solid tiles everywhere, the sprite is over a tile boundary and hits at its first pixel */
+    memset(&nes_current->ppu_bus.chr_ram[0x0010], 0xFF, 16);
+    memset(nes_current->ppu_bus.vram, 0x01, 0x3C0);
+    memcpy(ppu->OAM, (const uint8_t[]){ 99, 0x01, 0x00, 123 }, 4);
+    ppu->PPU_registers[PPUMASK] = 0x1E;
+
+    while (ops-- > 0)
+        bench_sink += (uint8_t)PPU_sprite0_dot(ppu, 100);
+}
+
+static void bench_apu_end_frame(uint64_t ops)
+{
+    while (ops-- > 0)
+    {
+        nes_current->cpu_registers.Total_Cycles += 29781;
+        nes_apu_end_frame();
+    }
+}
+
+static nes_state bench_state;
+
+static void bench_state_save(uint64_t ops)
+{
+    while (ops-- > 0)
+        nes_save_state(&bench_state);
+}
+
+static void bench_state_load(uint64_t ops)
+{
+    while (ops-- > 0)
+        nes_load_state(&bench_state);
+}
+
+static void bench_hash_screen(uint64_t ops)
+{
+    while (ops-- > 0)
+        bench_sink = (uint8_t)nes_framehash_screen();
+}
+
+static void bench_hash_ram(uint64_t ops)
+{
+    while (ops-- > 0)
+        bench_sink = (uint8_t)nes_framehash_ram();
+}
+
+/* Kernels that run on a machine in any state */
+static void bench_kernels(uint8_t * prg)
+{
+    static const struct
+    {
+        const char * name;
+        void       (*run)(uint64_t ops);
+    }
+    benches[] = {
+        { "ppu/render_scanline", bench_render_scanline },
+        { "ppu/tick",            bench_ppu_tick },
+        { "ppu/skip",            bench_ppu_skip },
+        { "ppu/sprite_eval",     bench_sprite_eval },
+        { "ppu/sprite0",         bench_sprite0 },
+        { "apu/end_frame",       bench_apu_end_frame },
+        { "state/save",          bench_state_save },
+        { "state/load",          bench_state_load },
+        { "hash/screen",         bench_hash_screen },
+        { "hash/ram",            bench_hash_ram },
+    };
+
+    memset(prg, 0xEA, 0x8000);
+
+    for (size_t i = 0; i < sizeof(benches) / sizeof(benches[0]); i++)
+    {
+        if (!bench_selected(benches[i].name))
+            continue;
+
+        nes_machine * machine = bench_machine(prg);
+
+        nes_save_state(&bench_state);
+        bench_measure(benches[i].name, benches[i].run);
+
+        nes_machine_destroy(machine);
+    }
+}
+
+int main(int argc, char ** argv)
+{
+    const char * report_path = NULL;
+
+    for (int i = 1; i < argc; i += 2)
+    {
+        if (i + 1 >= argc)
+        {
+            fprintf(stderr, "error: Invalid usage. USAGE:\n./nesbench [-o REPORT] [-f FILTER] [-s SAMPLES]\n");
+            return -1;
+        }
+
+        if (strcmp(argv[i], "-o") == 0)
+            report_path = argv[i + 1];
+        else if (strcmp(argv[i], "-f") == 0)
+            bench_filter = argv[i + 1];
+        else if (strcmp(argv[i], "-s") == 0)
+            bench_samples = (uint32_t)strtoul(argv[i + 1], NULL, 10);
+        else
+        {
+            fprintf(stderr, "error: unknown option %s\n", argv[i]);
+            return -1;
+        }
+    }
+
+    if (bench_samples == 0 || bench_samples > BENCH_MAX_SAMPLES)
+    {
+        fprintf(stderr, "error: SAMPLES must be 1 to %d\n", BENCH_MAX_SAMPLES);
+        return -1;
+    }
+
+    bench_out = stdout;
+    if (report_path != NULL && (bench_out = fopen(report_path, "w")) == NULL)
+    {
+        fprintf(stderr, "error: failed to open %s for writing: %s\n", report_path, strerror(errno));
+        return -1;
+    }
+
+    uint8_t * prg = malloc(0x8000);
+    if (prg == NULL)
+    {
+        fprintf(stderr, "error: Out of memory\n");
+        return -1;
+    }
+
+    fprintf(bench_out, "{\"unit\": \"ns/op\", \"benchmarks\": [\n");
+
+    bench_opcodes(prg);
+    bench_frames(prg);
+    bench_memory(prg);
+    bench_kernels(prg);
+
+    fprintf(bench_out, "\n]}\n");
+
+    free(prg);
+
+    if (bench_out != stdout)
+        fclose(bench_out);
+
+    return 0;
+}
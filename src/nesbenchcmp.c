@@ -0,0 +1,144 @@
+/*
+    nesbenchcmp: Compare two nesbench reports
+
+    USAGE: nesbenchcmp [BASELINE REPORT] [NEW REPORT] [THRESHOLD %]
+
+    A benchmark has regressed when both its median and its minimum time per operation grew by
+    more than THRESHOLD percent (5 by default). Requiring both keeps one noisy sample from
+    flagging anything. Regressions and improvements are printed along with benchmarks only one
+    report has. The exit code is 1 if anything regressed and 0 otherwise.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+
+typedef struct bench_result
+{
+    char    name[128];
+    double  min, median, p99;
+    bool    matched;
+}
+bench_result;
+
+/* Read the benchmarks of a report, one per line as nesbench writes them, NULL on failure */
+static bench_result * read_report(const char * path, size_t * count)
+{
+    FILE * file = fopen(path, "r");
+
+    if (file == NULL)
+    {
+        fprintf(stderr, "error: failed to open %s for reading: %s\n", path, strerror(errno));
+        return NULL;
+    }
+
+    bench_result * results = NULL;
+    size_t capacity = 0;
+    char line[512];
+
+    *count = 0;
+
+    while (fgets(line, sizeof(line), file))
+    {
+        bench_result result = { 0 };
+        const char * start = strstr(line, "{\"name\":");
+
+        if (start == NULL || sscanf(start, "{\"name\": \"%127[^\"]\", \"ops\": %*u, \"samples\": %*u, \"min_ns\": %lf, \"median_ns\": %lf, \"p99_ns\": %lf",
+                                    result.name, &result.min, &result.median, &result.p99) != 4)
+            continue;
+
+        if (*count == capacity)
+        {
+            capacity = capacity ? capacity * 2 : 256;
+            bench_result * grown = realloc(results, capacity * sizeof(bench_result));
+
+            if (grown == NULL)
+            {
+                fprintf(stderr, "error: Out of memory reading %s\n", path);
+                free(results);
+                fclose(file);
+                return NULL;
+            }
+
+            results = grown;
+        }
+
+        results[(*count)++] = result;
+    }
+
+    fclose(file);
+    return results;
+}
+
+int main(int argc, char ** argv)
+{
+    if (argc < 3 || argc > 4)
+    {
+        fprintf(stderr, "error: Invalid usage. USAGE:\n./nesbenchcmp [BASELINE REPORT] [NEW REPORT] [THRESHOLD %%]\n");
+        return -1;
+    }
+
+    double threshold = argc == 4 ? strtod(argv[3], NULL) : 5.0;
+    size_t base_count, new_count;
+
+    bench_result * base  = read_report(argv[1], &base_count);
+    bench_result * fresh = base ? read_report(argv[2], &new_count) : NULL;
+
+    if (fresh == NULL)
+    {
+        free(base);
+        return -1;
+    }
+
+    size_t regressions = 0, improvements = 0;
+
+    for (size_t i = 0; i < new_count; i++)
+    {
+        bench_result * now = &fresh[i];
+        bench_result * was = NULL;
+
+        for (size_t j = 0; j < base_count && was == NULL; j++)
+        {
+            if (!base[j].matched && strcmp(base[j].name, now->name) == 0)
+                was = &base[j];
+        }
+
+        if (was == NULL)
+        {
+            printf("new          %-28s %12.3f ns\n", now->name, now->median);
+            continue;
+        }
+
+        was->matched = true;
+
+        double median = (now->median / was->median - 1.0) * 100.0;
+        double min    = (now->min / was->min - 1.0) * 100.0;
+
+        if (median > threshold && min > threshold)
+        {
+            printf("REGRESSION   %-28s %12.3f -> %12.3f ns  %+7.1f%%\n", now->name, was->median, now->median, median);
+            regressions++;
+        }
+        else if (median < -threshold && min < -threshold)
+        {
+            printf("improvement  %-28s %12.3f -> %12.3f ns  %+7.1f%%\n", now->name, was->median, now->median, median);
+            improvements++;
+        }
+    }
+
+    for (size_t j = 0; j < base_count; j++)
+    {
+        if (!base[j].matched)
+            printf("gone         %-28s %12.3f ns\n", base[j].name, base[j].median);
+    }
+
+    printf("%zu regressions, %zu improvements beyond %.1f%% in %zu benchmarks\n", regressions, improvements, threshold, new_count);
+
+    free(base);
+    free(fresh);
+
+    return regressions > 0 ? 1 : 0;
+}
@@ -0,0 +1,675 @@
+/*
+    nesfarm: Run every ROM in a directory against one or more input scripts, in parallel
+
+    USAGE: nesfarm [ROM DIR] [FRAMES] [-i INPUT SCRIPT OR DIR] [-j THREADS] [-o REPORT] [-l LOG DIR] [-a AUDIO DIR] [-c CORE] [-p PROFILE DIR] [-d CDL DIR] [-s SKIP] [-r AHEAD]
+
+    Every ROM/input pair is one task, emulated on its own nes_machine by a pool of worker
+    threads. Each worker owns a deque of tasks, pops from its own end and steals from the far
+    end of another worker's deque once it runs dry, so a few slow ROMs don't leave cores idle.
+
+    Input scripts are text files with one "FRAME PAD1 PAD2" line per change, pads in hex
+    (bit 0 = A ... bit 7 = Right), held until the next line. '#' starts a comment. Files ending
+    in .nesmov are movies (see nes_movie.h) and only run on the ROM they were recorded on, from
+    power-on, releasing all buttons once they end. Without -i every ROM runs once with no
+    buttons pressed.
+
+    The report has one line per run: ROM, input, frames, all frame hashes chained together,
+    the last frame's hash, the final RAM hash, the hash of all audio samples, run time,
+    emulated frames per second and the share of the run time spent hashing. With -l every run
+    also writes a per-frame hash log (see nes_framehash.h) to LOG DIR, named after the ROM and
+    input script, for nesframecmp. With -a it writes the run's audio to a WAV file in
+    AUDIO DIR, otherwise audio goes to a null sink, so the timings always include audio.
+
+    -c picks the CPU core: "interp" (the default) or "jit", which translates hot code to x86-64
+    (see nes_jit.h). Both give the same hashes, so two reports can be diffed.
+
+    With -p every run is profiled (sampling, see nes_profile.h) and saves a pprof profile to
+    PROFILE DIR, named after the ROM and input script with a .pb extension.
+
+    With -d every run keeps a code/data log (see nes_coverage.h) and saves it to CDL DIR with a
+    .cdl extension, to see how much of each ROM the inputs reach. Runs with a log stay in the
+    interpreter even with -c jit.
+
+    -s skips drawing SKIP frames out of every SKIP + 1 (the last frame is always drawn), as
+    fast-forward does. Only drawn frames go into the frame chain, the others log a screen hash
+    of 0, so RAM is compared against a run that drew every frame with nesframecmp -ram. -s all
+    never draws or plays anything and runs headless machines (see nes_machine_headless()), the
+    smallest there are, for large batches that only compare RAM.
+
+    -r checks save states the way run-ahead uses them: every frame goes through
+    nes_runahead_frame(), which saves a state after it, runs AHEAD more frames nobody hears and
+    loads the state back (see nes_runahead.h). The picture is the last frame run ahead, as a
+    player would see it, but the RAM hashes and the audio have to be the same as without -r
+    (nesframecmp -ram), or something the CPU can see was left out of nes_state.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <time.h>
+
+#include <dirent.h>
+#include <pthread.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <unistd.h>
+#endif
+
+#include "nes_cpu.h"
+#include "nes_runahead.h"
+#include "nes_hash.h"
+#include "nes_framehash.h"
+#include "nes_movie.h"
+#include "nes_audio_sink.h"
+#include "nes_jit.h"
+#include "nes_profile.h"
+#include "nes_coverage.h"
+
+/* An input script, pads[i] is held from frames[i] onwards, or a movie */
+typedef struct farm_input
+{
+    char      * path;
+    uint32_t  * frames;
+    uint8_t   (*pads)[2];
+    size_t      count;
+    nes_movie * movie;
+}
+farm_input;
+
+/* One ROM/input pair and its results */
+typedef struct farm_task
+{
+    const char       * rom;
+    const farm_input * input;
+
+    bool        ok;
+    uint64_t    frame_chain;    /* Hash of every frame hash, in order */
+    uint64_t    last_frame;     /* Hash of the last frame's screen */
+    uint64_t    ram;            /* Hash of CPU RAM after the last frame */
+    uint64_t    audio;          /* Hash of every audio sample */
+    double      ms;
+    double      hash_ms;        /* Part of 'ms' spent hashing */
+}
+farm_task;
+
+/* Per-worker task deque, the owner pops from the tail, thieves take from the head */
+typedef struct farm_deque
+{
+    pthread_mutex_t lock;
+    size_t        * tasks;
+    size_t          head, tail;
+}
+farm_deque;
+
+static farm_task  * farm_tasks;
+static farm_deque * farm_deques;
+static size_t       farm_worker_count;
+static uint32_t     farm_frames;
+static const char * farm_log_dir;
+static const char * farm_audio_dir;
+static bool         farm_jit;
+static const char * farm_profile_dir;
+static const char * farm_cdl_dir;
+static uint32_t     farm_skip;
+static bool         farm_headless;
+static uint8_t      farm_ahead;
+
+/* Host time in milliseconds */
+static double farm_now_ms(void)
+{
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+
+    return (double)ts.tv_sec * 1000.0 + (double)ts.tv_nsec / 1000000.0;
+}
+
+/* Last path component without its extension, for naming logs */
+static void farm_base_name(const char * path, char * name, size_t size)
+{
+    const char * slash = strrchr(path, '/');
+    const char * start = slash ? slash + 1 : path;
+    const char * dot   = strrchr(start, '.');
+    size_t len = dot ? (size_t)(dot - start) : strlen(start);
+
+    if (len >= size)
+        len = size - 1;
+
+    memcpy(name, start, len);
+    name[len] = '\0';
+}
+
+/* Path of a task's output file in 'dir', named after the ROM and input */
+static void farm_output_path(const farm_task * task, const char * dir, const char * extension, char * path, size_t size)
+{
+    char rom[256], input[256];
+
+    farm_base_name(task->rom, rom, sizeof(rom));
+    if (task->input != NULL)
+    {
+        farm_base_name(task->input->path, input, sizeof(input));
+        snprintf(path, size, "%s/%s.%s%s", dir, rom, input, extension);
+    }
+    else
+        snprintf(path, size, "%s/%s%s", dir, rom, extension);
+}
+
+/* Open the per-frame hash log of a task in farm_log_dir */
+static nes_framehash_log * farm_open_log(const farm_task * task)
+{
+    char path[1024];
+
+    farm_output_path(task, farm_log_dir, ".hashes", path, sizeof(path));
+    return nes_framehash_open(path, task->rom);
+}
+
+/* A WAV sink in farm_audio_dir, or a null sink */
+static nes_audio_sink * farm_open_audio(const farm_task * task, nes_audio_ring * ring)
+{
+    char path[1024];
+
+    if (farm_audio_dir == NULL)
+        return nes_audio_sink_null(ring);
+
+    farm_output_path(task, farm_audio_dir, ".wav", path, sizeof(path));
+    return nes_audio_sink_wav(ring, path);
+}
+
+/* Emulate one task start to finish on a fresh machine */
+static void farm_run(farm_task * task)
+{
+    double start = farm_now_ms();
+    nes_machine * machine = nes_machine_create();
+
+    if (machine == NULL)
+    {
+        fprintf(stderr, "error: Failed to allocate a machine for %s\n", task->rom);
+        return;
+    }
+
+    nes_machine_bind(machine);
+
+    if (farm_headless)
+        nes_machine_headless();
+
+    if (nes_load_rom(task->rom, &machine->cartridge) != 0 || (farm_jit && !nes_jit_enable())
+        || (farm_profile_dir != NULL && !nes_profile_enable(NES_PROFILE_PERIOD))
+        || (farm_cdl_dir != NULL && !nes_coverage_enable()))
+    {
+        nes_machine_destroy(machine);
+        return;
+    }
+
+    /* A frame is ~800 samples, the sink drains the ring after every one */
+    nes_audio_ring * ring = nes_audio_ring_create(4096);
+    nes_audio_sink * sink = ring ? farm_open_audio(task, ring) : NULL;
+
+    if (sink == NULL)
+    {
+        nes_audio_ring_destroy(ring);
+        nes_machine_destroy(machine);
+        return;
+    }
+
+    machine->audio.ring = ring;
+
+    const farm_input * input = task->input;
+    size_t next_input = 0;
+
+    /* Movies keep their playback position, so every task plays its own copy */
+    bool playing = input != NULL && input->movie != NULL;
+    nes_movie movie = { 0 };
+
+    if (playing)
+    {
+        movie = *input->movie;
+
+        if (nes_movie_state_hash() != movie.state_hash)
+        {
+            fprintf(stderr, "error: %s starts from a different machine state than %s\n", input->path, task->rom);
+            nes_audio_sink_close(sink);
+            nes_audio_ring_destroy(ring);
+            nes_machine_destroy(machine);
+            return;
+        }
+    }
+
+    nes_framehash_log * log = farm_log_dir ? farm_open_log(task) : NULL;
+    nes_hash_state chain;
+    double hash_ms = 0.0;
+
+    /* Only for -r, it holds a ~15 KiB save state */
+    nes_runahead * runahead = farm_ahead > 0 ? nes_runahead_create() : NULL;
+
+    if (farm_ahead > 0 && runahead == NULL)
+    {
+        fprintf(stderr, "error: Failed to allocate run-ahead for %s\n", task->rom);
+        nes_framehash_close(log);
+        nes_audio_sink_close(sink);
+        nes_audio_ring_destroy(ring);
+        nes_machine_destroy(machine);
+        return;
+    }
+
+    nes_hash_init(&chain, 0);
+
+    for (uint32_t frame = 0; frame < farm_frames; frame++)
+    {
+        if (playing)
+            nes_movie_play_frame(&movie);
+
+        while (input != NULL && next_input < input->count && input->frames[next_input] <= frame)
+        {
+            machine->pad[0] = input->pads[next_input][0];
+            machine->pad[1] = input->pads[next_input][1];
+            next_input++;
+        }
+
+        bool drawn = !farm_headless && ((frame + 1) % (farm_skip + 1) == 0 || frame + 1 == farm_frames);
+
+        machine->ppu.skip_render = !drawn;
+
+        if (runahead != NULL)
+            nes_runahead_frame(runahead, farm_ahead);
+        else
+            nes_run_frame();
+
+        nes_audio_sink_frame(sink);
+
+        double hash_start = farm_now_ms();
+
+        if (drawn)
+        {
+            task->last_frame = nes_framehash_screen();
+            nes_hash_update(&chain, &task->last_frame, sizeof(task->last_frame));
+        }
+
+        if (log != NULL)
+            nes_framehash_write(log, drawn ? task->last_frame : 0, nes_framehash_ram());
+
+        hash_ms += farm_now_ms() - hash_start;
+    }
+
+    nes_runahead_destroy(runahead);
+
+    /* Every ROM has code hot enough to translate, a JIT run without any only ran the interpreter (-d always does) */
+    if (farm_jit && farm_cdl_dir == NULL && nes_jit_get_stats()->blocks == 0)
+        fprintf(stderr, "warning: %s ran with -c jit but translated no code\n", task->rom);
+
+    task->frame_chain = nes_hash_final(&chain);
+    task->ram         = nes_framehash_ram();
+    task->audio       = nes_audio_sink_hash(sink);
+    task->ms          = farm_now_ms() - start;
+    task->hash_ms     = hash_ms;
+    task->ok          = true;
+
+    if (farm_profile_dir != NULL)
+    {
+        char path[1024];
+
+        farm_output_path(task, farm_profile_dir, ".pb", path, sizeof(path));
+        nes_profile_write(path, task->rom);
+    }
+
+    if (farm_cdl_dir != NULL)
+    {
+        char path[1024];
+
+        farm_output_path(task, farm_cdl_dir, ".cdl", path, sizeof(path));
+        nes_coverage_write(path);
+    }
+
+    nes_framehash_close(log);
+    nes_audio_sink_close(sink);
+    nes_audio_ring_destroy(ring);
+    nes_machine_destroy(machine);
+}
+
+/* Take a task from our own deque */
+static bool farm_pop(farm_deque * deque, size_t * task)
+{
+    bool found = false;
+
+    pthread_mutex_lock(&deque->lock);
+    if (deque->tail > deque->head)
+    {
+        *task = deque->tasks[--deque->tail];
+        found = true;
+    }
+    pthread_mutex_unlock(&deque->lock);
+
+    return found;
+}
+
+/* Take the oldest task of another worker, false once every deque is empty */
+static bool farm_steal(size_t worker, size_t * task)
+{
+    for (size_t i = 1; i < farm_worker_count; i++)
+    {
+        farm_deque * victim = &farm_deques[(worker + i) % farm_worker_count];
+        bool found = false;
+
+        pthread_mutex_lock(&victim->lock);
+        if (victim->tail > victim->head)
+        {
+            *task = victim->tasks[victim->head++];
+            found = true;
+        }
+        pthread_mutex_unlock(&victim->lock);
+
+        if (found)
+            return true;
+    }
+
+    return false;
+}
+
+static void * farm_worker(void * arg)
+{
+    size_t worker = (size_t)(uintptr_t)arg;
+    size_t task;
+
+    /* Tasks never spawn tasks, so once nothing is left to steal we are done */
+    while (farm_pop(&farm_deques[worker], &task) || farm_steal(worker, &task))
+        farm_run(&farm_tasks[task]);
+
+    return NULL;
+}
+
+/* Load an input script or movie, see the top of the file for the format */
+static bool farm_load_input(const char * path, farm_input * input)
+{
+    size_t len = strlen(path);
+
+    input->path   = strdup(path);
+    input->frames = NULL;
+    input->pads   = NULL;
+    input->count  = 0;
+    input->movie  = NULL;
+
+    if (len > 7 && strcasecmp(path + len - 7, ".nesmov") == 0)
+        return (input->movie = nes_movie_load(path)) != NULL;
+
+    FILE * file = fopen(path, "r");
+    if (file == NULL)
+    {
+        fprintf(stderr, "error: failed to open %s for reading: %s\n", path, strerror(errno));
+        return false;
+    }
+
+    char line[256];
+    size_t capacity = 0;
+
+    while (fgets(line, sizeof(line), file))
+    {
+        unsigned int frame, pad1, pad2 = 0;
+
+        char * comment = strchr(line, '#');
+        if (comment != NULL)
+            *comment = '\0';
+
+        if (sscanf(line, "%u %x %x", &frame, &pad1, &pad2) < 2)
+            continue;
+
+        if (input->count == capacity)
+        {
+            capacity = capacity ? capacity * 2 : 64;
+            input->frames = realloc(input->frames, capacity * sizeof(*input->frames));
+            input->pads   = realloc(input->pads, capacity * sizeof(*input->pads));
+        }
+
+        input->frames[input->count]  = frame;
+        input->pads[input->count][0] = (uint8_t)pad1;
+        input->pads[input->count][1] = (uint8_t)pad2;
+        input->count++;
+    }
+
+    fclose(file);
+    return true;
+}
+
+static int farm_compare_names(const void * a, const void * b)
+{
+    return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+/* List the files in 'dir' (only those ending in 'extension' unless it is NULL), sorted by name */
+static size_t farm_list_dir(const char * dir, const char * extension, char *** paths)
+{
+    DIR * d = opendir(dir);
+    struct dirent * entry;
+    size_t count = 0, capacity = 0;
+
+    *paths = NULL;
+    if (d == NULL)
+        return 0;
+
+    while ((entry = readdir(d)) != NULL)
+    {
+        const char * name = entry->d_name;
+        size_t len = strlen(name);
+
+        if (name[0] == '.')
+            continue;
+
+        if (extension != NULL && (len < strlen(extension) || strcasecmp(name + len - strlen(extension), extension) != 0))
+            continue;
+
+        if (count == capacity)
+        {
+            capacity = capacity ? capacity * 2 : 64;
+            *paths = realloc(*paths, capacity * sizeof(char *));
+        }
+
+        (*paths)[count] = malloc(strlen(dir) + len + 2);
+        sprintf((*paths)[count], "%s/%s", dir, name);
+        count++;
+    }
+
+    closedir(d);
+    qsort(*paths, count, sizeof(char *), farm_compare_names);
+
+    return count;
+}
+
+static size_t farm_default_threads(void)
+{
+#ifdef _WIN32
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return info.dwNumberOfProcessors;
+#else
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? (size_t)n : 1;
+#endif
+}
+
+int main(int argc, char ** argv)
+{
+    const char * input_path  = NULL;
+    const char * report_path = NULL;
+    size_t threads = farm_default_threads();
+
+    if (argc < 3)
+    {
+        fprintf(stderr, "error: Invalid usage. USAGE:\n./nesfarm [ROM DIR] [FRAMES] [-i INPUT SCRIPT OR DIR] [-j THREADS] [-o REPORT] [-l LOG DIR] [-a AUDIO DIR] [-c CORE] [-p PROFILE DIR] [-d CDL DIR] [-s SKIP] [-r AHEAD]\n");
+        return -1;
+    }
+
+    farm_frames = (uint32_t)strtoul(argv[2], NULL, 10);
+
+    for (int i = 3; i + 1 < argc; i += 2)
+    {
+        if (strcmp(argv[i], "-i") == 0)
+            input_path = argv[i + 1];
+        else if (strcmp(argv[i], "-j") == 0)
+            threads = strtoul(argv[i + 1], NULL, 10);
+        else if (strcmp(argv[i], "-o") == 0)
+            report_path = argv[i + 1];
+        else if (strcmp(argv[i], "-l") == 0)
+            farm_log_dir = argv[i + 1];
+        else if (strcmp(argv[i], "-a") == 0)
+            farm_audio_dir = argv[i + 1];
+        else if (strcmp(argv[i], "-c") == 0 && (strcmp(argv[i + 1], "jit") == 0 || strcmp(argv[i + 1], "interp") == 0))
+            farm_jit = (strcmp(argv[i + 1], "jit") == 0);
+        else if (strcmp(argv[i], "-p") == 0)
+            farm_profile_dir = argv[i + 1];
+        else if (strcmp(argv[i], "-d") == 0)
+            farm_cdl_dir = argv[i + 1];
+        else if (strcmp(argv[i], "-s") == 0 && strcmp(argv[i + 1], "all") == 0)
+            farm_headless = true;
+        else if (strcmp(argv[i], "-s") == 0)
+            farm_skip = (uint32_t)strtoul(argv[i + 1], NULL, 10);
+        else if (strcmp(argv[i], "-r") == 0)
+            farm_ahead = (uint8_t)strtoul(argv[i + 1], NULL, 10);
+        else
+        {
+            fprintf(stderr, "error: unknown option %s\n", argv[i]);
+            return -1;
+        }
+    }
+
+    if (threads == 0)
+        threads = 1;
+
+    /* ROMs */
+    char ** roms;
+    size_t rom_count = farm_list_dir(argv[1], ".nes", &roms);
+    if (rom_count == 0)
+    {
+        fprintf(stderr, "error: no .nes files in %s\n", argv[1]);
+        return -1;
+    }
+
+    /* Input scripts, a single file or every file in a directory */
+    farm_input * inputs = NULL;
+    size_t input_count = 0;
+
+    if (input_path != NULL)
+    {
+        char ** scripts;
+        size_t script_count = farm_list_dir(input_path, NULL, &scripts);
+
+        if (script_count == 0)
+        {
+            scripts = malloc(sizeof(char *));
+            scripts[0] = strdup(input_path);
+            script_count = 1;
+        }
+
+        inputs = malloc(script_count * sizeof(farm_input));
+        for (size_t i = 0; i < script_count; i++)
+        {
+            if (farm_load_input(scripts[i], &inputs[input_count]))
+                input_count++;
+            free(scripts[i]);
+        }
+        free(scripts);
+
+        if (input_count == 0)
+            return -1;
+    }
+
+    /* One task per ROM/input pair, movies only pair with their own ROM */
+    size_t task_count = 0;
+    farm_tasks = calloc(rom_count * (input_count ? input_count : 1), sizeof(farm_task));
+
+    for (size_t r = 0; r < rom_count; r++)
+    {
+        uint64_t rom_hash = 0;
+
+        if (input_count == 0)
+        {
+            farm_tasks[task_count++].rom = roms[r];
+            continue;
+        }
+
+        for (size_t i = 0; i < input_count; i++)
+        {
+            if (inputs[i].movie != NULL && rom_hash == 0 && nes_movie_rom_hash(roms[r], &rom_hash) != 0)
+                break;
+
+            if (inputs[i].movie != NULL && inputs[i].movie->rom_hash != rom_hash)
+                continue;
+
+            farm_tasks[task_count].rom   = roms[r];
+            farm_tasks[task_count].input = &inputs[i];
+            task_count++;
+        }
+    }
+
+    if (task_count == 0)
+    {
+        fprintf(stderr, "error: none of the movies were recorded on a ROM in %s\n", argv[1]);
+        return -1;
+    }
+
+    /* Dealt round-robin onto the workers' deques */
+    farm_deques = calloc(threads, sizeof(farm_deque));
+    farm_worker_count = threads;
+
+    for (size_t w = 0; w < threads; w++)
+    {
+        pthread_mutex_init(&farm_deques[w].lock, NULL);
+        farm_deques[w].tasks = malloc((task_count / threads + 1) * sizeof(size_t));
+    }
+
+    for (size_t t = 0; t < task_count; t++)
+    {
+        farm_deque * deque = &farm_deques[t % threads];
+        deque->tasks[deque->tail++] = t;
+    }
+
+    double start = farm_now_ms();
+
+    pthread_t * workers = malloc(threads * sizeof(pthread_t));
+    for (size_t w = 0; w < threads; w++)
+        pthread_create(&workers[w], NULL, farm_worker, (void *)(uintptr_t)w);
+    for (size_t w = 0; w < threads; w++)
+        pthread_join(workers[w], NULL);
+
+    double wall_ms = farm_now_ms() - start;
+
+    /* Report, in task order so two runs can be diffed */
+    FILE * report = stdout;
+    if (report_path != NULL && (report = fopen(report_path, "w")) == NULL)
+    {
+        fprintf(stderr, "error: failed to open %s for writing: %s\n", report_path, strerror(errno));
+        report = stdout;
+    }
+
+    size_t failed = 0;
+    fprintf(report, "# rom\tinput\tframes\tframe_chain\tlast_frame\tram\taudio\tms\tfps\thash%%\n");
+
+    for (size_t t = 0; t < task_count; t++)
+    {
+        const farm_task * task = &farm_tasks[t];
+        const char * input = task->input ? task->input->path : "-";
+
+        if (!task->ok)
+        {
+            fprintf(report, "%s\t%s\tFAILED\n", task->rom, input);
+            failed++;
+            continue;
+        }
+
+        fprintf(report, "%s\t%s\t%u\t%016llX\t%016llX\t%016llX\t%016llX\t%.1f\t%.1f\t%.2f\n", task->rom, input, farm_frames,
+            (unsigned long long)task->frame_chain, (unsigned long long)task->last_frame,
+            (unsigned long long)task->ram, (unsigned long long)task->audio, task->ms, farm_frames / (task->ms / 1000.0),
+            task->hash_ms / task->ms * 100.0);
+    }
+
+    size_t total_frames = (task_count - failed) * farm_frames;
+    fprintf(report, "# %zu runs (%zu failed) on %zu threads, %zu frames in %.1f ms, %.1f frames/s\n",
+        task_count, failed, threads, total_frames, wall_ms, total_frames / (wall_ms / 1000.0));
+
+    if (report != stdout)
+        fclose(report);
+
+    return failed ? 1 : 0;
+}
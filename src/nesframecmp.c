@@ -0,0 +1,95 @@
+/*
+    nesframecmp: Compare two frame hash logs (see nes_framehash.h)
+
+    USAGE: nesframecmp [-ram] [GOLDEN LOG] [NEW LOG]
+
+    Prints the first frame whose screen or RAM hash differs and exits with 1, or exits with 0
+    if both logs hold the same frames. A log that stops early counts as a divergence. With -ram
+    only RAM hashes are compared, for logs of runs that skipped drawing frames.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+
+typedef struct frame_record
+{
+    unsigned long long frame, screen, ram;
+}
+frame_record;
+
+/* Read the next record, skipping comment lines, false at end of file */
+static bool read_record(FILE * file, frame_record * record)
+{
+    char line[256];
+
+    while (fgets(line, sizeof(line), file))
+    {
+        if (line[0] == '#')
+            continue;
+
+        if (sscanf(line, "%llu %llx %llx", &record->frame, &record->screen, &record->ram) == 3)
+            return true;
+    }
+
+    return false;
+}
+
+int main(int argc, char ** argv)
+{
+    bool ram_only = argc == 4 && strcmp(argv[1], "-ram") == 0;
+
+    if (argc != 3 && !ram_only)
+    {
+        fprintf(stderr, "error: Invalid usage. USAGE:\n./nesframecmp [-ram] [GOLDEN LOG] [NEW LOG]\n");
+        return -1;
+    }
+
+    argv += ram_only;
+
+    FILE * golden = fopen(argv[1], "r");
+    FILE * test   = fopen(argv[2], "r");
+
+    if (golden == NULL || test == NULL)
+    {
+        fprintf(stderr, "error: failed to open %s for reading: %s\n", golden ? argv[2] : argv[1], strerror(errno));
+        return -1;
+    }
+
+    frame_record a, b;
+    unsigned long long frames = 0;
+
+    for (;;)
+    {
+        bool has_a = read_record(golden, &a);
+        bool has_b = read_record(test, &b);
+
+        if (!has_a && !has_b)
+            break;
+
+        if (has_a != has_b)
+        {
+            printf("%s ends after %llu frames, %s goes on\n", has_a ? argv[2] : argv[1], frames, has_a ? argv[1] : argv[2]);
+            return 1;
+        }
+
+        bool screen = !ram_only && a.screen != b.screen;
+
+        if (screen || a.ram != b.ram)
+        {
+            printf("first divergence at frame %llu:%s%s\n", a.frame,
+                screen ? " screen" : "", a.ram != b.ram ? " ram" : "");
+            printf("  golden: screen %016llX ram %016llX\n", a.screen, a.ram);
+            printf("  new:    screen %016llX ram %016llX\n", b.screen, b.ram);
+            return 1;
+        }
+
+        frames++;
+    }
+
+    printf("%llu frames match\n", frames);
+    return 0;
+}